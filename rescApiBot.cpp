@@ -31,6 +31,16 @@ int serverSocket;
 deque<string> USER_LIST;
 pthread_mutex_t userListLock;
 int userListStatus = pthread_mutex_init(&userListLock, NULL);
+// Framing agreed with the server at login.
+uint8_t PROTOCOL_VERSION = PROTOCOL_V1;
+uint64_t SEND_SEQ = 0;
+// For logging in again when the connection drops; SESSION_TOKEN is empty
+// unless the server can resume the session. serverSocket only changes
+// under userListLock.
+string SERVER_HOST;
+unsigned short SERVER_PORT = 0;
+string USER_NAME;
+string SESSION_TOKEN;
 
 // Data Structures
 struct threadArgs {
@@ -44,11 +54,24 @@ string ReadFile(string filename);
 // post: none
 
 void ProcessServerMessages(int serverSocket);
-// Function handles incoming messages from server
+// Function handles incoming messages from server, reconnecting whenever
+// the connection drops
 // pre: none
 // post: none
 
-void ProcessClientRequest(string msg);
+bool LogIn(int sock, uint64_t nextSeq, string &authResponse);
+// Function logs in as USER_NAME, offering to resume SESSION_TOKEN from
+// frame nextSeq if there is one.
+// pre: sock should be connected
+// post: PROTOCOL_VERSION and SESSION_TOKEN are set from a successful reply
+
+int Reconnect(FrameReader* reader);
+// Function keeps trying to log in again, with backoff, and resumes the
+// session if the server kept it.
+// pre: the old connection has dropped
+// post: returns the new socket, now serverSocket
+
+void ProcessClientRequest(MessageView &parsedMsg);
 // Function handles client request
 // pre: none
 // post: none
@@ -82,15 +105,16 @@ int main (int argc, char * argv[]) {
 	sigemptyset(&sigIntHandler.sa_mask);
 	sigIntHandler.sa_flags = 0;
 	sigaction(SIGINT, &sigIntHandler, NULL);
+	// A dropped connection gets reconnected; it mustn't kill us first.
+	signal(SIGPIPE, SIG_IGN);
 	
+	SERVER_HOST = hostname;
+	SERVER_PORT = serverPort;
 	serverSocket = OpenSocket(hostname, serverPort);
 	
-	string username = argv[3];
-	string authMsg = username + "|test";
-	SendMessage(serverSocket, authMsg);
-	string authResponse = ReadMessage(serverSocket);
-	
-	if (CheckAuthResponse(authResponse)) {
+	USER_NAME = argv[3];
+	string authResponse;
+	if (LogIn(serverSocket, 0, authResponse)) {
 		// Establish Socket Reader
 		struct threadArgs* args_p = new threadArgs;
 		args_p -> serverSocket = serverSocket;
@@ -132,8 +156,13 @@ int main (int argc, char * argv[]) {
 				pthread_mutex_lock(&userListLock);
 				deque<string>::iterator userIter = USER_LIST.begin();
 				while (userIter != USER_LIST.end()) {
-					string msgToSend = "/filestream " + *userIter + " " + data;
-					SendMessage(serverSocket, msgToSend);
+					if (PROTOCOL_VERSION == PROTOCOL_V2) {
+						// Typed frame; no need to glue the command together.
+						SendFrame(serverSocket, FILE_STREAM_MSG, SEND_SEQ++, *userIter, string_view(), data);
+					} else {
+						string msgToSend = "/filestream " + *userIter + " " + data;
+						SendMessage(serverSocket, msgToSend);
+					}
 					userIter++;
 				}
 				pthread_mutex_unlock(&userListLock);
@@ -176,6 +205,11 @@ void ProcessServerMessages(int serverSocket)
   bool canRead = true;
   fd_set hostfd;
   struct timeval tv;
+  FrameReader reader;
+  FrameReaderInit(&reader);
+  reader.version = PROTOCOL_VERSION;
+  FrameHeader header;
+  MessageView view;
 
   // Clear FD_Set and set timeout.
   FD_ZERO(&hostfd);
@@ -193,15 +227,79 @@ void ProcessServerMessages(int serverSocket)
     tv.tv_usec = 10000;
     FD_SET(serverSocket, &hostfd);
     if (pollSock != 0 && pollSock != -1) {
-		// Socket has data, let's retrieve it.
-		string incMessage = ReadMessage(serverSocket);
-		ProcessClientRequest(incMessage);
+		// Socket has data, let's retrieve all of it.
+		if (FrameReaderFill(serverSocket, &reader) <= 0) {
+			serverSocket = Reconnect(&reader);
+			FD_ZERO(&hostfd);
+			FD_SET(serverSocket, &hostfd);
+			numberOfSocks = serverSocket + 1;
+			continue;
+		}
+		while (FrameReaderNext(&reader, header, view) == FRAME_READY) {
+			ProcessClientRequest(view);
+		}
+		FrameReaderRelease(&reader);
     }
   }
 }
 
-void ProcessClientRequest(string msg) {
-	Message parsedMsg = CreateMessage(msg, "");
+bool LogIn(int sock, uint64_t nextSeq, string &authResponse)
+{
+	string authMsg = USER_NAME + "|test\n" + CAPABILITY_V2 + " " + CAPABILITY_SLICES + " " + CAPABILITY_RESUME;
+	if (!SESSION_TOKEN.empty()) {
+		authMsg += " token=" + SESSION_TOKEN + " seq=" + to_string(nextSeq);
+	}
+	SendMessage(sock, authMsg);
+	authResponse = ReadMessage(sock);
+	if (!CheckAuthResponse(authResponse)) {
+		return false;
+	}
+	string_view response(authResponse);
+	string_view capabilities = SplitCapabilities(response);
+	PROTOCOL_VERSION = (HasCapability(capabilities, CAPABILITY_V2)) ? PROTOCOL_V2 : PROTOCOL_V1;
+	SESSION_TOKEN = string(CapabilityValue(capabilities, "token"));
+	return true;
+}
+
+int Reconnect(FrameReader* reader)
+{
+	cout << "Lost the connection to the server; reconnecting." << endl;
+	int delaySeconds = 1;
+	while (true) {
+		sleep(delaySeconds);
+		delaySeconds = min(delaySeconds * 2, 30);
+		int sock = OpenSocket(SERVER_HOST, SERVER_PORT);
+		if (sock < 0) {
+			continue;
+		}
+		string authResponse;
+		if (!LogIn(sock, reader -> nextSeq, authResponse)) {
+			close(sock);
+			continue;
+		}
+		string_view response(authResponse);
+		string_view resumed = CapabilityValue(SplitCapabilities(response), "resumed");
+		if (resumed.empty()) {
+			// A new session; subscribers are ours, so they carry over anyway.
+			FrameReaderInit(reader);
+			reader -> version = PROTOCOL_VERSION;
+		} else {
+			FrameReaderRestart(reader, strtoull(string(resumed).c_str(), NULL, 10));
+		}
+		pthread_mutex_lock(&userListLock);
+		close(serverSocket);
+		serverSocket = sock;
+		pthread_mutex_unlock(&userListLock);
+		cout << "Reconnected" << (resumed.empty() ? " as a new session." : ".") << endl;
+		return sock;
+	}
+}
+
+void ProcessClientRequest(MessageView &parsedMsg) {
+	if (parsedMsg.cmd == INVALID_MSG) {
+		// v1 text frame.
+		parsedMsg = ParseMessage(parsedMsg.msg, "");
+	}
 	
 	if (parsedMsg.cmd == DIRECT_MSG) {
 		// Search our user base for user and toggle subscription
@@ -215,7 +313,7 @@ void ProcessClientRequest(string msg) {
 		}
 		if (userIter == USER_LIST.end()) {
 			// Couldn't find user, so add them to subscribers
-			USER_LIST.push_back(parsedMsg.from);
+			USER_LIST.push_back(string(parsedMsg.from));
 		} else {
 			// Remove user form subscribers
 			USER_LIST.erase(userIter);
@@ -228,7 +326,7 @@ void ProcessSignal(int sig) {
 	cout << endl << "Shutting down ApiBot." << endl;
 	sleep(1);
 	string quit = "/quit";
-	SendMessage(serverSocket, quit);
+	SendCommand(serverSocket, PROTOCOL_VERSION, SEND_SEQ++, quit, "");
 	CloseSocket(serverSocket);
 	exit(0);
 }
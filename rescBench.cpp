@@ -0,0 +1,2179 @@
+// AUTHOR: Ray Powers
+// DATE: October 18, 2026
+// FILE: rescBench.cpp
+
+// DESCRIPTION: rescBench drives a running rescServer with synthetic clients
+//				and reports how long messages take to make it through. It also
+//				carries in-process benchmarks for the server's hot paths.
+
+// epoll, eventfd and sendfile.
+#ifndef __linux__
+#error "Builds on Linux only; see Dependencies in README.md."
+#endif
+
+// Standard Library
+#include<iostream>
+#include<sstream>
+#include<string>
+#include<vector>
+#include<set>
+#include<map>
+#include<algorithm>
+#include<cstdlib>
+#include<cerrno>
+#include<ctime>
+#include<csignal>
+
+// Network Functions
+#include<fcntl.h>
+#include<getopt.h>
+#include<sys/epoll.h>
+#include<sys/resource.h>
+#include<sys/eventfd.h>
+#include<sys/wait.h>
+#include<poll.h>
+
+// Multithreading
+#include<pthread.h>
+
+// RESC Framework
+#include "rescFramework.h"
+#include "rescMailbox.h"
+#include "rescRegistry.h"
+#include "rescPool.h"
+#include "rescLog.h"
+#include "rescHistory.h"
+
+using namespace std;
+using namespace RESC;
+
+// Data Structures
+struct BenchClient {
+	int sock;
+	string username;
+	string room;		// Joined by the load scenario's room mode.
+	int roomPeers;		// Other clients in that room.
+	FrameReader reader;
+	OutQueue out;		// Sends wait here while the socket is full.
+	bool isWaiting;		// Registered for EPOLLOUT.
+};
+
+// Latency histogram in the HdrHistogram layout: values below 2048 get a
+// bin each, every power of two above that is split into 1024 bins, so any
+// recorded value is within 0.1% of its bin.
+struct Histogram {
+	vector<long> counts;
+	long total;
+	long maxValue;
+};
+
+// What a load run should do; shared read-only by every worker.
+struct LoadConfig {
+	string hostname;
+	unsigned short serverPort;
+	int clientCount;
+	int workerCount;
+	double rate;		// Messages per second across all workers.
+	int seconds;
+	int mix[3];			// Percent /all, /msg, /filestream.
+	int chatSize;
+	int fileSize;
+	uint8_t version;
+	bool wantsDelta;	// Offer delta presence at login.
+	bool canSlice;		// Offer sliced large messages at login (v2 only).
+	int rounds;			// Storms and presence churn only.
+	int roomCount;		// Load only: when set, /all goes to the sender's room.
+};
+
+struct LoadWorker {
+	LoadConfig* config;
+	int index;
+	pthread_t tid;
+	vector<BenchClient*> clients;
+	Histogram latency;	// Delivery latency, or login latency for storms.
+	Histogram chatLatency;	// Load only: /all, /msg and /room deliveries.
+	long sent[3];
+	long roomDeliveries;	// Recipients the room messages sent should reach.
+	long delivered;
+	long bytesReceived;
+	long failures;
+};
+
+// A client that only watches presence, keeping the user set the way
+// rescClient does.
+struct PresenceWatcher {
+	BenchClient* client;
+	set<string> users;
+	unsigned long version;
+	long userlists;		// Whole lists received (legacy).
+	long deltas;		// Deltas and snapshots received.
+	long gaps;
+	long bytesReceived;
+	bool keepsChat;
+	vector<string> chat;	// /all and /msg bodies, when keepsChat.
+};
+
+struct RegistryArgs {
+	pthread_t tid;
+	bool isSharded;
+	vector<string> names;	// Built up front so only the registry is timed.
+};
+
+// Thread-mode mailboxes a fan-out posts into, as the server has them.
+struct FanoutArgs {
+	vector<Mailbox*> boxes;
+	vector<int> wakeSocks;
+	Payload* payload;
+};
+
+// One thread's share of offline log appends.
+struct OfflineArgs {
+	pthread_t tid;
+	MessageLog* log;
+	int index;
+	int count;
+	int recipients;
+	string msg;
+};
+
+// A thread replaying a history ring as fast as it can.
+struct ReplayArgs {
+	pthread_t tid;
+	HistoryRing* ring;
+	long replays;
+	long replayed;		// Messages copied out whole.
+};
+
+struct DrainArgs {
+	int sock;
+	long expected;
+};
+
+// Globals
+const int MAX_EVENTS = 256;
+const int READ_CHUNK = 65536;
+volatile bool IS_RUNNING = true;
+// Logins replay the server's recent /all history, which may hold stamped
+// messages from an earlier run; anything stamped before this is skipped.
+long RUN_START_NS = 0;
+vector<BenchClient*> RECEIVERS;
+vector<long> LATENCIES;
+pthread_mutex_t latencyLock;
+int latencyStatus = pthread_mutex_init(&latencyLock, NULL);
+const int HISTOGRAM_SUB_BUCKETS = 1024;
+const long HISTOGRAM_MAX = 1L << 40;	// ~18 minutes in ns.
+const char* MIX_NAMES[3] = {"/all", "/msg", "/filestream"};
+// Registry contention: the old single-lock table and the sharded one.
+unordered_map<string, User> LOCKED_USERS;
+pthread_mutex_t lockedUsersLock;
+int lockedUsersStatus = pthread_mutex_init(&lockedUsersLock, NULL);
+Registry<User> SHARDED_USERS;
+int shardedUsersStatus = RegistryInit(&SHARDED_USERS);
+// Workers line up here between load phases.
+pthread_barrier_t PHASE_BARRIER;
+volatile bool IS_SENDING = false;
+
+// Function Prototypes
+int RunLatency(string hostname, unsigned short serverPort, int receiverCount, int messageCount, int intervalMs);
+// Function measures end-to-end /all latency seen by idle receivers.
+// pre: a rescServer should be listening on hostname:serverPort
+// post: none
+
+int RunWritev(int messageCount, int messageSize, int depth);
+// Function compares per-message sends against vectored OutQueue flushes.
+// pre: none
+// post: none
+
+int RunParse(int messageCount, int messageSize);
+// Function compares the copying stringstream parser against ParseMessage.
+// pre: none
+// post: none
+
+int RunScan(int bufferSize, int rounds);
+// Function reports bytes/sec for each delimiter scanning kernel.
+// pre: none
+// post: none
+
+int RunRegistry(int threadCount, int operations);
+// Function hammers login, lookup and logout from many threads against a
+// single-lock user table and the sharded registry.
+// pre: none
+// post: none
+
+int RunFanout(int workerCount, int rounds);
+// Function times one fan-out to thread-mode mailboxes inline and on the
+// work-stealing pool, for a range of recipient counts.
+// pre: none
+// post: none
+
+int RunOffline(int threadCount, int messageCount, int messageSize);
+// Function times appends to the offline message log from many threads,
+// the group-committed syncs behind them, recovery on reopening and
+// draining every recipient.
+// pre: none
+// post: none
+
+void* OfflineThread(void* args_p);
+// Function appends one thread's share of messages to the offline log.
+// pre: PHASE_BARRIER should be set up for every thread plus the caller
+// post: none
+
+int RunHistory(int readerCount, int messageCount, int messageSize);
+// Function times senders recording into a history ring with no readers,
+// then with readers replaying all of it over and over.
+// pre: none
+// post: none
+
+void* ReplayThread(void* args_p);
+// Function replays a history ring until IS_SENDING is cleared.
+// pre: PHASE_BARRIER should be set up for every thread plus the caller
+// post: none
+
+void FanoutChunk(void* args_p, size_t begin, size_t end);
+// Function posts the payload to mailboxes [begin, end); a pool chunk.
+// pre: args_p should be a FanoutArgs
+// post: none
+
+void* RegistryThread(void* args_p);
+// Function runs one thread's share of registry operations.
+// pre: PHASE_BARRIER should be set up for every thread plus the caller
+// post: none
+
+Message LegacyCreateMessage(string msg, string from);
+// Function is the parser the server used before ParseMessage, kept as a
+// baseline: every field is rebuilt one character at a time.
+// pre: none
+// post: none
+
+bool OpenLoopback(int &sendSock, int &recvSock);
+// Function connects a pair of TCP sockets over 127.0.0.1.
+// pre: none
+// post: none
+
+void* DrainThread(void* args_p);
+// Function reads and discards the expected number of bytes.
+// pre: none
+// post: none
+
+void PrintUsage(string name);
+// Function prints the scenarios and their options.
+// pre: none
+// post: none
+
+int RunLoad(LoadConfig &config);
+// Function drives a mix of /all, /msg and /filestream traffic from many
+// clients at a target rate and reports throughput and latency.
+// pre: a rescServer should be listening on config.hostname:serverPort
+// post: none
+
+void* LoadThread(void* args_p);
+// Function connects one worker's clients, sends its share of the rate and
+// records delivery latency for everything they receive.
+// pre: config should be filled in
+// post: none
+
+void SendLoadMessage(LoadWorker* worker, int epollSock, long stampNs);
+// Function queues one randomly chosen message from one of the worker's clients.
+// pre: none
+// post: none
+
+void FlushClient(BenchClient* client, int epollSock);
+// Function writes a client's queued messages, waiting for EPOLLOUT when full.
+// pre: client should be registered with epollSock
+// post: none
+
+void ReadLoadClient(LoadWorker* worker, BenchClient* client);
+// Function reads whatever a client has and records stamped deliveries.
+// pre: none
+// post: none
+
+int RunStorm(LoadConfig &config, bool isReconnect);
+// Function logs every client in at once (and, for reconnect storms, drops
+// and logs them all back in) and reports login latency.
+// pre: a rescServer should be listening on config.hostname:serverPort
+// post: none
+
+void* StormThread(void* args_p);
+// Function logs one worker's clients in, and out again between rounds.
+// pre: config should be filled in
+// post: none
+
+int RunPresence(LoadConfig &config, int churnCount);
+// Function keeps watchers logged in while batches of other users come and
+// go, and reports how many presence bytes each watcher had to read.
+// pre: a rescServer should be listening on config.hostname:serverPort
+// post: none
+
+void ReadPresence(PresenceWatcher* watcher);
+// Function reads everything a watcher has and applies presence updates.
+// pre: watcher's socket should be non-blocking
+// post: none
+
+int RunCluster(string serverPath, unsigned short basePort, int clientCount, int messageCount, int relayCount);
+// Function starts rescServer nodes on loopback, three linked into one
+// cluster or, given relayCount, a root with that many relays under it,
+// and checks that /all and /msg cross them exactly once, how soon
+// presence agrees everywhere and how soon a lost node is noticed.
+// pre: serverPath should be a rescServer binary
+// post: none
+
+long AwaitPresence(vector<PresenceWatcher*> &watchers, size_t count, size_t userCount, int timeoutMs);
+// Function reads the first count watchers until each sees userCount users.
+// pre: watchers' sockets should be non-blocking
+// post: returns the ns it took, or -1 after timeoutMs
+
+void PollWatchers(vector<PresenceWatcher*> &watchers, size_t count, int timeoutMs);
+// Function waits up to timeoutMs for the first count watchers and reads
+// whichever have something.
+// pre: watchers' sockets should be non-blocking
+// post: none
+
+void CountDeliveries(vector<PresenceWatcher*> &watchers, map<string, long> &deliveries, Histogram* latency);
+// Function tallies the cluster messages the watchers have read, and how
+// long each took: latency[0] for /all, latency[1] for /msg.
+// pre: none
+// post: every watcher's chat is emptied
+
+void StopNodes(vector<pid_t> &nodes);
+// Function interrupts every node and waits for it to exit.
+// pre: none
+// post: none
+
+void CloseClient(BenchClient* client);
+// Function says /quit and releases a client.
+// pre: none
+// post: none
+
+void HistogramInit(Histogram* histogram);
+// Function empties a histogram.
+// pre: none
+// post: none
+
+void HistogramRecord(Histogram* histogram, long value);
+// Function counts one value.
+// pre: none
+// post: none
+
+void HistogramMerge(Histogram* into, const Histogram* from);
+// Function adds another histogram's counts.
+// pre: none
+// post: none
+
+long HistogramPercentile(const Histogram* histogram, double percentile);
+// Function returns the value at the given percentile.
+// pre: none
+// post: none
+
+void ReportHistogram(string title, const Histogram* histogram);
+// Function prints the standard percentiles in microseconds.
+// pre: none
+// post: none
+
+void RaiseFileLimit();
+// Function lifts the descriptor limit to the hard maximum.
+// pre: none
+// post: none
+
+bool ParseMix(string mix, int* percents);
+// Function reads "all:msg:filestream" percentages.
+// pre: none
+// post: returns false unless the three add up to 100
+
+BenchClient* ConnectClient(string hostname, unsigned short serverPort, string username, uint8_t version, bool wantsDelta, bool canSlice);
+// Function opens a socket and logs in as username.
+// pre: none
+// post: returns NULL on failure
+
+void* ReceiverThread(void* args_p);
+// Function reads every receiver socket and records latency samples.
+// pre: RECEIVERS should be populated
+// post: none
+
+void RecordFrame(string &msg);
+// Function extracts the send timestamp from a bench broadcast.
+// pre: none
+// post: none
+
+void ReportLatency(long expected);
+// Function prints the latency percentiles.
+// pre: none
+// post: none
+
+long NowNs();
+// Function returns a monotonic timestamp in nanoseconds.
+// pre: none
+// post: none
+
+int main (int argc, char * argv[])
+{
+	int receiverCount = 0;
+	int messageCount = 0;
+	int intervalMs = 20;
+	int messageSize = 64;
+	int depth = 64;
+	LoadConfig config;
+	config.clientCount = 100;
+	config.workerCount = 4;
+	config.rate = 1000;
+	config.seconds = 10;
+	config.mix[0] = 80;
+	config.mix[1] = 15;
+	config.mix[2] = 5;
+	config.fileSize = 16384;
+	config.version = PROTOCOL_V1;
+	config.wantsDelta = false;
+	config.canSlice = false;
+	config.roomCount = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "r:n:i:s:d:c:w:R:D:x:f:g:2PS")) != -1) {
+		switch (opt) {
+			case 'c':
+				config.clientCount = atoi(optarg);
+				break;
+			case 'w':
+				config.workerCount = max(1, atoi(optarg));
+				break;
+			case 'R':
+				config.rate = atof(optarg);
+				break;
+			case 'D':
+				config.seconds = atoi(optarg);
+				break;
+			case 'x':
+				if (!ParseMix(optarg, config.mix)) {
+					cerr << "Mix should be three percentages adding up to 100, e.g. 80:15:5." << endl;
+					return -1;
+				}
+				break;
+			case 'f':
+				config.fileSize = atoi(optarg);
+				break;
+			case '2':
+				config.version = PROTOCOL_V2;
+				break;
+			case 'P':
+				config.wantsDelta = true;
+				break;
+			case 'S':
+				config.canSlice = true;
+				break;
+			case 'g':
+				config.roomCount = max(0, atoi(optarg));
+				break;
+			case 'r':
+				receiverCount = atoi(optarg);
+				break;
+			case 'n':
+				messageCount = atoi(optarg);
+				break;
+			case 'i':
+				intervalMs = atoi(optarg);
+				break;
+			case 's':
+				messageSize = atoi(optarg);
+				break;
+			case 'd':
+				depth = atoi(optarg);
+				break;
+			default:
+				PrintUsage(argv[0]);
+				return -1;
+		}
+	}
+	if (argc - optind < 1) {
+		PrintUsage(argv[0]);
+		return -1;
+	}
+	string scenario = argv[optind];
+	signal(SIGPIPE, SIG_IGN);
+
+	if (scenario == "latency" && argc - optind == 3) {
+		string hostname = argv[optind+1];
+		unsigned short serverPort = atoi(argv[optind+2]);
+		return RunLatency(hostname, serverPort, (receiverCount > 0) ? receiverCount : 50, (messageCount > 0) ? messageCount : 200, intervalMs);
+	}
+	if ((scenario == "load" || scenario == "connect" || scenario == "reconnect") && argc - optind == 3) {
+		RaiseFileLimit();
+		config.hostname = argv[optind+1];
+		config.serverPort = atoi(argv[optind+2]);
+		config.chatSize = messageSize;
+		config.rounds = (messageCount > 0) ? messageCount : 3;
+		config.workerCount = min(config.workerCount, max(1, config.clientCount));
+		if (scenario == "load") {
+			return RunLoad(config);
+		}
+		if (scenario == "connect") {
+			config.rounds = 0;
+		}
+		return RunStorm(config, scenario == "reconnect");
+	}
+	if (scenario == "presence" && argc - optind == 3) {
+		RaiseFileLimit();
+		config.hostname = argv[optind+1];
+		config.serverPort = atoi(argv[optind+2]);
+		config.rounds = (messageCount > 0) ? messageCount : 20;
+		return RunPresence(config, (receiverCount > 0) ? receiverCount : 50);
+	}
+	if ((scenario == "cluster" || scenario == "relay") && argc - optind == 3) {
+		RaiseFileLimit();
+		int relayCount = (scenario == "relay") ? ((receiverCount > 0) ? receiverCount : 3) : 0;
+		return RunCluster(argv[optind+1], atoi(argv[optind+2]), config.clientCount, (messageCount > 0) ? messageCount : 200, relayCount);
+	}
+	if (scenario == "writev" && argc - optind == 1) {
+		return RunWritev((messageCount > 0) ? messageCount : 200000, messageSize, depth);
+	}
+	if (scenario == "parse" && argc - optind == 1) {
+		return RunParse((messageCount > 0) ? messageCount : 200000, messageSize);
+	}
+	if (scenario == "registry" && argc - optind == 1) {
+		return RunRegistry(config.workerCount, (messageCount > 0) ? messageCount : 200000);
+	}
+	if (scenario == "fanout" && argc - optind == 1) {
+		RaiseFileLimit();
+		return RunFanout(config.workerCount, (messageCount > 0) ? messageCount : 50);
+	}
+	if (scenario == "offline" && argc - optind == 1) {
+		return RunOffline(config.workerCount, (messageCount > 0) ? messageCount : 250000, messageSize);
+	}
+	if (scenario == "history" && argc - optind == 1) {
+		return RunHistory(config.workerCount, (messageCount > 0) ? messageCount : 2000000, messageSize);
+	}
+	if (scenario == "scan" && argc - optind == 1) {
+		return RunScan((messageSize > 64) ? messageSize : 1024 * 1024, (messageCount > 0) ? messageCount : 2000);
+	}
+	PrintUsage(argv[0]);
+	return -1;
+}
+
+void PrintUsage(string name)
+{
+	cerr << "Usage: " << name << " <scenario> [args] [options]" << endl;
+	cerr << "  latency <host> <port> [-r receivers] [-n messages] [-i interval ms]" << endl;
+	cerr << "  load <host> <port> [-c clients] [-w workers] [-R msgs/sec] [-D seconds]" << endl;
+	cerr << "       [-x all:msg:filestream percent] [-s chat bytes] [-f filestream bytes] [-g rooms] [-2] [-S]" << endl;
+	cerr << "  connect <host> <port> [-c clients] [-w workers] [-2]" << endl;
+	cerr << "  reconnect <host> <port> [-c clients] [-w workers] [-n rounds] [-2]" << endl;
+	cerr << "  presence <host> <port> [-c watchers] [-r churn users] [-n rounds] [-2] [-P]" << endl;
+	cerr << "  cluster <rescServer path> <base port> [-c clients per node] [-n messages]" << endl;
+	cerr << "  relay <rescServer path> <base port> [-r relays] [-c clients per node] [-n messages]" << endl;
+	cerr << "  writev [-n messages] [-s message bytes] [-d messages per flush]" << endl;
+	cerr << "  parse [-n messages] [-s chat message bytes]" << endl;
+	cerr << "  scan [-n rounds] [-s buffer bytes]" << endl;
+	cerr << "  registry [-w max threads] [-n logins per thread]" << endl;
+	cerr << "  fanout [-w pool workers] [-n fan-outs per size]" << endl;
+	cerr << "  offline [-w threads] [-n messages per thread] [-s message bytes]" << endl;
+	cerr << "  history [-w readers] [-n messages] [-s message bytes]" << endl;
+}
+
+int RunLatency(string hostname, unsigned short serverPort, int receiverCount, int messageCount, int intervalMs)
+{
+	// Idle receivers are the interesting case: nothing but the broadcast
+	// itself should get the server to flush their queue.
+	RUN_START_NS = NowNs();
+	for (int i = 0; i < receiverCount; i++) {
+		stringstream ss;
+		ss << "benchRecv" << i;
+		BenchClient* client = ConnectClient(hostname, serverPort, ss.str(), PROTOCOL_V1, false, false);
+		if (client == NULL) {
+			cerr << "Unable to connect receiver " << i << "." << endl;
+			return -1;
+		}
+		RECEIVERS.push_back(client);
+	}
+	BenchClient* sender = ConnectClient(hostname, serverPort, "benchSend", PROTOCOL_V1, false, false);
+	if (sender == NULL) {
+		cerr << "Unable to connect sender." << endl;
+		return -1;
+	}
+
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, ReceiverThread, NULL) != 0) {
+		cerr << "Failed to create receiver thread." << endl;
+		return -1;
+	}
+
+	// Let the login userlist churn settle before measuring.
+	sleep(2);
+	for (int i = 0; i < messageCount; i++) {
+		stringstream ss;
+		ss << "bench " << NowNs();
+		SendMessage(sender -> sock, ss.str());
+		usleep(intervalMs * 1000);
+	}
+	sleep(2);
+	IS_RUNNING = false;
+	pthread_join(tid, NULL);
+
+	ReportLatency((long) messageCount * receiverCount);
+
+	SendMessage(sender -> sock, "/quit");
+	CloseSocket(sender -> sock);
+	for (int i = 0; i < RECEIVERS.size(); i++) {
+		SendMessage(RECEIVERS[i] -> sock, "/quit");
+		CloseSocket(RECEIVERS[i] -> sock);
+	}
+	return 0;
+}
+
+int RunWritev(int messageCount, int messageSize, int depth)
+{
+	string body(messageSize, 'x');
+	long frameBytes = sizeof(long) + messageSize + 1;
+	long totalBytes = frameBytes * messageCount;
+
+	for (int pass = 0; pass < 2; pass++) {
+		int sendSock, recvSock;
+		if (!OpenLoopback(sendSock, recvSock)) {
+			cerr << "Unable to open loopback sockets." << endl;
+			return -1;
+		}
+		DrainArgs args;
+		args.sock = recvSock;
+		args.expected = totalBytes;
+		pthread_t tid;
+		pthread_create(&tid, NULL, DrainThread, &args);
+
+		long syscalls = 0;
+		long startNs = NowNs();
+		if (pass == 0) {
+			// What the drain loop used to do: prefix, then body, per message.
+			for (int i = 0; i < messageCount; i++) {
+				SendInteger(sendSock, messageSize + 1);
+				SendData(sendSock, body);
+			}
+			syscalls = 2L * messageCount;
+		} else {
+			// One shared payload, flushed depth messages at a time.
+			OutQueue out;
+			OutQueueInit(&out);
+			Payload* payload = CreateRawPayload(body);
+			for (int sent = 0; sent < messageCount; ) {
+				for (int i = 0; i < depth && sent < messageCount; i++, sent++) {
+					RetainPayload(payload);
+					OutQueuePush(&out, payload);
+				}
+				FlushOutQueue(sendSock, &out);
+			}
+			ReleasePayload(payload);
+			syscalls = out.syscalls;
+		}
+		pthread_join(tid, NULL);
+		long elapsedNs = NowNs() - startNs;
+		close(sendSock);
+		close(recvSock);
+
+		double seconds = elapsedNs / 1e9;
+		cout << ((pass == 0) ? "per-message send " : "vectored flush   ")
+			<< messageCount << " msgs, " << syscalls << " syscalls ("
+			<< (double) syscalls / messageCount << "/msg), "
+			<< (long) (messageCount / seconds) << " msg/s, "
+			<< (totalBytes / seconds) / (1024 * 1024) << " MB/s" << endl;
+	}
+	return 0;
+}
+
+int RunParse(int messageCount, int messageSize)
+{
+	// A chat-like mix: mostly short /all and /msg, with the occasional
+	// 4KB /filestream chunk carrying most of the bytes.
+	vector<string> corpus;
+	string chat(messageSize, 'x');
+	string chunk(4096, 'f');
+	for (int i = 0; i < 64; i++) {
+		stringstream ss;
+		switch (i % 8) {
+			case 0:
+				ss << "/filestream user" << i << " " << chunk;
+				break;
+			case 1:
+			case 2:
+			case 3:
+				ss << "/msg user" << i << " " << chat;
+				break;
+			default:
+				ss << "/all user" << i << " " << chat;
+				break;
+		}
+		corpus.push_back(ss.str());
+	}
+	string userFrom = "benchSend";
+	long totalBytes = 0;
+	for (int i = 0; i < messageCount; i++) {
+		totalBytes += corpus[i % corpus.size()].length();
+	}
+
+	// Both parsers have to agree before their speed means anything.
+	for (int i = 0; i < corpus.size(); i++) {
+		Message legacy = LegacyCreateMessage(corpus[i], userFrom);
+		MessageView view = ParseMessage(corpus[i], userFrom);
+		if (legacy.cmd != view.cmd || legacy.to != view.to ||
+			legacy.from != view.from || legacy.msg != view.msg) {
+			cerr << "Parsers disagree on message " << i << "." << endl;
+			return -1;
+		}
+	}
+
+	for (int pass = 0; pass < 2; pass++) {
+		long checksum = 0;
+		long startNs = NowNs();
+		for (int i = 0; i < messageCount; i++) {
+			const string &raw = corpus[i % corpus.size()];
+			if (pass == 0) {
+				Message msg = LegacyCreateMessage(raw, userFrom);
+				checksum += msg.msg.length() + msg.to.length();
+			} else {
+				MessageView msg = ParseMessage(raw, userFrom);
+				checksum += msg.msg.length() + msg.to.length();
+			}
+		}
+		long elapsedNs = NowNs() - startNs;
+
+		double seconds = elapsedNs / 1e9;
+		cout << ((pass == 0) ? "stringstream parse " : "string_view parse  ")
+			<< messageCount << " msgs, "
+			<< (double) elapsedNs / messageCount << " ns/msg, "
+			<< (totalBytes / seconds) / (1024 * 1024) << " MB/s"
+			<< " (checksum " << checksum << ")" << endl;
+	}
+	return 0;
+}
+
+int RunScan(int bufferSize, int rounds)
+{
+	// Worst case for a frame: the delimiter (the trailing null) is the
+	// last byte, so every kernel has to look at the whole body.
+	string body(bufferSize, 'x');
+	body[bufferSize - 1] = '\0';
+
+	vector<pair<string, ScanKernel> > kernels;
+	kernels.push_back(make_pair(string("scalar"), ScanScalar));
+#ifdef RESC_SCAN_X86
+	kernels.push_back(make_pair(string("sse2"), ScanSSE2));
+	if (__builtin_cpu_supports("avx2")) {
+		kernels.push_back(make_pair(string("avx2"), ScanAVX2));
+	}
+#endif
+	cout << "FindByte dispatches to " << SCAN_KERNEL_NAME << endl;
+	for (int k = 0; k < kernels.size(); k++) {
+		ScanKernel kernel = kernels[k].second;
+		size_t found = 0;
+		long startNs = NowNs();
+		for (int i = 0; i < rounds; i++) {
+			found += kernel(body.data(), body.length(), '\0');
+		}
+		long elapsedNs = NowNs() - startNs;
+		if (found != (size_t) rounds * (bufferSize - 1)) {
+			cerr << kernels[k].first << " found the wrong byte." << endl;
+			return -1;
+		}
+		double seconds = elapsedNs / 1e9;
+		cout << kernels[k].first << "\t" << bufferSize << " bytes x " << rounds << ", "
+			<< ((double) bufferSize * rounds / seconds) / (1024 * 1024 * 1024) << " GB/s" << endl;
+	}
+	return 0;
+}
+
+int RunRegistry(int threadCount, int operations)
+{
+	cout << "Registry: login, lookup and logout, " << operations << " per thread, "
+		<< REGISTRY_SHARDS << " shards" << endl;
+	for (int threads = 1; threads <= threadCount; threads *= 2) {
+		for (int pass = 0; pass < 2; pass++) {
+			bool isSharded = (pass == 1);
+			vector<RegistryArgs*> workers;
+			pthread_barrier_init(&PHASE_BARRIER, NULL, threads + 1);
+			for (int i = 0; i < threads; i++) {
+				RegistryArgs* args = new RegistryArgs;
+				args -> isSharded = isSharded;
+				unsigned int seed = i + 1;
+				for (int k = 0; k < operations; k++) {
+					// A few thousand users so threads do meet on names.
+					args -> names.push_back("user" + to_string(rand_r(&seed) % 4096));
+				}
+				pthread_create(&args -> tid, NULL, RegistryThread, args);
+				workers.push_back(args);
+			}
+			pthread_barrier_wait(&PHASE_BARRIER);
+			long startNs = NowNs();
+			for (int i = 0; i < threads; i++) {
+				pthread_join(workers[i] -> tid, NULL);
+				delete workers[i];
+			}
+			long elapsedNs = NowNs() - startNs;
+			pthread_barrier_destroy(&PHASE_BARRIER);
+			cout << threads << " threads, " << ((isSharded) ? "sharded:     " : "single lock: ")
+				<< (long) (threads * (double) operations / (elapsedNs / 1e9)) << " logins/s" << endl;
+		}
+	}
+	return 0;
+}
+
+int RunFanout(int workerCount, int rounds)
+{
+	WorkPool pool;
+	if (WorkPoolInit(&pool, workerCount) != 0) {
+		return -1;
+	}
+	Message msg;
+	msg.cmd = BROADCAST_MSG;
+	msg.from = "bench";
+	msg.msg = "fan-out";
+	FanoutArgs args;
+	args.payload = CreatePayload(msg);
+	cout << "Fanout: " << rounds << " fan-outs per size, pool of " << workerCount
+		<< " workers plus the sender, 256 recipients per chunk" << endl;
+	for (int recipients = 256; recipients <= 32768; recipients *= 4) {
+		while (args.boxes.size() < recipients) {
+			int wakeSock = eventfd(0, EFD_NONBLOCK);
+			if (wakeSock < 0) {
+				cerr << "Out of eventfds at " << args.boxes.size() << " mailboxes." << endl;
+				return -1;
+			}
+			Mailbox* box = new Mailbox;
+			MailboxInit(box);
+			args.boxes.push_back(box);
+			args.wakeSocks.push_back(wakeSock);
+		}
+		long elapsedNs[2] = {0, 0};
+		long maxNs[2] = {0, 0};
+		for (int i = 0; i < rounds; i++) {
+			for (int pass = 0; pass < 2; pass++) {
+				long startNs = NowNs();
+				if (pass == 0) {
+					FanoutChunk(&args, 0, recipients);
+				} else {
+					WorkPoolRun(&pool, recipients, 256, FanoutChunk, &args);
+				}
+				long roundNs = NowNs() - startNs;
+				elapsedNs[pass] += roundNs;
+				maxNs[pass] = max(maxNs[pass], roundNs);
+				// Drain like each user's thread would, so every fan-out
+				// pays for its wakes. Not timed.
+				for (int k = 0; k < recipients; k++) {
+					eventfd_t wakeCount;
+					eventfd_read(args.wakeSocks[k], &wakeCount);
+					MailboxArm(args.boxes[k]);
+					MailboxClear(args.boxes[k]);
+				}
+			}
+		}
+		cout << recipients << " recipients, inline: avg " << elapsedNs[0] / rounds / 1000
+			<< " us, max " << maxNs[0] / 1000 << " us; pool: avg " << elapsedNs[1] / rounds / 1000
+			<< " us, max " << maxNs[1] / 1000 << " us, " << pool.steals.load() << " chunks stolen so far" << endl;
+	}
+	ReleasePayload(args.payload);
+	return 0;
+}
+
+int RunOffline(int threadCount, int messageCount, int messageSize)
+{
+	char dir[] = "/tmp/rescBench.XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		cerr << "Unable to create a directory for the log." << endl;
+		return -1;
+	}
+	MessageLog log;
+	if (LogOpen(&log, dir) != 0) {
+		return -1;
+	}
+	const int recipients = 1000;
+	long total = (long) threadCount * messageCount;
+	cout << "Offline: " << threadCount << " threads appending " << messageCount << " messages of "
+		<< messageSize << " bytes each for " << recipients << " users, log in " << dir << endl;
+	vector<OfflineArgs*> workers;
+	pthread_barrier_init(&PHASE_BARRIER, NULL, threadCount + 1);
+	for (int i = 0; i < threadCount; i++) {
+		OfflineArgs* args = new OfflineArgs;
+		args -> log = &log;
+		args -> index = i;
+		args -> count = messageCount;
+		args -> recipients = recipients;
+		args -> msg = string(messageSize, 'm');
+		pthread_create(&args -> tid, NULL, OfflineThread, args);
+		workers.push_back(args);
+	}
+	pthread_barrier_wait(&PHASE_BARRIER);
+	long startNs = NowNs();
+	for (int i = 0; i < threadCount; i++) {
+		pthread_join(workers[i] -> tid, NULL);
+		delete workers[i];
+	}
+	long appendNs = NowNs() - startNs;
+	LogWaitDurable(&log);
+	long durableNs = NowNs() - startNs;
+	pthread_barrier_destroy(&PHASE_BARRIER);
+	cout << "Append:  " << (long) (total / (appendNs / 1e9)) << " msgs/s, "
+		<< (long) (total * (double) messageSize / (appendNs / 1e9) / 1e6) << " MB/s, "
+		<< appendNs / max(1L, total) << " ns each" << endl;
+	cout << "Durable: all synced after " << durableNs / 1000000 << " ms, " << log.syncs << " syncs, "
+		<< total / max(1L, log.syncs) << " messages per sync" << endl;
+	LogClose(&log);
+
+	startNs = NowNs();
+	if (LogOpen(&log, dir) != 0) {
+		return -1;
+	}
+	long recoverNs = NowNs() - startNs;
+	cout << "Recover: " << log.waitingCount << " messages for " << log.waiting.size() << " users in "
+		<< recoverNs / 1000000 << " ms, " << (long) (log.waitingCount / (recoverNs / 1e9)) << " msgs/s" << endl;
+
+	vector<Payload*> payloads;
+	long drained = 0;
+	startNs = NowNs();
+	for (int i = 0; i < recipients; i++) {
+		LogDrain(&log, "user" + to_string(i), payloads);
+		drained += payloads.size();
+		// As if every one had been sent at once.
+		deque<Payload*> sent(payloads.begin(), payloads.end());
+		LogConfirm(&log, sent);
+		payloads.clear();
+	}
+	long drainNs = NowNs() - startNs;
+	cout << "Drain:   " << drained << " messages, " << (long) (drained / (drainNs / 1e9)) << " msgs/s" << endl;
+	LogWaitDurable(&log);
+	LogClose(&log);
+
+	DIR* listing = opendir(dir);
+	struct dirent* entry;
+	while (listing != NULL && (entry = readdir(listing)) != NULL) {
+		if (entry -> d_name[0] != '.') {
+			unlink((string(dir) + "/" + entry -> d_name).c_str());
+		}
+	}
+	if (listing != NULL) {
+		closedir(listing);
+	}
+	rmdir(dir);
+	return (drained == total) ? 0 : -1;
+}
+
+void* OfflineThread(void* args_p)
+{
+	OfflineArgs* args = (OfflineArgs*) args_p;
+	string from = "sender" + to_string(args -> index);
+	vector<string> names;
+	for (int i = 0; i < args -> recipients; i++) {
+		names.push_back("user" + to_string(i));
+	}
+	pthread_barrier_wait(&PHASE_BARRIER);
+	for (int i = 0; i < args -> count; i++) {
+		LogAppend(args -> log, names[(i + args -> index) % args -> recipients], from, args -> msg);
+	}
+	return NULL;
+}
+
+int RunHistory(int readerCount, int messageCount, int messageSize)
+{
+	const size_t capacity = 50;
+	Message msg;
+	msg.cmd = BROADCAST_MSG;
+	msg.from = "bench";
+	msg.msg = string(messageSize, 'h');
+	Payload* payload = CreatePayload(msg);
+	cout << "History: " << messageCount << " messages of " << messageSize << " bytes into a ring of "
+		<< capacity << endl;
+	for (int readers = 0; readers <= readerCount; readers += max(1, readerCount)) {
+		HistoryRing* ring = CreateHistoryRing(capacity);
+		vector<ReplayArgs*> workers;
+		IS_SENDING = true;
+		pthread_barrier_init(&PHASE_BARRIER, NULL, readers + 1);
+		for (int i = 0; i < readers; i++) {
+			ReplayArgs* args = new ReplayArgs;
+			args -> ring = ring;
+			args -> replays = 0;
+			args -> replayed = 0;
+			pthread_create(&args -> tid, NULL, ReplayThread, args);
+			workers.push_back(args);
+		}
+		pthread_barrier_wait(&PHASE_BARRIER);
+		long startNs = NowNs();
+		for (int i = 0; i < messageCount; i++) {
+			HistoryRecord(ring, payload);
+		}
+		long elapsedNs = NowNs() - startNs;
+		IS_SENDING = false;
+		long replays = 0;
+		long replayed = 0;
+		for (int i = 0; i < readers; i++) {
+			pthread_join(workers[i] -> tid, NULL);
+			replays += workers[i] -> replays;
+			replayed += workers[i] -> replayed;
+			delete workers[i];
+		}
+		pthread_barrier_destroy(&PHASE_BARRIER);
+		DeleteHistoryRing(ring);
+		cout << readers << " readers: " << (long) (messageCount / (elapsedNs / 1e9)) << " messages/s kept, "
+			<< (long) (replays / (elapsedNs / 1e9)) << " replays/s, "
+			<< (long) (replayed / (elapsedNs / 1e9)) << " messages/s replayed" << endl;
+	}
+	ReleasePayload(payload);
+	return 0;
+}
+
+void* ReplayThread(void* args_p)
+{
+	ReplayArgs* args = (ReplayArgs*) args_p;
+	vector<Payload*> payloads;
+	pthread_barrier_wait(&PHASE_BARRIER);
+	while (IS_SENDING) {
+		HistoryReplay(args -> ring, HistoryHead(args -> ring), payloads);
+		args -> replayed += payloads.size();
+		for (size_t i = 0; i < payloads.size(); i++) {
+			ReleasePayload(payloads[i]);
+		}
+		payloads.clear();
+		args -> replays++;
+	}
+	return NULL;
+}
+
+void FanoutChunk(void* args_p, size_t begin, size_t end)
+{
+	FanoutArgs* args = (FanoutArgs*) args_p;
+	for (size_t i = begin; i < end; i++) {
+		MailNode* node = new MailNode;
+		RetainPayload(args -> payload);
+		node -> payload = args -> payload;
+		node -> target = 0;
+		if (MailboxPush(args -> boxes[i], node)) {
+			eventfd_write(args -> wakeSocks[i], 1);
+		}
+	}
+}
+
+void* RegistryThread(void* args_p)
+{
+	RegistryArgs* args = (RegistryArgs*) args_p;
+	pthread_barrier_wait(&PHASE_BARRIER);
+	long found = 0;
+	for (int i = 0; i < args -> names.size(); i++) {
+		const string &name = args -> names[i];
+		if (!args -> isSharded) {
+			// What ValidateUser, a /msg lookup and DisconnectUser did
+			// under the one UserListLock.
+			pthread_mutex_lock(&lockedUsersLock);
+			User &user = LOCKED_USERS[name];
+			user.username = name;
+			user.isConnected = true;
+			pthread_mutex_unlock(&lockedUsersLock);
+			pthread_mutex_lock(&lockedUsersLock);
+			found += LOCKED_USERS.count(name);
+			pthread_mutex_unlock(&lockedUsersLock);
+			pthread_mutex_lock(&lockedUsersLock);
+			LOCKED_USERS[name].isConnected = false;
+			pthread_mutex_unlock(&lockedUsersLock);
+			continue;
+		}
+		RegistryShard<User>* shard = RegistryShardFor(&SHARDED_USERS, name);
+		pthread_mutex_lock(&shard -> lock);
+		User &user = shard -> entries[name];
+		user.username = name;
+		user.isConnected = true;
+		pthread_mutex_unlock(&shard -> lock);
+		pthread_mutex_lock(&shard -> lock);
+		found += shard -> entries.count(name);
+		pthread_mutex_unlock(&shard -> lock);
+		pthread_mutex_lock(&shard -> lock);
+		shard -> entries[name].isConnected = false;
+		pthread_mutex_unlock(&shard -> lock);
+	}
+	return (void*) found;
+}
+
+Message LegacyCreateMessage(string msg, string from)
+{
+	Message newMsg;
+	newMsg.msg = "";
+	newMsg.to = "";
+	newMsg.from = from;
+	newMsg.cmd = INVALID_MSG;
+	bool isClient = (newMsg.from == "");
+
+	const char *cMsg = msg.c_str();
+	if (cMsg[0] != '/') {
+		newMsg.cmd = BROADCAST_MSG;
+		newMsg.msg = msg;
+		return newMsg;
+	}
+	int cmdSize = -1;
+	for (int i = 1; i < msg.length(); i++) {
+		if (cMsg[i] == ' ') {
+			cmdSize = i;
+			break;
+		}
+	}
+	if (cmdSize == -1) {
+		cmdSize = msg.length();
+	}
+	stringstream ss;
+	for (int i = 0; i < cmdSize; i++) {
+		ss << cMsg[i];
+	}
+	string cmdName = ss.str();
+	ss.str("");
+	ss.clear();
+
+	MsgType cmd = INVALID_MSG;
+	if (cmdName == "/userlist") {
+		for (int i = cmdSize+1; i < msg.length(); i++) {
+			ss << cMsg[i];
+		}
+		newMsg.msg.append(ss.str());
+		newMsg.cmd = USER_LIST_MSG;
+		return newMsg;
+	} else if (cmdName == "/all") {
+		cmd = BROADCAST_MSG;
+	} else if (cmdName == "/msg") {
+		cmd = DIRECT_MSG;
+	} else if (cmdName == "/filestream") {
+		cmd = FILE_STREAM_MSG;
+	} else {
+		return newMsg;
+	}
+	int userSize = -1;
+	for (int i = cmdSize+1; i < msg.length(); i++) {
+		if (cMsg[i] == ' ') {
+			userSize = i;
+			break;
+		}
+	}
+	if (userSize == -1) {
+		return newMsg;
+	}
+	for (int i = cmdSize+1; i < userSize; i++) {
+		ss << cMsg[i];
+	}
+	if (isClient) {
+		newMsg.from.append(ss.str());
+	} else {
+		newMsg.to.append(ss.str());
+	}
+	ss.str("");
+	ss.clear();
+	for (int i = userSize+1; i < msg.length(); i++) {
+		ss << cMsg[i];
+	}
+	newMsg.msg.append(ss.str());
+	newMsg.cmd = cmd;
+	return newMsg;
+}
+
+bool OpenLoopback(int &sendSock, int &recvSock)
+{
+	int listenSock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0;
+	socklen_t addrLen = sizeof(address);
+	if (bind(listenSock, (struct sockaddr *) &address, addrLen) < 0 ||
+		listen(listenSock, 1) < 0 ||
+		getsockname(listenSock, (struct sockaddr *) &address, &addrLen) < 0) {
+		close(listenSock);
+		return false;
+	}
+	sendSock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (connect(sendSock, (struct sockaddr *) &address, addrLen) < 0) {
+		close(listenSock);
+		return false;
+	}
+	recvSock = accept(listenSock, NULL, NULL);
+	close(listenSock);
+	return (recvSock >= 0);
+}
+
+void* DrainThread(void* args_p)
+{
+	DrainArgs* args = (DrainArgs*) args_p;
+	char buffer[READ_CHUNK];
+	long received = 0;
+	while (received < args -> expected) {
+		int bytesRecv = recv(args -> sock, buffer, READ_CHUNK, 0);
+		if (bytesRecv <= 0) {
+			break;
+		}
+		received += bytesRecv;
+	}
+	return NULL;
+}
+
+BenchClient* ConnectClient(string hostname, unsigned short serverPort, string username, uint8_t version, bool wantsDelta, bool canSlice)
+{
+	int sock = OpenSocket(hostname, serverPort);
+	if (sock < 0) {
+		return NULL;
+	}
+	string capabilities;
+	if (version == PROTOCOL_V2) {
+		capabilities = CAPABILITY_V2;
+	}
+	if (wantsDelta) {
+		capabilities += (capabilities.empty()) ? CAPABILITY_DELTA : " " + CAPABILITY_DELTA;
+	}
+	if (canSlice) {
+		capabilities += (capabilities.empty()) ? CAPABILITY_SLICES : " " + CAPABILITY_SLICES;
+	}
+	string request = username + "|bench";
+	if (!capabilities.empty()) {
+		request += "\n" + capabilities;
+	}
+	SendMessage(sock, request);
+	string authResponse = ReadMessage(sock);
+	if (!CheckAuthResponse(authResponse)) {
+		CloseSocket(sock);
+		return NULL;
+	}
+	BenchClient* client = new BenchClient;
+	client -> sock = sock;
+	client -> username = username;
+	client -> roomPeers = 0;
+	client -> isWaiting = false;
+	FrameReaderInit(&client -> reader);
+	OutQueueInit(&client -> out);
+	string_view response(authResponse);
+	if (HasCapability(SplitCapabilities(response), CAPABILITY_V2)) {
+		client -> reader.version = PROTOCOL_V2;
+		client -> out.version = PROTOCOL_V2;
+	}
+	return client;
+}
+
+void CloseClient(BenchClient* client)
+{
+	if (client -> out.version == PROTOCOL_V2) {
+		SendFrame(client -> sock, INVALID_MSG, client -> out.seq, string_view(), string_view(), "/quit");
+	} else {
+		SendMessage(client -> sock, "/quit");
+	}
+	CloseSocket(client -> sock);
+	OutQueueClear(&client -> out);
+	delete client;
+}
+
+int RunLoad(LoadConfig &config)
+{
+	cout << "Load: " << config.clientCount << " clients on " << config.workerCount << " workers, "
+		<< config.rate << " msgs/s for " << config.seconds << "s, mix "
+		<< config.mix[0] << ":" << config.mix[1] << ":" << config.mix[2]
+		<< ", v" << (int) config.version;
+	if (config.roomCount > 0) {
+		cout << ", /all sent to " << config.roomCount << " rooms";
+	}
+	cout << endl;
+
+	vector<LoadWorker*> workers;
+	RUN_START_NS = NowNs();
+	pthread_barrier_init(&PHASE_BARRIER, NULL, config.workerCount + 1);
+	for (int i = 0; i < config.workerCount; i++) {
+		LoadWorker* worker = new LoadWorker;
+		worker -> config = &config;
+		worker -> index = i;
+		HistogramInit(&worker -> latency);
+		HistogramInit(&worker -> chatLatency);
+		worker -> sent[0] = worker -> sent[1] = worker -> sent[2] = 0;
+		worker -> roomDeliveries = 0;
+		worker -> delivered = 0;
+		worker -> bytesReceived = 0;
+		worker -> failures = 0;
+		if (pthread_create(&worker -> tid, NULL, LoadThread, worker) != 0) {
+			cerr << "Failed to create load worker." << endl;
+			return -1;
+		}
+		workers.push_back(worker);
+	}
+
+	// Phase 1: everyone logs in.
+	long startNs = NowNs();
+	pthread_barrier_wait(&PHASE_BARRIER);
+	long connectNs = NowNs() - startNs;
+	long failures = 0;
+	for (int i = 0; i < workers.size(); i++) {
+		failures += workers[i] -> failures;
+	}
+	cout << "Connected " << config.clientCount - failures << " clients in "
+		<< connectNs / 1000000 << " ms" << endl;
+
+	// Phase 2: let the login userlists drain, then send for the duration.
+	sleep(1);
+	IS_SENDING = true;
+	startNs = NowNs();
+	sleep(config.seconds);
+	IS_SENDING = false;
+	long sendNs = NowNs() - startNs;
+
+	// Phase 3: give stragglers a moment to arrive.
+	sleep(2);
+	IS_RUNNING = false;
+	for (int i = 0; i < workers.size(); i++) {
+		pthread_join(workers[i] -> tid, NULL);
+	}
+
+	Histogram latency;
+	HistogramInit(&latency);
+	Histogram chatLatency;
+	HistogramInit(&chatLatency);
+	long sent[3] = {0, 0, 0};
+	long roomDeliveries = 0;
+	long delivered = 0;
+	long bytesReceived = 0;
+	for (int i = 0; i < workers.size(); i++) {
+		HistogramMerge(&latency, &workers[i] -> latency);
+		HistogramMerge(&chatLatency, &workers[i] -> chatLatency);
+		for (int k = 0; k < 3; k++) {
+			sent[k] += workers[i] -> sent[k];
+		}
+		roomDeliveries += workers[i] -> roomDeliveries;
+		delivered += workers[i] -> delivered;
+		bytesReceived += workers[i] -> bytesReceived;
+		delete workers[i];
+	}
+	// Every other client receives an /all, every other member a /room;
+	// /msg and /filestream have one recipient.
+	long connected = config.clientCount - failures;
+	long expected = sent[0] * (connected - 1) + sent[1] + sent[2];
+	if (config.roomCount > 0) {
+		expected = roomDeliveries + sent[1] + sent[2];
+	}
+	double seconds = sendNs / 1e9;
+	cout << "Sent " << sent[0] + sent[1] + sent[2] << " msgs (";
+	for (int k = 0; k < 3; k++) {
+		string name = (k == 0 && config.roomCount > 0) ? "/room" : MIX_NAMES[k];
+		cout << name << " " << sent[k] << ((k < 2) ? ", " : "");
+	}
+	cout << "), " << (long) ((sent[0] + sent[1] + sent[2]) / seconds) << " msgs/s" << endl;
+	cout << "Delivered " << delivered << " / " << expected << ", "
+		<< (long) (delivered / seconds) << " deliveries/s, "
+		<< (bytesReceived / seconds) / (1024 * 1024) << " MB/s received" << endl;
+	ReportHistogram("Delivery latency", &latency);
+	if (config.mix[2] > 0) {
+		// What filestreams cost everything else.
+		ReportHistogram("Chat delivery latency", &chatLatency);
+	}
+	pthread_barrier_destroy(&PHASE_BARRIER);
+	return 0;
+}
+
+void* LoadThread(void* args_p)
+{
+	LoadWorker* worker = (LoadWorker*) args_p;
+	LoadConfig* config = worker -> config;
+	int epollSock = epoll_create1(0);
+	unsigned int seed = worker -> index + 1;
+
+	// Clients are dealt out round robin so names map back to workers.
+	for (int i = worker -> index; i < config -> clientCount; i += config -> workerCount) {
+		stringstream ss;
+		ss << "load" << i;
+		BenchClient* client = ConnectClient(config -> hostname, config -> serverPort, ss.str(), config -> version, config -> wantsDelta, config -> canSlice);
+		if (client == NULL) {
+			worker -> failures++;
+			continue;
+		}
+		if (config -> roomCount > 0) {
+			// Client i is in room i % roomCount.
+			int room = i % config -> roomCount;
+			stringstream roomName;
+			roomName << "room" << room;
+			client -> room = roomName.str();
+			client -> roomPeers = config -> clientCount / config -> roomCount
+				+ ((room < config -> clientCount % config -> roomCount) ? 1 : 0) - 1;
+			if (client -> out.version == PROTOCOL_V2) {
+				SendFrame(client -> sock, JOIN_MSG, client -> out.seq++, client -> room, string_view(), string_view());
+			} else {
+				SendMessage(client -> sock, "/join " + client -> room);
+			}
+		}
+		int flags = fcntl(client -> sock, F_GETFL, 0);
+		fcntl(client -> sock, F_SETFL, flags | O_NONBLOCK);
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = client;
+		epoll_ctl(epollSock, EPOLL_CTL_ADD, client -> sock, &ev);
+		worker -> clients.push_back(client);
+	}
+	pthread_barrier_wait(&PHASE_BARRIER);
+
+	// Open loop: messages are due every interval whether or not the server
+	// keeps up, and latency counts from when a message was due, so a
+	// stalled server cannot hide its backlog.
+	long intervalNs = (long) (1e9 * config -> workerCount / config -> rate);
+	long nextNs = 0;
+	struct epoll_event events[MAX_EVENTS];
+	while (IS_RUNNING) {
+		long nowNs = NowNs();
+		if (IS_SENDING && !worker -> clients.empty()) {
+			if (nextNs == 0) {
+				// Stagger workers across the first interval.
+				nextNs = nowNs + intervalNs * worker -> index / config -> workerCount;
+			}
+			while (nextNs <= nowNs) {
+				SendLoadMessage(worker, epollSock, nextNs);
+				nextNs += intervalNs;
+			}
+		}
+		int timeoutMs = 100;
+		if (IS_SENDING && nextNs > nowNs) {
+			timeoutMs = min(100L, (nextNs - nowNs) / 1000000);
+		}
+		int eventCount = epoll_wait(epollSock, events, MAX_EVENTS, timeoutMs);
+		for (int i = 0; i < eventCount; i++) {
+			BenchClient* client = (BenchClient*) events[i].data.ptr;
+			if (events[i].events & EPOLLIN) {
+				ReadLoadClient(worker, client);
+			}
+			if (events[i].events & EPOLLOUT) {
+				FlushClient(client, epollSock);
+			}
+		}
+	}
+
+	for (int i = 0; i < worker -> clients.size(); i++) {
+		CloseClient(worker -> clients[i]);
+	}
+	close(epollSock);
+	return NULL;
+}
+
+void SendLoadMessage(LoadWorker* worker, int epollSock, long stampNs)
+{
+	LoadConfig* config = worker -> config;
+	BenchClient* client = worker -> clients[rand() % worker -> clients.size()];
+	int pick = rand() % 100;
+	int kind = (pick < config -> mix[0]) ? 0 : (pick < config -> mix[0] + config -> mix[1]) ? 1 : 2;
+	stringstream target;
+	target << "load" << rand() % config -> clientCount;
+	string to = target.str();
+	if (kind != 0 && to == client -> username) {
+		// Talking to yourself is never delivered; make it an /all.
+		kind = 0;
+	}
+
+	// Body is the due time, then padding to the configured size.
+	stringstream body;
+	body << stampNs << " ";
+	string msg = body.str();
+	msg.append(max(0, ((kind == 2) ? config -> fileSize : config -> chatSize) - (int) msg.length()), 'x');
+
+	MessageView view;
+	view.cmd = (kind == 0) ? BROADCAST_MSG : (kind == 1) ? DIRECT_MSG : FILE_STREAM_MSG;
+	view.to = (kind == 0) ? string_view("load") : string_view(to);
+	view.from = string_view();
+	view.msg = msg;
+	string cmdName = MIX_NAMES[kind];
+	if (kind == 0 && config -> roomCount > 0) {
+		view.cmd = ROOM_MSG;
+		view.to = client -> room;
+		cmdName = "/room";
+		worker -> roomDeliveries += client -> roomPeers;
+	}
+	Payload* payload;
+	if (client -> out.version == PROTOCOL_V2) {
+		payload = CreatePayload(view);
+	} else {
+		payload = CreateRawPayload(cmdName + " " + string(view.to) + " " + msg);
+	}
+	OutQueuePush(&client -> out, payload);
+	worker -> sent[kind]++;
+	if (!client -> isWaiting) {
+		FlushClient(client, epollSock);
+	}
+}
+
+void FlushClient(BenchClient* client, int epollSock)
+{
+	FlushStatus status = FlushOutQueue(client -> sock, &client -> out);
+	bool shouldWait = (status == FLUSH_BLOCKED);
+	if (shouldWait != client -> isWaiting) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN | ((shouldWait) ? EPOLLOUT : 0);
+		ev.data.ptr = client;
+		epoll_ctl(epollSock, EPOLL_CTL_MOD, client -> sock, &ev);
+		client -> isWaiting = shouldWait;
+	}
+}
+
+void ReadLoadClient(LoadWorker* worker, BenchClient* client)
+{
+	int bytesRecv = FrameReaderFill(client -> sock, &client -> reader);
+	if (bytesRecv <= 0) {
+		return;
+	}
+	worker -> bytesReceived += bytesRecv;
+	long nowNs = NowNs();
+	FrameHeader header;
+	MessageView view;
+	while (FrameReaderNext(&client -> reader, header, view) == FRAME_READY) {
+		if (view.cmd == INVALID_MSG) {
+			view = ParseMessage(view.msg, "");
+		}
+		if (view.cmd != BROADCAST_MSG && view.cmd != DIRECT_MSG && view.cmd != FILE_STREAM_MSG &&
+			view.cmd != ROOM_MSG) {
+			continue;
+		}
+		long stampNs = atol(string(view.msg.substr(0, 24)).c_str());
+		if (stampNs >= RUN_START_NS) {
+			worker -> delivered++;
+			HistogramRecord(&worker -> latency, nowNs - stampNs);
+			if (view.cmd != FILE_STREAM_MSG) {
+				HistogramRecord(&worker -> chatLatency, nowNs - stampNs);
+			}
+		}
+	}
+	FrameReaderRelease(&client -> reader);
+}
+
+int RunStorm(LoadConfig &config, bool isReconnect)
+{
+	int rounds = config.rounds + 1;
+	cout << ((isReconnect) ? "Reconnect" : "Connect") << " storm: " << config.clientCount
+		<< " clients on " << config.workerCount << " workers";
+	if (isReconnect) {
+		cout << ", " << config.rounds << " reconnects";
+	}
+	cout << endl;
+
+	vector<LoadWorker*> workers;
+	pthread_barrier_init(&PHASE_BARRIER, NULL, config.workerCount + 1);
+	for (int i = 0; i < config.workerCount; i++) {
+		LoadWorker* worker = new LoadWorker;
+		worker -> config = &config;
+		worker -> index = i;
+		worker -> failures = 0;
+		HistogramInit(&worker -> latency);
+		if (pthread_create(&worker -> tid, NULL, StormThread, worker) != 0) {
+			cerr << "Failed to create storm worker." << endl;
+			return -1;
+		}
+		workers.push_back(worker);
+	}
+
+	// Each round: release the workers together, wait for every login.
+	for (int round = 0; round < rounds; round++) {
+		pthread_barrier_wait(&PHASE_BARRIER);
+		long startNs = NowNs();
+		pthread_barrier_wait(&PHASE_BARRIER);
+		long elapsedNs = NowNs() - startNs;
+
+		Histogram latency;
+		HistogramInit(&latency);
+		long failures = 0;
+		for (int i = 0; i < workers.size(); i++) {
+			HistogramMerge(&latency, &workers[i] -> latency);
+			HistogramInit(&workers[i] -> latency);
+			failures += workers[i] -> failures;
+			workers[i] -> failures = 0;
+		}
+		stringstream title;
+		if (round == 0) {
+			title << "Connect";
+		} else {
+			title << "Reconnect " << round;
+		}
+		cout << title.str() << ": " << config.clientCount - failures << " logins in "
+			<< elapsedNs / 1000000 << " ms, "
+			<< (long) ((config.clientCount - failures) / (elapsedNs / 1e9)) << " logins/s, "
+			<< failures << " failed" << endl;
+		ReportHistogram(title.str() + " login latency", &latency);
+	}
+	for (int i = 0; i < workers.size(); i++) {
+		pthread_join(workers[i] -> tid, NULL);
+		delete workers[i];
+	}
+	pthread_barrier_destroy(&PHASE_BARRIER);
+	return 0;
+}
+
+void* StormThread(void* args_p)
+{
+	LoadWorker* worker = (LoadWorker*) args_p;
+	LoadConfig* config = worker -> config;
+	int rounds = config -> rounds + 1;
+	for (int round = 0; round < rounds; round++) {
+		pthread_barrier_wait(&PHASE_BARRIER);
+		if (round > 0) {
+			// Everyone drops at once, the way a deploy or network blip
+			// would do it, and comes straight back.
+			for (int i = 0; i < worker -> clients.size(); i++) {
+				CloseClient(worker -> clients[i]);
+			}
+			worker -> clients.clear();
+		}
+		for (int i = worker -> index; i < config -> clientCount; i += config -> workerCount) {
+			stringstream ss;
+			ss << "storm" << i;
+			long startNs = NowNs();
+			BenchClient* client = ConnectClient(config -> hostname, config -> serverPort, ss.str(), config -> version, config -> wantsDelta, config -> canSlice);
+			if (client == NULL) {
+				worker -> failures++;
+				continue;
+			}
+			HistogramRecord(&worker -> latency, NowNs() - startNs);
+			worker -> clients.push_back(client);
+		}
+		pthread_barrier_wait(&PHASE_BARRIER);
+	}
+	for (int i = 0; i < worker -> clients.size(); i++) {
+		CloseClient(worker -> clients[i]);
+	}
+	return NULL;
+}
+
+int RunPresence(LoadConfig &config, int churnCount)
+{
+	cout << "Presence: " << config.clientCount << " watchers, " << config.rounds << " rounds of "
+		<< churnCount << " logins and logouts, v" << (int) config.version
+		<< ((config.wantsDelta) ? " with deltas" : " with userlists") << endl;
+
+	vector<PresenceWatcher*> watchers;
+	for (int i = 0; i < config.clientCount; i++) {
+		stringstream ss;
+		ss << "watch" << i;
+		BenchClient* client = ConnectClient(config.hostname, config.serverPort, ss.str(), config.version, config.wantsDelta, config.canSlice);
+		if (client == NULL) {
+			cerr << "Unable to log in " << ss.str() << endl;
+			return -1;
+		}
+		int flags = fcntl(client -> sock, F_GETFL, 0);
+		fcntl(client -> sock, F_SETFL, flags | O_NONBLOCK);
+		PresenceWatcher* watcher = new PresenceWatcher;
+		watcher -> client = client;
+		watcher -> version = 0;
+		watcher -> userlists = 0;
+		watcher -> deltas = 0;
+		watcher -> gaps = 0;
+		watcher -> bytesReceived = 0;
+		watcher -> keepsChat = false;
+		watchers.push_back(watcher);
+	}
+
+	// Let the watchers' own logins settle, then only count the churn.
+	usleep(500000);
+	for (int i = 0; i < watchers.size(); i++) {
+		ReadPresence(watchers[i]);
+		watchers[i] -> userlists = 0;
+		watchers[i] -> deltas = 0;
+		watchers[i] -> bytesReceived = 0;
+	}
+
+	long startNs = NowNs();
+	for (int round = 0; round < config.rounds; round++) {
+		vector<BenchClient*> churn;
+		for (int i = 0; i < churnCount; i++) {
+			stringstream ss;
+			ss << "churn" << i;
+			BenchClient* client = ConnectClient(config.hostname, config.serverPort, ss.str(), config.version, config.wantsDelta, config.canSlice);
+			if (client != NULL) {
+				churn.push_back(client);
+			}
+		}
+		usleep(100000);
+		for (int i = 0; i < churn.size(); i++) {
+			CloseClient(churn[i]);
+		}
+		usleep(100000);
+		for (int i = 0; i < watchers.size(); i++) {
+			ReadPresence(watchers[i]);
+		}
+	}
+	usleep(500000);
+	long elapsedNs = NowNs() - startNs;
+
+	long userlists = 0;
+	long deltas = 0;
+	long gaps = 0;
+	long bytesReceived = 0;
+	long mismatched = 0;
+	for (int i = 0; i < watchers.size(); i++) {
+		PresenceWatcher* watcher = watchers[i];
+		ReadPresence(watcher);
+		userlists += watcher -> userlists;
+		deltas += watcher -> deltas;
+		gaps += watcher -> gaps;
+		bytesReceived += watcher -> bytesReceived;
+		if (config.wantsDelta && watcher -> users.size() != watchers.size()) {
+			// Every churn user has left; only the watchers should remain.
+			mismatched++;
+		}
+	}
+	cout << "Per watcher: " << userlists / (double) watchers.size() << " userlists, "
+		<< deltas / (double) watchers.size() << " deltas, "
+		<< bytesReceived / watchers.size() << " bytes in " << elapsedNs / 1000000 << " ms" << endl;
+	if (config.wantsDelta) {
+		cout << "Delta gaps: " << gaps << ", watchers with the wrong user set: " << mismatched << endl;
+	}
+	for (int i = 0; i < watchers.size(); i++) {
+		CloseClient(watchers[i] -> client);
+		delete watchers[i];
+	}
+	return 0;
+}
+
+void ReadPresence(PresenceWatcher* watcher)
+{
+	BenchClient* client = watcher -> client;
+	FrameHeader header;
+	MessageView view;
+	int bytesRecv;
+	while ((bytesRecv = FrameReaderFill(client -> sock, &client -> reader)) > 0) {
+		watcher -> bytesReceived += bytesRecv;
+		while (FrameReaderNext(&client -> reader, header, view) == FRAME_READY) {
+			if (view.cmd == INVALID_MSG) {
+				view = ParseMessage(view.msg, "");
+			}
+			if (view.cmd == USER_LIST_MSG) {
+				watcher -> userlists++;
+				continue;
+			}
+			if (view.cmd == BROADCAST_MSG || view.cmd == DIRECT_MSG) {
+				if (watcher -> keepsChat) {
+					watcher -> chat.push_back(string(view.msg));
+				}
+				continue;
+			}
+			unsigned long version;
+			bool isSnapshot;
+			string_view entries;
+			if (view.cmd != PRESENCE_MSG || !ParsePresence(view.msg, version, isSnapshot, entries)) {
+				continue;
+			}
+			watcher -> deltas++;
+			if (!isSnapshot && version != watcher -> version + 1) {
+				watcher -> gaps++;
+			}
+			if (isSnapshot) {
+				watcher -> users.clear();
+			}
+			watcher -> version = version;
+			size_t start = 0;
+			while (start < entries.length()) {
+				size_t split = FindByte(entries, '\n', start);
+				if (split == string_view::npos) {
+					split = entries.length();
+				}
+				string_view entry = entries.substr(start, split - start);
+				if (isSnapshot) {
+					watcher -> users.insert(string(entry));
+				} else if (entry[0] == '+') {
+					watcher -> users.insert(string(entry.substr(1)));
+				} else if (entry[0] == '-') {
+					watcher -> users.erase(string(entry.substr(1)));
+				}
+				start = split + 1;
+			}
+		}
+		FrameReaderRelease(&client -> reader);
+	}
+}
+
+int RunCluster(string serverPath, unsigned short basePort, int clientCount, int messageCount, int relayCount)
+{
+	int nodeCount = (relayCount > 0) ? relayCount + 1 : 3;
+	cout << ((relayCount > 0) ? "Relay tree: " : "Cluster: ") << nodeCount << " nodes on ports " << basePort << "-" << basePort + nodeCount - 1
+		<< ", " << clientCount << " clients each, " << messageCount << " /all and " << messageCount << " /msg" << endl;
+
+	// Every node needs the same key to link up.
+	char keyPath[] = "/tmp/rescBenchKeyXXXXXX";
+	int keySock = mkstemp(keyPath);
+	if (keySock < 0) {
+		cerr << "Unable to write a cluster key." << endl;
+		return -1;
+	}
+	string key = to_string(NowNs()) + "\n";
+	if (write(keySock, key.data(), key.length()) != (ssize_t) key.length()) {
+		cerr << "Unable to write a cluster key." << endl;
+		close(keySock);
+		unlink(keyPath);
+		return -1;
+	}
+	close(keySock);
+
+	// In a cluster node i dials every node started before it, so each pair
+	// has one link; in a tree every relay dials the root, node 0.
+	vector<pid_t> nodes;
+	for (int i = 0; i < nodeCount; i++) {
+		vector<string> args;
+		args.push_back(serverPath);
+		args.push_back(to_string(basePort + i));
+		args.push_back("-l");
+		args.push_back("off");
+		args.push_back("-c");
+		args.push_back(to_string(basePort + nodeCount + i));
+		args.push_back("-N");
+		args.push_back("node" + to_string(i));
+		args.push_back("-K");
+		args.push_back(keyPath);
+		for (int j = 0; j < i && relayCount == 0; j++) {
+			args.push_back("-P");
+			args.push_back("127.0.0.1:" + to_string(basePort + nodeCount + j));
+		}
+		if (relayCount > 0 && i > 0) {
+			args.push_back("-u");
+			args.push_back("127.0.0.1:" + to_string(basePort + nodeCount));
+		}
+		pid_t pid = fork();
+		if (pid == 0) {
+			int devNull = open("/dev/null", O_WRONLY);
+			dup2(devNull, STDOUT_FILENO);
+			dup2(devNull, STDERR_FILENO);
+			vector<char*> argList;
+			for (size_t k = 0; k < args.size(); k++) {
+				argList.push_back((char*) args[k].c_str());
+			}
+			argList.push_back(NULL);
+			execv(serverPath.c_str(), argList.data());
+			_exit(127);
+		}
+		if (pid < 0) {
+			cerr << "Unable to start node " << i << endl;
+			StopNodes(nodes);
+			unlink(keyPath);
+			return -1;
+		}
+		nodes.push_back(pid);
+	}
+
+	vector<PresenceWatcher*> watchers;
+	for (int i = 0; i < nodeCount * clientCount; i++) {
+		int node = i / clientCount;
+		stringstream ss;
+		ss << "node" << node << "user" << i % clientCount;
+		BenchClient* client = NULL;
+		for (int attempt = 0; client == NULL && attempt < 50; attempt++) {
+			// The node may still be starting up.
+			client = ConnectClient("127.0.0.1", basePort + node, ss.str(), PROTOCOL_V2, true, false);
+			if (client == NULL) {
+				usleep(100000);
+			}
+		}
+		if (client == NULL) {
+			cerr << "Unable to log in " << ss.str() << endl;
+			StopNodes(nodes);
+			unlink(keyPath);
+			return -1;
+		}
+		int flags = fcntl(client -> sock, F_GETFL, 0);
+		fcntl(client -> sock, F_SETFL, flags | O_NONBLOCK);
+		PresenceWatcher* watcher = new PresenceWatcher;
+		watcher -> client = client;
+		watcher -> version = 0;
+		watcher -> userlists = 0;
+		watcher -> deltas = 0;
+		watcher -> gaps = 0;
+		watcher -> bytesReceived = 0;
+		watcher -> keepsChat = true;
+		watchers.push_back(watcher);
+	}
+
+	long presenceNs = AwaitPresence(watchers, watchers.size(), watchers.size(), 10000);
+	if (presenceNs < 0) {
+		cout << "Presence: not every client saw all " << watchers.size() << " users within 10 s" << endl;
+	} else {
+		cout << "Presence: every client saw all " << watchers.size() << " users " << presenceNs / 1000000
+			<< " ms after the last login" << endl;
+	}
+
+	// One message at a time, so latency is the trip across the cluster and
+	// not a queue. An /all should reach everyone but its sender and a /msg
+	// its user on the next node over; any more is a message that crossed a
+	// link twice.
+	Histogram latency[2];
+	HistogramInit(&latency[0]);
+	HistogramInit(&latency[1]);
+	map<string, long> deliveries;
+	map<string, long> expected;
+	for (int kind = 0; kind < 2; kind++) {
+		for (int k = 0; k < messageCount; k++) {
+			PresenceWatcher* sender = watchers[k % watchers.size()];
+			PresenceWatcher* target = watchers[(k + clientCount) % watchers.size()];
+			stringstream ss;
+			ss << ((kind == 0) ? "all" : "msg") << k << " " << NowNs();
+			string body = ss.str();
+			expected[body] = (kind == 0) ? watchers.size() - 1 : 1;
+			SendFrame(sender -> client -> sock, (kind == 0) ? BROADCAST_MSG : DIRECT_MSG, sender -> client -> out.seq++,
+				(kind == 0) ? string_view("cluster") : string_view(target -> client -> username), string_view(), body);
+			long deadlineNs = NowNs() + 2000000000L;
+			while (deliveries[body] < expected[body] && NowNs() < deadlineNs) {
+				PollWatchers(watchers, watchers.size(), 10);
+				CountDeliveries(watchers, deliveries, latency);
+			}
+		}
+	}
+	// Anything still on its way, including the copies that shouldn't be.
+	long settleNs = NowNs() + 500000000L;
+	while (NowNs() < settleNs) {
+		PollWatchers(watchers, watchers.size(), 10);
+		CountDeliveries(watchers, deliveries, latency);
+	}
+	long missing[2] = {0, 0};
+	long duplicated[2] = {0, 0};
+	map<string, long>::iterator expectIter;
+	for (expectIter = expected.begin(); expectIter != expected.end(); expectIter++) {
+		int kind = ((*expectIter).first.compare(0, 3, "msg") == 0) ? 1 : 0;
+		long got = deliveries[(*expectIter).first];
+		missing[kind] += max(0L, (*expectIter).second - got);
+		duplicated[kind] += max(0L, got - (*expectIter).second);
+	}
+	ReportHistogram("/all across nodes", &latency[0]);
+	ReportHistogram("/msg across nodes", &latency[1]);
+	cout << "Delivered: /all " << latency[0].total << " (" << missing[0] << " missing, " << duplicated[0] << " duplicated), /msg "
+		<< latency[1].total << " (" << missing[1] << " missing, " << duplicated[1] << " duplicated)" << endl;
+
+	// Lose the last node; everyone left should see its users go.
+	kill(nodes[nodeCount - 1], SIGINT);
+	waitpid(nodes[nodeCount - 1], NULL, 0);
+	nodes.pop_back();
+	size_t remaining = (nodeCount - 1) * clientCount;
+	long lossNs = AwaitPresence(watchers, remaining, remaining, 10000);
+	if (lossNs < 0) {
+		cout << "Node loss: the remaining clients still saw other users after 10 s" << endl;
+	} else {
+		cout << "Node loss: the remaining clients saw " << remaining << " users after " << lossNs / 1000000 << " ms" << endl;
+	}
+
+	for (int i = 0; i < watchers.size(); i++) {
+		CloseClient(watchers[i] -> client);
+		delete watchers[i];
+	}
+	StopNodes(nodes);
+	unlink(keyPath);
+	bool isExact = missing[0] + missing[1] + duplicated[0] + duplicated[1] == 0 && presenceNs >= 0 && lossNs >= 0;
+	return (isExact) ? 0 : -1;
+}
+
+long AwaitPresence(vector<PresenceWatcher*> &watchers, size_t count, size_t userCount, int timeoutMs)
+{
+	long startNs = NowNs();
+	long deadlineNs = startNs + timeoutMs * 1000000L;
+	while (NowNs() < deadlineNs) {
+		PollWatchers(watchers, count, 10);
+		size_t agreed = 0;
+		for (size_t i = 0; i < count; i++) {
+			if (watchers[i] -> users.size() == userCount) {
+				agreed++;
+			}
+		}
+		if (agreed == count) {
+			return NowNs() - startNs;
+		}
+	}
+	return -1;
+}
+
+void PollWatchers(vector<PresenceWatcher*> &watchers, size_t count, int timeoutMs)
+{
+	vector<struct pollfd> watchfds(count);
+	for (size_t i = 0; i < count; i++) {
+		watchfds[i].fd = watchers[i] -> client -> sock;
+		watchfds[i].events = POLLIN;
+		watchfds[i].revents = 0;
+	}
+	if (poll(watchfds.data(), count, timeoutMs) <= 0) {
+		return;
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (watchfds[i].revents & POLLIN) {
+			ReadPresence(watchers[i]);
+		}
+	}
+}
+
+void CountDeliveries(vector<PresenceWatcher*> &watchers, map<string, long> &deliveries, Histogram* latency)
+{
+	long nowNs = NowNs();
+	for (size_t i = 0; i < watchers.size(); i++) {
+		vector<string> &chat = watchers[i] -> chat;
+		for (size_t j = 0; j < chat.size(); j++) {
+			size_t split = chat[j].find(' ');
+			if (split == string::npos) {
+				continue;
+			}
+			deliveries[chat[j]]++;
+			int kind = (chat[j].compare(0, 3, "msg") == 0) ? 1 : 0;
+			HistogramRecord(&latency[kind], nowNs - atol(chat[j].c_str() + split + 1));
+		}
+		chat.clear();
+	}
+}
+
+void StopNodes(vector<pid_t> &nodes)
+{
+	for (size_t i = 0; i < nodes.size(); i++) {
+		kill(nodes[i], SIGINT);
+	}
+	for (size_t i = 0; i < nodes.size(); i++) {
+		waitpid(nodes[i], NULL, 0);
+	}
+}
+
+void HistogramInit(Histogram* histogram)
+{
+	int binCount = (64 - __builtin_clzl(HISTOGRAM_MAX) - 10) * HISTOGRAM_SUB_BUCKETS;
+	histogram -> counts.assign(binCount, 0);
+	histogram -> total = 0;
+	histogram -> maxValue = 0;
+}
+
+int HistogramIndex(long value)
+{
+	if (value < 2 * HISTOGRAM_SUB_BUCKETS) {
+		return value;
+	}
+	// Power of two above 2048 picks the bucket; the next 10 bits the bin.
+	int bucket = 63 - __builtin_clzl(value) - 10;
+	long subBucket = value >> bucket;
+	return (bucket + 1) * HISTOGRAM_SUB_BUCKETS + (subBucket - HISTOGRAM_SUB_BUCKETS);
+}
+
+long HistogramValue(int index)
+{
+	// Highest value that lands in the bin.
+	if (index < 2 * HISTOGRAM_SUB_BUCKETS) {
+		return index;
+	}
+	int bucket = index / HISTOGRAM_SUB_BUCKETS - 1;
+	long subBucket = index % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+	return ((subBucket + 1) << bucket) - 1;
+}
+
+void HistogramRecord(Histogram* histogram, long value)
+{
+	value = min(max(value, 0L), HISTOGRAM_MAX - 1);
+	histogram -> counts[HistogramIndex(value)]++;
+	histogram -> total++;
+	histogram -> maxValue = max(histogram -> maxValue, value);
+}
+
+void HistogramMerge(Histogram* into, const Histogram* from)
+{
+	for (int i = 0; i < from -> counts.size(); i++) {
+		into -> counts[i] += from -> counts[i];
+	}
+	into -> total += from -> total;
+	into -> maxValue = max(into -> maxValue, from -> maxValue);
+}
+
+long HistogramPercentile(const Histogram* histogram, double percentile)
+{
+	long rank = (long) (histogram -> total * percentile / 100.0 + 0.5);
+	rank = min(max(rank, 1L), histogram -> total);
+	long seen = 0;
+	for (int i = 0; i < histogram -> counts.size(); i++) {
+		seen += histogram -> counts[i];
+		if (seen >= rank) {
+			return min(HistogramValue(i), histogram -> maxValue);
+		}
+	}
+	return histogram -> maxValue;
+}
+
+void ReportHistogram(string title, const Histogram* histogram)
+{
+	if (histogram -> total == 0) {
+		cout << title << ": no samples" << endl;
+		return;
+	}
+	double percentiles[5] = {50, 90, 99, 99.9, 99.99};
+	cout << title << " (us):";
+	for (int i = 0; i < 5; i++) {
+		cout << " p" << percentiles[i] << " " << HistogramPercentile(histogram, percentiles[i]) / 1000;
+	}
+	cout << " max " << histogram -> maxValue / 1000 << endl;
+}
+
+void RaiseFileLimit()
+{
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+bool ParseMix(string mix, int* percents)
+{
+	for (int i = 0; i < 3; i++) {
+		size_t split = mix.find(':');
+		percents[i] = atoi(mix.substr(0, split).c_str());
+		mix = (split == string::npos) ? "" : mix.substr(split + 1);
+	}
+	return percents[0] + percents[1] + percents[2] == 100 &&
+		percents[0] >= 0 && percents[1] >= 0 && percents[2] >= 0;
+}
+
+void* ReceiverThread(void* args_p)
+{
+	int epollSock = epoll_create1(0);
+	for (int i = 0; i < RECEIVERS.size(); i++) {
+		int flags = fcntl(RECEIVERS[i] -> sock, F_GETFL, 0);
+		fcntl(RECEIVERS[i] -> sock, F_SETFL, flags | O_NONBLOCK);
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = RECEIVERS[i];
+		epoll_ctl(epollSock, EPOLL_CTL_ADD, RECEIVERS[i] -> sock, &ev);
+	}
+
+	struct epoll_event events[MAX_EVENTS];
+	string msg;
+	while (IS_RUNNING) {
+		int eventCount = epoll_wait(epollSock, events, MAX_EVENTS, 100);
+		for (int i = 0; i < eventCount; i++) {
+			BenchClient* client = (BenchClient*) events[i].data.ptr;
+			int bytesRecv = FrameReaderFill(client -> sock, &client -> reader);
+			if (bytesRecv <= 0) {
+				if (bytesRecv == 0) {
+					epoll_ctl(epollSock, EPOLL_CTL_DEL, client -> sock, NULL);
+				}
+				continue;
+			}
+			while (FrameReaderNext(&client -> reader, msg) == FRAME_READY) {
+				RecordFrame(msg);
+			}
+		}
+	}
+	close(epollSock);
+	return NULL;
+}
+
+void RecordFrame(string &msg)
+{
+	// "/all benchSend bench <ns>"
+	if (msg.compare(0, 5, "/all ") != 0) {
+		return;
+	}
+	size_t stamp = msg.find(" bench ");
+	if (stamp == string::npos) {
+		return;
+	}
+	long sentNs = atol(msg.c_str() + stamp + 7);
+	if (sentNs < RUN_START_NS) {
+		return;
+	}
+	long latency = NowNs() - sentNs;
+	pthread_mutex_lock(&latencyLock);
+	LATENCIES.push_back(latency);
+	pthread_mutex_unlock(&latencyLock);
+}
+
+void ReportLatency(long expected)
+{
+	pthread_mutex_lock(&latencyLock);
+	sort(LATENCIES.begin(), LATENCIES.end());
+	cout << "Delivered " << LATENCIES.size() << " / " << expected << " messages" << endl;
+	if (!LATENCIES.empty()) {
+		long p50 = LATENCIES[LATENCIES.size() * 50 / 100];
+		long p99 = LATENCIES[min(LATENCIES.size() - 1, LATENCIES.size() * 99 / 100)];
+		long worst = LATENCIES.back();
+		cout << "Latency p50: " << p50 / 1000 << " us" << endl;
+		cout << "Latency p99: " << p99 / 1000 << " us" << endl;
+		cout << "Latency max: " << worst / 1000 << " us" << endl;
+	}
+	pthread_mutex_unlock(&latencyLock);
+}
+
+long NowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
@@ -15,6 +15,14 @@
 #include<cstdlib>
 #include<unordered_map>
 #include<queue>
+#include<vector>
+#include<algorithm>
+#include<atomic>
+
+// Files
+#include<fcntl.h>
+#include<sys/stat.h>
+#include<signal.h>
 
 // User Interface
 #include<curses.h>
@@ -39,9 +47,63 @@ WINDOW* MSG_SCREEN;
 WINDOW* USER_SCREEN;
 pthread_mutex_t displayLock;
 int displayStatus = pthread_mutex_init(&displayLock, NULL);
-deque<string> USER_LIST;
+// Online users, sorted, as of presence delta PRESENCE_VERSION.
+vector<string> USER_LIST;
 pthread_mutex_t userListLock;
 int userListStatus = pthread_mutex_init(&userListLock, NULL);
+unsigned long PRESENCE_VERSION = 0;
+bool isAwaitingSnapshot = false;
+// Set by the reader thread on a delta gap; the input loop asks for a snapshot.
+atomic<bool> shouldRequestSnapshot(false);
+// Framing agreed with the server at login.
+uint8_t PROTOCOL_VERSION = PROTOCOL_V1;
+bool CAN_TRANSFER = false;
+// The input loop, the reader thread and file senders all write frames;
+// one at a time, in seq order.
+uint64_t SEND_SEQ = 0;
+pthread_mutex_t sendLock;
+int sendStatus = pthread_mutex_init(&sendLock, NULL);
+string USER_NAME;
+int SERVER_SOCKET = -1;
+// What it takes to log in again when the connection drops. SESSION_TOKEN
+// is empty unless the server can resume the session.
+const string CLIENT_CAPABILITIES = CAPABILITY_V2 + " " + CAPABILITY_DELTA + " " + CAPABILITY_SLICES + " " +
+	CAPABILITY_FILES + " " + CAPABILITY_RESUME;
+const int RECONNECT_ATTEMPTS = 8;
+string SERVER_HOST;
+unsigned short SERVER_PORT = 0;
+string USER_PWD;
+string SESSION_TOKEN;
+atomic<bool> isQuitting(false);
+// Files on their way out, by id, and in, by "<from>/<id>". The reader
+// thread records acks and chunks; senders wait on transferCond for acks.
+struct OutgoingFile {
+	string to;
+	string id;
+	string name;
+	int fd;
+	uint64_t size;
+	uint64_t sent;
+	uint64_t acked;
+	bool hasStarted;	// The server said where to start.
+};
+struct IncomingFile {
+	string from;
+	string id;
+	string name;
+	string path;	// Saved as path + ".part" until it is all here.
+	int fd;
+	uint64_t size;
+	uint64_t received;
+	uint64_t requested;	// Asked the server for everything before this.
+};
+unordered_map<string, OutgoingFile*> OUTGOING_FILES;
+unordered_map<string, IncomingFile*> INCOMING_FILES;
+pthread_mutex_t transferLock;
+int transferStatus = pthread_mutex_init(&transferLock, NULL);
+pthread_cond_t transferCond;
+int transferCondStatus = pthread_cond_init(&transferCond, NULL);
+bool isServerGone = false;
 
 // Data Structures
 struct threadArgs {
@@ -84,8 +146,48 @@ void DisplayUserList(string &msg);
 // pre: USER_SCREEN should exist
 // post: none
 
+void ProcessPresence(string_view body);
+// Function applies a presence snapshot or delta to USER_LIST and the screen.
+// pre: USER_SCREEN should exist
+// post: a gap in delta versions sets shouldRequestSnapshot
+
+void ApplyPresenceChange(string_view change);
+// Function adds ("+name") or removes ("-name") one user, moving only the
+// screen lines below it.
+// pre: userListLock and displayLock should be held
+// post: none
+
+void RedrawUserList();
+// Function draws USER_LIST from scratch.
+// pre: userListLock and displayLock should be held
+// post: none
+
+void DrawUserFooter();
+// Function draws the divider and user count under the visible names.
+// pre: userListLock and displayLock should be held
+// post: none
+
+void DrawUserLine(int row, string_view text);
+// Function draws one "| text" line of USER_SCREEN.
+// pre: displayLock should be held
+// post: none
+
 void ProcessIncomingData(int serverSocket);
-// Function loops over polling the server socket for data.
+// Function loops over polling the server socket for data, reconnecting
+// whenever the connection drops until the user quits.
+// pre: none
+// post: none
+
+int Reconnect(FrameReader* reader);
+// Function logs in again after the connection drops, resuming the session
+// if the server kept it, with backoff between attempts.
+// pre: USER_NAME and USER_PWD should be set
+// post: returns the new socket, now SERVER_SOCKET, or -1 once
+//       RECONNECT_ATTEMPTS have failed
+
+void RestartTransfers();
+// Function picks every file transfer up again from wherever the server has
+// it, since chunks and requests sent while disconnected are lost.
 // pre: none
 // post: none
 
@@ -94,7 +196,7 @@ bool HasAuthenticated (int serverSocket, User &user);
 // pre: none
 // post: none
 
-void ProcessMessage(string rawMsg);
+void ProcessMessage(MessageView &view);
 // Function processess incoming messages.
 // pre: none
 // post: none
@@ -104,6 +206,49 @@ void SaveFileStream(Message &fileStream, string userFrom);
 // pre: none
 // post: none
 
+void SendToServer(string_view text);
+// Function sends a command in the negotiated framing.
+// pre: SERVER_SOCKET should be connected
+// post: none
+
+void StartFileSend(string_view args);
+// Function starts sending "<user> <path>" on a thread of its own.
+// pre: the server accepted "files"
+// post: none
+
+void* FileSendThread(void* args_p);
+// Function announces a file, then sends it in chunks from wherever the
+// server says it got to, keeping at most FILE_WINDOW_BYTES unacked.
+// pre: args_p is the file's OutgoingFile
+// post: the OutgoingFile is freed
+
+void ProcessTransfer(MessageView &view);
+// Function handles acks, offers and chunks.
+// pre: view.cmd is FILE_ACK_MSG, FILE_OFFER_MSG or FILE_CHUNK_MSG
+// post: none
+
+void AcceptFileOffer(MessageView &view);
+// Function opens (or reopens, to resume) the .part file for an offer and
+// asks for its first window.
+// pre: none
+// post: repeated offers for a file already coming in are ignored
+
+void ReceiveFileChunk(MessageView &view);
+// Function writes a chunk, asks for the next window when this one is half
+// in and finishes the file after its last byte.
+// pre: none
+// post: none
+
+void RequestFileWindow(IncomingFile* file);
+// Function asks for the next FILE_WINDOW_BYTES of a file.
+// pre: transferLock should be held
+// post: none
+
+void FinishIncomingFile(IncomingFile* file);
+// Function renames the .part file, tells the server and forgets the file.
+// pre: transferLock should be held
+// post: file is freed
+
 int main (int argc, char * argv[])
 {
 	// LOCALS
@@ -121,6 +266,11 @@ int main (int argc, char * argv[])
 	// Need to store arguments
 	string hostname = argv[1];
 	unsigned short serverPort = atoi(argv[2]);
+	SERVER_HOST = hostname;
+	SERVER_PORT = serverPort;
+	
+	// A dropped connection gets reconnected; it mustn't kill us first.
+	signal(SIGPIPE, SIG_IGN);
 	
 	// Begin User Interface
 	PrepareWindows();
@@ -130,6 +280,8 @@ int main (int argc, char * argv[])
 	while (!HasAuthenticated(serverSocket, user)) {
 	}
 	userName = user.username;
+	USER_NAME = userName;
+	SERVER_SOCKET = serverSocket;
 	
 	// Establish Socket Reader
 	struct threadArgs* args_p = new threadArgs;
@@ -143,13 +295,24 @@ int main (int argc, char * argv[])
 	if (serverSocket > 0) {
 		// Enter Function Loop
 		while (true) {
+			if (shouldRequestSnapshot.exchange(false)) {
+				// Missed a presence delta; start over from a snapshot.
+				SendToServer("/presence");
+			}
 			if (GetUserInput(inputStr, false)) {
 				// Process Local Commands
 				if (inputStr == "/quit" || inputStr == "/exit" || inputStr == "/close") {
 					// Notify Server we're done.
-					SendMessage(serverSocket, inputStr);
+					isQuitting = true;
+					SendToServer(inputStr);
 					break;
 				}
+				if (inputStr.compare(0, 10, "/sendfile ") == 0) {
+					StartFileSend(string_view(inputStr).substr(10));
+					inputStr.clear();
+					ClearInputScreen();
+					continue;
+				}
 			
 				// Provide some feedback to the user.
 				string tmp = "You said: ";
@@ -158,7 +321,7 @@ int main (int argc, char * argv[])
 				DisplayMessage(tmp, 6);
 			
 				// Send to Chat Server
-				SendMessage(serverSocket, inputStr);
+				SendToServer(inputStr);
 				
 				// Clean slate
 				inputStr.clear();
@@ -168,7 +331,7 @@ int main (int argc, char * argv[])
 	}
 	
 	// Clean it all up
-	CloseSocket(serverSocket);
+	CloseSocket(SERVER_SOCKET);
 	delwin(INPUT_SCREEN);
 	delwin(USER_SCREEN);
 	delwin(MSG_SCREEN);
@@ -278,7 +441,10 @@ bool HasAuthenticated (int serverSocket, User &user) {
   ClearInputScreen();
   
   // Process
-  ss << userName << "|" << userPwd;
+  // Offer v2 framing, delta presence, sliced filestreams, file
+  // transfers and resuming; an older
+  // server just sees a longer password.
+  ss << userName << "|" << userPwd << "\n" << CLIENT_CAPABILITIES;
   string bodyMsg = ss.str();
   ss.str("");
   ss.clear();
@@ -289,6 +455,14 @@ bool HasAuthenticated (int serverSocket, User &user) {
   if (CheckAuthResponse(authResponse)) {
     // Login Sucessful!
     user.username = userName;
+    string_view response(authResponse);
+    string_view capabilities = SplitCapabilities(response);
+    if (HasCapability(capabilities, CAPABILITY_V2)) {
+      PROTOCOL_VERSION = PROTOCOL_V2;
+    }
+    CAN_TRANSFER = HasCapability(capabilities, CAPABILITY_FILES);
+    USER_PWD = userPwd;
+    SESSION_TOKEN = string(CapabilityValue(capabilities, "token"));
     return true;
   }
   // Login Failed
@@ -359,14 +533,20 @@ void DisplayMessage(string &msg, int messageClass) {
 void DisplayUserList(string &msg) {
 	pthread_mutex_lock(&displayLock);
 	wbkgd(USER_SCREEN, COLOR_PAIR(4));
-	const char * cMsg = msg.c_str();
-	for (int i = 0; i < msg.length(); i++) {
-		if (cMsg[i] == '|') {
+	// Draw the text between '|' separators as runs rather than per char.
+	size_t start = 0;
+	while (start < msg.length()) {
+		size_t split = RESC::FindByte(msg, '|', start);
+		if (split == string::npos) {
+			split = msg.length();
+		}
+		wattrset(USER_SCREEN, COLOR_PAIR(3));
+		waddnstr(USER_SCREEN, msg.data() + start, split - start);
+		if (split < msg.length()) {
 			wattrset(USER_SCREEN, COLOR_PAIR(4));
-		} else {
-			wattrset(USER_SCREEN, COLOR_PAIR(3));
+			waddch(USER_SCREEN, '|');
 		}
-		waddch(USER_SCREEN, cMsg[i]);
+		start = split + 1;
 	}
 	
 	// Show screen
@@ -374,6 +554,122 @@ void DisplayUserList(string &msg) {
 	pthread_mutex_unlock(&displayLock);
 }
 
+void ProcessPresence(string_view body) {
+	unsigned long version;
+	bool isSnapshot;
+	string_view entries;
+	if (!ParsePresence(body, version, isSnapshot, entries)) {
+		return;
+	}
+	pthread_mutex_lock(&userListLock);
+	pthread_mutex_lock(&displayLock);
+	if (isSnapshot) {
+		USER_LIST.clear();
+		size_t start = 0;
+		while (start < entries.length()) {
+			size_t split = FindByte(entries, '\n', start);
+			if (split == string_view::npos) {
+				split = entries.length();
+			}
+			USER_LIST.push_back(string(entries.substr(start, split - start)));
+			start = split + 1;
+		}
+		sort(USER_LIST.begin(), USER_LIST.end());
+		PRESENCE_VERSION = version;
+		isAwaitingSnapshot = false;
+		RedrawUserList();
+	} else if (!isAwaitingSnapshot && version == PRESENCE_VERSION + 1) {
+		size_t start = 0;
+		while (start < entries.length()) {
+			size_t split = FindByte(entries, '\n', start);
+			if (split == string_view::npos) {
+				split = entries.length();
+			}
+			ApplyPresenceChange(entries.substr(start, split - start));
+			start = split + 1;
+		}
+		PRESENCE_VERSION = version;
+		DrawUserFooter();
+	} else if (!isAwaitingSnapshot && version > PRESENCE_VERSION + 1) {
+		// Deltas only make sense on top of the one before; anything older
+		// than our version is already part of the snapshot we have.
+		isAwaitingSnapshot = true;
+		shouldRequestSnapshot = true;
+	}
+	wrefresh(USER_SCREEN);
+	pthread_mutex_unlock(&displayLock);
+	pthread_mutex_unlock(&userListLock);
+}
+
+void ApplyPresenceChange(string_view change) {
+	if (change.length() < 2) {
+		return;
+	}
+	string name(change.substr(1));
+	int nameRows = LINES - INPUT_LINES - 2;
+	vector<string>::iterator position = lower_bound(USER_LIST.begin(), USER_LIST.end(), name);
+	int row = position - USER_LIST.begin();
+	bool isListed = (position != USER_LIST.end() && *position == name);
+	if (change[0] == '+' && !isListed) {
+		USER_LIST.insert(position, name);
+		if (row < nameRows) {
+			// Push the lines below down one and fill the gap.
+			wmove(USER_SCREEN, row, 0);
+			winsertln(USER_SCREEN);
+			DrawUserLine(row, name);
+		}
+	} else if (change[0] == '-' && isListed) {
+		USER_LIST.erase(position);
+		if (row < nameRows) {
+			// Pull the lines below up one; the last visible name row may
+			// now have someone to show.
+			wmove(USER_SCREEN, row, 0);
+			wdeleteln(USER_SCREEN);
+			if (USER_LIST.size() >= nameRows) {
+				DrawUserLine(nameRows - 1, USER_LIST[nameRows - 1]);
+			}
+		}
+	}
+}
+
+void RedrawUserList() {
+	wbkgd(USER_SCREEN, COLOR_PAIR(4));
+	werase(USER_SCREEN);
+	int nameRows = LINES - INPUT_LINES - 2;
+	for (int row = 0; row < nameRows && row < USER_LIST.size(); row++) {
+		DrawUserLine(row, USER_LIST[row]);
+	}
+	DrawUserFooter();
+}
+
+void DrawUserFooter() {
+	int rows = LINES - INPUT_LINES;
+	if (rows < 2) {
+		return;
+	}
+	int row = min((int) USER_LIST.size(), rows - 2);
+	DrawUserLine(row, "-----");
+	DrawUserLine(row + 1, to_string(USER_LIST.size()) + " Users");
+	if (row + 2 < rows) {
+		// Below the count is empty border, as ClearUserScreen leaves it.
+		wmove(USER_SCREEN, row + 2, 0);
+		wclrtobot(USER_SCREEN);
+		wattrset(USER_SCREEN, COLOR_PAIR(4));
+		mvwvline(USER_SCREEN, row + 2, 0, '|', rows - row - 2);
+	}
+}
+
+void DrawUserLine(int row, string_view text) {
+	wmove(USER_SCREEN, row, 0);
+	wattrset(USER_SCREEN, COLOR_PAIR(4));
+	waddch(USER_SCREEN, '|');
+	wattrset(USER_SCREEN, COLOR_PAIR(3));
+	waddch(USER_SCREEN, ' ');
+	// Stop short of the last column so the cursor never wraps a line.
+	waddnstr(USER_SCREEN, text.data(), min((int) text.length(), USER_COLS - 3));
+	wclrtoeol(USER_SCREEN);
+}
+
 void* ServerThread(void* args_p) {
   
   // Local Variables
@@ -384,12 +680,10 @@ void* ServerThread(void* args_p) {
   // Detach Thread to ensure that resources are deallocated on return.
   pthread_detach(pthread_self());
 
-  // Communicate with Client
+  // Communicate with Client. The socket may be replaced along the way;
+  // main closes whichever is SERVER_SOCKET at the end.
   ProcessIncomingData(hostSock);
 
-  // Close Client socket
-  close(hostSock);
-
   // Quit thread
   pthread_exit(NULL);
 }
@@ -400,6 +694,11 @@ void ProcessIncomingData(int serverSocket) {
   bool canRead = true;
   fd_set hostfd;
   struct timeval tv;
+  FrameReader reader;
+  FrameReaderInit(&reader);
+  reader.version = PROTOCOL_VERSION;
+  FrameHeader header;
+  MessageView view;
 
   // Clear FD_Set and set timeout.
   FD_ZERO(&hostfd);
@@ -417,26 +716,123 @@ void ProcessIncomingData(int serverSocket) {
     tv.tv_usec = 10000;
     FD_SET(serverSocket, &hostfd);
     if (pollSock != 0 && pollSock != -1) {
-      // Socket has data, let's retrieve it.
-      string incMessage = ReadMessage(serverSocket);
-	  // Display Message
-	  ProcessMessage(incMessage);
-	  //DisplayMessage(incMessage);
+      // Socket has data, let's retrieve all of it.
+      if (FrameReaderFill(serverSocket, &reader) <= 0) {
+        serverSocket = (isQuitting) ? -1 : Reconnect(&reader);
+        if (serverSocket < 0) {
+          canRead = false;
+          break;
+        }
+        FD_ZERO(&hostfd);
+        FD_SET(serverSocket, &hostfd);
+        numberOfSocks = serverSocket + 1;
+        continue;
+      }
+      while (FrameReaderNext(&reader, header, view) == FRAME_READY) {
+	    // Display Message
+	    ProcessMessage(view);
+      }
+      FrameReaderRelease(&reader);
 	  wrefresh(INPUT_SCREEN);
     }
   }
+  // Senders waiting on acks that won't come can stop.
+  pthread_mutex_lock(&transferLock);
+  isServerGone = true;
+  pthread_cond_broadcast(&transferCond);
+  pthread_mutex_unlock(&transferLock);
 }
 
-void ProcessMessage(string rawMsg) {
-	RESC::Message msg = RESC::CreateMessage(rawMsg, "");
+int Reconnect(FrameReader* reader) {
+	string status = "Lost the connection to the server; reconnecting.\n";
+	DisplayMessage(status, 6);
+	int delayMs = 250;
+	for (int attempt = 0; attempt < RECONNECT_ATTEMPTS && !isQuitting; attempt++) {
+		usleep(delayMs * 1000);
+		delayMs = min(delayMs * 2, 8000);
+		int serverSocket = OpenSocket(SERVER_HOST, SERVER_PORT);
+		if (serverSocket < 0) {
+			continue;
+		}
+		string loginMsg = USER_NAME + "|" + USER_PWD + "\n" + CLIENT_CAPABILITIES;
+		if (!SESSION_TOKEN.empty()) {
+			loginMsg += " token=" + SESSION_TOKEN + " seq=" + to_string(reader -> nextSeq);
+		}
+		SendMessage(serverSocket, loginMsg);
+		string authResponse = ReadMessage(serverSocket);
+		if (!CheckAuthResponse(authResponse)) {
+			close(serverSocket);
+			continue;
+		}
+		string_view response(authResponse);
+		string_view capabilities = SplitCapabilities(response);
+		string_view resumed = CapabilityValue(capabilities, "resumed");
+		SESSION_TOKEN = string(CapabilityValue(capabilities, "token"));
+		if (resumed.empty()) {
+			// Logged in afresh: presence comes over again, rooms don't.
+			FrameReaderInit(reader);
+			reader -> version = PROTOCOL_VERSION;
+			status = "Reconnected as a new session; /join your rooms again.\n";
+		} else {
+			FrameReaderRestart(reader, strtoull(string(resumed).c_str(), NULL, 10));
+			status = "Reconnected.\n";
+		}
+		pthread_mutex_lock(&sendLock);
+		close(SERVER_SOCKET);
+		SERVER_SOCKET = serverSocket;
+		pthread_mutex_unlock(&sendLock);
+		DisplayMessage(status, 6);
+		RestartTransfers();
+		return serverSocket;
+	}
+	status = "Unable to reconnect to the server.\n";
+	DisplayMessage(status, 6);
+	return -1;
+}
+
+void RestartTransfers() {
+	pthread_mutex_lock(&transferLock);
+	unordered_map<string, OutgoingFile*>::iterator outIter = OUTGOING_FILES.begin();
+	while (outIter != OUTGOING_FILES.end()) {
+		// The server acks how much it spooled, and sending carries on from there.
+		OutgoingFile* file = (*outIter).second;
+		file -> hasStarted = false;
+		SendToServer("/fileput " + file -> to + " " + file -> id + " " + to_string(file -> size) + " " + file -> name);
+		outIter++;
+	}
+	unordered_map<string, IncomingFile*>::iterator inIter = INCOMING_FILES.begin();
+	while (inIter != INCOMING_FILES.end()) {
+		IncomingFile* file = (*inIter).second;
+		file -> requested = file -> received;
+		RequestFileWindow(file);
+		inIter++;
+	}
+	pthread_mutex_unlock(&transferLock);
+}
+
+void ProcessMessage(MessageView &view) {
+	// v1 frames arrive as text; v2 frames are already split up.
+	if (view.cmd == INVALID_MSG) {
+		view = ParseMessage(view.msg, "");
+	}
+	if (view.cmd == FILE_ACK_MSG || view.cmd == FILE_OFFER_MSG || view.cmd == FILE_CHUNK_MSG) {
+		// Chunks are handled straight out of the frame, uncopied.
+		ProcessTransfer(view);
+		return;
+	}
+	RESC::Message msg = RESC::ToMessage(view);
 	string FileStreamMsg = msg.from + " sent you a FileStream.\n";
 	string DirectMsg = "<" + msg.from + " messaged you: " + msg.msg + ">\n";
 	string BroadCastMsg = msg.from + " said: " + msg.msg + "\n";
+	string RoomMsg = "[" + msg.to + "] " + msg.from + " said: " + msg.msg + "\n";
 	switch(msg.cmd) {
 		case USER_LIST_MSG:
 			ClearUserScreen();
 			DisplayUserList(msg.msg);
 			break;
+		case PRESENCE_MSG:
+			ProcessPresence(view.msg);
+			break;
 		case FILE_STREAM_MSG:
 			// Gonna have to figure out where to save these things.
 			DisplayMessage(FileStreamMsg, 2);
@@ -448,6 +844,9 @@ void ProcessMessage(string rawMsg) {
 		case BROADCAST_MSG:
 			DisplayMessage(BroadCastMsg, 1);
 			break;
+		case ROOM_MSG:
+			DisplayMessage(RoomMsg, 3);
+			break;
 		default:
 			//DisplayMessage(rawMsg, false);
 			break;
@@ -463,4 +862,272 @@ void SaveFileStream(Message &fileStream, string userFrom) {
 	savFile << fileStream.msg << endl;
 	savFile.close();
 	
-}
\ No newline at end of file
+}
+void SendToServer(string_view text) {
+	pthread_mutex_lock(&sendLock);
+	SendCommand(SERVER_SOCKET, PROTOCOL_VERSION, SEND_SEQ++, text, USER_NAME);
+	pthread_mutex_unlock(&sendLock);
+}
+
+void StartFileSend(string_view args) {
+	// "<user> <path>"; the path may have spaces.
+	size_t split = FindByte(args, ' ');
+	if (!CAN_TRANSFER || split == string_view::npos || split == 0 || split + 1 == args.length()) {
+		string usage = (CAN_TRANSFER) ? "Usage: /sendfile <user> <path>\n" : "This server doesn't take file transfers.\n";
+		DisplayMessage(usage, 6);
+		return;
+	}
+	string to(args.substr(0, split));
+	string path(args.substr(split + 1));
+	int fd = open(path.c_str(), O_RDONLY);
+	struct stat fileStat;
+	if (fd < 0 || fstat(fd, &fileStat) != 0 || !S_ISREG(fileStat.st_mode)) {
+		string error = "Can't read " + path + ".\n";
+		DisplayMessage(error, 6);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return;
+	}
+	// The same file to the same user gets the same id, so sending it again
+	// after a disconnect picks up where the server got to.
+	string identity = to + "\n" + path + "\n" + to_string(fileStat.st_size) + "\n" + to_string(fileStat.st_mtime);
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < identity.length(); i++) {
+		hash = (hash ^ (unsigned char) identity[i]) * 1099511628211ULL;
+	}
+	char id[17];
+	snprintf(id, sizeof(id), "%016llx", (unsigned long long) hash);
+	OutgoingFile* file = new OutgoingFile;
+	file -> to = to;
+	file -> id = id;
+	size_t slash = FindLastByte(path, '/');
+	file -> name = (slash == string::npos) ? path : path.substr(slash + 1);
+	file -> fd = fd;
+	file -> size = fileStat.st_size;
+	file -> sent = 0;
+	file -> acked = 0;
+	file -> hasStarted = false;
+	pthread_mutex_lock(&transferLock);
+	bool isSending = (OUTGOING_FILES.find(file -> id) != OUTGOING_FILES.end());
+	if (!isSending) {
+		OUTGOING_FILES[file -> id] = file;
+	}
+	pthread_mutex_unlock(&transferLock);
+	if (isSending) {
+		string busy = "Already sending " + file -> name + " to " + to + ".\n";
+		DisplayMessage(busy, 6);
+		close(fd);
+		delete file;
+		return;
+	}
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, FileSendThread, (void*) file) != 0) {
+		cerr << "Failed to create file sender." << endl;
+		pthread_mutex_lock(&transferLock);
+		OUTGOING_FILES.erase(file -> id);
+		pthread_mutex_unlock(&transferLock);
+		close(fd);
+		delete file;
+	}
+}
+
+void* FileSendThread(void* args_p) {
+	OutgoingFile* file = (OutgoingFile*) args_p;
+	pthread_detach(pthread_self());
+	string status = "Sending " + file -> name + " to " + file -> to + ", " + to_string(file -> size) + " bytes.\n";
+	DisplayMessage(status, 6);
+	SendToServer("/fileput " + file -> to + " " + file -> id + " " + to_string(file -> size) + " " + file -> name);
+
+	vector<char> chunk(FILE_OFFSET_SIZE + FILE_CHUNK_BYTES);
+	bool isDone = false;
+	while (!isDone) {
+		pthread_mutex_lock(&transferLock);
+		while (!isServerGone && (!file -> hasStarted ||
+			(file -> sent < file -> size && file -> sent - file -> acked >= FILE_WINDOW_BYTES) ||
+			(file -> sent == file -> size && file -> acked < file -> size))) {
+			pthread_cond_wait(&transferCond, &transferLock);
+		}
+		isDone = isServerGone || file -> acked == file -> size;
+		uint64_t offset = file -> sent;
+		pthread_mutex_unlock(&transferLock);
+		if (isDone) {
+			break;
+		}
+		size_t length = min((uint64_t) FILE_CHUNK_BYTES, file -> size - offset);
+		ssize_t bytesRead = pread(file -> fd, &chunk[FILE_OFFSET_SIZE], length, offset);
+		if (bytesRead != (ssize_t) length) {
+			// Changed under us; a new /sendfile gets a new id.
+			break;
+		}
+		PutLittleEndian(&chunk[0], offset, FILE_OFFSET_SIZE);
+		pthread_mutex_lock(&sendLock);
+		SendFrame(SERVER_SOCKET, FILE_CHUNK_MSG, SEND_SEQ++, file -> id, string_view(), string_view(&chunk[0], FILE_OFFSET_SIZE + length));
+		pthread_mutex_unlock(&sendLock);
+		pthread_mutex_lock(&transferLock);
+		if (file -> sent == offset) {
+			// Unless a reconnect has moved us back meanwhile.
+			file -> sent = offset + length;
+		}
+		pthread_mutex_unlock(&transferLock);
+	}
+
+	pthread_mutex_lock(&transferLock);
+	OUTGOING_FILES.erase(file -> id);
+	bool isSent = (file -> acked == file -> size);
+	pthread_mutex_unlock(&transferLock);
+	status = (isSent) ? "Sent " + file -> name + " to " + file -> to + ".\n" :
+		"Stopped sending " + file -> name + " after " + to_string(file -> acked) + " bytes; /sendfile it again to resume.\n";
+	DisplayMessage(status, 6);
+	close(file -> fd);
+	delete file;
+	return NULL;
+}
+
+void ProcessTransfer(MessageView &view) {
+	switch (view.cmd) {
+		case FILE_ACK_MSG: {
+			// "<id> <offset>" for a file we're sending.
+			string_view fields = view.msg;
+			string_view id;
+			string_view offsetField;
+			uint64_t offset;
+			if (!SplitTransferField(fields, id) || !SplitTransferField(fields, offsetField) ||
+				!ParseTransferNumber(offsetField, offset)) {
+				break;
+			}
+			pthread_mutex_lock(&transferLock);
+			unordered_map<string, OutgoingFile*>::iterator fileIter = OUTGOING_FILES.find(string(id));
+			if (fileIter != OUTGOING_FILES.end() && offset <= (*fileIter).second -> size) {
+				OutgoingFile* file = (*fileIter).second;
+				if (!file -> hasStarted) {
+					// The first ack answers /fileput.
+					file -> hasStarted = true;
+					file -> sent = offset;
+				}
+				file -> acked = offset;
+				pthread_cond_broadcast(&transferCond);
+			}
+			pthread_mutex_unlock(&transferLock);
+			break;
+		}
+		case FILE_OFFER_MSG:
+			AcceptFileOffer(view);
+			break;
+		case FILE_CHUNK_MSG:
+			ReceiveFileChunk(view);
+			break;
+		default:
+			break;
+	}
+}
+
+void AcceptFileOffer(MessageView &view) {
+	// "<id> <size> <name>" from view.from.
+	string_view fields = view.msg;
+	string_view id;
+	string_view sizeField;
+	uint64_t size;
+	if (!SplitTransferField(fields, id) || !IsTransferId(id) || !SplitTransferField(fields, sizeField) ||
+		!ParseTransferNumber(sizeField, size) || fields.empty()) {
+		return;
+	}
+	string key = string(view.from) + "/" + string(id);
+	pthread_mutex_lock(&transferLock);
+	if (INCOMING_FILES.find(key) != INCOMING_FILES.end()) {
+		pthread_mutex_unlock(&transferLock);
+		return;
+	}
+	IncomingFile* file = new IncomingFile;
+	file -> from = string(view.from);
+	file -> id = string(id);
+	file -> name = string(fields);
+	// Saved next to the filestreams, as "<from>-<name>", with nothing in
+	// the name that could leave this directory.
+	replace(file -> name.begin(), file -> name.end(), '/', '_');
+	if (file -> name[0] == '.') {
+		file -> name[0] = '_';
+	}
+	file -> path = file -> from + "-" + file -> name;
+	file -> size = size;
+	file -> fd = open((file -> path + ".part").c_str(), O_WRONLY | O_CREAT, 0644);
+	struct stat fileStat;
+	if (file -> fd < 0 || fstat(file -> fd, &fileStat) != 0) {
+		pthread_mutex_unlock(&transferLock);
+		string error = "Can't save " + file -> path + ".\n";
+		DisplayMessage(error, 6);
+		if (file -> fd >= 0) {
+			close(file -> fd);
+		}
+		delete file;
+		return;
+	}
+	// Whatever an earlier attempt left is kept.
+	file -> received = min((uint64_t) fileStat.st_size, size);
+	file -> requested = file -> received;
+	INCOMING_FILES[key] = file;
+	string status = file -> from + " is sending you " + file -> name + ", " + to_string(size) + " bytes";
+	status += (file -> received > 0) ? ", resuming at " + to_string(file -> received) + ".\n" : ".\n";
+	DisplayMessage(status, 2);
+	if (file -> received == size) {
+		ftruncate(file -> fd, size);
+		FinishIncomingFile(file);
+	} else {
+		RequestFileWindow(file);
+	}
+	pthread_mutex_unlock(&transferLock);
+}
+
+void ReceiveFileChunk(MessageView &view) {
+	uint64_t offset;
+	string_view data;
+	if (!SplitFileChunk(view.msg, offset, data)) {
+		return;
+	}
+	string key = string(view.from) + "/" + string(view.to);
+	pthread_mutex_lock(&transferLock);
+	unordered_map<string, IncomingFile*>::iterator fileIter = INCOMING_FILES.find(key);
+	if (fileIter == INCOMING_FILES.end()) {
+		pthread_mutex_unlock(&transferLock);
+		return;
+	}
+	IncomingFile* file = (*fileIter).second;
+	if (offset != file -> received || data.length() > file -> size - file -> received) {
+		pthread_mutex_unlock(&transferLock);
+		return;
+	}
+	if (pwrite(file -> fd, data.data(), data.length(), offset) != (ssize_t) data.length()) {
+		pthread_mutex_unlock(&transferLock);
+		string error = "Can't write " + file -> path + ".part.\n";
+		DisplayMessage(error, 6);
+		return;
+	}
+	file -> received += data.length();
+	if (file -> received == file -> size) {
+		ftruncate(file -> fd, file -> size);
+		FinishIncomingFile(file);
+	} else if (file -> requested < file -> size && file -> requested - file -> received <= FILE_WINDOW_BYTES / 2) {
+		// Ask for more before this window runs out.
+		RequestFileWindow(file);
+	}
+	pthread_mutex_unlock(&transferLock);
+}
+
+void RequestFileWindow(IncomingFile* file) {
+	SendToServer("/fileget " + file -> from + " " + file -> id + " " + to_string(file -> requested));
+	file -> requested = min(file -> size, file -> requested + FILE_WINDOW_BYTES);
+}
+
+void FinishIncomingFile(IncomingFile* file) {
+	close(file -> fd);
+	string status;
+	if (rename((file -> path + ".part").c_str(), file -> path.c_str()) == 0) {
+		status = "Saved " + file -> name + " from " + file -> from + " as " + file -> path + ".\n";
+	} else {
+		status = "Can't rename " + file -> path + ".part.\n";
+	}
+	DisplayMessage(status, 2);
+	SendToServer("/filedone " + file -> from + " " + file -> id);
+	INCOMING_FILES.erase(file -> from + "/" + file -> id);
+	delete file;
+}
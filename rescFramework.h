@@ -12,13 +12,27 @@
 #include<iostream>
 #include<cstdio>
 #include<string>
+#include<string_view>
 #include<cstring>
+#include<cctype>
+#include<cerrno>
+#include<vector>
+#include<algorithm>
+#include<cstdlib>
+#include<cstdint>
+
+// Delimiter scanning kernels
+#if defined(__x86_64__) || defined(__i386__)
+#define RESC_SCAN_X86
+#include<immintrin.h>
+#endif
 
 // Network Function
 #include<sys/types.h>
 #include<sys/socket.h>
 #include<sys/select.h>
 #include<sys/time.h>
+#include<sys/uio.h>
 #include<netinet/in.h>
 #include<arpa/inet.h>
 #include<unistd.h>
@@ -33,7 +47,17 @@ enum MsgType {
 	DIRECT_MSG,
 	BROADCAST_MSG,
 	FILE_STREAM_MSG,
-	USER_LIST_MSG
+	USER_LIST_MSG,
+	PRESENCE_MSG,
+	JOIN_MSG,
+	LEAVE_MSG,
+	ROOM_MSG,
+	FILE_PUT_MSG,
+	FILE_GET_MSG,
+	FILE_DONE_MSG,
+	FILE_OFFER_MSG,
+	FILE_ACK_MSG,
+	FILE_CHUNK_MSG
 };
 
 struct Message {
@@ -43,19 +67,285 @@ struct Message {
 	string msg;
 };
 
+// Same fields as Message, but pointing into the received frame. Only valid
+// while the frame buffer is.
+struct MessageView {
+	MsgType cmd;
+	string_view to;
+	string_view from;
+	string_view msg;
+};
+
 struct User {
 	string username;
 	string password;
 	bool isConnected;
 };
 
+// Frames larger than this are treated as a protocol error.
+const long MAX_FRAME_SIZE = 64 * 1024 * 1024;
+// Minimum free space offered to each recv().
+const size_t READER_CHUNK = 65536;
+
+enum FrameStatus {
+	FRAME_PARTIAL = 0,
+	FRAME_READY,
+	FRAME_INVALID
+};
+
+// Protocol versions. v1 frames are a host long holding htonl(length) and a
+// null-terminated text command. v2 is offered at login and, once both sides
+// agree, replaces it in both directions with a fixed little-endian header
+// followed by the to, from and body bytes. A v2 frame of type INVALID_MSG
+// carries a v1 text command (/quit and friends) in its body.
+const uint8_t PROTOCOL_V1 = 1;
+const uint8_t PROTOCOL_V2 = 2;
+const size_t FRAME_HEADER_SIZE = 20;
+const string CAPABILITY_V2 = "v2";
+
+// Clients offering "delta" get presence as numbered join/leave deltas
+// instead of a whole userlist per change. The body of a /presence message
+// is "<version> full" followed by one name per line, or "<version> delta"
+// followed by one "+name" or "-name" per line. A client that sees a
+// version gap sends a bare "/presence" to get a fresh snapshot.
+const string CAPABILITY_DELTA = "delta";
+
+// Clients offering "slices" (v2 only) may get a large message as several
+// frames so smaller ones can go out between them. The first frame has the
+// to and from fields and FRAME_FLAG_MORE; the rest carry only body bytes
+// and FRAME_FLAG_CONTINUES, the last one without MORE. Only one message is
+// ever being sliced at a time, so continuations need no id.
+const string CAPABILITY_SLICES = "slices";
+const uint16_t FRAME_FLAG_MORE = 1;
+const uint16_t FRAME_FLAG_CONTINUES = 2;
+
+// File transfers (v2 clients offering "files"). The sender announces one
+// with "/fileput <to> <id> <size> <name>"; the server answers "/fileack
+// <to> <id> <offset>" with how much of it it already has, and the sender
+// goes on from there in FILE_CHUNK frames: the id in the to field and a
+// body of the 8 byte little-endian offset followed by the data. Each chunk
+// the server spools is acked the same way. Once all of it is in, the
+// receiver is sent "/fileoffer <from> <id> <size> <name>" (again at every
+// login until it is done) and pulls it a window at a time with "/fileget
+// <from> <id> <offset>", getting chunks with the sender in the from field.
+// "/filedone <from> <id>" lets the server forget it. Ids are up to 64
+// letters, digits, '-' or '_' and are the sender's to pick; offering the
+// same id again resumes.
+const string CAPABILITY_FILES = "files";
+const size_t FILE_CHUNK_BYTES = 64 * 1024;
+const uint64_t FILE_WINDOW_BYTES = 1024 * 1024;	// Unacked or unrequested bytes per transfer.
+const size_t FILE_OFFSET_SIZE = 8;
+const size_t FILE_ID_LENGTH = 64;
+
+// Clients offering "resume" (v2 only) get "token=<hex>" back among the
+// capabilities. Logging in again within the server's grace period with
+// "token=<hex> seq=<n>" offered too, n being the seq of the first frame not
+// received, picks the old session up where it stopped: the user never left
+// as far as anyone else can tell, and frames from n on are sent again ahead
+// of anything new. The reply then says "resumed=<seq>", which is later than
+// n if the server no longer had all of them. Without it the login was an
+// ordinary one and nothing carried over.
+const string CAPABILITY_RESUME = "resume";
+
+// Rooms. "/join <room>" and "/leave <room>" change membership; "/room
+// <room> <msg>" goes to every other member and arrives as "/room <room>
+// <from> <msg>". In v2 frames the room travels in the to field. /all is the
+// room everyone is in.
+
+struct FrameHeader {
+	uint8_t version;
+	uint8_t type;		// MsgType
+	uint16_t flags;
+	uint16_t toLength;
+	uint16_t fromLength;
+	uint32_t bodyLength;
+	uint64_t seq;		// Per connection and direction, from 0.
+};
+
+// Per-connection receive buffer. Each Fill pulls whatever the socket has in
+// one recv(); Next hands back complete frames and keeps a trailing partial
+// frame for the next Fill.
+struct FrameReader {
+	vector<char> buffer;
+	size_t start;	// First byte not yet handed out.
+	size_t end;		// One past the last byte received.
+	uint8_t version;	// Framing expected on the wire.
+	uint64_t nextSeq;	// Seq of the next v2 frame: one past the last read, slices included.
+	// The sliced message being put back together, if any.
+	bool hasOpenSlice;
+	uint8_t sliceType;
+	string sliceTo;
+	string sliceFrom;
+	string sliceBody;
+};
+
+// Delimiter Scanning
+// Each kernel returns the index of the first target byte in data, or length
+// when there is none. FindByte picks the widest one the CPU supports.
+typedef size_t (*ScanKernel)(const char* data, size_t length, char target);
+
+size_t ScanScalar(const char* data, size_t length, char target)
+{
+	for (size_t i = 0; i < length; i++) {
+		if (data[i] == target) {
+			return i;
+		}
+	}
+	return length;
+}
+
+#ifdef RESC_SCAN_X86
+size_t ScanSSE2(const char* data, size_t length, char target)
+{
+	// 16 bytes per compare.
+	__m128i needle = _mm_set1_epi8(target);
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i*) (data + i));
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+		if (mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	return i + ScanScalar(data + i, length - i, target);
+}
+
+__attribute__((target("avx2")))
+size_t ScanAVX2(const char* data, size_t length, char target)
+{
+	// Two 32-byte compares per iteration; locate the byte only on a hit.
+	__m256i needle = _mm256_set1_epi8(target);
+	size_t i = 0;
+	for (; i + 64 <= length; i += 64) {
+		__m256i low = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (data + i)), needle);
+		__m256i high = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (data + i + 32)), needle);
+		if (!_mm256_testz_si256(_mm256_or_si256(low, high), _mm256_or_si256(low, high))) {
+			unsigned int lowMask = _mm256_movemask_epi8(low);
+			if (lowMask != 0) {
+				return i + __builtin_ctz(lowMask);
+			}
+			return i + 32 + __builtin_ctz((unsigned int) _mm256_movemask_epi8(high));
+		}
+	}
+	for (; i + 32 <= length; i += 32) {
+		unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (data + i)), needle));
+		if (mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	return i + ScanSSE2(data + i, length - i, target);
+}
+#endif
+
+const char* SCAN_KERNEL_NAME = "scalar";
+
+ScanKernel SelectScanKernel()
+{
+	// RESC_SCAN=scalar|sse2|avx2 caps the kernel, e.g. to exercise the
+	// fallback on a machine that has AVX2.
+	const char* limit = getenv("RESC_SCAN");
+	string cap = (limit != NULL) ? limit : "avx2";
+	if (cap == "scalar") {
+		SCAN_KERNEL_NAME = "scalar";
+		return ScanScalar;
+	}
+#ifdef RESC_SCAN_X86
+	__builtin_cpu_init();
+	if (cap == "avx2" && __builtin_cpu_supports("avx2")) {
+		SCAN_KERNEL_NAME = "avx2";
+		return ScanAVX2;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		SCAN_KERNEL_NAME = "sse2";
+		return ScanSSE2;
+	}
+#endif
+	SCAN_KERNEL_NAME = "scalar";
+	return ScanScalar;
+}
+
+ScanKernel SCAN_KERNEL = SelectScanKernel();
+
+size_t FindByte(string_view text, char target, size_t start = 0)
+{
+	// Same contract as string_view::find.
+	if (start >= text.length()) {
+		return string_view::npos;
+	}
+	size_t index = start + SCAN_KERNEL(text.data() + start, text.length() - start, target);
+	return (index < text.length()) ? index : string_view::npos;
+}
+
+size_t FindLastByte(string_view text, char target)
+{
+	// Forward scans only; fine for the short strings this is used on.
+	size_t last = string_view::npos;
+	size_t index = FindByte(text, target);
+	while (index != string_view::npos) {
+		last = index;
+		index = FindByte(text, target, index + 1);
+	}
+	return last;
+}
+
 // Framework Helper functions
+string_view SplitCapabilities(string_view &request)
+{
+	// Login requests and replies may carry a second line of space separated
+	// capabilities: "user|pwd\nv2". Trims request to the first line and
+	// returns the rest.
+	size_t split = FindByte(request, '\n');
+	if (split == string_view::npos) {
+		return string_view();
+	}
+	string_view capabilities = request.substr(split + 1);
+	request = request.substr(0, split);
+	return capabilities;
+}
+
+bool HasCapability(string_view capabilities, string_view capability)
+{
+	size_t start = 0;
+	while (start <= capabilities.length()) {
+		size_t split = FindByte(capabilities, ' ', start);
+		if (split == string_view::npos) {
+			split = capabilities.length();
+		}
+		if (capabilities.substr(start, split - start) == capability) {
+			return true;
+		}
+		start = split + 1;
+	}
+	return false;
+}
+
+string_view CapabilityValue(string_view capabilities, string_view name)
+{
+	// The value of a "name=value" capability, or an empty view.
+	size_t start = 0;
+	while (start < capabilities.length()) {
+		size_t split = FindByte(capabilities, ' ', start);
+		if (split == string_view::npos) {
+			split = capabilities.length();
+		}
+		string_view capability = capabilities.substr(start, split - start);
+		if (capability.length() > name.length() && capability[name.length()] == '=' &&
+			capability.substr(0, name.length()) == name) {
+			return capability.substr(name.length() + 1);
+		}
+		start = split + 1;
+	}
+	return string_view();
+}
+
 bool CheckAuthResponse(string msg) 
 {
-	return (!msg.compare("SUCCESSFUL"));
+	string_view response(msg);
+	SplitCapabilities(response);
+	return (response == "SUCCESSFUL");
 }
 
-bool HasQuit(string msg)
+bool HasQuit(string_view msg)
 {
 	bool hasQuit = false;
 	if (msg == "/quit" || msg == "/close" || msg == "/exit"){
@@ -65,176 +355,241 @@ bool HasQuit(string msg)
 }
 
 // Message Protocol
-Message CreateMessage(string msg, string from)
+MessageView ParseMessage(string_view raw, string_view from)
 {
 	// Turn
 	// "/msg userX blahblahblah", "UserA"
 	// into
 	// ("blahblahblah", "userX", "UserA", DIRECT_MSG)
-	Message newMsg;
-	newMsg.msg = "";
-	newMsg.to = "";
-	newMsg.from = from;
-	newMsg.cmd = INVALID_MSG;
-	string cmdName = "";
-	bool isClient = (newMsg.from == "");
-	
-	const char *cMsg = msg.c_str();
-	if (cMsg[0] == '/') {
-		// Assumption is that all messages to be parsed start with a '/'
-		int cmdSize = -1;
-		for (int i = 1; i < msg.length(); i++) {
-			if (cMsg[i] == ' ') {
-				cmdSize = i;
-				break;
-			}
+	// Every field is a view into raw (or from); nothing is copied.
+	MessageView view;
+	view.cmd = INVALID_MSG;
+	view.from = from;
+	bool isClient = from.empty();
+
+	if (raw.empty() || raw[0] != '/') {
+		// Legacy support states that broadcast messages do not need a '/' starter
+		view.cmd = BROADCAST_MSG;
+		view.msg = raw;
+		return view;
+	}
+
+	// Assumption is that all messages to be parsed start with a '/'
+	size_t cmdSize = FindByte(raw, ' ', 1);
+	if (cmdSize == string_view::npos) {
+		// Non-Argument Command was entered.
+		cmdSize = raw.length();
+	}
+	string_view cmdName = raw.substr(0, cmdSize);
+	string_view rest = (cmdSize < raw.length()) ? raw.substr(cmdSize + 1) : string_view();
+
+	if (cmdName == "/userlist") {
+		view.msg = rest;
+		view.cmd = USER_LIST_MSG;
+		return view;
+	}
+	if (cmdName == "/presence") {
+		view.msg = rest;
+		view.cmd = PRESENCE_MSG;
+		return view;
+	}
+	if (cmdName == "/join" || cmdName == "/leave") {
+		if (rest.empty() || FindByte(rest, ' ') != string_view::npos) {
+			return view;
 		}
-		if (cmdSize == -1) {
-			// Non-Argument Command was entered.
-			cmdSize = msg.length();
-		}
-		// Build Command Type
-		stringstream ss;
-		for (int i = 0; i < cmdSize; i++) {
-			ss << cMsg[i];
-		}
-		cmdName.append(ss.str());
-		ss.str("");
-		ss.clear();
-		
-		if (cmdName == "/all") {
-			int userSize = -1;
-			for (int i = cmdSize+1; i < msg.length(); i++) {
-				if (cMsg[i] == ' ') {
-					userSize = i;
-					break;
-				}
-			}
-			if (userSize == -1) {
-				return newMsg;
-			}
-			for (int i = cmdSize+1; i < userSize; i++) {
-				ss << cMsg[i];
-			}
-			if (isClient) {
-				newMsg.from.append(ss.str());
-			} else {
-				newMsg.to.append(ss.str());
-			}
-			ss.str("");
-			ss.clear();
-			for (int i = userSize+1; i < msg.length(); i++) {
-				ss << cMsg[i];
-			}
-			newMsg.msg.append(ss.str());
-			ss.str("");
-			ss.clear();
-			newMsg.cmd = BROADCAST_MSG;
-			
-		} else if (cmdName == "/msg") {
-			int userSize = -1;
-			for (int i = cmdSize+1; i < msg.length(); i++) {
-				if (cMsg[i] == ' ') {
-					userSize = i;
-					break;
-				}
-			}
-			if (userSize == -1) {
-				// No user target, so this is invalid.
-				return newMsg;
-			}
-			// Build UserTo
-			for (int i = cmdSize+1; i < userSize; i++) {
-				ss << cMsg[i];
-			}
-			if (isClient) {
-				newMsg.from.append(ss.str());
-			} else {
-				newMsg.to.append(ss.str());
-			}
-			ss.str("");
-			ss.clear();
-			for (int i = userSize+1; i < msg.length();i++) {
-				ss << cMsg[i];
-			}
-			newMsg.msg.append(ss.str());
-			ss.str("");
-			ss.clear();
-			newMsg.cmd = DIRECT_MSG;
-		} else if (cmdName == "/userlist") {
-			for (int i = cmdSize+1; i < msg.length();i++) {
-				ss << cMsg[i];
-			}
-			newMsg.msg.append(ss.str());
-			newMsg.cmd = USER_LIST_MSG;
-			ss.str("");
-			ss.clear();
-		} else if (cmdName == "/filestream") {
-			int userSize = -1;
-			for (int i = cmdSize+1; i < msg.length(); i++) {
-				if (cMsg[i] == ' ') {
-					userSize = i;
-					break;
-				}
-			}
-			if (userSize == -1) {
-				// invalid message
-				return newMsg;
-			}
-			// Build UserFrom
-			for (int i = cmdSize+1; i < userSize; i++) {
-				ss << cMsg[i];
-			}
-			if (isClient) {
-				newMsg.from.append(ss.str());
-			} else {
-				newMsg.to.append(ss.str());
-			}
-			ss.str("");
-			ss.clear();
-			newMsg.cmd = FILE_STREAM_MSG;
-		
-			for (int i = userSize+1; i < msg.length();i++) {
-				ss << cMsg[i];
-			}
-			newMsg.msg.append(ss.str());
-			ss.str("");
-			ss.clear();
+		view.to = rest;
+		view.cmd = (cmdName == "/join") ? JOIN_MSG : LEAVE_MSG;
+		return view;
+	}
+	if (cmdName == "/room" && isClient) {
+		// "/room <room> <from> <msg>"
+		size_t roomSize = FindByte(rest, ' ');
+		size_t fromSize = (roomSize == string_view::npos) ? string_view::npos : FindByte(rest, ' ', roomSize + 1);
+		if (fromSize == string_view::npos) {
+			return view;
 		}
-		
+		view.to = rest.substr(0, roomSize);
+		view.from = rest.substr(roomSize + 1, fromSize - roomSize - 1);
+		view.msg = rest.substr(fromSize + 1);
+		view.cmd = ROOM_MSG;
+		return view;
+	}
+
+	MsgType cmd = INVALID_MSG;
+	if (cmdName == "/all") {
+		cmd = BROADCAST_MSG;
+	} else if (cmdName == "/msg") {
+		cmd = DIRECT_MSG;
+	} else if (cmdName == "/filestream") {
+		cmd = FILE_STREAM_MSG;
+	} else if (cmdName == "/room") {
+		cmd = ROOM_MSG;
+	} else if (cmdName == "/fileput") {
+		cmd = FILE_PUT_MSG;
+	} else if (cmdName == "/fileget") {
+		cmd = FILE_GET_MSG;
+	} else if (cmdName == "/filedone") {
+		cmd = FILE_DONE_MSG;
+	} else if (cmdName == "/fileoffer") {
+		cmd = FILE_OFFER_MSG;
+	} else if (cmdName == "/fileack") {
+		cmd = FILE_ACK_MSG;
 	} else {
-		// Legacy support states that broadcast messages do not need a '/' starter
-		newMsg.cmd = BROADCAST_MSG;
-		newMsg.msg = msg;
+		return view;
 	}
-	
+
+	// "<cmd> <user> <body>": without a user the message is invalid.
+	size_t userSize = FindByte(rest, ' ');
+	if (cmdSize >= raw.length() || userSize == string_view::npos) {
+		return view;
+	}
+	if (isClient) {
+		view.from = rest.substr(0, userSize);
+	} else {
+		view.to = rest.substr(0, userSize);
+	}
+	view.msg = rest.substr(userSize + 1);
+	view.cmd = cmd;
+	return view;
+}
+
+Message ToMessage(const MessageView &view)
+{
+	// Copy out of the frame buffer for callers that keep the message.
+	Message newMsg;
+	newMsg.cmd = view.cmd;
+	newMsg.to.assign(view.to.data(), view.to.length());
+	newMsg.from.assign(view.from.data(), view.from.length());
+	newMsg.msg.assign(view.msg.data(), view.msg.length());
 	return newMsg;
 }
 
-string EncodeMessage(Message msg)
+Message CreateMessage(string msg, string from)
 {
-	stringstream ss;
-	
-	switch (msg.cmd) {
-		case INVALID_MSG:
-			break;
+	return ToMessage(ParseMessage(msg, from));
+}
+
+void AppendEncoded(string &out, MsgType cmd, string_view to, string_view from, string_view msg)
+{
+	string_view cmdName;
+	switch (cmd) {
 		case DIRECT_MSG:
-			ss << "/msg " << msg.from << " " << msg.msg;
+			cmdName = "/msg ";
 			break;
 		case BROADCAST_MSG:
-			ss << "/all " << msg.from << " " << msg.msg;
+			cmdName = "/all ";
 			break;
 		case FILE_STREAM_MSG:
-			ss << "/filestream " << msg.from << " " << msg.msg;
+			cmdName = "/filestream ";
+			break;
+		case FILE_OFFER_MSG:
+			cmdName = "/fileoffer ";
+			break;
+		case FILE_ACK_MSG:
+			cmdName = "/fileack ";
+			break;
+		case FILE_CHUNK_MSG:
+			// Binary; only ever sent in v2 frames.
+			cmdName = "/filechunk ";
 			break;
 		case USER_LIST_MSG:
-			ss << "/userlist " << msg.msg;
+			out.append("/userlist ");
+			out.append(msg.data(), msg.length());
+			return;
+		case PRESENCE_MSG:
+			out.append("/presence ");
+			out.append(msg.data(), msg.length());
+			return;
+		case ROOM_MSG:
+			// Members need to know which room; the room goes first.
+			out.append("/room ");
+			out.append(to.data(), to.length());
+			cmdName = " ";
 			break;
 		default:
-			break;
+			return;
 	}
-	
-	return ss.str();
+	out.reserve(out.length() + cmdName.length() + from.length() + 1 + msg.length() + 1);
+	out.append(cmdName.data(), cmdName.length());
+	out.append(from.data(), from.length());
+	out.push_back(' ');
+	out.append(msg.data(), msg.length());
+}
+
+string EncodeMessage(const MessageView &view)
+{
+	string encoded;
+	AppendEncoded(encoded, view.cmd, view.to, view.from, view.msg);
+	return encoded;
+}
+
+string EncodeMessage(const Message &msg)
+{
+	string encoded;
+	AppendEncoded(encoded, msg.cmd, msg.to, msg.from, msg.msg);
+	return encoded;
+}
+
+bool ParsePresence(string_view body, unsigned long &version, bool &isSnapshot, string_view &entries)
+{
+	// Splits "<version> full|delta\n<entries>"; entries are one per line.
+	size_t split = FindByte(body, ' ');
+	if (split == string_view::npos || split == 0) {
+		return false;
+	}
+	version = strtoul(string(body.substr(0, split)).c_str(), NULL, 10);
+	string_view rest = body.substr(split + 1);
+	size_t lineEnd = FindByte(rest, '\n');
+	string_view kind = rest.substr(0, lineEnd);
+	entries = (lineEnd == string_view::npos) ? string_view() : rest.substr(lineEnd + 1);
+	if (kind == "full") {
+		isSnapshot = true;
+	} else if (kind == "delta") {
+		isSnapshot = false;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+bool IsTransferId(string_view id)
+{
+	if (id.empty() || id.length() > FILE_ID_LENGTH) {
+		return false;
+	}
+	for (size_t i = 0; i < id.length(); i++) {
+		if (!isalnum((unsigned char) id[i]) && id[i] != '-' && id[i] != '_') {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool SplitTransferField(string_view &fields, string_view &field)
+{
+	// Takes the next space separated field off the front of fields.
+	if (fields.empty()) {
+		return false;
+	}
+	size_t split = FindByte(fields, ' ');
+	field = fields.substr(0, split);
+	fields = (split == string_view::npos) ? string_view() : fields.substr(split + 1);
+	return !field.empty();
+}
+
+bool ParseTransferNumber(string_view field, uint64_t &number)
+{
+	if (field.empty() || field.length() > 19) {
+		return false;
+	}
+	number = 0;
+	for (size_t i = 0; i < field.length(); i++) {
+		if (field[i] < '0' || field[i] > '9') {
+			return false;
+		}
+		number = number * 10 + (field[i] - '0');
+	}
+	return true;
 }
 
 
@@ -259,11 +614,14 @@ string EncodeMessage(Message msg)
 
 	string GetData(int inSock, int messageLength) {
 	  // Retrieve msg
+	  if (messageLength <= 0 || messageLength > MAX_FRAME_SIZE) {
+		return "";
+	  }
 	  int bytesLeft = messageLength;
-	  char buffer[messageLength];
-	  char* buffPTR = buffer;
+	  vector<char> buffer(messageLength + 1, '\0');
+	  char* buffPTR = &buffer[0];
 	  while (bytesLeft > 0){
-		int bytesRecv = recv(inSock, buffPTR, messageLength, 0);
+		int bytesRecv = recv(inSock, buffPTR, bytesLeft, 0);
 		if (bytesRecv <= 0) {
 		  // Failed to Read for some reason.
 		  cerr << "Could not recv bytes. Closing clientSocket: " << inSock << "." << endl;
@@ -273,7 +631,7 @@ string EncodeMessage(Message msg)
 		buffPTR = buffPTR + bytesRecv;
 	  }
 
-	  return buffer;
+	  return &buffer[0];
 	}
 
 	long GetInteger(int inSock) {
@@ -312,17 +670,333 @@ string EncodeMessage(Message msg)
 	  return true;
 	}
 	
+	bool SendVector(int outSocket, struct iovec* iov, int iovCount) {
+	  // Keep writing until every iovec is on the wire, stepping past
+	  // whatever a short write already covered.
+	  while (iovCount > 0) {
+		struct msghdr msgHeader;
+		memset(&msgHeader, 0, sizeof(msgHeader));
+		msgHeader.msg_iov = iov;
+		msgHeader.msg_iovlen = iovCount;
+		ssize_t bytesSent = sendmsg(outSocket, &msgHeader, MSG_NOSIGNAL);
+		if (bytesSent < 0 && errno == EINTR) {
+		  continue;
+		}
+		if (bytesSent <= 0) {
+		  cerr << "Unable to send data. Closing clientSocket: " << outSocket << "." << endl;
+		  return false;
+		}
+		while (iovCount > 0 && (size_t) bytesSent >= iov[0].iov_len) {
+		  bytesSent -= iov[0].iov_len;
+		  iov++;
+		  iovCount--;
+		}
+		if (iovCount > 0) {
+		  iov[0].iov_base = (char *) iov[0].iov_base + bytesSent;
+		  iov[0].iov_len -= bytesSent;
+		}
+	  }
+	  return true;
+	}
+	
 	void SendMessage(int outSocket, string msg) {
-		if (!SendInteger(outSocket, msg.length()+1)) {
-			cerr << "Unable to send Int. " << endl;
+		// Length prefix and body leave in a single syscall.
+		long networkInt = htonl(msg.length()+1);
+		struct iovec iov[2];
+		iov[0].iov_base = &networkInt;
+		iov[0].iov_len = sizeof(long);
+		iov[1].iov_base = (void *) msg.c_str();
+		iov[1].iov_len = msg.length()+1;
+		if (!SendVector(outSocket, iov, 2)) {
+			cerr << "Unable to send Message. " << endl;
 			return;
 		}
-		if (!SendData(outSocket, msg)) {
-			cerr << "Unable to send Message. " << endl;
+	}
+	
+	void PutLittleEndian(char* out, uint64_t value, int bytes) {
+		for (int i = 0; i < bytes; i++) {
+			out[i] = (char) (value >> (8 * i));
+		}
+	}
+	
+	uint64_t GetLittleEndian(const char* in, int bytes) {
+		uint64_t value = 0;
+		for (int i = 0; i < bytes; i++) {
+			value |= (uint64_t) (unsigned char) in[i] << (8 * i);
+		}
+		return value;
+	}
+	
+	void PackFrameHeader(const FrameHeader &header, char* out) {
+		PutLittleEndian(out, header.version, 1);
+		PutLittleEndian(out + 1, header.type, 1);
+		PutLittleEndian(out + 2, header.flags, 2);
+		PutLittleEndian(out + 4, header.toLength, 2);
+		PutLittleEndian(out + 6, header.fromLength, 2);
+		PutLittleEndian(out + 8, header.bodyLength, 4);
+		PutLittleEndian(out + 12, header.seq, 8);
+	}
+	
+	void UnpackFrameHeader(const char* in, FrameHeader &header) {
+		header.version = GetLittleEndian(in, 1);
+		header.type = GetLittleEndian(in + 1, 1);
+		header.flags = GetLittleEndian(in + 2, 2);
+		header.toLength = GetLittleEndian(in + 4, 2);
+		header.fromLength = GetLittleEndian(in + 6, 2);
+		header.bodyLength = GetLittleEndian(in + 8, 4);
+		header.seq = GetLittleEndian(in + 12, 8);
+	}
+	
+	void AppendFileOffset(string &out, uint64_t offset) {
+		// The head of a FILE_CHUNK body.
+		char bytes[FILE_OFFSET_SIZE];
+		PutLittleEndian(bytes, offset, FILE_OFFSET_SIZE);
+		out.append(bytes, FILE_OFFSET_SIZE);
+	}
+	
+	bool SplitFileChunk(string_view body, uint64_t &offset, string_view &data) {
+		if (body.length() < FILE_OFFSET_SIZE) {
+			return false;
+		}
+		offset = GetLittleEndian(body.data(), FILE_OFFSET_SIZE);
+		data = body.substr(FILE_OFFSET_SIZE);
+		return true;
+	}
+	
+	bool SendFrame(int outSocket, MsgType type, uint64_t seq, string_view to, string_view from, string_view body) {
+		// One v2 frame, header and all three fields in a single sendmsg.
+		if (to.length() > 0xFFFF || from.length() > 0xFFFF || body.length() > (size_t) MAX_FRAME_SIZE) {
+			cerr << "Frame too large to send." << endl;
+			return false;
+		}
+		FrameHeader header;
+		header.version = PROTOCOL_V2;
+		header.type = type;
+		header.flags = 0;
+		header.toLength = to.length();
+		header.fromLength = from.length();
+		header.bodyLength = body.length();
+		header.seq = seq;
+		char head[FRAME_HEADER_SIZE];
+		PackFrameHeader(header, head);
+		struct iovec iov[4];
+		iov[0].iov_base = head;
+		iov[0].iov_len = FRAME_HEADER_SIZE;
+		iov[1].iov_base = (void *) to.data();
+		iov[1].iov_len = to.length();
+		iov[2].iov_base = (void *) from.data();
+		iov[2].iov_len = from.length();
+		iov[3].iov_base = (void *) body.data();
+		iov[3].iov_len = body.length();
+		return SendVector(outSocket, iov, 4);
+	}
+	
+	void SendCommand(int outSocket, uint8_t version, uint64_t seq, string_view text, string_view username) {
+		// Sends what the user typed in whichever framing was negotiated. For
+		// v2 the command is parsed here so the server can route from the
+		// header; anything untyped goes as text.
+		if (version != PROTOCOL_V2) {
+			SendMessage(outSocket, string(text));
 			return;
 		}
+		MessageView view = ParseMessage(text, username);
+		bool isSent;
+		if (view.cmd == INVALID_MSG || view.cmd == USER_LIST_MSG || view.cmd == PRESENCE_MSG) {
+			isSent = SendFrame(outSocket, INVALID_MSG, seq, string_view(), string_view(), text);
+		} else {
+			isSent = SendFrame(outSocket, view.cmd, seq, view.to, string_view(), view.msg);
+		}
+		if (!isSent) {
+			cerr << "Unable to send Message. " << endl;
+		}
+	}
+	
+	void FrameReaderInit(FrameReader* reader) {
+		reader -> buffer.resize(READER_CHUNK);
+		reader -> start = 0;
+		reader -> end = 0;
+		reader -> version = PROTOCOL_V1;
+		reader -> nextSeq = 0;
+		reader -> hasOpenSlice = false;
+	}
+	
+	void FrameReaderReserve(FrameReader* reader, size_t freeBytes) {
+		// Makes room for at least freeBytes after end.
+		if (reader -> start == reader -> end) {
+			reader -> start = 0;
+			reader -> end = 0;
+		} else if (reader -> start > 0 && reader -> buffer.size() - reader -> end < freeBytes) {
+			// Slide the partial frame down before growing.
+			memmove(&reader -> buffer[0], &reader -> buffer[reader -> start], reader -> end - reader -> start);
+			reader -> end -= reader -> start;
+			reader -> start = 0;
+		}
+		if (reader -> buffer.size() - reader -> end < freeBytes) {
+			reader -> buffer.resize(max(reader -> buffer.size() * 2, reader -> end + freeBytes));
+		}
+	}
+	
+	void FrameReaderAppend(FrameReader* reader, const char* data, size_t length) {
+		// For bytes that were received somewhere else, e.g. an io_uring buffer.
+		FrameReaderReserve(reader, length);
+		memcpy(&reader -> buffer[reader -> end], data, length);
+		reader -> end += length;
+	}
+	
+	int FrameReaderFill(int inSock, FrameReader* reader) {
+		// One recv() into whatever room is left, making room first. Returns
+		// the recv() result: bytes read, 0 on EOF, -1 with errno set.
+		FrameReaderReserve(reader, READER_CHUNK);
+		int bytesRecv = recv(inSock, &reader -> buffer[reader -> end], reader -> buffer.size() - reader -> end, 0);
+		if (bytesRecv > 0) {
+			reader -> end += bytesRecv;
+		}
+		return bytesRecv;
+	}
+	
+	FrameStatus FrameReaderNext(FrameReader* reader, const char* &frame, size_t &frameLength) {
+		// frame points into the reader and stays valid until the next Fill.
+		size_t available = reader -> end - reader -> start;
+		if (available < sizeof(long)) {
+			return FRAME_PARTIAL;
+		}
+		long networkInt;
+		memcpy(&networkInt, &reader -> buffer[reader -> start], sizeof(long));
+		long msgLength = ntohl(networkInt);
+		if (msgLength <= 0 || msgLength > MAX_FRAME_SIZE) {
+			return FRAME_INVALID;
+		}
+		if (available < sizeof(long) + msgLength) {
+			return FRAME_PARTIAL;
+		}
+		frame = &reader -> buffer[reader -> start + sizeof(long)];
+		// Frames carry a trailing null; stop at the first one like GetData.
+		frameLength = FindByte(string_view(frame, msgLength), '\0');
+		if (frameLength == string_view::npos) {
+			frameLength = msgLength;
+		}
+		reader -> start += sizeof(long) + msgLength;
+		if (reader -> start == reader -> end) {
+			reader -> start = 0;
+			reader -> end = 0;
+		}
+		return FRAME_READY;
+	}
+	
+	FrameStatus FrameReaderNext(FrameReader* reader, string &msg) {
+		const char* frame;
+		size_t frameLength;
+		FrameStatus status = FrameReaderNext(reader, frame, frameLength);
+		if (status == FRAME_READY) {
+			msg.assign(frame, frameLength);
+		}
+		return status;
+	}
+	
+	FrameStatus FrameReaderNext(FrameReader* reader, FrameHeader &header, MessageView &view) {
+		// Either framing. v1 frames come back as type INVALID_MSG with the
+		// text in view.msg; v2 fields are views into the reader.
+		if (reader -> version != PROTOCOL_V2) {
+			const char* frame;
+			size_t frameLength;
+			FrameStatus status = FrameReaderNext(reader, frame, frameLength);
+			if (status == FRAME_READY) {
+				memset(&header, 0, sizeof(header));
+				header.version = PROTOCOL_V1;
+				header.bodyLength = frameLength;
+				view.cmd = INVALID_MSG;
+				view.to = string_view();
+				view.from = string_view();
+				view.msg = string_view(frame, frameLength);
+			}
+			return status;
+		}
+		while (true) {
+			size_t available = reader -> end - reader -> start;
+			if (available < FRAME_HEADER_SIZE) {
+				return FRAME_PARTIAL;
+			}
+			const char* frame = &reader -> buffer[reader -> start];
+			UnpackFrameHeader(frame, header);
+			size_t frameLength = (size_t) header.toLength + header.fromLength + header.bodyLength;
+			if (header.version != PROTOCOL_V2 || frameLength > (size_t) MAX_FRAME_SIZE) {
+				return FRAME_INVALID;
+			}
+			if (available < FRAME_HEADER_SIZE + frameLength) {
+				return FRAME_PARTIAL;
+			}
+			frame += FRAME_HEADER_SIZE;
+			reader -> nextSeq = header.seq + 1;
+			view.cmd = (MsgType) header.type;
+			view.to = string_view(frame, header.toLength);
+			view.from = string_view(frame + header.toLength, header.fromLength);
+			view.msg = string_view(frame + header.toLength + header.fromLength, header.bodyLength);
+			reader -> start += FRAME_HEADER_SIZE + frameLength;
+			if (reader -> start == reader -> end) {
+				reader -> start = 0;
+				reader -> end = 0;
+			}
+			if (!(header.flags & (FRAME_FLAG_MORE | FRAME_FLAG_CONTINUES))) {
+				return FRAME_READY;
+			}
+			// A slice: keep it and carry on until the last one, handing
+			// out whole frames that arrive in between as usual.
+			if (header.flags & FRAME_FLAG_CONTINUES) {
+				if (!reader -> hasOpenSlice || header.type != reader -> sliceType ||
+					reader -> sliceBody.length() + view.msg.length() > (size_t) MAX_FRAME_SIZE) {
+					return FRAME_INVALID;
+				}
+				reader -> sliceBody.append(view.msg.data(), view.msg.length());
+			} else {
+				if (reader -> hasOpenSlice) {
+					return FRAME_INVALID;
+				}
+				reader -> hasOpenSlice = true;
+				reader -> sliceType = header.type;
+				reader -> sliceTo.assign(view.to.data(), view.to.length());
+				reader -> sliceFrom.assign(view.from.data(), view.from.length());
+				reader -> sliceBody.assign(view.msg.data(), view.msg.length());
+			}
+			if (!(header.flags & FRAME_FLAG_MORE)) {
+				// Views into the slice strings last until the next message
+				// starts being sliced.
+				reader -> hasOpenSlice = false;
+				header.flags = 0;
+				header.toLength = reader -> sliceTo.length();
+				header.fromLength = reader -> sliceFrom.length();
+				header.bodyLength = reader -> sliceBody.length();
+				view.to = reader -> sliceTo;
+				view.from = reader -> sliceFrom;
+				view.msg = reader -> sliceBody;
+				return FRAME_READY;
+			}
+		}
 	}
 	
+	void FrameReaderRelease(FrameReader* reader) {
+		// Give back a buffer that grew for one oversized frame.
+		if (reader -> start == reader -> end && reader -> buffer.size() > READER_CHUNK * 4) {
+			vector<char>(READER_CHUNK).swap(reader -> buffer);
+			reader -> start = 0;
+			reader -> end = 0;
+		}
+		if (!reader -> hasOpenSlice && reader -> sliceBody.capacity() > READER_CHUNK * 4) {
+			string().swap(reader -> sliceBody);
+		}
+	}
+
+	void FrameReaderRestart(FrameReader* reader, uint64_t seq) {
+		// For a resumed session on a new connection, which starts with
+		// frame seq. Bytes left from the old connection are dropped; so is
+		// a part-read sliced message, unless its next slice is seq.
+		reader -> start = 0;
+		reader -> end = 0;
+		if (seq != reader -> nextSeq) {
+			reader -> hasOpenSlice = false;
+		}
+		reader -> nextSeq = seq;
+	}
+
 	string ReadMessage(int inSocket) {
 		long msgLength = GetInteger(inSocket);
 		if (msgLength <= 0) {
@@ -354,12 +1028,16 @@ string EncodeMessage(Message msg)
 	  host = gethostbyname(hostName.c_str());
 	  if (!host) {
 		cerr << "Unable to resolve hostname's ip address. Exiting..." << endl;
+		close(hostSock);
 		return -1;
 	  }
 	  char* tmpIP = inet_ntoa( *(struct in_addr *)host->h_addr_list[0]);
 	  unsigned long serverIP;
 	  status = inet_pton(AF_INET, tmpIP,(void*) &serverIP);
-	  if (status <= 0) return -1;
+	  if (status <= 0) {
+		close(hostSock);
+		return -1;
+	  }
 
 	  struct sockaddr_in serverAddress;
 	  serverAddress.sin_family = AF_INET;
@@ -369,7 +1047,9 @@ string EncodeMessage(Message msg)
 	  // Now that we have the proper information, we can open a connection.
 	  status = connect(hostSock, (struct sockaddr *) &serverAddress, sizeof(serverAddress));
 	  if (status < 0) {
+		// Callers that retry would otherwise run out of descriptors.
 		cerr << "Error with the connection." << endl;
+		close(hostSock);
 		return -1;
 	  }
 
@@ -0,0 +1,144 @@
+// AUTHOR: Ray Powers
+// DATE: October 18, 2026
+// FILE: rescHistory.h
+
+// DESCRIPTION: Recent-history rings for the RESC server: the last few
+//				messages sent to /all or to a room, replayed to whoever logs
+//				in or joins. The memory is fixed when a ring is made. Senders
+//				take turns writing; readers take no lock at all and simply
+//				skip whatever a sender overwrote while they were copying it.
+
+#ifndef _RESCHISTORY_H_
+#define _RESCHISTORY_H_
+
+// Standard Library
+#include<atomic>
+#include<cstring>
+#include<string_view>
+#include<vector>
+
+// Multithreading
+#include<pthread.h>
+
+// RESC Framework
+#include "rescFramework.h"
+#include "rescMailbox.h"
+
+using namespace std;
+
+namespace RESC {
+
+// Room for to, from and msg together; longer messages are not kept.
+const size_t HISTORY_SLOT_BYTES = 512;
+
+// One message. version is 2 * seq once message seq is in place and odd
+// while it is being written, so a reader can tell a whole copy of the one
+// it wanted from anything else.
+struct HistorySlot {
+	atomic<uint64_t> version;
+	MsgType cmd;
+	uint16_t toLength;
+	uint16_t fromLength;
+	uint32_t msgLength;
+	char bytes[HISTORY_SLOT_BYTES];
+};
+
+struct HistoryRing {
+	pthread_mutex_t writeLock;	// Senders only.
+	atomic<uint64_t> head;		// Last seq written in full; 0 when empty.
+	size_t capacity;
+	HistorySlot* slots;
+};
+
+HistoryRing* CreateHistoryRing(size_t capacity)
+{
+	HistoryRing* ring = new HistoryRing;
+	pthread_mutex_init(&ring -> writeLock, NULL);
+	ring -> head.store(0, memory_order_relaxed);
+	ring -> capacity = capacity;
+	ring -> slots = new HistorySlot[capacity];
+	for (size_t i = 0; i < capacity; i++) {
+		ring -> slots[i].version.store(0, memory_order_relaxed);
+	}
+	return ring;
+}
+
+void DeleteHistoryRing(HistoryRing* ring)
+{
+	// Nobody may be reading it any more.
+	pthread_mutex_destroy(&ring -> writeLock);
+	delete [] ring -> slots;
+	delete ring;
+}
+
+bool HistoryRecord(HistoryRing* ring, Payload* payload)
+{
+	// Keeps a chat message and stamps it with its seq. Call before the
+	// payload is posted anywhere, so a reader that has read past its seq
+	// can tell a live copy from one it already replayed.
+	string_view body(payload -> body);
+	string_view from = body.substr(payload -> fromOffset, payload -> fromLength);
+	string_view msg = body.substr(payload -> msgOffset, payload -> msgLength);
+	if (payload -> file != NULL || payload -> to.length() + from.length() + msg.length() > HISTORY_SLOT_BYTES) {
+		return false;
+	}
+	pthread_mutex_lock(&ring -> writeLock);
+	uint64_t seq = ring -> head.load(memory_order_relaxed) + 1;
+	HistorySlot* slot = &ring -> slots[seq % ring -> capacity];
+	slot -> version.store(2 * seq - 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	slot -> cmd = payload -> cmd;
+	slot -> toLength = payload -> to.length();
+	slot -> fromLength = from.length();
+	slot -> msgLength = msg.length();
+	memcpy(slot -> bytes, payload -> to.data(), payload -> to.length());
+	memcpy(slot -> bytes + payload -> to.length(), from.data(), from.length());
+	memcpy(slot -> bytes + payload -> to.length() + from.length(), msg.data(), msg.length());
+	slot -> version.store(2 * seq, memory_order_release);
+	ring -> head.store(seq, memory_order_release);
+	pthread_mutex_unlock(&ring -> writeLock);
+	payload -> historySeq = seq;
+	return true;
+}
+
+uint64_t HistoryHead(HistoryRing* ring)
+{
+	return ring -> head.load(memory_order_acquire);
+}
+
+void HistoryReplay(HistoryRing* ring, uint64_t upTo, vector<Payload*> &payloads)
+{
+	// Encodes what is still kept of messages up to and including upTo,
+	// oldest first. Caller owns a reference to each payload.
+	uint64_t first = (upTo > ring -> capacity) ? upTo - ring -> capacity + 1 : 1;
+	HistorySlot copy;
+	for (uint64_t seq = first; seq <= upTo; seq++) {
+		HistorySlot* slot = &ring -> slots[seq % ring -> capacity];
+		uint64_t version = slot -> version.load(memory_order_acquire);
+		if (version != 2 * seq) {
+			continue;
+		}
+		copy.cmd = slot -> cmd;
+		copy.toLength = slot -> toLength;
+		copy.fromLength = slot -> fromLength;
+		copy.msgLength = slot -> msgLength;
+		size_t length = min((size_t) copy.toLength + copy.fromLength + copy.msgLength, HISTORY_SLOT_BYTES);
+		memcpy(copy.bytes, slot -> bytes, length);
+		atomic_thread_fence(memory_order_acquire);
+		if (slot -> version.load(memory_order_relaxed) != version) {
+			// Overwritten while we copied; it was the oldest anyway.
+			continue;
+		}
+		MessageView view;
+		view.cmd = copy.cmd;
+		view.to = string_view(copy.bytes, copy.toLength);
+		view.from = string_view(copy.bytes + copy.toLength, copy.fromLength);
+		view.msg = string_view(copy.bytes + copy.toLength + copy.fromLength, copy.msgLength);
+		Payload* payload = CreatePayload(view);
+		payload -> historySeq = seq;
+		payloads.push_back(payload);
+	}
+}
+
+}
+#endif // _RESCHISTORY_H_
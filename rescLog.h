@@ -0,0 +1,543 @@
+// AUTHOR: Ray Powers
+// DATE: October 18, 2026
+// FILE: rescLog.h
+
+// DESCRIPTION: Append-only message log for the RESC server. Records go into
+//				fixed-size segment files mapped into memory, and a flusher
+//				thread syncs everything written since its last pass in one
+//				go, so an append never waits on the disk. An index in memory
+//				keeps each recipient's waiting records in order; a segment is
+//				deleted once nothing in it, or in any older one, still waits.
+
+#ifndef _RESCLOG_H_
+#define _RESCLOG_H_
+
+// Standard Library
+#include<iostream>
+#include<string>
+#include<string_view>
+#include<deque>
+#include<vector>
+#include<unordered_map>
+#include<algorithm>
+#include<cstdio>
+#include<cstring>
+#include<cerrno>
+
+// File Functions
+#include<sys/types.h>
+#include<sys/stat.h>
+#include<sys/mman.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<dirent.h>
+
+// Multithreading
+#include<pthread.h>
+
+// RESC Framework
+#include "rescFramework.h"
+#include "rescMailbox.h"
+
+using namespace std;
+
+namespace RESC {
+
+// A record is a LOG_HEADER_SIZE header, then to, from and body, padded to
+// LOG_ALIGN. The header, little-endian:
+//		length u32, checksum u32, lsn u64, bodyLength u32, type u8, unused u8,
+//		toLength u16, fromLength u16, then unused up to LOG_HEADER_SIZE.
+// The checksum covers everything after itself. Segments are preallocated
+// with zeros, so a zero length is where writing stopped; a bad checksum is
+// where a crash tore the last write, and nothing after it is read.
+const size_t LOG_SEGMENT_BYTES = 64 * 1024 * 1024;
+const size_t LOG_HEADER_SIZE = 32;
+const size_t LOG_ALIGN = 8;
+const long LOG_COMMIT_US = 2000;	// How long the flusher lets a group gather.
+
+enum LogRecordType {
+	LOG_DIRECT = 1,		// A message for to, from from.
+	LOG_DELIVERED		// to has been sent everything up to the lsn in body.
+};
+
+struct LogRecord {
+	size_t length;		// Padded, header included.
+	uint64_t lsn;
+	LogRecordType type;
+	string_view to;
+	string_view from;
+	string_view body;
+};
+
+struct LogSegment {
+	uint64_t number;	// Names the file; higher is newer.
+	string path;
+	int fd;
+	char* base;
+	size_t tail;		// Bytes written.
+	size_t synced;		// Bytes the flusher has taken.
+	long waiting;		// Records in here nobody has been sent yet.
+};
+
+struct LogLocation {
+	LogSegment* segment;
+	size_t offset;
+	uint64_t lsn;
+};
+
+struct MessageLog {
+	string dir;
+	pthread_mutex_t lock;
+	pthread_cond_t dirtyCond;	// The flusher waits here for writes.
+	pthread_cond_t syncedCond;	// LogWaitDurable waits here for the flusher.
+	deque<LogSegment*> segments;	// Oldest first; appends go to the last.
+	unordered_map<string, deque<LogLocation>> waiting;	// By recipient, oldest first.
+	long waitingCount;
+	uint64_t nextLsn;
+	bool isDirty;
+	bool isClosing;
+	long written;		// Records written, deliveries included.
+	long durable;		// Of those, how many the flusher has synced.
+	long appends;
+	long delivered;
+	long syncs;
+	pthread_t flusher;
+};
+
+uint32_t LogChecksum(const char* data, size_t length)
+{
+	// FNV-1a; it only has to catch a torn tail.
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (unsigned char) data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+LogSegment* LogMapSegment(const string &dir, uint64_t number, bool isNew)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.log", (unsigned long long) number);
+	LogSegment* segment = new LogSegment;
+	segment -> number = number;
+	segment -> path = dir + "/" + name;
+	segment -> tail = 0;
+	segment -> synced = 0;
+	segment -> waiting = 0;
+	segment -> base = NULL;
+	segment -> fd = open(segment -> path.c_str(), (isNew) ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR, 0600);
+	if (segment -> fd < 0) {
+		cerr << "Unable to open log segment " << segment -> path << "." << endl;
+		delete segment;
+		return NULL;
+	}
+	// Allocated up front, so running out of disk fails here rather than as
+	// a fault on some later store into the mapping.
+	struct stat info;
+	bool isSized = (isNew) ? (posix_fallocate(segment -> fd, 0, LOG_SEGMENT_BYTES) == 0) :
+		(fstat(segment -> fd, &info) == 0 && (size_t) info.st_size == LOG_SEGMENT_BYTES);
+	if (isSized) {
+		void* base = mmap(NULL, LOG_SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, segment -> fd, 0);
+		segment -> base = (base == MAP_FAILED) ? NULL : (char*) base;
+	}
+	if (segment -> base == NULL) {
+		cerr << "Unable to map log segment " << segment -> path << "." << endl;
+		close(segment -> fd);
+		if (isNew) {
+			unlink(segment -> path.c_str());
+		}
+		delete segment;
+		return NULL;
+	}
+	return segment;
+}
+
+void LogUnmapSegment(LogSegment* segment, bool isRemoved)
+{
+	munmap(segment -> base, LOG_SEGMENT_BYTES);
+	close(segment -> fd);
+	if (isRemoved) {
+		unlink(segment -> path.c_str());
+	}
+	delete segment;
+}
+
+bool LogReadRecord(const LogSegment* segment, size_t offset, LogRecord &record)
+{
+	if (offset + LOG_HEADER_SIZE > LOG_SEGMENT_BYTES) {
+		return false;
+	}
+	const char* head = segment -> base + offset;
+	record.length = GetLittleEndian(head, 4);
+	if (record.length < LOG_HEADER_SIZE || record.length % LOG_ALIGN != 0 ||
+		record.length > LOG_SEGMENT_BYTES - offset) {
+		return false;
+	}
+	size_t bodyLength = GetLittleEndian(head + 16, 4);
+	size_t toLength = GetLittleEndian(head + 22, 2);
+	size_t fromLength = GetLittleEndian(head + 24, 2);
+	if (LOG_HEADER_SIZE + toLength + fromLength + bodyLength > record.length ||
+		GetLittleEndian(head + 4, 4) != LogChecksum(head + 8, record.length - 8)) {
+		return false;
+	}
+	record.lsn = GetLittleEndian(head + 8, 8);
+	record.type = (LogRecordType) GetLittleEndian(head + 20, 1);
+	record.to = string_view(head + LOG_HEADER_SIZE, toLength);
+	record.from = string_view(head + LOG_HEADER_SIZE + toLength, fromLength);
+	record.body = string_view(head + LOG_HEADER_SIZE + toLength + fromLength, bodyLength);
+	return true;
+}
+
+bool LogAddSegment(MessageLog* log)
+{
+	// Lock held, or not yet shared. The segment before keeps whatever it
+	// has left unsynced for the flusher.
+	uint64_t number = (log -> segments.empty()) ? 1 : log -> segments.back() -> number + 1;
+	LogSegment* segment = LogMapSegment(log -> dir, number, true);
+	if (segment == NULL) {
+		return false;
+	}
+	log -> segments.push_back(segment);
+	return true;
+}
+
+bool LogWriteRecord(MessageLog* log, LogRecordType type, string_view to, string_view from, string_view body, LogLocation &location)
+{
+	// Lock held.
+	if (to.length() > 0xFFFF || from.length() > 0xFFFF) {
+		return false;
+	}
+	size_t length = LOG_HEADER_SIZE + to.length() + from.length() + body.length();
+	length = (length + LOG_ALIGN - 1) / LOG_ALIGN * LOG_ALIGN;
+	if (length > LOG_SEGMENT_BYTES) {
+		return false;
+	}
+	if (log -> segments.empty() || log -> segments.back() -> tail + length > LOG_SEGMENT_BYTES) {
+		if (!LogAddSegment(log)) {
+			return false;
+		}
+	}
+	LogSegment* segment = log -> segments.back();
+	char* head = segment -> base + segment -> tail;
+	PutLittleEndian(head, length, 4);
+	PutLittleEndian(head + 8, log -> nextLsn, 8);
+	PutLittleEndian(head + 16, body.length(), 4);
+	PutLittleEndian(head + 20, type, 1);
+	PutLittleEndian(head + 21, 0, 1);
+	PutLittleEndian(head + 22, to.length(), 2);
+	PutLittleEndian(head + 24, from.length(), 2);
+	memset(head + 26, 0, LOG_HEADER_SIZE - 26);
+	char* fields = head + LOG_HEADER_SIZE;
+	memcpy(fields, to.data(), to.length());
+	memcpy(fields + to.length(), from.data(), from.length());
+	memcpy(fields + to.length() + from.length(), body.data(), body.length());
+	size_t used = LOG_HEADER_SIZE + to.length() + from.length() + body.length();
+	memset(head + used, 0, length - used);
+	PutLittleEndian(head + 4, LogChecksum(head + 8, length - 8), 4);
+
+	location.segment = segment;
+	location.offset = segment -> tail;
+	location.lsn = log -> nextLsn++;
+	segment -> tail += length;
+	log -> written++;
+	if (!log -> isDirty) {
+		log -> isDirty = true;
+		pthread_cond_signal(&log -> dirtyCond);
+	}
+	return true;
+}
+
+size_t LogForget(MessageLog* log, const string &username, uint64_t upTo)
+{
+	// Lock held, or not yet shared. Drops username's waiting records up to
+	// lsn upTo from the index and returns how many there were.
+	unordered_map<string, deque<LogLocation>>::iterator waitIter = log -> waiting.find(username);
+	if (waitIter == log -> waiting.end()) {
+		return 0;
+	}
+	deque<LogLocation> &locations = (*waitIter).second;
+	size_t forgotten = 0;
+	while (!locations.empty() && locations.front().lsn <= upTo) {
+		locations.front().segment -> waiting--;
+		locations.pop_front();
+		forgotten++;
+	}
+	log -> waitingCount -= forgotten;
+	if (locations.empty()) {
+		log -> waiting.erase(waitIter);
+	}
+	return forgotten;
+}
+
+void LogTakeReclaimable(MessageLog* log, vector<LogSegment*> &reclaimed)
+{
+	// Lock held. Oldest first only: a delivery record can only speak for
+	// segments older than its own, so those must go before it does.
+	while (log -> segments.size() > 1 && log -> segments.front() -> waiting == 0) {
+		reclaimed.push_back(log -> segments.front());
+		log -> segments.pop_front();
+	}
+}
+
+void* LogFlushThread(void* args_p)
+{
+	MessageLog* log = (MessageLog*) args_p;
+	long pageSize = sysconf(_SC_PAGESIZE);
+	vector<pair<char*, size_t>> ranges;
+	vector<LogSegment*> reclaimed;
+	while (true) {
+		pthread_mutex_lock(&log -> lock);
+		while (!log -> isDirty && !log -> isClosing) {
+			pthread_cond_wait(&log -> dirtyCond, &log -> lock);
+		}
+		bool isClosing = log -> isClosing;
+		pthread_mutex_unlock(&log -> lock);
+		if (!isClosing) {
+			// Whatever else lands in the meantime shares this sync.
+			usleep(LOG_COMMIT_US);
+		}
+
+		// Only this thread ever unmaps a segment, so the ranges stay good
+		// after the lock is dropped.
+		pthread_mutex_lock(&log -> lock);
+		log -> isDirty = false;
+		long target = log -> written;
+		ranges.clear();
+		for (size_t i = 0; i < log -> segments.size(); i++) {
+			LogSegment* segment = log -> segments[i];
+			if (segment -> tail > segment -> synced) {
+				size_t start = segment -> synced / pageSize * pageSize;
+				ranges.push_back(make_pair(segment -> base + start, segment -> tail - start));
+				segment -> synced = segment -> tail;
+			}
+		}
+		pthread_mutex_unlock(&log -> lock);
+
+		for (size_t i = 0; i < ranges.size(); i++) {
+			if (msync(ranges[i].first, ranges[i].second, MS_SYNC) != 0) {
+				cerr << "Unable to sync message log." << endl;
+			}
+		}
+
+		pthread_mutex_lock(&log -> lock);
+		log -> durable = target;
+		if (!ranges.empty()) {
+			log -> syncs++;
+		}
+		LogTakeReclaimable(log, reclaimed);
+		pthread_cond_broadcast(&log -> syncedCond);
+		pthread_mutex_unlock(&log -> lock);
+		for (size_t i = 0; i < reclaimed.size(); i++) {
+			LogUnmapSegment(reclaimed[i], true);
+		}
+		reclaimed.clear();
+		if (isClosing) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+void LogRecover(MessageLog* log, LogSegment* segment)
+{
+	// Replays one segment into the index, oldest segment first.
+	LogRecord record;
+	size_t offset = 0;
+	while (LogReadRecord(segment, offset, record)) {
+		if (record.type == LOG_DIRECT) {
+			LogLocation location;
+			location.segment = segment;
+			location.offset = offset;
+			location.lsn = record.lsn;
+			log -> waiting[string(record.to)].push_back(location);
+			segment -> waiting++;
+			log -> waitingCount++;
+		} else if (record.type == LOG_DELIVERED && record.body.length() == 8) {
+			LogForget(log, string(record.to), GetLittleEndian(record.body.data(), 8));
+		}
+		log -> nextLsn = max(log -> nextLsn, record.lsn + 1);
+		offset += record.length;
+	}
+	segment -> tail = offset;
+	segment -> synced = offset;
+}
+
+int LogOpen(MessageLog* log, const string &dir)
+{
+	// Picks up whatever an earlier run left in dir, then starts a fresh
+	// segment: whatever follows a torn tail is never written over.
+	log -> dir = dir;
+	pthread_mutex_init(&log -> lock, NULL);
+	pthread_cond_init(&log -> dirtyCond, NULL);
+	pthread_cond_init(&log -> syncedCond, NULL);
+	log -> waitingCount = 0;
+	log -> nextLsn = 1;
+	log -> isDirty = false;
+	log -> isClosing = false;
+	log -> written = 0;
+	log -> durable = 0;
+	log -> appends = 0;
+	log -> delivered = 0;
+	log -> syncs = 0;
+	if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+		cerr << "Unable to create message log directory " << dir << "." << endl;
+		return -1;
+	}
+	DIR* listing = opendir(dir.c_str());
+	if (listing == NULL) {
+		cerr << "Unable to read message log directory " << dir << "." << endl;
+		return -1;
+	}
+	vector<uint64_t> numbers;
+	struct dirent* entry;
+	while ((entry = readdir(listing)) != NULL) {
+		unsigned long long number;
+		char tail[8];
+		if (strlen(entry -> d_name) == 20 && sscanf(entry -> d_name, "%16llx%7s", &number, tail) == 2 &&
+			strcmp(tail, ".log") == 0) {
+			numbers.push_back(number);
+		}
+	}
+	closedir(listing);
+	sort(numbers.begin(), numbers.end());
+	for (size_t i = 0; i < numbers.size(); i++) {
+		LogSegment* segment = LogMapSegment(dir, numbers[i], false);
+		if (segment == NULL) {
+			continue;
+		}
+		log -> segments.push_back(segment);
+		LogRecover(log, segment);
+	}
+	if (!LogAddSegment(log)) {
+		return -1;
+	}
+	vector<LogSegment*> reclaimed;
+	LogTakeReclaimable(log, reclaimed);
+	for (size_t i = 0; i < reclaimed.size(); i++) {
+		LogUnmapSegment(reclaimed[i], true);
+	}
+	if (pthread_create(&log -> flusher, NULL, LogFlushThread, log) != 0) {
+		cerr << "Failed to create message log flusher." << endl;
+		return -1;
+	}
+	return 0;
+}
+
+void LogClose(MessageLog* log)
+{
+	// Syncs what is left and lets go of every segment. Nothing else may
+	// touch the log once this starts.
+	pthread_mutex_lock(&log -> lock);
+	log -> isClosing = true;
+	pthread_cond_signal(&log -> dirtyCond);
+	pthread_mutex_unlock(&log -> lock);
+	pthread_join(log -> flusher, NULL);
+	for (size_t i = 0; i < log -> segments.size(); i++) {
+		LogUnmapSegment(log -> segments[i], false);
+	}
+	log -> segments.clear();
+	log -> waiting.clear();
+	log -> waitingCount = 0;
+}
+
+bool LogAppend(MessageLog* log, string_view to, string_view from, string_view msg)
+{
+	// Returns once the record is in the mapping; it is on disk by the
+	// flusher's next pass.
+	pthread_mutex_lock(&log -> lock);
+	LogLocation location;
+	bool isWritten = LogWriteRecord(log, LOG_DIRECT, to, from, msg, location);
+	if (isWritten) {
+		log -> waiting[string(to)].push_back(location);
+		location.segment -> waiting++;
+		log -> waitingCount++;
+		log -> appends++;
+	}
+	pthread_mutex_unlock(&log -> lock);
+	return isWritten;
+}
+
+bool LogHasWaiting(MessageLog* log, const string &username)
+{
+	pthread_mutex_lock(&log -> lock);
+	bool hasWaiting = log -> waiting.count(username) > 0;
+	pthread_mutex_unlock(&log -> lock);
+	return hasWaiting;
+}
+
+void LogDrain(MessageLog* log, const string &username, vector<Payload*> &payloads)
+{
+	// Encodes everything waiting for username, oldest first. It stays
+	// waiting until LogConfirm hears it was sent, so a drain that never
+	// reaches the socket is drained again at the next login. Caller owns a
+	// reference to each payload.
+	pthread_mutex_lock(&log -> lock);
+	unordered_map<string, deque<LogLocation>>::iterator waitIter = log -> waiting.find(username);
+	if (waitIter == log -> waiting.end()) {
+		pthread_mutex_unlock(&log -> lock);
+		return;
+	}
+	deque<LogLocation> &locations = (*waitIter).second;
+	LogRecord record;
+	MessageView view;
+	view.cmd = DIRECT_MSG;
+	for (deque<LogLocation>::iterator locIter = locations.begin(); locIter != locations.end(); locIter++) {
+		if (LogReadRecord((*locIter).segment, (*locIter).offset, record)) {
+			view.to = record.to;
+			view.from = record.from;
+			view.msg = record.body;
+			Payload* payload = CreatePayload(view);
+			payload -> logLsn = (*locIter).lsn;
+			payloads.push_back(payload);
+		}
+	}
+	pthread_mutex_unlock(&log -> lock);
+}
+
+void LogConfirm(MessageLog* log, deque<Payload*> &sent)
+{
+	// Records that the drained payloads in sent went out whole, one
+	// delivery record per run for the same recipient, and releases them.
+	if (sent.empty()) {
+		return;
+	}
+	pthread_mutex_lock(&log -> lock);
+	while (!sent.empty()) {
+		Payload* payload = sent.front();
+		sent.pop_front();
+		uint64_t upTo = payload -> logLsn;
+		while (!sent.empty() && sent.front() -> to == payload -> to) {
+			upTo = max(upTo, sent.front() -> logLsn);
+			ReleasePayload(sent.front());
+			sent.pop_front();
+		}
+		// Nothing forgotten means a resend, already recorded.
+		size_t forgotten = LogForget(log, payload -> to, upTo);
+		if (forgotten > 0) {
+			char body[8];
+			PutLittleEndian(body, upTo, 8);
+			LogLocation location;
+			if (!LogWriteRecord(log, LOG_DELIVERED, payload -> to, string_view(), string_view(body, 8), location)) {
+				cerr << "Unable to record delivery to " << payload -> to << " in the message log." << endl;
+			}
+			log -> delivered += forgotten;
+		}
+		ReleasePayload(payload);
+	}
+	pthread_mutex_unlock(&log -> lock);
+}
+
+void LogWaitDurable(MessageLog* log)
+{
+	// Returns once everything written before the call has been synced.
+	pthread_mutex_lock(&log -> lock);
+	long target = log -> written;
+	while (log -> durable < target) {
+		pthread_cond_wait(&log -> syncedCond, &log -> lock);
+	}
+	pthread_mutex_unlock(&log -> lock);
+}
+
+}
+#endif // _RESCLOG_H_
@@ -0,0 +1,881 @@
+// AUTHOR: Ray Powers
+// DATE: October 18, 2026
+// FILE: rescMailbox.h
+
+// DESCRIPTION: Per-connection mailboxes for the RESC server. Any thread may
+//				post into a mailbox without taking a lock; only the thread that
+//				serves the connection takes messages out. Mailboxes carry
+//				refcounted, already encoded payloads so a broadcast is encoded
+//				once no matter how many users receive it.
+
+#ifndef _RESCMAILBOX_H_
+#define _RESCMAILBOX_H_
+
+// Standard Library
+#include<atomic>
+#include<deque>
+
+// Zero-copy file sends
+#include<sys/sendfile.h>
+
+// RESC Framework
+#include "rescFramework.h"
+
+using namespace std;
+
+namespace RESC {
+
+// An open file that payloads send part of straight from the page cache.
+// Each such payload holds a reference; the last one closes it.
+struct FileSource {
+	atomic<int> refCount;
+	int fd;
+};
+
+// Immutable wire form of one message. Every mailbox it is posted to holds a
+// reference; the last one to flush it frees it. v2 connections are sent the
+// to, from and msg fields, the latter two straight out of body.
+struct Payload {
+	atomic<int> refCount;
+	MsgType cmd;
+	string body;	// Encoded message and its terminating null.
+	string to;
+	size_t fromOffset;
+	size_t fromLength;
+	size_t msgOffset;
+	size_t msgLength;
+	// When file is set, the last fileLength bytes of the msg field are
+	// read from it at fileOffset rather than kept in body. v2 only.
+	FileSource* file;
+	off_t fileOffset;
+	size_t fileLength;
+	uint64_t historySeq;	// Place in a history ring, from 1; 0 when kept in none.
+	uint64_t logLsn;	// Message log record it was read from; 0 when none.
+};
+
+// Frames written per sendmsg call when flushing; up to four iovecs each.
+const int FLUSH_BATCH = 256;
+const int FRAME_PARTS = 4;
+
+enum FlushStatus {
+	FLUSH_DONE = 0,
+	FLUSH_BLOCKED,
+	FLUSH_ERROR
+};
+
+// Priority lanes. Control (raw replies, userlists, presence) always goes
+// first. Chat and bulk (filestreams and anything bigger than a slice)
+// split the rest LANE_WEIGHTS to one by bytes while both have something
+// waiting, deficit round robin style.
+enum Lane {
+	LANE_CONTROL = 0,
+	LANE_CHAT,
+	LANE_BULK
+};
+const int LANE_COUNT = 3;
+const long LANE_WEIGHTS[LANE_COUNT] = {0, 4, 1};
+const long LANE_QUANTUM = 16 * 1024;	// Bytes per unit of weight per turn.
+// Largest body piece of a sliced message, and how many bytes are lined up
+// ahead of the socket; a new chat message waits behind at most that much.
+const size_t SLICE_BYTES = 16 * 1024;
+const size_t COMMIT_BYTES = 64 * 1024;
+
+// What to do when a slow reader's OutQueue goes over its limits.
+enum OverflowPolicy {
+	OVERFLOW_DROP_OLDEST = 0,
+	OVERFLOW_DROP_BULK,		// The bulk lane first, oldest first, then anything.
+	OVERFLOW_DISCONNECT
+};
+
+struct OutQueueLimits {
+	size_t maxBytes;	// 0 is no limit.
+	size_t maxMessages;	// 0 is no limit.
+	OverflowPolicy policy;
+};
+
+struct QueuedPayload {
+	Payload* payload;
+	uint64_t order;		// Push order across lanes, for dropping the oldest.
+};
+
+// One frame lined up for the socket: a whole payload or a slice of its body.
+struct WireFrame {
+	Payload* payload;
+	uint16_t flags;		// FRAME_FLAG_* for a slice, 0 for a whole payload.
+	size_t bodyOffset;	// Part of the msg field a slice carries.
+	size_t bodyLength;
+	bool isLast;		// Sending it finishes the payload.
+};
+
+// Payloads taken out of a mailbox but not yet fully written to the socket.
+// They wait in their lane, where they may still be dropped, until they are
+// lined up on the wire in the order they will be sent.
+struct OutQueue {
+	deque<QueuedPayload> lanes[LANE_COUNT];
+	deque<WireFrame> wire;
+	size_t offset;	// Bytes of the front wire frame (prefix + body) already sent.
+	size_t wireBytes;	// Bytes lined up on the wire, including offset.
+	size_t sliceOffset;	// Body bytes of the front bulk payload already lined up.
+	long deficits[LANE_COUNT];
+	int turn;		// LANE_CHAT or LANE_BULK.
+	bool hasTurnStarted;
+	bool canSlice;	// Peer offered "slices".
+	uint64_t pushes;
+	long syscalls;	// sendmsg calls made, for benchmarking.
+	uint8_t version;	// Framing negotiated with the peer.
+	uint64_t seq;	// Sequence number of the front v2 frame.
+	// The last keepSent v2 frames written, seq - sent.size() on, so a
+	// resumed session can have them again. Each holds its own reference.
+	deque<WireFrame> sent;
+	size_t keepSent;
+	// Payloads read from a message log and written whole since the owner
+	// last confirmed them. Each holds its own reference.
+	deque<Payload*> logged;
+	size_t count;	// Payloads queued, waiting or lined up.
+	size_t bytes;	// Their whole frame bytes.
+	long dropped;	// Payloads dropped to stay within the limits.
+	long droppedBytes;
+};
+
+struct MailNode {
+	atomic<MailNode*> next;
+	Payload* payload;
+	uint64_t target;	// Connection it is for in a reactor's inbound queue; 0 is all of them.
+};
+
+// Intrusive multi-producer/single-consumer queue (Vyukov). Producers swap
+// themselves onto head; the consumer walks forward from tail.
+struct Mailbox {
+	atomic<MailNode*> head;
+	MailNode* tail;
+	MailNode stub;
+	atomic<bool> hasPendingWake;
+};
+
+Payload* CreatePayload(const MessageView &view)
+{
+	// Encodes straight from the parsed frame. Caller owns the first reference.
+	Payload* payload = new Payload;
+	payload -> refCount.store(1, memory_order_relaxed);
+	payload -> cmd = view.cmd;
+	payload -> body.reserve(view.to.length() + view.from.length() + view.msg.length() + 16);
+	AppendEncoded(payload -> body, view.cmd, view.to, view.from, view.msg);
+	payload -> body.push_back('\0');
+	payload -> to.assign(view.to.data(), view.to.length());
+	// AppendEncoded writes "<cmd> <from> <msg>", "/room <room> <from> <msg>",
+	// or "/userlist <msg>" and "/presence <msg>".
+	payload -> msgLength = view.msg.length();
+	payload -> msgOffset = payload -> body.length() - 1 - payload -> msgLength;
+	if (view.cmd == USER_LIST_MSG || view.cmd == PRESENCE_MSG) {
+		payload -> fromOffset = 0;
+		payload -> fromLength = 0;
+	} else {
+		payload -> fromLength = view.from.length();
+		payload -> fromOffset = payload -> msgOffset - 1 - payload -> fromLength;
+	}
+	payload -> file = NULL;
+	payload -> fileOffset = 0;
+	payload -> fileLength = 0;
+	payload -> historySeq = 0;
+	payload -> logLsn = 0;
+	return payload;
+}
+
+Payload* CreatePayload(const Message &msg)
+{
+	MessageView view;
+	view.cmd = msg.cmd;
+	view.to = msg.to;
+	view.from = msg.from;
+	view.msg = msg.msg;
+	return CreatePayload(view);
+}
+
+FileSource* CreateFileSource(int fd)
+{
+	// Takes over fd. Caller owns the first reference.
+	FileSource* file = new FileSource;
+	file -> refCount.store(1, memory_order_relaxed);
+	file -> fd = fd;
+	return file;
+}
+
+void RetainFile(FileSource* file)
+{
+	file -> refCount.fetch_add(1, memory_order_relaxed);
+}
+
+void ReleaseFile(FileSource* file)
+{
+	if (file -> refCount.fetch_sub(1, memory_order_acq_rel) == 1) {
+		close(file -> fd);
+		delete file;
+	}
+}
+
+Payload* CreateFilePayload(const MessageView &view, FileSource* file, off_t fileOffset, size_t fileLength)
+{
+	// view.msg is what goes ahead of the file bytes in the msg field.
+	Payload* payload = CreatePayload(view);
+	RetainFile(file);
+	payload -> file = file;
+	payload -> fileOffset = fileOffset;
+	payload -> fileLength = fileLength;
+	payload -> msgLength += fileLength;
+	return payload;
+}
+
+void RetainPayload(Payload* payload)
+{
+	payload -> refCount.fetch_add(1, memory_order_relaxed);
+}
+
+void ReleasePayload(Payload* payload)
+{
+	if (payload -> refCount.fetch_sub(1, memory_order_acq_rel) == 1) {
+		if (payload -> file != NULL) {
+			ReleaseFile(payload -> file);
+		}
+		delete payload;
+	}
+}
+
+Payload* CreateRawPayload(const string &msg)
+{
+	// For replies that are not protocol messages, e.g. the auth response.
+	Payload* payload = new Payload;
+	payload -> refCount.store(1, memory_order_relaxed);
+	// Always sent with v1 framing, whatever the connection negotiated.
+	payload -> cmd = INVALID_MSG;
+	payload -> body = msg;
+	payload -> body.push_back('\0');
+	payload -> fromOffset = 0;
+	payload -> fromLength = 0;
+	payload -> msgOffset = 0;
+	payload -> msgLength = msg.length();
+	payload -> file = NULL;
+	payload -> fileOffset = 0;
+	payload -> fileLength = 0;
+	payload -> historySeq = 0;
+	payload -> logLsn = 0;
+	return payload;
+}
+
+void OutQueueInit(OutQueue* out)
+{
+	out -> offset = 0;
+	out -> wireBytes = 0;
+	out -> sliceOffset = 0;
+	for (int i = 0; i < LANE_COUNT; i++) {
+		out -> deficits[i] = 0;
+	}
+	out -> turn = LANE_CHAT;
+	out -> hasTurnStarted = false;
+	out -> canSlice = false;
+	out -> pushes = 0;
+	out -> syscalls = 0;
+	out -> version = PROTOCOL_V1;
+	out -> seq = 0;
+	out -> keepSent = 0;
+	out -> count = 0;
+	out -> bytes = 0;
+	out -> dropped = 0;
+	out -> droppedBytes = 0;
+}
+
+bool IsV2Frame(const OutQueue* out, const Payload* payload)
+{
+	return out -> version == PROTOCOL_V2 && payload -> cmd != INVALID_MSG;
+}
+
+size_t FrameLength(const OutQueue* out, const Payload* payload)
+{
+	if (IsV2Frame(out, payload)) {
+		return FRAME_HEADER_SIZE + payload -> to.length() + payload -> fromLength + payload -> msgLength;
+	}
+	return sizeof(long) + payload -> body.length();
+}
+
+size_t WireFrameLength(const OutQueue* out, const WireFrame &frame)
+{
+	if (frame.flags == 0) {
+		return FrameLength(out, frame.payload);
+	}
+	if (frame.flags & FRAME_FLAG_CONTINUES) {
+		return FRAME_HEADER_SIZE + frame.bodyLength;
+	}
+	return FRAME_HEADER_SIZE + frame.payload -> to.length() + frame.payload -> fromLength + frame.bodyLength;
+}
+
+int FrameParts(const OutQueue* out, const WireFrame &frame, uint64_t seq, char* head, struct iovec* parts)
+{
+	// Fills head with the frame's prefix and parts with the iovecs that make
+	// up the whole frame; the body parts point into the payload.
+	Payload* payload = frame.payload;
+	if (!IsV2Frame(out, payload)) {
+		long networkInt = htonl(payload -> body.length());
+		memcpy(head, &networkInt, sizeof(long));
+		parts[0].iov_base = head;
+		parts[0].iov_len = sizeof(long);
+		parts[1].iov_base = (void *) payload -> body.data();
+		parts[1].iov_len = payload -> body.length();
+		return 2;
+	}
+	// Continuation slices only carry body bytes.
+	bool hasFields = !(frame.flags & FRAME_FLAG_CONTINUES);
+	FrameHeader header;
+	header.version = PROTOCOL_V2;
+	header.type = payload -> cmd;
+	header.flags = frame.flags;
+	header.toLength = (hasFields) ? payload -> to.length() : 0;
+	header.fromLength = (hasFields) ? payload -> fromLength : 0;
+	header.bodyLength = frame.bodyLength;
+	header.seq = seq;
+	PackFrameHeader(header, head);
+	parts[0].iov_base = head;
+	parts[0].iov_len = FRAME_HEADER_SIZE;
+	parts[1].iov_base = (void *) payload -> to.data();
+	parts[1].iov_len = header.toLength;
+	parts[2].iov_base = (void *) (payload -> body.data() + payload -> fromOffset);
+	parts[2].iov_len = header.fromLength;
+	parts[3].iov_base = (void *) (payload -> body.data() + payload -> msgOffset + frame.bodyOffset);
+	// File bytes are not in memory; the flush sends them separately.
+	parts[3].iov_len = frame.bodyLength - payload -> fileLength;
+	return 4;
+}
+
+Lane PayloadLane(const Payload* payload)
+{
+	if (payload -> cmd == INVALID_MSG || payload -> cmd == USER_LIST_MSG || payload -> cmd == PRESENCE_MSG ||
+		payload -> cmd == FILE_OFFER_MSG || payload -> cmd == FILE_ACK_MSG) {
+		return LANE_CONTROL;
+	}
+	if (payload -> cmd == FILE_STREAM_MSG || payload -> cmd == FILE_CHUNK_MSG || payload -> msgLength > SLICE_BYTES) {
+		return LANE_BULK;
+	}
+	return LANE_CHAT;
+}
+
+bool IsDroppable(const Payload* payload)
+{
+	// Raw replies aren't protocol messages, and file transfers pace
+	// themselves with acks and requests, so a lost one would stall them.
+	return payload -> cmd != INVALID_MSG && payload -> cmd != FILE_OFFER_MSG &&
+		payload -> cmd != FILE_ACK_MSG && payload -> cmd != FILE_CHUNK_MSG;
+}
+
+bool IsSliced(const OutQueue* out, const Payload* payload)
+{
+	// File chunks are already no bigger than a few slices.
+	return out -> canSlice && IsV2Frame(out, payload) && payload -> msgLength > SLICE_BYTES && payload -> file == NULL;
+}
+
+bool OutQueueIsEmpty(const OutQueue* out)
+{
+	return out -> count == 0;
+}
+
+void OutQueuePush(OutQueue* out, Payload* payload)
+{
+	// Takes over the caller's reference.
+	QueuedPayload queued;
+	queued.payload = payload;
+	queued.order = out -> pushes++;
+	out -> lanes[PayloadLane(payload)].push_back(queued);
+	out -> count++;
+	out -> bytes += FrameLength(out, payload);
+}
+
+void OutQueueForget(OutQueue* out, Payload* payload)
+{
+	// Undoes OutQueuePush's accounting for a payload leaving the queue.
+	out -> count--;
+	out -> bytes -= FrameLength(out, payload);
+}
+
+bool OutQueueIsOver(const OutQueue* out, const OutQueueLimits &limits)
+{
+	return (limits.maxBytes > 0 && out -> bytes > limits.maxBytes) ||
+		(limits.maxMessages > 0 && out -> count > limits.maxMessages);
+}
+
+bool OutQueueDropOne(OutQueue* out, bool isBulkOnly)
+{
+	// Drops the oldest payload still waiting in a lane. A bulk payload
+	// with slices on the wire has started going out and stays.
+	int dropLane = -1;
+	size_t dropIndex = 0;
+	for (int lane = (isBulkOnly) ? LANE_BULK : LANE_CONTROL; lane < LANE_COUNT; lane++) {
+		deque<QueuedPayload> &waiting = out -> lanes[lane];
+		size_t first = (lane == LANE_BULK && out -> sliceOffset > 0) ? 1 : 0;
+		for (size_t i = first; i < waiting.size(); i++) {
+			if (!IsDroppable(waiting[i].payload)) {
+				continue;
+			}
+			if (dropLane < 0 || waiting[i].order < out -> lanes[dropLane][dropIndex].order) {
+				dropLane = lane;
+				dropIndex = i;
+			}
+			break;
+		}
+	}
+	if (dropLane < 0) {
+		return false;
+	}
+	Payload* payload = out -> lanes[dropLane][dropIndex].payload;
+	out -> dropped++;
+	out -> droppedBytes += FrameLength(out, payload);
+	OutQueueForget(out, payload);
+	out -> lanes[dropLane].erase(out -> lanes[dropLane].begin() + dropIndex);
+	ReleasePayload(payload);
+	return true;
+}
+
+int OutQueueOffer(OutQueue* out, Payload* payload, const OutQueueLimits &limits)
+{
+	// Pushes like OutQueuePush, then brings the queue back within its
+	// limits. Returns how many payloads were dropped for it, or -1 when
+	// the policy is to disconnect. v2 frames are numbered as they go out,
+	// so a drop never leaves a gap in seq.
+	OutQueuePush(out, payload);
+	if (!OutQueueIsOver(out, limits)) {
+		return 0;
+	}
+	if (limits.policy == OVERFLOW_DISCONNECT) {
+		return -1;
+	}
+	int dropCount = 0;
+	if (limits.policy == OVERFLOW_DROP_BULK) {
+		while (OutQueueIsOver(out, limits) && OutQueueDropOne(out, true)) {
+			dropCount++;
+		}
+	}
+	while (OutQueueIsOver(out, limits) && OutQueueDropOne(out, false)) {
+		dropCount++;
+	}
+	return dropCount;
+}
+
+void OutQueueClear(OutQueue* out)
+{
+	// Slices that don't finish their payload don't hold a reference.
+	while (!out -> wire.empty()) {
+		if (out -> wire.front().isLast) {
+			ReleasePayload(out -> wire.front().payload);
+		}
+		out -> wire.pop_front();
+	}
+	for (int lane = 0; lane < LANE_COUNT; lane++) {
+		while (!out -> lanes[lane].empty()) {
+			ReleasePayload(out -> lanes[lane].front().payload);
+			out -> lanes[lane].pop_front();
+		}
+	}
+	while (!out -> sent.empty()) {
+		ReleasePayload(out -> sent.front().payload);
+		out -> sent.pop_front();
+	}
+	// Never confirmed, so still waiting in their log.
+	while (!out -> logged.empty()) {
+		ReleasePayload(out -> logged.front());
+		out -> logged.pop_front();
+	}
+	out -> offset = 0;
+	out -> wireBytes = 0;
+	out -> sliceOffset = 0;
+	out -> count = 0;
+	out -> bytes = 0;
+}
+
+size_t OutQueueNextLength(const OutQueue* out, int lane)
+{
+	// Bytes the next frame from lane would put on the wire.
+	Payload* payload = out -> lanes[lane].front().payload;
+	if (lane != LANE_BULK || !IsSliced(out, payload)) {
+		return FrameLength(out, payload);
+	}
+	size_t bodyLength = min(SLICE_BYTES, payload -> msgLength - out -> sliceOffset);
+	if (out -> sliceOffset > 0) {
+		return FRAME_HEADER_SIZE + bodyLength;
+	}
+	return FRAME_HEADER_SIZE + payload -> to.length() + payload -> fromLength + bodyLength;
+}
+
+void OutQueueLineUp(OutQueue* out, int lane)
+{
+	// Moves the next frame of lane onto the wire; a payload leaves its
+	// lane with its last slice.
+	Payload* payload = out -> lanes[lane].front().payload;
+	WireFrame frame;
+	frame.payload = payload;
+	frame.flags = 0;
+	frame.bodyOffset = 0;
+	frame.bodyLength = payload -> msgLength;
+	frame.isLast = true;
+	if (lane == LANE_BULK && IsSliced(out, payload)) {
+		frame.bodyOffset = out -> sliceOffset;
+		frame.bodyLength = min(SLICE_BYTES, payload -> msgLength - out -> sliceOffset);
+		frame.flags = (out -> sliceOffset > 0) ? FRAME_FLAG_CONTINUES : 0;
+		out -> sliceOffset += frame.bodyLength;
+		frame.isLast = (out -> sliceOffset == payload -> msgLength);
+		if (!frame.isLast) {
+			frame.flags |= FRAME_FLAG_MORE;
+		}
+	}
+	out -> wire.push_back(frame);
+	out -> wireBytes += WireFrameLength(out, frame);
+	if (frame.isLast) {
+		out -> lanes[lane].pop_front();
+		if (lane == LANE_BULK) {
+			out -> sliceOffset = 0;
+		}
+	}
+}
+
+void OutQueueSchedule(OutQueue* out)
+{
+	// Lines frames up from the lanes until COMMIT_BYTES are ahead of the
+	// socket or a sendmsg's worth of frames is.
+	while (out -> wireBytes < COMMIT_BYTES && out -> wire.size() < FLUSH_BATCH) {
+		if (!out -> lanes[LANE_CONTROL].empty()) {
+			OutQueueLineUp(out, LANE_CONTROL);
+			continue;
+		}
+		int lane = out -> turn;
+		int other = (lane == LANE_CHAT) ? LANE_BULK : LANE_CHAT;
+		if (out -> lanes[lane].empty() && out -> lanes[other].empty()) {
+			break;
+		}
+		if (out -> lanes[lane].empty() || out -> lanes[other].empty()) {
+			// Only one lane busy: it has the socket to itself, and an idle
+			// lane saves up no credit.
+			int busy = (out -> lanes[lane].empty()) ? other : lane;
+			out -> deficits[LANE_CHAT] = 0;
+			out -> deficits[LANE_BULK] = 0;
+			out -> hasTurnStarted = false;
+			OutQueueLineUp(out, busy);
+			continue;
+		}
+		if (!out -> hasTurnStarted) {
+			out -> deficits[lane] += LANE_WEIGHTS[lane] * LANE_QUANTUM;
+			out -> hasTurnStarted = true;
+		}
+		long length = OutQueueNextLength(out, lane);
+		if (length > out -> deficits[lane]) {
+			out -> turn = other;
+			out -> hasTurnStarted = false;
+			continue;
+		}
+		out -> deficits[lane] -= length;
+		OutQueueLineUp(out, lane);
+	}
+}
+
+int OutQueueGather(OutQueue* out, char (*headers)[FRAME_HEADER_SIZE], struct iovec* iov)
+{
+	// Lines up what should go next, then fills iov with frame prefixes and
+	// payload bodies for as many wire frames as fit in one sendmsg,
+	// starting where the last send stopped. A frame with file bytes ends
+	// the batch after its in-memory part, and 0 is returned once only its
+	// file bytes are left (see OutQueueFilePart). headers needs room for
+	// FLUSH_BATCH prefixes, iov for FLUSH_BATCH * FRAME_PARTS.
+	OutQueueSchedule(out);
+	int iovCount = 0;
+	int frameCount = 0;
+	size_t skip = out -> offset;	// Only the front frame can be partly sent.
+	uint64_t seq = out -> seq;
+	deque<WireFrame>::iterator frameIter = out -> wire.begin();
+	while (frameIter != out -> wire.end() && frameCount < FLUSH_BATCH) {
+		struct iovec parts[FRAME_PARTS];
+		int partCount = FrameParts(out, *frameIter, seq, headers[frameCount], parts);
+		if (IsV2Frame(out, (*frameIter).payload)) {
+			seq++;
+		}
+		for (int i = 0; i < partCount; i++) {
+			if (skip >= parts[i].iov_len) {
+				skip -= parts[i].iov_len;
+				continue;
+			}
+			iov[iovCount].iov_base = (char *) parts[i].iov_base + skip;
+			iov[iovCount].iov_len = parts[i].iov_len - skip;
+			iovCount++;
+			skip = 0;
+		}
+		if ((*frameIter).payload -> file != NULL) {
+			break;
+		}
+		frameCount++;
+		frameIter++;
+	}
+	return iovCount;
+}
+
+bool OutQueueFilePart(const OutQueue* out, int &fd, off_t &position, size_t &length)
+{
+	// True when all that is left of the front wire frame is file bytes,
+	// and where they are.
+	if (out -> wire.empty() || out -> wire.front().payload -> file == NULL) {
+		return false;
+	}
+	const WireFrame &frame = out -> wire.front();
+	Payload* payload = frame.payload;
+	size_t inMemory = WireFrameLength(out, frame) - payload -> fileLength;
+	if (out -> offset < inMemory) {
+		return false;
+	}
+	fd = payload -> file -> fd;
+	position = payload -> fileOffset + (out -> offset - inMemory);
+	length = payload -> fileLength - (out -> offset - inMemory);
+	return true;
+}
+
+void OutQueueAdvance(OutQueue* out, size_t bytesSent)
+{
+	// Drops every wire frame the kernel took all of and remembers how far
+	// into the next one it got.
+	size_t bytesLeft = bytesSent;
+	while (bytesLeft > 0 && !out -> wire.empty()) {
+		WireFrame &frame = out -> wire.front();
+		size_t frameLength = WireFrameLength(out, frame);
+		size_t frameLeft = frameLength - out -> offset;
+		if (bytesLeft < frameLeft) {
+			out -> offset += bytesLeft;
+			break;
+		}
+		bytesLeft -= frameLeft;
+		out -> offset = 0;
+		out -> wireBytes -= frameLength;
+		if (IsV2Frame(out, frame.payload)) {
+			out -> seq++;
+			if (out -> keepSent > 0) {
+				RetainPayload(frame.payload);
+				out -> sent.push_back(frame);
+				if (out -> sent.size() > out -> keepSent) {
+					ReleasePayload(out -> sent.front().payload);
+					out -> sent.pop_front();
+				}
+			}
+		}
+		if (frame.isLast) {
+			OutQueueForget(out, frame.payload);
+			if (frame.payload -> logLsn != 0) {
+				out -> logged.push_back(frame.payload);
+			} else {
+				ReleasePayload(frame.payload);
+			}
+		}
+		out -> wire.pop_front();
+	}
+}
+
+uint64_t OutQueueResume(OutQueue* out, uint64_t nextSeq)
+{
+	// For a new connection taking over from one that dropped: the peer
+	// has every frame before nextSeq. Puts the kept frames from there on
+	// back at the front of the wire and starts the front frame over.
+	// Returns the seq sending starts from, later than nextSeq if those
+	// frames are no longer kept. Nothing may be in flight.
+	uint64_t from = min(max(nextSeq, out -> seq - out -> sent.size()), out -> seq);
+	while (out -> seq - out -> sent.size() < from) {
+		ReleasePayload(out -> sent.front().payload);
+		out -> sent.pop_front();
+	}
+	if (from != nextSeq) {
+		// The peer lost the start of whatever message was part way out,
+		// so the rest of it is no use; only one is sliced at a time.
+		Payload* broken = NULL;
+		bool isStarted = false;
+		size_t frameCount = out -> sent.size() + out -> wire.size();
+		for (size_t i = 0; i < frameCount && broken == NULL && !isStarted; i++) {
+			const WireFrame &frame = (i < out -> sent.size()) ? out -> sent[i] : out -> wire[i - out -> sent.size()];
+			if (frame.flags & FRAME_FLAG_CONTINUES) {
+				broken = frame.payload;
+			} else if (frame.flags & FRAME_FLAG_MORE) {
+				isStarted = true;
+			}
+		}
+		if (broken == NULL && !isStarted && out -> sliceOffset > 0) {
+			broken = out -> lanes[LANE_BULK].front().payload;
+		}
+		if (broken != NULL) {
+			deque<WireFrame>::iterator frameIter = out -> sent.begin();
+			while (frameIter != out -> sent.end()) {
+				if ((*frameIter).payload != broken) {
+					frameIter++;
+					continue;
+				}
+				ReleasePayload(broken);
+				frameIter = out -> sent.erase(frameIter);
+			}
+			frameIter = out -> wire.begin();
+			while (frameIter != out -> wire.end()) {
+				if ((*frameIter).payload != broken) {
+					frameIter++;
+					continue;
+				}
+				out -> wireBytes -= WireFrameLength(out, *frameIter);
+				if ((*frameIter).isLast) {
+					OutQueueForget(out, broken);
+					ReleasePayload(broken);
+				}
+				frameIter = out -> wire.erase(frameIter);
+			}
+			if (out -> sliceOffset > 0 && out -> lanes[LANE_BULK].front().payload == broken) {
+				OutQueueForget(out, broken);
+				ReleasePayload(broken);
+				out -> lanes[LANE_BULK].pop_front();
+				out -> sliceOffset = 0;
+			}
+		}
+	}
+	// Kept frames go back on the wire, where only a payload's last frame
+	// holds a reference, and are numbered from from again as they go.
+	out -> offset = 0;
+	while (!out -> sent.empty()) {
+		WireFrame frame = out -> sent.back();
+		out -> sent.pop_back();
+		if (frame.isLast) {
+			out -> count++;
+			out -> bytes += FrameLength(out, frame.payload);
+		} else {
+			ReleasePayload(frame.payload);
+		}
+		out -> wireBytes += WireFrameLength(out, frame);
+		out -> wire.push_front(frame);
+	}
+	out -> seq = from;
+	return from;
+}
+
+void OutQueuePushFirst(OutQueue* out, Payload* payload)
+{
+	// Puts a whole raw reply ahead of everything, even frames already
+	// lined up. Only while the front frame is unsent; takes over the
+	// caller's reference.
+	WireFrame frame;
+	frame.payload = payload;
+	frame.flags = 0;
+	frame.bodyOffset = 0;
+	frame.bodyLength = payload -> msgLength;
+	frame.isLast = true;
+	out -> wire.push_front(frame);
+	out -> wireBytes += WireFrameLength(out, frame);
+	out -> count++;
+	out -> bytes += FrameLength(out, payload);
+}
+
+FlushStatus FlushOutQueue(int outSocket, OutQueue* out)
+{
+	// Gather frame prefixes and payload bodies for as many frames as fit
+	// in one sendmsg, then advance past whatever the kernel accepted.
+	char headers[FLUSH_BATCH][FRAME_HEADER_SIZE];
+	struct iovec iov[FLUSH_BATCH * FRAME_PARTS];
+
+	while (!OutQueueIsEmpty(out)) {
+		struct msghdr msgHeader;
+		memset(&msgHeader, 0, sizeof(msgHeader));
+		msgHeader.msg_iov = iov;
+		msgHeader.msg_iovlen = OutQueueGather(out, headers, iov);
+		ssize_t bytesSent;
+		int fd;
+		off_t position;
+		size_t length;
+		if (msgHeader.msg_iovlen == 0 && OutQueueFilePart(out, fd, position, length)) {
+			// File bytes go from the page cache to the socket without
+			// passing through us.
+			bytesSent = sendfile(outSocket, fd, &position, length);
+			if (bytesSent == 0) {
+				// The file is shorter than promised.
+				return FLUSH_ERROR;
+			}
+		} else {
+			bytesSent = sendmsg(outSocket, &msgHeader, MSG_NOSIGNAL);
+		}
+		out -> syscalls++;
+		if (bytesSent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return FLUSH_BLOCKED;
+			}
+			return FLUSH_ERROR;
+		}
+		OutQueueAdvance(out, bytesSent);
+	}
+	return FLUSH_DONE;
+}
+
+void MailboxInit(Mailbox* box)
+{
+	box -> stub.next.store(NULL, memory_order_relaxed);
+	box -> head.store(&box -> stub, memory_order_relaxed);
+	box -> tail = &box -> stub;
+	box -> hasPendingWake.store(false, memory_order_relaxed);
+}
+
+void MailboxEnqueue(Mailbox* box, MailNode* node)
+{
+	node -> next.store(NULL, memory_order_relaxed);
+	MailNode* prev = box -> head.exchange(node, memory_order_acq_rel);
+	// Between the exchange and this store the consumer sees the queue as
+	// empty; the wake that follows every push covers that window.
+	prev -> next.store(node, memory_order_release);
+}
+
+bool MailboxPush(Mailbox* box, MailNode* node)
+{
+	// Returns true when the consumer has to be woken up.
+	MailboxEnqueue(box, node);
+	return !box -> hasPendingWake.exchange(true, memory_order_acq_rel);
+}
+
+void MailboxArm(Mailbox* box)
+{
+	// Consumer calls this before draining so the next push wakes it again.
+	box -> hasPendingWake.exchange(false, memory_order_acq_rel);
+}
+
+MailNode* MailboxPop(Mailbox* box)
+{
+	// Consumer only. Returns NULL when nothing is (yet) visible.
+	MailNode* tail = box -> tail;
+	MailNode* next = tail -> next.load(memory_order_acquire);
+	if (tail == &box -> stub) {
+		if (next == NULL) {
+			return NULL;
+		}
+		box -> tail = next;
+		tail = next;
+		next = next -> next.load(memory_order_acquire);
+	}
+	if (next != NULL) {
+		box -> tail = next;
+		return tail;
+	}
+	if (tail != box -> head.load(memory_order_acquire)) {
+		// A producer is mid-push; its wake will bring us back.
+		return NULL;
+	}
+	// tail is the last node; park the stub behind it so it can be handed out.
+	MailboxEnqueue(box, &box -> stub);
+	next = tail -> next.load(memory_order_acquire);
+	if (next != NULL) {
+		box -> tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+void MailboxClear(Mailbox* box)
+{
+	// Consumer only, once no producer can reach the mailbox any more.
+	MailNode* node;
+	while ((node = MailboxPop(box)) != NULL) {
+		ReleasePayload(node -> payload);
+		delete node;
+	}
+}
+
+}
+#endif // _RESCMAILBOX_H_
@@ -0,0 +1,196 @@
+// AUTHOR: Ray Powers
+// DATE: October 18, 2026
+// FILE: rescPool.h
+
+// DESCRIPTION: Work-stealing thread pool for the RESC server. A big loop is
+//				cut into chunks and dealt across the workers' deques; a worker
+//				that runs dry steals from the others, and the thread that
+//				asked for the work helps until every chunk of it is done.
+
+#ifndef _RESCPOOL_H_
+#define _RESCPOOL_H_
+
+// Standard Library
+#include<iostream>
+#include<atomic>
+#include<deque>
+#include<vector>
+
+// Multithreading
+#include<pthread.h>
+#include<sched.h>
+
+using namespace std;
+
+namespace RESC {
+
+// Runs items [begin, end) of a job.
+typedef void (*ChunkFunction)(void* arg, size_t begin, size_t end);
+
+struct PoolJob {
+	ChunkFunction run;
+	void* arg;
+	atomic<size_t> remaining;	// Chunks not finished yet.
+};
+
+struct PoolChunk {
+	PoolJob* job;
+	size_t begin;
+	size_t end;
+};
+
+struct WorkPool;
+
+struct PoolWorker {
+	pthread_mutex_t lock;
+	deque<PoolChunk> chunks;	// The owner takes from the back, thieves from the front.
+	WorkPool* pool;
+	int index;
+	pthread_t tid;
+};
+
+struct WorkPool {
+	vector<PoolWorker*> workers;
+	atomic<long> queued;		// Chunks sitting in any deque.
+	atomic<unsigned> nextWorker;	// Where the next job starts dealing.
+	atomic<long> steals;		// Chunks run by someone other than their deque's owner.
+	pthread_mutex_t idleLock;
+	pthread_cond_t idleCond;
+};
+
+bool PoolTake(WorkPool* pool, int self, PoolChunk &chunk)
+{
+	// Own deque first, newest chunk; then the oldest chunk of each of the
+	// others. self is -1 for a thread outside the pool.
+	int count = pool -> workers.size();
+	if (self >= 0) {
+		PoolWorker* worker = pool -> workers[self];
+		pthread_mutex_lock(&worker -> lock);
+		bool hasChunk = !worker -> chunks.empty();
+		if (hasChunk) {
+			chunk = worker -> chunks.back();
+			worker -> chunks.pop_back();
+		}
+		pthread_mutex_unlock(&worker -> lock);
+		if (hasChunk) {
+			pool -> queued.fetch_sub(1, memory_order_relaxed);
+			return true;
+		}
+	}
+	for (int i = 1; i <= count; i++) {
+		PoolWorker* victim = pool -> workers[(self + i + count) % count];
+		if (victim -> index == self) {
+			continue;
+		}
+		pthread_mutex_lock(&victim -> lock);
+		bool hasChunk = !victim -> chunks.empty();
+		if (hasChunk) {
+			chunk = victim -> chunks.front();
+			victim -> chunks.pop_front();
+		}
+		pthread_mutex_unlock(&victim -> lock);
+		if (hasChunk) {
+			pool -> queued.fetch_sub(1, memory_order_relaxed);
+			pool -> steals.fetch_add(1, memory_order_relaxed);
+			return true;
+		}
+	}
+	return false;
+}
+
+void PoolRunChunk(PoolChunk &chunk)
+{
+	chunk.job -> run(chunk.job -> arg, chunk.begin, chunk.end);
+	// Last touch of the job: its owner may return as soon as this lands.
+	chunk.job -> remaining.fetch_sub(1, memory_order_release);
+}
+
+void* PoolWorkerThread(void* args_p)
+{
+	PoolWorker* worker = (PoolWorker*) args_p;
+	WorkPool* pool = worker -> pool;
+	PoolChunk chunk;
+	while (true) {
+		if (PoolTake(pool, worker -> index, chunk)) {
+			PoolRunChunk(chunk);
+			continue;
+		}
+		pthread_mutex_lock(&pool -> idleLock);
+		while (pool -> queued.load(memory_order_acquire) == 0) {
+			pthread_cond_wait(&pool -> idleCond, &pool -> idleLock);
+		}
+		pthread_mutex_unlock(&pool -> idleLock);
+	}
+	return NULL;
+}
+
+int WorkPoolInit(WorkPool* pool, int threadCount)
+{
+	// Zero threads is allowed; every job then runs on its caller.
+	pool -> queued.store(0, memory_order_relaxed);
+	pool -> nextWorker.store(0, memory_order_relaxed);
+	pool -> steals.store(0, memory_order_relaxed);
+	pthread_mutex_init(&pool -> idleLock, NULL);
+	pthread_cond_init(&pool -> idleCond, NULL);
+	for (int i = 0; i < threadCount; i++) {
+		PoolWorker* worker = new PoolWorker;
+		pthread_mutex_init(&worker -> lock, NULL);
+		worker -> pool = pool;
+		worker -> index = i;
+		pool -> workers.push_back(worker);
+	}
+	for (int i = 0; i < threadCount; i++) {
+		if (pthread_create(&pool -> workers[i] -> tid, NULL, PoolWorkerThread, pool -> workers[i]) != 0) {
+			cerr << "Failed to create pool worker." << endl;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void WorkPoolRun(WorkPool* pool, size_t count, size_t chunkSize, ChunkFunction run, void* arg)
+{
+	// Runs run over [0, count) in chunks of chunkSize and returns once all
+	// of them are done. Chunks may run on the caller, so they must not wait
+	// on anything the caller holds.
+	if (pool -> workers.empty() || count <= chunkSize) {
+		run(arg, 0, count);
+		return;
+	}
+	PoolJob job;
+	job.run = run;
+	job.arg = arg;
+	size_t chunkCount = (count + chunkSize - 1) / chunkSize;
+	job.remaining.store(chunkCount, memory_order_relaxed);
+
+	int workerCount = pool -> workers.size();
+	unsigned start = pool -> nextWorker.fetch_add(1, memory_order_relaxed);
+	for (size_t i = 0; i < chunkCount; i++) {
+		PoolChunk chunk;
+		chunk.job = &job;
+		chunk.begin = i * chunkSize;
+		chunk.end = min(count, chunk.begin + chunkSize);
+		PoolWorker* worker = pool -> workers[(start + i) % workerCount];
+		pthread_mutex_lock(&worker -> lock);
+		worker -> chunks.push_back(chunk);
+		pthread_mutex_unlock(&worker -> lock);
+	}
+	pthread_mutex_lock(&pool -> idleLock);
+	pool -> queued.fetch_add(chunkCount, memory_order_release);
+	pthread_cond_broadcast(&pool -> idleCond);
+	pthread_mutex_unlock(&pool -> idleLock);
+
+	// Help rather than wait; once nothing is left to take, the last
+	// chunks are already running somewhere.
+	PoolChunk chunk;
+	while (job.remaining.load(memory_order_acquire) > 0) {
+		if (PoolTake(pool, -1, chunk)) {
+			PoolRunChunk(chunk);
+		} else {
+			sched_yield();
+		}
+	}
+}
+
+}
+#endif // _RESCPOOL_H_
@@ -0,0 +1,100 @@
+// AUTHOR: Ray Powers
+// DATE: October 18, 2026
+// FILE: rescRegistry.h
+
+// DESCRIPTION: Name-keyed tables for the RESC server, split into shards by
+//				a hash of the name. Each shard has its own lock, so logins,
+//				logouts and lookups for different users only meet when their
+//				names land in the same shard. Also the dense member sets that
+//				rooms fan out over.
+
+#ifndef _RESCREGISTRY_H_
+#define _RESCREGISTRY_H_
+
+// Standard Library
+#include<string>
+#include<string_view>
+#include<vector>
+#include<unordered_map>
+#include<functional>
+
+// Multithreading
+#include<pthread.h>
+
+using namespace std;
+
+namespace RESC {
+
+// Power of two so picking a shard is a mask.
+const size_t REGISTRY_SHARDS = 64;
+
+// One lock and its part of the table. Aligned so two shards never share a
+// cache line and taking one lock does not slow down its neighbour.
+template<typename T>
+struct alignas(64) RegistryShard {
+	pthread_mutex_t lock;
+	unordered_map<string, T> entries;
+};
+
+template<typename T>
+struct Registry {
+	RegistryShard<T> shards[REGISTRY_SHARDS];
+};
+
+template<typename T>
+int RegistryInit(Registry<T>* registry)
+{
+	int status = 0;
+	for (size_t i = 0; i < REGISTRY_SHARDS; i++) {
+		status |= pthread_mutex_init(&registry -> shards[i].lock, NULL);
+	}
+	return status;
+}
+
+template<typename T>
+RegistryShard<T>* RegistryShardFor(Registry<T>* registry, string_view name)
+{
+	// Callers hold the shard's lock for as long as they use its entries.
+	size_t hash = std::hash<string_view>()(name);
+	return &registry -> shards[hash & (REGISTRY_SHARDS - 1)];
+}
+
+// Members packed into a vector so a fan-out is a straight walk over it;
+// slots maps each member back to its index so leaving is a swap with the
+// last one. No lock of its own.
+template<typename T>
+struct MemberSet {
+	vector<T> members;
+	unordered_map<T, size_t> slots;
+};
+
+template<typename T>
+bool MemberSetAdd(MemberSet<T>* set, T member)
+{
+	// Returns false if member was already in.
+	if (!set -> slots.emplace(member, set -> members.size()).second) {
+		return false;
+	}
+	set -> members.push_back(member);
+	return true;
+}
+
+template<typename T>
+bool MemberSetRemove(MemberSet<T>* set, T member)
+{
+	// Returns false if member wasn't in. Moves the last member into the gap.
+	typename unordered_map<T, size_t>::iterator slotIter = set -> slots.find(member);
+	if (slotIter == set -> slots.end()) {
+		return false;
+	}
+	size_t slot = (*slotIter).second;
+	T last = set -> members.back();
+	set -> members[slot] = last;
+	set -> slots[last] = slot;
+	set -> members.pop_back();
+	set -> slots.erase(member);
+	return true;
+}
+
+}
+#endif // _RESCREGISTRY_H_
@@ -5,6 +5,11 @@
 // DESCRIPTION: RESCServer will be v2 of the rescTracker. This v2 will improve throughput
 // 				with a low latency design with SOA. 
 
+// epoll, eventfd, sendfile and io_uring, in every mode.
+#ifndef __linux__
+#error "Builds on Linux only; see Dependencies in README.md."
+#endif
+
 // Standard Library
 #include<iostream>
 #include<sstream>
@@ -12,24 +17,44 @@
 #include<ctime>
 #include<cstdlib>
 #include<queue>
+#include<vector>
 #include<unordered_map>
+#include<unordered_set>
+#include<algorithm>
+#include<fstream>
+#include<atomic>
 
 // Network Functions
 #include<sys/types.h>
 #include<sys/socket.h>
+#include<netinet/tcp.h>
 #include<sys/select.h>
 #include<sys/time.h>
 #include<netinet/in.h>
 #include<arpa/inet.h>
 #include<unistd.h>
 #include<netdb.h>
+#include<fcntl.h>
+#include<getopt.h>
+#include<sys/epoll.h>
+#include<sys/eventfd.h>
+#include<poll.h>
+#include<sched.h>
 #include<csignal>
+#include<cerrno>
+#include<sys/random.h>
 
 // Multithreading
 #include<pthread.h>
 
 // RESC Framework
 #include "rescFramework.h"
+#include "rescMailbox.h"
+#include "rescRegistry.h"
+#include "rescUring.h"
+#include "rescPool.h"
+#include "rescLog.h"
+#include "rescHistory.h"
 
 using namespace std;
 
@@ -38,15 +63,329 @@ struct threadArgs {
   int requestSocket;
 };
 
+enum ServerMode {
+	THREAD_MODE = 0,
+	REACTOR_MODE,
+	URING_MODE		// Reactors on io_uring, falling back to epoll.
+};
+
+struct Reactor;
+struct MsgQueue;
+struct Session;
+
+// What the client settled on at login.
+struct SessionOptions {
+	uint8_t version;	// Framing for the rest of the connection.
+	bool wantsDelta;	// Presence as deltas rather than userlists.
+	bool canSlice;		// Large messages may arrive in slices.
+	bool canTransfer;	// Speaks the file transfer commands.
+	bool canResume;		// May come back as token within the grace period.
+	string token;
+	// The session this login takes over, claimed for it, and the first
+	// frame the client is missing.
+	Session* session;
+	uint64_t resumeSeq;
+};
+
+enum ConnState {
+	CONN_AUTH = 0,
+	CONN_CHAT,
+	CONN_RESUMING,	// Taking over a session; waiting for its last send.
+	CONN_MOVING,	// Taking over a session another reactor has.
+	CONN_CLOSED
+};
+
+// One sendmsg handed to io_uring. The kernel reads all of it after the
+// submit returns, so it lives until the completion comes back.
+struct UringSend {
+	struct msghdr msgHeader;
+	char headers[RESC::FLUSH_BATCH][RESC::FRAME_HEADER_SIZE];
+	struct iovec iov[RESC::FLUSH_BATCH * RESC::FRAME_PARTS];
+	vector<char> fileBytes;	// File part of a frame; there is no sendfile op to use.
+};
+
+// What an io_uring completion is for, kept in the low bits of its
+// user_data next to the Connection or Reactor pointer.
+enum UringOp {
+	URING_ACCEPT = 0,
+	URING_WAKE,
+	URING_RECV,
+	URING_SEND,
+	URING_CANCEL
+};
+const uint64_t URING_OP_MASK = 7;
+
+struct Connection {
+	uint64_t id;		// Never reused, unlike the pointer.
+	int sock;
+	ConnState state;
+	RESC::User user;
+	RESC::FrameReader reader;
+	RESC::OutQueue out;
+	Reactor* reactor;
+	MsgQueue* queue;
+	bool hasPendingFlush;	// Already due a flush this inbound pass.
+	// io_uring only: requests that still point at us, and the send in
+	// flight. A closed connection is freed once both are done.
+	int pendingOps;
+	UringSend* send;
+	// Set when the client can resume. A parked connection has lost its
+	// socket but goes on taking deliveries for whoever resumes it.
+	Session* session;
+	bool isParked;
+	bool canPark;		// Cleared by /quit and by overflowing.
+	Session* resuming;	// Claimed at login, not ours yet.
+};
+
+// One event loop per core. Each has its own listening socket, bound with
+// SO_REUSEPORT so the kernel spreads new connections, and only ever touches
+// its own connections. Other threads reach them through the inbound queue.
+struct Reactor {
+	int index;
+	int listenSock;
+	int epollSock;
+	int wakeSock;
+	pthread_t tid;
+	unordered_map<uint64_t, Connection*> connections;
+	// Payloads for our connections from any thread, lock free. Pushing
+	// the first one since the last drain signals wakeSock.
+	RESC::Mailbox inbound;
+	// Closed during the current batch. Later events in the same batch may
+	// still point at them, so they are freed once it is done, or once
+	// io_uring has finished with them.
+	vector<Connection*> closed;
+	// Set when this reactor runs on io_uring rather than epoll.
+	RESC::Uring* ring;
+	vector<UringSend*> spareSends;
+	// Whether the multishot accept and wakeup poll are still in the ring.
+	bool isAcceptArmed;
+	bool isWakeArmed;
+	// Our connections in each room that has any of them.
+	unordered_map<string, RESC::MemberSet<Connection*>> rooms;
+};
+
+struct MsgQueue {
+	// Thread mode: the user's own mailbox and the eventfd their thread
+	// polls. Reactor mode: where the user's connection lives.
+	RESC::Mailbox mailbox;
+	int wakeSock;
+	Reactor* reactor;
+	uint64_t connId;
+	bool wantsDelta;
+	bool canTransfer;
+	vector<string> rooms;	// Joined, so logging out can leave them all.
+	// Last history seq replayed at login, and at joining each of rooms;
+	// live copies of those messages are skipped.
+	uint64_t historyFloor;
+	vector<uint64_t> roomFloors;
+};
+
+enum SessionState {
+	SESSION_ATTACHED = 0,
+	SESSION_PARKED,		// Lost its connection; waiting out the grace period.
+	SESSION_EXPIRED		// Out of SESSIONS and being logged out.
+};
+
+// A login that can be picked up again by token. While it is parked the
+// user stays online and everything for them keeps queueing: in out here
+// for a thread-mode user, on the parked Connection for a reactor user. A
+// claim gives one login the sole right to take it over.
+struct Session {
+	string token;
+	string username;
+	SessionState state;
+	bool isClaimed;
+	MsgQueue* queue;
+	int sock;		// The connection's socket, so a claim can cut it off; -1 when parked.
+	long parkedAt;
+	// Thread mode.
+	int wakeSock;	// Stays open while parked: room posts may still signal it.
+	RESC::OutQueue out;
+	// Reactor mode: where the Connection holding the session lives. The id
+	// stays the same across resumes.
+	Reactor* reactor;
+	uint64_t connId;
+	// Handed over by the login taking it over.
+	int resumeSock;
+	string resumeBytes;		// Whatever followed the login in its reader.
+	uint64_t resumeSeq;
+	string authResponse;
+	Connection* adopter;	// Waiting on this reactor for the last send to finish.
+};
+
+// Who is in a room. Thread mode: the members' queues. Reactor mode: how
+// many members each reactor has; each reactor keeps its own member set.
+struct Room {
+	RESC::MemberSet<MsgQueue*> members;
+	vector<int> reactorMembers;
+	int memberCount;
+	RESC::HistoryRing* history;	// Made with the room's first message.
+};
+
+// One thread-mode fan-out as handed to the pool: either a walk over
+// MSG_QUEUE shards or over a room's members.
+struct FanoutJob {
+	RESC::Payload* payload;
+	MsgQueue* sender;
+	vector<MsgQueue*>* members;
+	atomic<long> delivered;
+};
+
+// A file on its way from one user to another. It is spooled to an unlinked
+// temp file, so the two never have to be online together and either one
+// can drop and carry on from where it got to.
+struct Transfer {
+	string sender;
+	string receiver;
+	string id;
+	string name;
+	uint64_t size;
+	uint64_t received;	// Spooled so far, always from the start.
+	RESC::FileSource* spool;
+};
+
+// Fan-out timings for one range of recipient counts.
+struct FanoutBucket {
+	atomic<long> count;
+	atomic<long> totalNs;
+	atomic<long> maxNs;
+};
+
+// A link to another node of the cluster, from either end. Frames go both
+// ways in v2, read and written by one thread per link, much as a
+// thread-mode user's are.
+struct Peer {
+	string node;		// The other end's name, from the handshake.
+	bool isTree;		// A relay tree edge rather than a cluster link.
+	int sock;
+	int wakeSock;
+	RESC::Mailbox mailbox;	// Payloads to forward; posted to under PeerLock.
+	vector<string> advertised;	// Users gossiped down it, sorted; under PublishLock.
+	unsigned long advertisedVersion;
+};
+
+// What a peer thread links over: a -P or -u address it dials, and dials
+// again whenever the link drops, or a socket the other node dialled.
+struct PeerAddress {
+	string host;		// Empty for a link we accepted.
+	unsigned short port;
+	int sock;
+	bool isUpstream;	// Our -u relay upstream.
+};
+
 // Globals
-int MAXPENDING = 20;
+int MAXPENDING = SOMAXCONN;
+const int MAX_EVENTS = 256;
 int conn_socket;
-unordered_map<string, deque<RESC::Message> > MSG_QUEUE;
-pthread_mutex_t MsgQueueLock;
-int msgQueueStatus = pthread_mutex_init(&MsgQueueLock, NULL);
-unordered_map<string, RESC::User> USER_LIST;
-pthread_mutex_t UserListLock;
-int usgListStatus = pthread_mutex_init(&UserListLock, NULL);
+unsigned short SERVER_PORT;
+ServerMode SERVER_MODE = REACTOR_MODE;
+int REACTOR_COUNT = 0;
+vector<Reactor*> REACTORS;
+atomic<uint64_t> NEXT_CONNECTION_ID(1);
+// Shard locks in MSG_QUEUE only guard the name -> mailbox map. Posting into
+// a mailbox needs its shard locked; draining one never takes it.
+RESC::Registry<MsgQueue*> MSG_QUEUE;
+int msgQueueStatus = RESC::RegistryInit(&MSG_QUEUE);
+RESC::Registry<RESC::User> USER_LIST;
+int usgListStatus = RESC::RegistryInit(&USER_LIST);
+// Holding a room's shard lock keeps every member queue in it alive.
+RESC::Registry<Room> ROOMS;
+int roomsStatus = RESC::RegistryInit(&ROOMS);
+// Transfers by "<id>/<sender>"; ids can't hold a '/'. Spools live in
+// SPOOL_DIR until the receiver is done with them.
+RESC::Registry<Transfer*> TRANSFERS;
+int transfersStatus = RESC::RegistryInit(&TRANSFERS);
+atomic<long> OPEN_TRANSFERS(0);
+string SPOOL_DIR = "/tmp";
+// Direct messages for users who aren't logged in wait here and go out at
+// their next login. Only names that have logged in since startup, or still
+// have messages waiting, get them; anything else is dropped as before.
+// Unless -l says otherwise the log lives in SPOOL_DIR, one per port.
+RESC::MessageLog OFFLINE_LOG;
+string OFFLINE_DIR;
+bool isOfflineLogOpen = false;
+// The last HISTORY_SIZE messages to /all, and to each room, are replayed
+// at login and at joining the room.
+int HISTORY_SIZE = 50;
+RESC::HistoryRing* ALL_HISTORY = NULL;
+// Logins and logouts only mark presence dirty; the presence thread sends
+// one userlist per window however many changes landed in it.
+int PRESENCE_WINDOW_MS = 50;
+bool isPresenceDirty = false;
+long PRESENCE_CHANGES = 0;		// Logins and logouts seen.
+long PRESENCE_SNAPSHOTS = 0;	// Userlists actually sent.
+pthread_mutex_t PresenceLock;
+int presenceStatus = pthread_mutex_init(&PresenceLock, NULL);
+pthread_cond_t PresenceCond;
+int presenceCondStatus = pthread_cond_init(&PresenceCond, NULL);
+// Online users as of the last delta, sorted, and that delta's number.
+// PublishLock also covers opening a delta queue, so a login snapshot and
+// the deltas after it never overlap or leave a hole.
+vector<string> PUBLISHED_USERS;
+unsigned long PRESENCE_VERSION = 0;
+pthread_mutex_t PublishLock;
+int publishStatus = pthread_mutex_init(&PublishLock, NULL);
+// Thread mode: fan-outs to more than FANOUT_THRESHOLD recipients are cut
+// into chunks for the work-stealing pool; smaller ones stay on the sender.
+int FANOUT_THRESHOLD = 1024;
+int FANOUT_WORKERS = -1;		// Defaults to one less than the cores; the sender helps.
+const size_t FANOUT_CHUNK = 256;	// Room members per chunk.
+const size_t FANOUT_SHARD_CHUNK = 4;	// MSG_QUEUE shards per chunk.
+RESC::WorkPool FANOUT_POOL;
+atomic<long> OPEN_QUEUES(0);
+// Fan-out timings by recipient count, bucket i holding [2^i, 2^(i+1)).
+// Reactors time their own share of each fan-out.
+const int FANOUT_BUCKETS = 24;
+const int FANOUT_REPORT_SECONDS = 10;
+FanoutBucket FANOUT_STATS[FANOUT_BUCKETS];
+// What one connection may have queued before the overflow policy kicks in.
+// Room for the largest frame plus change; payloads are shared, so this is
+// what the user holds on to rather than what they cost alone.
+RESC::OutQueueLimits OUT_LIMITS = {2 * RESC::MAX_FRAME_SIZE, 65536, RESC::OVERFLOW_DROP_BULK};
+const char* POLICY_NAMES[3] = {"oldest", "bulk", "disconnect"};
+atomic<long> DROPPED_FRAMES(0);
+atomic<long> DROPPED_BYTES(0);
+atomic<long> SLOW_KICKS(0);
+// Sessions by token. One that loses its connection is kept for
+// RESUME_GRACE_SECONDS, with the last RESUME_WINDOW frames sent on it.
+RESC::Registry<Session*> SESSIONS;
+int sessionsStatus = RESC::RegistryInit(&SESSIONS);
+int RESUME_GRACE_SECONDS = 30;
+const size_t RESUME_WINDOW = 1024;
+const int RESUME_WAIT_MS = 5000;	// For the old connection's thread to let go.
+atomic<long> RESUMED_SESSIONS(0);
+// Cluster mode. Each node gossips its users' logins and logouts down its
+// links, once per presence window, and LOCATIONS holds the link each
+// remote user is reached by, or "" once they have logged out. A /msg for a
+// remote user goes down that one link. /all and room messages go down
+// every link once; what comes over a cluster link goes no further, so
+// every pair of cluster nodes needs a link of its own. Relay tree edges
+// are the exception: a relay (-u) and its upstream pass on whatever comes
+// over one to every other link, and tell each link about every user that
+// is reached through the rest.
+string NODE_NAME;
+unsigned short CLUSTER_PORT = 0;
+vector<PeerAddress> PEER_ADDRESSES;
+vector<Peer*> PEERS;	// Links whose handshake is done; one per node.
+pthread_mutex_t PeerLock;
+int peerStatus = pthread_mutex_init(&PeerLock, NULL);
+RESC::Registry<string> LOCATIONS;
+int locationsStatus = RESC::RegistryInit(&LOCATIONS);
+// Our own users as of the last presence update, sorted; under
+// PublishLock, like PUBLISHED_USERS.
+vector<string> LOCAL_USERS;
+const string PEER_HELLO = "peer ";
+const string RELAY_HELLO = "relay ";	// From a relay to its upstream.
+// Every hello carries it; a node that doesn't know it is no node of ours.
+string CLUSTER_KEY_FILE;
+string CLUSTER_KEY;
+const int PEER_RETRY_SECONDS = 30;	// Longest wait between dials.
+atomic<long> FORWARDED_FRAMES(0);
+atomic<long> PEER_FRAMES(0);		// Received from other nodes.
+// Unsent bytes a connection's socket may hold. What the kernel holds goes
+// out in the order it was written, so the less it holds, the sooner a chat
+// message can get past a filestream.
+const int NOTSENT_LOWAT = 16 * 1024;
 
 // Function Prototypes
 void* requestThread(void* args_p);
@@ -60,214 +399,3099 @@ void ProcessRequest(int requestSock);
 // post: none
 
 void UpdateUserLists();
-// Function sends all users an updated userlist
+// Function sends legacy users an updated userlist and delta users what
+// changed since the last window.
+// pre: none
+// post: none
+
+RESC::Payload* CreatePresenceSnapshot();
+// Function encodes every published user at the current presence version.
+// pre: PublishLock should be held
+// post: caller owns the returned reference
+
+void SendPresenceSnapshot(const string &username);
+// Function answers a client's request for a fresh presence snapshot.
+// pre: none
+// post: none
+
+void SchedulePresenceUpdate();
+// Function records a login or logout for the next presence window.
+// pre: none
+// post: a userlist goes out within PRESENCE_WINDOW_MS
+
+void* PresenceThread(void* args_p);
+// Function sends one coalesced userlist per window while presence is dirty.
+// pre: none
+// post: none
+
+bool ProcessFrame(RESC::MessageView msg, const string &fromUser, MsgQueue* queue);
+// Function handles one frame from a logged in user, text or typed.
+// pre: queue should be the user's open queue
+// post: returns false once the user has asked to quit
+
+void ProcessMessage(RESC::MessageView msg, const string &fromUser, MsgQueue* queue);
+// Function routes a parsed message to its recipients' mailboxes.
+// pre: msg.from should be the sending user
+// post: none
+
+void ProcessTransfer(RESC::MessageView msg, const string &fromUser, MsgQueue* queue);
+// Function handles the file transfer commands and chunks.
+// pre: msg.cmd is one of FILE_PUT_MSG, FILE_GET_MSG, FILE_DONE_MSG or FILE_CHUNK_MSG
+// post: replies and chunks are posted to queue
+
+void StartTransfer(RESC::MessageView msg, const string &fromUser, MsgQueue* queue);
+// Function opens a transfer, or finds the one being resumed, and acks how
+// much of it is spooled.
+// pre: none
+// post: a new transfer has an empty spool
+
+void SpoolChunk(RESC::MessageView msg, const string &fromUser, MsgQueue* queue);
+// Function appends a chunk to its transfer's spool and acks it; the last
+// one offers the file to the receiver.
+// pre: none
+// post: chunks that don't start where the spool ends are ignored
+
+void SendTransferWindow(RESC::MessageView msg, const string &fromUser, MsgQueue* queue);
+// Function queues up to FILE_WINDOW_BYTES of a spooled file for its
+// receiver, as chunks sent from the spool file.
 // pre: none
 // post: none
 
-void ProcessMessage(string rawMsg, string fromUser);
-// Function processess incoming messages.
+void FinishTransfer(RESC::MessageView msg, const string &fromUser);
+// Function forgets a transfer its receiver has all of.
+// pre: none
+// post: the spool goes once the last chunk sent from it has
+
+void OfferTransfers(const string &username, MsgQueue* queue);
+// Function offers a user who just logged in every spooled file for them.
+// pre: queue is username's and open
+// post: none
+
+RESC::FileSource* CreateSpool();
+// Function opens an unlinked temp file in SPOOL_DIR.
+// pre: none
+// post: returns NULL on failure
+
+RESC::Payload* CreateTransferPayload(RESC::MsgType cmd, const string &name, const string &text);
+// Function builds a /fileack (name is the receiver) or /fileoffer (name is
+// the sender).
+// pre: none
+// post: caller owns the reference
+
+bool JoinRoom(MsgQueue* queue, const string &room);
+// Function adds the user to a room, creating it if need be.
+// pre: called by the thread that drains queue
+// post: returns false if the user was already in it
+
+bool LeaveRoom(MsgQueue* queue, const string &room);
+// Function takes the user out of a room, dropping the room once it is empty.
+// pre: called by the thread that drains queue
+// post: returns false if the user wasn't in it
+
+uint64_t RoomHistoryFloor(MsgQueue* queue, const string &room);
+// Function returns the last seq of room's history replayed to the user.
 // pre: none
 // post: none
 
+bool IsRoomMember(MsgQueue* queue, const string &room);
+// Function checks whether the user has joined room.
+// pre: called by the thread that drains queue
+// post: none
+
+void ReplayHistory(RESC::HistoryRing* ring, uint64_t upTo, MsgQueue* queue);
+// Function queues a ring's messages up to upTo for the user, oldest first.
+// pre: reactor users: called from their reactor
+// post: none
+
+void PostToRoom(RESC::Payload* payload, MsgQueue* sender);
+// Function delivers a room message to every member but the sender, or to
+// each reactor that has members.
+// pre: payload->to should be the room
+// post: none
+
+long DeliverToRoom(Reactor* reactor, RESC::Payload* payload, vector<Connection*> &pending);
+// Function queues a room message on the reactor's own members of the room.
+// pre: called on the reactor's own thread
+// post: returns how many members it was queued for
+
 void ProcessSignal(int sig);
 // Function interprets signal interrupts so we can handle safe closure of threads.
 // pre: none
 // post: none
 
-bool ValidateUser(string request, RESC::User &user);
-// Function checks user request for proper credentials
-// pre: none
-// post: none
+bool ValidateUser(string_view request, RESC::User &user);
+// Function checks user request for proper credentials
+// pre: none
+// post: none
+
+bool Authenticate(string_view request, RESC::User &user, SessionOptions &options, string &authResponse);
+// Function validates a login request and settles the framing and presence
+// style for the rest of the connection from the capabilities offered.
+// pre: none
+// post: authResponse holds the reply to send in v1 framing
+
+MsgQueue* OpenQueue(string username, int wakeSock, Connection* conn, const SessionOptions &options);
+// Function creates the user's mailbox and publishes it for routing.
+// pre: user should have been validated; reactor connections should call
+//      this from their own reactor
+// post: returned handle stays valid until CloseQueue; delta users start
+//       with a presence snapshot queued
+
+void CloseQueue(string username, MsgQueue* queue);
+// Function takes the user out of their rooms, then unpublishes and frees
+// the user's mailbox.
+// pre: called by the thread that drains queue
+// post: queue is deleted
+
+void StoreOffline(RESC::Payload* payload);
+// Function keeps a direct message for a recipient who isn't logged in in
+// OFFLINE_LOG, if they are someone it keeps messages for.
+// pre: the recipient's MSG_QUEUE shard should be locked, with no queue
+//      published under their name
+// post: none
+
+void ConfirmStored(RESC::OutQueue* out);
+// Function records in OFFLINE_LOG that the stored messages out has written
+// whole were delivered, so they are not drained again.
+// pre: called by the thread that owns out
+// post: out->logged is empty
+
+void DeliverOrStore(RESC::Payload* payload);
+// Function posts a direct message that its first queue never took to
+// whoever is logged in under the recipient's name now, or stores it.
+// pre: none
+// post: none
+
+bool IsKnownUser(const string &username);
+// Function checks whether username has logged in since startup, here or
+// on another node of the cluster.
+// pre: none
+// post: none
+
+void PostPayload(MsgQueue* queue, RESC::Payload* payload);
+// Function hands a payload to the user's mailbox, or to the inbound queue
+// of the reactor that owns them, and wakes whoever drains it.
+// pre: the queue's MSG_QUEUE shard should be locked
+// post: the mailbox or inbound queue holds its own reference to payload
+
+bool QueueForSend(RESC::OutQueue* out, RESC::Payload* payload, const string &username);
+// Function queues a payload on a connection within OUT_LIMITS, dropping
+// or refusing per the overflow policy, and logs whatever that cost.
+// pre: called by the thread that owns out; takes over a reference
+// post: returns false when the user should be disconnected
+
+void PostToReactor(Reactor* reactor, uint64_t target, RESC::Payload* payload);
+// Function queues a payload for one of the reactor's connections, or for
+// all of them when target is 0.
+// pre: none
+// post: the inbound queue holds its own reference to payload
+
+void BroadcastPayload(RESC::Payload* payload);
+// Function delivers a payload to every user it is meant for.
+// pre: none
+// post: none
+
+void BroadcastShards(void* args_p, size_t begin, size_t end);
+// Function posts a thread-mode broadcast to every user in MSG_QUEUE shards
+// [begin, end); a pool chunk.
+// pre: args_p should be a FanoutJob
+// post: none
+
+void PostToMembers(void* args_p, size_t begin, size_t end);
+// Function posts a thread-mode room message to members [begin, end); a
+// pool chunk.
+// pre: args_p should be a FanoutJob; the room's shard lock should be held
+// post: none
+
+long NowNs();
+// Function returns a monotonic timestamp in nanoseconds.
+// pre: none
+// post: none
+
+void RecordFanout(long recipients, long elapsedNs);
+// Function adds one fan-out to the timings for its recipient count.
+// pre: none
+// post: none
+
+void ReportFanout();
+// Function logs fan-out timings for each recipient count seen so far.
+// pre: none
+// post: none
+
+void* FanoutReportThread(void* args_p);
+// Function logs fan-out timings every FANOUT_REPORT_SECONDS while there
+// are new ones.
+// pre: none
+// post: none
+
+bool IsBroadcastFor(RESC::Payload* payload, const string &username, MsgQueue* queue);
+// Function decides whether a broadcast reaches a user: chat skips its
+// sender and anything already replayed to them from history, presence
+// goes out in the style the user asked for.
+// pre: none
+// post: none
+
+void DisconnectUser(RESC::User &user, MsgQueue* queue);
+// Function drops the user's queue, marks them offline and announces it.
+// pre: user should have been validated
+// post: user.isConnected is false, queue is deleted
+
+string CreateSessionToken();
+// Function makes a random 128-bit session token, in hex.
+// pre: none
+// post: returns an empty string if there was no randomness to be had
+
+Session* OpenSession(const SessionOptions &options, const string &username, MsgQueue* queue, int sock,
+	int wakeSock, Connection* conn);
+// Function registers a fresh login's session under options.token.
+// pre: options.canResume; conn is the reactor connection, NULL in thread mode
+// post: the session is attached to sock
+
+Session* ClaimSession(const string &token, const string &username);
+// Function claims username's session for a login offering its token and
+// cuts off whatever connection it still has, which has most likely died
+// without our noticing.
+// pre: none
+// post: returns NULL if there is no such session or it is already claimed
+
+void ReleaseClaim(Session* session);
+// Function gives up a claim whose login went away before taking over.
+// pre: session claimed by the caller
+// post: session may be claimed again or expire
+
+bool ParkSession(Session* session, bool canPark, RESC::OutQueue* out);
+// Function keeps a session whose connection has gone for the grace period,
+// along with the thread-mode output queue out, or ends it. A claimed
+// session is always kept for its claimant.
+// pre: called by the owner of the connection before closing its socket;
+//      out is NULL for a reactor connection
+// post: returns false when the session has ended: it is out of SESSIONS
+//       and the caller logs the user out and deletes it
+
+bool ResumeThreadSession(Session* session, int requestSock, RESC::OutQueue &out);
+// Function waits for the old connection's thread to park a claimed
+// session, then takes it over.
+// pre: session claimed by the caller; out should be empty
+// post: out holds the session's output queue; false, with the claim
+//       released, if the old thread never let go
+
+void ExpireSession(Session* session);
+// Function logs out a thread-mode session that nobody resumed in time.
+// pre: session is SESSION_EXPIRED
+// post: session is deleted
+
+void StoreUnsent(RESC::OutQueue* out);
+// Function passes direct messages still waiting in out to DeliverOrStore,
+// so an expired session loses none the offline log would have kept.
+// pre: the user's queue should be unpublished
+// post: out is unchanged
+
+void* SessionThread(void* args_p);
+// Function expires sessions parked past the grace period, once a second,
+// and keeps parked thread-mode mailboxes within OUT_LIMITS meanwhile.
+// pre: none
+// post: none
+
+void PostSessionEvent(Reactor* reactor, uint64_t connId);
+// Function tells a reactor that the session on one of its connections
+// has been handed a socket or has expired: a node with no payload.
+// pre: none
+// post: none
+
+bool ReadClusterKey();
+// Function reads CLUSTER_KEY from the first line of CLUSTER_KEY_FILE.
+// pre: none
+// post: returns false if there is no such file or the line is empty
+
+bool IsClusterKey(string_view key);
+// Function compares key with CLUSTER_KEY, in time that doesn't tell how
+// much of it matched.
+// pre: none
+// post: none
+
+void StartCluster();
+// Function listens for links from other nodes on CLUSTER_PORT and starts
+// dialling every -P address and the -u upstream.
+// pre: NODE_NAME should be set
+// post: exits if the cluster port can't be bound
+
+void* ClusterListenThread(void* args_p);
+// Function accepts links from other nodes, each on a peer thread of its own.
+// pre: args_p should be the listening socket
+// post: none
+
+void* PeerThread(void* args_p);
+// Function serves one link, or dials one -P or -u address for as long as
+// we run.
+// pre: args_p should be a PeerAddress
+// post: none
+
+int DialPeer(const PeerAddress* address);
+// Function connects to another node's cluster port.
+// pre: none
+// post: returns the socket, or -1 on failure
+
+bool ServePeer(int peerSock, bool isDialled, bool isUpstream);
+// Function trades node names and the cluster key with the other end, then
+// forwards what is posted to the link and handles what comes over it until
+// it drops. The link is a relay tree edge if either end dialled the other
+// with -u.
+// pre: peerSock should be connected and blocking
+// post: returns false if the handshake failed
+
+void RegisterPeer(Peer* peer, RESC::OutQueue* out);
+// Function makes the link the route to its node and queues a presence
+// snapshot of the users reached through us on it.
+// pre: out should be the link's empty output queue
+// post: a second link to the same node takes over from the first
+
+void UnregisterPeer(Peer* peer, RESC::OutQueue* out);
+// Function stops routing through the link and marks its node's users
+// offline, keeping direct messages it never sent for later.
+// pre: called by the link's own thread
+// post: nothing can be posted to peer any more
+
+void ProcessPeerFrame(Peer* peer, RESC::MessageView msg);
+// Function delivers a frame from another node to our own users, or
+// applies its presence gossip.
+// pre: called by the link's own thread
+// post: only a frame from or for a relay tree edge is forwarded again
+
+void ApplyGossip(const string &node, string_view body);
+// Function updates LOCATIONS from a node's "<version> full|delta" gossip.
+// pre: none
+// post: a presence update is scheduled
+
+void UpdateLocation(const string &username, const string &node, bool isOnline);
+// Function records a remote user logging in on node, or out of it, and
+// forwards direct messages kept here for them while they were away.
+// pre: none
+// post: a logout from a node the user has since left changes nothing
+
+void ForgetNode(const string &node);
+// Function marks every user on node offline.
+// pre: none
+// post: none
+
+bool IsReachedBy(const string &username, const string &node);
+// Function checks whether username is a user the link to node told us of.
+// pre: none
+// post: none
+
+bool ForwardToPeer(RESC::Payload* payload, Peer* from);
+// Function posts a message for a remote user to the link they are reached
+// by, unless it came over that link, or over a cluster link to go down
+// another one.
+// pre: from should be the link it came over, or NULL for our own users'
+// post: returns false if it was not posted
+
+bool PostToPeer(const string &node, RESC::Payload* payload, Peer* from);
+// Function posts a payload to the link to node, within the same limits.
+// pre: from should be as for ForwardToPeer
+// post: returns false if there is no such link or it was not posted
+
+void ForwardToPeers(RESC::Payload* payload, Peer* from);
+// Function posts a payload to every link but the one it came over, once
+// each; something from a cluster link only goes down relay tree edges.
+// pre: from should be as for ForwardToPeer
+// post: none
+
+bool IsForwarded(Peer* from, Peer* to);
+// Function decides whether what came over from may go down to.
+// pre: PeerLock should be held
+// post: none
+
+void GossipToPeers(const vector<pair<string, string> > &remote);
+// Function sends every link a delta of the users reached through us that
+// it hasn't been told about, or has and shouldn't have been.
+// pre: PublishLock should be held, and LOCAL_USERS up to date
+// post: none
+
+vector<string> AdvertisedTo(Peer* peer, const vector<pair<string, string> > &remote);
+// Function lists the users a link should know are reached through us:
+// our own, plus remote users unless only a cluster link leads to them or
+// they are reached by this very link.
+// pre: PublishLock and PeerLock should be held
+// post: the list is sorted
+
+void CollectLocations(vector<pair<string, string> > &remote);
+// Function lists every remote user with the node they are reached by.
+// pre: none
+// post: none
+
+void PostToLink(Peer* peer, RESC::Payload* payload);
+// Function hands a payload to a link's mailbox and wakes its thread.
+// pre: PeerLock should be held
+// post: the mailbox holds its own reference to payload
+
+string PresenceChanges(const vector<string> &before, const vector<string> &after);
+// Function lists who joined and left between two sorted user lists, as
+// "\n+name" and "\n-name" lines.
+// pre: both lists should be sorted
+// post: none
+
+void RunThreadMode();
+// Function accepts connections and hands each one to its own thread.
+// pre: conn_socket should be listening
+// post: none
+
+void RunReactorMode();
+// Function starts REACTOR_COUNT epoll or io_uring reactors and waits on them.
+// pre: conn_socket should be listening on SERVER_PORT
+// post: none
+
+int OpenListener(unsigned short port, bool isShared);
+// Function binds a listening socket, one that other reactors may share the
+// port with if isShared.
+// pre: none
+// post: returns -1 on failure
+
+void* ReactorThread(void* args_p);
+// Function is the event loop for a single reactor.
+// pre: none
+// post: none
+
+void RunEpollLoop(Reactor* reactor);
+// Function waits on the reactor's epoll instance and dispatches its events.
+// pre: listenSock and wakeSock should be registered with epollSock
+// post: returns only if epoll_wait fails
+
+bool StartUring(Reactor* reactor);
+// Function sets up an io_uring for the reactor and arms accept and wakeup.
+// pre: none
+// post: reactor->ring is set on success, NULL when epoll has to be used
+
+void RunUringLoop(Reactor* reactor);
+// Function submits queued requests and dispatches completions.
+// pre: StartUring should have succeeded
+// post: returns only if io_uring_enter fails
+
+void ArmReactor(Reactor* reactor);
+// Function arms accept and wakeup on the ring, whichever has ended.
+// pre: reactor->ring should be set
+// post: whichever got no SQE stays unarmed for the next call
+
+void HandleCompletion(Reactor* reactor, struct io_uring_cqe &cqe);
+// Function acts on one io_uring completion.
+// pre: called on the reactor's own thread
+// post: none
+
+void HandleRecvCompletion(Reactor* reactor, Connection* conn, struct io_uring_cqe &cqe);
+// Function feeds one provided buffer to the connection and re-arms recv if needed.
+// pre: conn should have a multishot recv outstanding
+// post: the buffer is back in the ring
+
+void HandleSendCompletion(Reactor* reactor, Connection* conn, struct io_uring_cqe &cqe);
+// Function advances the output queue past what the send wrote and sends the rest.
+// pre: conn->send should be the completed send
+// post: conn->send is NULL or the next send
+
+bool ArmRecv(Reactor* reactor, Connection* conn);
+// Function starts a multishot recv on the connection.
+// pre: reactor->ring should be set
+// post: returns false, with conn->state CONN_CLOSED, if no SQE could be had
+
+void UringFlushConnection(Connection* conn);
+// Function queues a sendmsg for the front of the output queue unless one is in flight.
+// pre: conn->reactor->ring should be set
+// post: conn->state is CONN_CLOSED if no SQE could be had
+
+Connection* CreateConnection(Reactor* reactor, int requestSock);
+// Function sets up a connection for an accepted socket and adds it to the reactor.
+// pre: none
+// post: none
+
+void FreeClosedConnections(Reactor* reactor);
+// Function frees closed connections nothing refers to any more.
+// pre: called between batches
+// post: connections with io_uring requests outstanding stay on the list
+
+void AcceptConnections(Reactor* reactor);
+// Function accepts every pending connection and registers it with the reactor.
+// pre: reactor->listenSock should be non-blocking
+// post: none
+
+void ReadConnection(Connection* conn);
+// Function reads all available bytes and handles every complete frame.
+// pre: conn->sock should be non-blocking
+// post: conn->state is CONN_CLOSED on EOF or error
+
+void HandleFrames(Connection* conn);
+// Function handles every complete frame in the connection's reader.
+// pre: none
+// post: conn->state is CONN_CLOSED on a bad frame
+
+void HandleFrame(Connection* conn, RESC::MessageView &msg);
+// Function advances the connection state machine by one inbound frame.
+// pre: none
+// post: none
+
+void DrainInbound(Reactor* reactor);
+// Function moves everything posted to the reactor into its connections'
+// output queues and flushes each of them once.
+// pre: called on the reactor's own thread
+// post: none
+
+void DeliverToConnection(Connection* conn, RESC::Payload* payload, vector<Connection*> &pending);
+// Function queues a payload on a connection and notes it for flushing.
+// pre: called on the connection's reactor
+// post: the output queue holds its own reference to payload
+
+void PinReactor(Reactor* reactor);
+// Function binds the calling reactor thread to one of the CPUs we may use.
+// pre: none
+// post: none
+
+void FlushConnection(Connection* conn);
+// Function writes as much of the output queue as the socket will take.
+// pre: conn->sock should be non-blocking
+// post: conn->state is CONN_CLOSED on error
+
+void CloseConnection(Reactor* reactor, Connection* conn);
+// Function unregisters and closes the connection, or parks it if it has a
+// session that can be resumed.
+// pre: none
+// post: conn is freed at the end of the reactor's current batch, or keeps
+//       taking deliveries without a socket until its session is resumed
+//       or expires
+
+void TakeOverSession(Connection* conn, Session* session);
+// Function starts a resuming login on the session it claimed: here if the
+// session's connection is on this reactor, otherwise by moving the socket
+// to that reactor once nothing here is reading it.
+// pre: conn is logging in and holds the claim
+// post: conn is CONN_CHAT, CONN_RESUMING or CONN_MOVING
+
+void AdoptSession(Reactor* reactor, Connection* conn, Session* session);
+// Function hands the session's parked connection over to conn: its id,
+// user, queue, rooms and output queue, the missed frames put back in front
+// behind the login reply.
+// pre: conn holds the claim; the session's connection is on reactor
+// post: conn is CONN_CHAT, or CONN_RESUMING until the old connection's
+//       send in flight completes
+
+void ServeAdopted(Reactor* reactor, Connection* conn);
+// Function handles whatever conn received while it waited to adopt its
+// session and starts sending the session's backlog.
+// pre: AdoptSession has been called on conn
+// post: none
+
+void MoveConnection(Reactor* reactor, Connection* conn);
+// Function passes a resuming login's socket, and anything read after the
+// login, to the reactor holding the session it claimed.
+// pre: conn is CONN_MOVING with nothing in flight
+// post: conn is closed without its socket
+
+void HandleSessionEvent(Reactor* reactor, uint64_t connId);
+// Function adopts a socket moved here for the session on connection
+// connId, or logs the session out if it expired.
+// pre: none
+// post: none
+
+bool SetNonBlocking(int sock);
+// Function puts a socket in non-blocking mode.
+// pre: none
+// post: none
+
+int main (int argc, char * argv[])
+{
+	// Process Arguments
+	unsigned short serverPort; 
+	int opt;
+	while ((opt = getopt(argc, argv, "m:t:p:f:w:b:q:o:s:l:H:r:c:P:N:u:K:")) != -1) {
+		switch (opt) {
+			case 'm':
+				if (string(optarg) == "threads") {
+					SERVER_MODE = THREAD_MODE;
+				} else if (string(optarg) == "epoll") {
+					SERVER_MODE = REACTOR_MODE;
+				} else if (string(optarg) == "uring") {
+					SERVER_MODE = URING_MODE;
+				} else {
+					cerr << "Unknown mode: " << optarg << ". Use threads, epoll or uring." << endl;
+					return -1;
+				}
+				break;
+			case 't':
+				REACTOR_COUNT = atoi(optarg);
+				break;
+			case 'p':
+				PRESENCE_WINDOW_MS = max(0, atoi(optarg));
+				break;
+			case 'f':
+				FANOUT_THRESHOLD = max(0, atoi(optarg));
+				break;
+			case 'w':
+				FANOUT_WORKERS = max(0, atoi(optarg));
+				break;
+			case 'b':
+				OUT_LIMITS.maxBytes = max(0L, atol(optarg));
+				break;
+			case 'q':
+				OUT_LIMITS.maxMessages = max(0L, atol(optarg));
+				break;
+			case 'o':
+				if (string(optarg) == "oldest") {
+					OUT_LIMITS.policy = RESC::OVERFLOW_DROP_OLDEST;
+				} else if (string(optarg) == "bulk") {
+					OUT_LIMITS.policy = RESC::OVERFLOW_DROP_BULK;
+				} else if (string(optarg) == "disconnect") {
+					OUT_LIMITS.policy = RESC::OVERFLOW_DISCONNECT;
+				} else {
+					cerr << "Unknown overflow policy: " << optarg << ". Use oldest, bulk or disconnect." << endl;
+					return -1;
+				}
+				break;
+			case 's':
+				SPOOL_DIR = optarg;
+				break;
+			case 'l':
+				OFFLINE_DIR = optarg;
+				break;
+			case 'H':
+				HISTORY_SIZE = max(0, atoi(optarg));
+				break;
+			case 'r':
+				RESUME_GRACE_SECONDS = max(0, atoi(optarg));
+				break;
+			case 'c':
+				CLUSTER_PORT = atoi(optarg);
+				break;
+			case 'P':
+			case 'u': {
+				string address(optarg);
+				size_t split = address.rfind(':');
+				if (split == string::npos || split == 0 || atoi(address.c_str() + split + 1) <= 0) {
+					cerr << "Peers are given as host:port, not " << optarg << "." << endl;
+					return -1;
+				}
+				PeerAddress peer;
+				peer.host = address.substr(0, split);
+				peer.port = atoi(address.c_str() + split + 1);
+				peer.sock = -1;
+				peer.isUpstream = (opt == 'u');
+				for (size_t i = 0; i < PEER_ADDRESSES.size() && peer.isUpstream; i++) {
+					if (PEER_ADDRESSES[i].isUpstream) {
+						// Two would make the tree a graph.
+						cerr << "A relay has one upstream." << endl;
+						return -1;
+					}
+				}
+				PEER_ADDRESSES.push_back(peer);
+				break;
+			}
+			case 'N':
+				NODE_NAME = optarg;
+				break;
+			case 'K':
+				CLUSTER_KEY_FILE = optarg;
+				break;
+			default:
+				cerr << "Usage: " << argv[0] << " <port number> [-m threads|epoll|uring] [-t reactor threads] [-p presence window ms] [-f fan-out threshold] [-w fan-out workers]"
+					<< " [-b max queued bytes] [-q max queued messages] [-o oldest|bulk|disconnect] [-s spool dir] [-l offline log dir|off] [-H history messages]"
+					<< " [-r resume grace seconds] [-c cluster port] [-P peer host:port]... [-N node name] [-u upstream host:port] [-K cluster key file]" << endl;
+				return -1;
+		}
+	}
+	if (argc - optind != 1){
+		// Incorrect number of arguments
+		cerr << "Incorrect number of arguments. Please try again." << endl;
+		return -1;
+	}
+	serverPort = atoi(argv[optind]); 
+	SERVER_PORT = serverPort;
+	if (OFFLINE_DIR.empty()) {
+		OFFLINE_DIR = SPOOL_DIR + "/rescOffline-" + to_string(SERVER_PORT);
+	}
+	if ((CLUSTER_PORT != 0 || !PEER_ADDRESSES.empty()) && !ReadClusterKey()) {
+		cerr << "Cluster links need a non-empty key, the first line of the -K file, the same on every node." << endl;
+		return -1;
+	}
+	if (NODE_NAME.find('\n') != string::npos) {
+		cerr << "Node names are one line." << endl;
+		return -1;
+	}
+	if (REACTOR_COUNT <= 0) {
+		REACTOR_COUNT = sysconf(_SC_NPROCESSORS_ONLN);
+		if (REACTOR_COUNT <= 0) REACTOR_COUNT = 1;
+	}
+	if (FANOUT_WORKERS < 0) {
+		FANOUT_WORKERS = max(0L, sysconf(_SC_NPROCESSORS_ONLN) - 1);
+	}
+	
+	// Create socket connection
+	conn_socket = OpenListener(serverPort, true);
+	if (conn_socket < 0) {
+		exit(-1);
+	}
+	
+	// We are good to go! Alert admin running that we can now accept requests
+	cout << endl << "RESCD: Ready to accept connections. " << endl;
+	cout << "RESCD: Up to " << OUT_LIMITS.maxBytes << " bytes and " << OUT_LIMITS.maxMessages
+		<< " messages queued per user (0 is unlimited), then drop " << POLICY_NAMES[OUT_LIMITS.policy] << "." << endl;
+	cout << "RESCD: File transfers spool in " << SPOOL_DIR << "." << endl;
+	if (HISTORY_SIZE > 0) {
+		ALL_HISTORY = RESC::CreateHistoryRing(HISTORY_SIZE);
+	}
+	cout << "RESCD: Replaying the last " << HISTORY_SIZE << " messages to /all and each room." << endl;
+	if (OFFLINE_DIR != "off") {
+		if (RESC::LogOpen(&OFFLINE_LOG, OFFLINE_DIR) != 0) {
+			exit(-1);
+		}
+		isOfflineLogOpen = true;
+		cout << "RESCD: Offline messages kept in " << OFFLINE_DIR << ", " << OFFLINE_LOG.waitingCount
+			<< " waiting for " << OFFLINE_LOG.waiting.size() << " users." << endl;
+	}
+	
+	
+	// Process Interrupts so we can gracefully exit()
+	struct sigaction sigIntHandler;
+	sigIntHandler.sa_handler = ProcessSignal;
+	sigemptyset(&sigIntHandler.sa_mask);
+	sigIntHandler.sa_flags = 0;
+	sigaction(SIGINT, &sigIntHandler, NULL);
+	
+	// A client vanishing mid-send should cost us that client, not the server.
+	signal(SIGPIPE, SIG_IGN);
+	
+	pthread_t presenceTid;
+	if (pthread_create(&presenceTid, NULL, PresenceThread, NULL) != 0) {
+		cerr << "Failed to create presence thread." << endl;
+		exit(-1);
+	}
+	pthread_t fanoutTid;
+	if (pthread_create(&fanoutTid, NULL, FanoutReportThread, NULL) != 0) {
+		cerr << "Failed to create fan-out report thread." << endl;
+		exit(-1);
+	}
+	if (RESUME_GRACE_SECONDS > 0) {
+		pthread_t sessionTid;
+		if (pthread_create(&sessionTid, NULL, SessionThread, NULL) != 0) {
+			cerr << "Failed to create session thread." << endl;
+			exit(-1);
+		}
+		cout << "RESCD: Dropped sessions can be resumed for " << RESUME_GRACE_SECONDS << " seconds." << endl;
+	}
+	if (CLUSTER_PORT != 0 || !PEER_ADDRESSES.empty()) {
+		StartCluster();
+	}
+	
+	if (SERVER_MODE == THREAD_MODE) {
+		RunThreadMode();
+	} else {
+		RunReactorMode();
+	}
+
+	return 0;
+}
+
+void RunThreadMode() {
+	cout << "RESCD: Thread-per-connection mode, fan-outs over " << FANOUT_THRESHOLD
+		<< " recipients on " << FANOUT_WORKERS << " pool workers." << endl;
+	if (RESC::WorkPoolInit(&FANOUT_POOL, FANOUT_WORKERS) != 0) {
+		exit(-1);
+	}
+
+	// Accept connections
+	while (true) {
+		// Accept connections
+		struct sockaddr_in clientAddress;
+		socklen_t addrLen = sizeof(clientAddress);
+		int requestSock = accept(conn_socket, (struct sockaddr*) &clientAddress, &addrLen);
+		if (requestSock < 0) {
+			cerr << "Error accepting connections." << endl;
+			exit(-1);
+		}
+
+		// Create child thread to handle process
+		struct threadArgs* args_p = new threadArgs;
+		args_p -> requestSocket = requestSock;
+		pthread_t tid;
+		int threadStatus = pthread_create(&tid, NULL, requestThread, (void*)args_p);
+		if (threadStatus != 0){
+			// Failed to create child thread
+			cerr << "Failed to create child process." << endl;
+			close(requestSock);
+			pthread_exit(NULL);
+		}
+	}
+}
+
+int OpenListener(unsigned short port, bool isShared) {
+	int listenSock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (listenSock < 0){
+		cerr << "Error with socket." << endl;
+		return -1;
+	}
+	
+	// Allow quick restarts while old connections sit in TIME_WAIT, and let
+	// every reactor bind a listener of its own to the same port. Nobody
+	// else may, so the cluster port is never shared.
+	int reuse = 1;
+	setsockopt(listenSock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	if (isShared) {
+		setsockopt(listenSock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+	}
+	
+	// Set the socket Fields
+	struct sockaddr_in serverAddress;
+	serverAddress.sin_family = AF_INET;    // Always AF_INET
+	serverAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+	serverAddress.sin_port = htons(port);
+	
+	// Assign Port to socket
+	int sock_status = bind(listenSock, (struct sockaddr *) &serverAddress, sizeof(serverAddress));
+	if (sock_status < 0) {
+		cerr << "Error with bind." << endl;
+		close(listenSock);
+		return -1;
+	}
+	
+	// Set socket to listen.
+	int listen_status = listen(listenSock, MAXPENDING);
+	if (listen_status < 0) {
+		cerr << "Error with listening." << endl;
+		close(listenSock);
+		return -1;
+	}
+	return listenSock;
+}
+
+void RunReactorMode() {
+	cout << "RESCD: " << (SERVER_MODE == URING_MODE ? "io_uring" : "epoll") << " reactor mode with " << REACTOR_COUNT << " threads." << endl;
+
+	for (int i = 0; i < REACTOR_COUNT; i++) {
+		Reactor* reactor = new Reactor;
+		reactor -> index = i;
+		// The first reactor takes the socket main bound; the kernel hashes
+		// new connections across all of the listeners on the port.
+		reactor -> listenSock = (i == 0) ? conn_socket : OpenListener(SERVER_PORT, true);
+		if (reactor -> listenSock < 0 || !SetNonBlocking(reactor -> listenSock)) {
+			cerr << "Error opening listening socket for reactor " << i << "." << endl;
+			exit(-1);
+		}
+		reactor -> epollSock = epoll_create1(0);
+		reactor -> wakeSock = eventfd(0, EFD_NONBLOCK);
+		if (reactor -> epollSock < 0 || reactor -> wakeSock < 0) {
+			cerr << "Error creating epoll instance." << endl;
+			exit(-1);
+		}
+		RESC::MailboxInit(&reactor -> inbound);
+		reactor -> ring = NULL;
+		// Registered even in uring mode, in case this reactor falls back.
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(reactor -> epollSock, EPOLL_CTL_ADD, reactor -> listenSock, &ev) < 0) {
+			cerr << "Error registering listening socket." << endl;
+			exit(-1);
+		}
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = reactor;
+		if (epoll_ctl(reactor -> epollSock, EPOLL_CTL_ADD, reactor -> wakeSock, &ev) < 0) {
+			cerr << "Error registering wakeup descriptor." << endl;
+			exit(-1);
+		}
+		REACTORS.push_back(reactor);
+	}
+	for (int i = 0; i < REACTOR_COUNT; i++) {
+		int threadStatus = pthread_create(&REACTORS[i] -> tid, NULL, ReactorThread, (void*)REACTORS[i]);
+		if (threadStatus != 0) {
+			cerr << "Failed to create reactor thread." << endl;
+			exit(-1);
+		}
+	}
+	for (int i = 0; i < REACTOR_COUNT; i++) {
+		pthread_join(REACTORS[i] -> tid, NULL);
+	}
+}
+
+
+void* requestThread(void* args_p) {
+  
+	// Local Variables
+	threadArgs* tmp = (threadArgs*) args_p;
+	int requestSocket = tmp -> requestSocket;
+	delete tmp;
+
+	// Detach Thread to ensure that resources are deallocated on return.
+	pthread_detach(pthread_self());
+
+	// Handle Request
+	ProcessRequest(requestSocket);
+
+	// Close Client socket
+	close(requestSocket);
+
+	// Quit thread
+	pthread_exit(NULL);
+}
+
+void ProcessRequest(int requestSock) {
+
+	// Polling structures
+	RESC::User user;
+	struct pollfd requestfd[2];
+	int wakeSock = eventfd(0, EFD_NONBLOCK);
+	if (wakeSock < 0) {
+		cerr << "Unable to create wakeup descriptor." << endl;
+		return;
+	}
+	
+	RESC::FrameReader reader;
+	RESC::FrameReaderInit(&reader);
+	RESC::FrameHeader header;
+	RESC::MessageView view;
+	RESC::FrameStatus status;
+	SessionOptions options;
+	RESC::OutQueue out;
+	RESC::OutQueueInit(&out);
+	
+	// Authenticate User
+	bool hasValidated = false;
+	cout << "Reading message incoming" << endl;
+	while (!hasValidated) {
+		status = RESC::FrameReaderNext(&reader, header, view);
+		if (status == RESC::FRAME_PARTIAL && RESC::FrameReaderFill(requestSock, &reader) > 0) {
+			continue;
+		}
+		if (status != RESC::FRAME_READY) {
+			// Client went away (or spoke garbage) before logging in.
+			close(wakeSock);
+			return;
+		}
+		string authResponse;
+		hasValidated = Authenticate(view.msg, user, options, authResponse);
+		if (options.session != NULL) {
+			// Take the session over, wake descriptor and all, and send
+			// again whatever the client missed.
+			if (ResumeThreadSession(options.session, requestSock, out)) {
+				close(wakeSock);
+				wakeSock = options.session -> wakeSock;
+				uint64_t from = RESC::OutQueueResume(&out, options.resumeSeq);
+				authResponse += " resumed=" + to_string(from);
+			} else {
+				authResponse = "UNSUCCESSFUL";
+				hasValidated = false;
+			}
+		}
+		RESC::SendMessage(requestSock, authResponse);
+	}
+	Session* session = options.session;
+	MsgQueue* queue;
+	reader.version = options.version;
+	if (session != NULL) {
+		queue = session -> queue;
+		RESUMED_SESSIONS.fetch_add(1, memory_order_relaxed);
+		cout << "Session: " << user.username << " resumed from seq " << out.seq << endl;
+	} else {
+		queue = OpenQueue(user.username, wakeSock, NULL, options);
+		OfferTransfers(user.username, queue);
+		out.version = options.version;
+		out.canSlice = options.canSlice;
+		if (options.canResume) {
+			out.keepSent = RESUME_WINDOW;
+			session = OpenSession(options, user.username, queue, requestSock, wakeSock, NULL);
+		}
+	}
+	// A full socket must not keep us from the mailbox, or a chat message
+	// would wait behind everything the socket has yet to take.
+	SetNonBlocking(requestSock);
+	setsockopt(requestSock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &NOTSENT_LOWAT, sizeof(NOTSENT_LOWAT));
+	
+	// Announce User, Update UserLists. A resumed user never left.
+	if (options.session == NULL) {
+		SchedulePresenceUpdate();
+	}
+	
+	// Wait on the socket and the wakeup together; no timeout needed since
+	// anything queued for us signals wakeSock.
+	// poll rather than select: with a socket and an eventfd per user,
+	// descriptors pass FD_SETSIZE after a few hundred logins.
+	requestfd[0].fd = requestSock;
+	requestfd[0].events = POLLIN;
+	requestfd[1].fd = wakeSock;
+	requestfd[1].events = POLLIN;
+	
+	bool hasQuit = false;
+	// Only losing the connection parks the session; quitting, garbage and
+	// overflowing end it.
+	bool canPark = true;
+	while (!hasQuit) {
+		// Handle every complete frame already buffered, including any that
+		// arrived together with the login.
+		while ((status = RESC::FrameReaderNext(&reader, header, view)) == RESC::FRAME_READY) {
+			if (!ProcessFrame(view, user.username, queue)) {
+				hasQuit = true;
+				break;
+			}
+		}
+		if (hasQuit || status == RESC::FRAME_INVALID) {
+			canPark = false;
+			break;
+		}
+		RESC::FrameReaderRelease(&reader);
+		
+		// Send Data
+		RESC::MailboxArm(&queue -> mailbox);
+		RESC::MailNode* node;
+		while (!hasQuit && (node = RESC::MailboxPop(&queue -> mailbox)) != NULL) {
+			hasQuit = !QueueForSend(&out, node -> payload, user.username);
+			delete node;
+		}
+		canPark = !hasQuit;
+		if (hasQuit || RESC::FlushOutQueue(requestSock, &out) == RESC::FLUSH_ERROR) {
+			break;
+		}
+		ConfirmStored(&out);
+		// Whatever the socket wouldn't take goes as soon as it will.
+		requestfd[0].events = (RESC::OutQueueIsEmpty(&out)) ? POLLIN : (POLLIN | POLLOUT);
+		
+		int pollSock = poll(requestfd, 2, -1);
+		if (pollSock > 0 && (requestfd[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+			// READ DATA
+			int bytesRecv = RESC::FrameReaderFill(requestSock, &reader);
+			if (bytesRecv == 0 || (bytesRecv < 0 && errno != EAGAIN && errno != EINTR)) {
+				break;
+			}
+		}
+		if (pollSock > 0 && (requestfd[1].revents & POLLIN)) {
+			eventfd_t wakeCount;
+			eventfd_read(wakeSock, &wakeCount);
+		}
+	}	
+	ConfirmStored(&out);
+	if (session != NULL && ParkSession(session, canPark, &out)) {
+		// Still online; the session keeps the queue and the descriptor.
+		cout << "Session: parking " << user.username << " for " << RESUME_GRACE_SECONDS << " seconds" << endl;
+		return;
+	}
+	RESC::OutQueueClear(&out);
+	DisconnectUser(user, queue);
+	close(wakeSock);
+	delete session;
+	cout << "Closing socket" << endl;
+}
+
+MsgQueue* OpenQueue(string username, int wakeSock, Connection* conn, const SessionOptions &options) {
+	MsgQueue* queue = new MsgQueue;
+	RESC::MailboxInit(&queue -> mailbox);
+	queue -> wakeSock = wakeSock;
+	queue -> reactor = (conn != NULL) ? conn -> reactor : NULL;
+	queue -> connId = (conn != NULL) ? conn -> id : 0;
+	queue -> wantsDelta = options.wantsDelta;
+	queue -> canTransfer = options.canTransfer;
+	queue -> historyFloor = 0;
+
+	// A second login under the same name takes over routing for that name.
+	pthread_mutex_lock(&PublishLock);
+	RESC::RegistryShard<MsgQueue*>* shard = RESC::RegistryShardFor(&MSG_QUEUE, username);
+	pthread_mutex_lock(&shard -> lock);
+	shard -> entries[username] = queue;
+	if (ALL_HISTORY != NULL) {
+		// Broadcasts are kept before they are posted, so anything after
+		// this seq reaches the new queue live and nothing up to it does.
+		queue -> historyFloor = RESC::HistoryHead(ALL_HISTORY);
+		ReplayHistory(ALL_HISTORY, queue -> historyFloor, queue);
+	}
+	if (isOfflineLogOpen) {
+		// Under the shard lock: a message for us is either stored before
+		// this or finds the queue, never neither.
+		vector<RESC::Payload*> stored;
+		RESC::LogDrain(&OFFLINE_LOG, username, stored);
+		for (size_t i = 0; i < stored.size(); i++) {
+			if (conn != NULL) {
+				RESC::OutQueuePush(&conn -> out, stored[i]);
+			} else {
+				PostPayload(queue, stored[i]);
+				RESC::ReleasePayload(stored[i]);
+			}
+		}
+		if (!stored.empty()) {
+			cout << "Offline: " << stored.size() << " messages delivered to " << username << endl;
+		}
+	}
+	pthread_mutex_unlock(&shard -> lock);
+	if (options.wantsDelta) {
+		// Nothing can be published between this snapshot and the queue
+		// going live, so the next delta the user sees is exactly one on.
+		// A reactor connection takes it straight away: deltas already in
+		// the inbound queue are older and the client skips them.
+		RESC::Payload* snapshot = CreatePresenceSnapshot();
+		if (conn != NULL) {
+			RESC::OutQueuePush(&conn -> out, snapshot);
+		} else {
+			PostPayload(queue, snapshot);
+			RESC::ReleasePayload(snapshot);
+		}
+	}
+	pthread_mutex_unlock(&PublishLock);
+	OPEN_QUEUES.fetch_add(1, memory_order_relaxed);
+	return queue;
+}
+
+void CloseQueue(string username, MsgQueue* queue) {
+	while (!queue -> rooms.empty()) {
+		LeaveRoom(queue, queue -> rooms.back());
+	}
+	RESC::RegistryShard<MsgQueue*>* shard = RESC::RegistryShardFor(&MSG_QUEUE, username);
+	pthread_mutex_lock(&shard -> lock);
+	unordered_map<string, MsgQueue*>::iterator msgIter = shard -> entries.find(username);
+	if (msgIter != shard -> entries.end() && (*msgIter).second == queue) {
+		shard -> entries.erase(msgIter);
+	}
+	pthread_mutex_unlock(&shard -> lock);
+
+	// Every producer posts under the shard lock, so nobody can reach the
+	// mailbox once we've held it. Direct messages we never took go to
+	// whoever has the name now, or into the offline log.
+	RESC::MailNode* node;
+	while ((node = RESC::MailboxPop(&queue -> mailbox)) != NULL) {
+		if (node -> payload -> cmd == RESC::DIRECT_MSG) {
+			DeliverOrStore(node -> payload);
+		}
+		RESC::ReleasePayload(node -> payload);
+		delete node;
+	}
+	delete queue;
+	OPEN_QUEUES.fetch_sub(1, memory_order_relaxed);
+}
+
+void StoreOffline(RESC::Payload* payload) {
+	if (!isOfflineLogOpen) {
+		return;
+	}
+	if (payload -> logLsn != 0) {
+		// Drained but never sent, so its record is still waiting.
+		return;
+	}
+	if (!IsKnownUser(payload -> to) && !RESC::LogHasWaiting(&OFFLINE_LOG, payload -> to)) {
+		return;
+	}
+	string_view body(payload -> body);
+	if (!RESC::LogAppend(&OFFLINE_LOG, payload -> to, body.substr(payload -> fromOffset, payload -> fromLength),
+		body.substr(payload -> msgOffset, payload -> msgLength))) {
+		cerr << "Unable to keep a message for " << payload -> to << " in the offline log." << endl;
+	}
+}
+
+void ConfirmStored(RESC::OutQueue* out) {
+	if (isOfflineLogOpen) {
+		RESC::LogConfirm(&OFFLINE_LOG, out -> logged);
+	}
+}
+
+void DeliverOrStore(RESC::Payload* payload) {
+	RESC::RegistryShard<MsgQueue*>* shard = RESC::RegistryShardFor(&MSG_QUEUE, payload -> to);
+	pthread_mutex_lock(&shard -> lock);
+		unordered_map<string, MsgQueue*>::iterator msgIter = shard -> entries.find(payload -> to);
+		if (msgIter != shard -> entries.end()) {
+			PostPayload((*msgIter).second, payload);
+		} else {
+			StoreOffline(payload);
+		}
+	pthread_mutex_unlock(&shard -> lock);
+}
+
+bool IsKnownUser(const string &username) {
+	RESC::RegistryShard<RESC::User>* shard = RESC::RegistryShardFor(&USER_LIST, username);
+	pthread_mutex_lock(&shard -> lock);
+	bool isKnown = shard -> entries.count(username) > 0;
+	pthread_mutex_unlock(&shard -> lock);
+	if (!isKnown) {
+		// Or on another node of the cluster.
+		RESC::RegistryShard<string>* locationShard = RESC::RegistryShardFor(&LOCATIONS, username);
+		pthread_mutex_lock(&locationShard -> lock);
+		isKnown = locationShard -> entries.count(username) > 0;
+		pthread_mutex_unlock(&locationShard -> lock);
+	}
+	return isKnown;
+}
+
+void PostPayload(MsgQueue* queue, RESC::Payload* payload) {
+	if (queue -> reactor != NULL) {
+		PostToReactor(queue -> reactor, queue -> connId, payload);
+		return;
+	}
+	RESC::MailNode* node = new RESC::MailNode;
+	RESC::RetainPayload(payload);
+	node -> payload = payload;
+	node -> target = 0;
+	if (RESC::MailboxPush(&queue -> mailbox, node) && queue -> wakeSock >= 0) {
+		eventfd_write(queue -> wakeSock, 1);
+	}
+}
+
+bool QueueForSend(RESC::OutQueue* out, RESC::Payload* payload, const string &username) {
+	long droppedBytes = out -> droppedBytes;
+	int dropCount = RESC::OutQueueOffer(out, payload, OUT_LIMITS);
+	if (dropCount < 0) {
+		long kicks = SLOW_KICKS.fetch_add(1, memory_order_relaxed) + 1;
+		cout << "Mailbox: disconnecting " << username << " with " << out -> count << " messages, "
+			<< out -> bytes << " bytes queued; " << kicks << " slow users disconnected so far" << endl;
+		return false;
+	}
+	if (dropCount > 0) {
+		droppedBytes = out -> droppedBytes - droppedBytes;
+		long totalFrames = DROPPED_FRAMES.fetch_add(dropCount, memory_order_relaxed) + dropCount;
+		long totalBytes = DROPPED_BYTES.fetch_add(droppedBytes, memory_order_relaxed) + droppedBytes;
+		cout << "Mailbox: dropped " << dropCount << " messages (" << droppedBytes << " bytes, policy "
+			<< POLICY_NAMES[OUT_LIMITS.policy] << ") for " << username << ", " << out -> count
+			<< " messages, " << out -> bytes << " bytes still queued; " << totalFrames << " messages, "
+			<< totalBytes << " bytes dropped so far" << endl;
+	}
+	return true;
+}
+
+void PostToReactor(Reactor* reactor, uint64_t target, RESC::Payload* payload) {
+	RESC::MailNode* node = new RESC::MailNode;
+	RESC::RetainPayload(payload);
+	node -> payload = payload;
+	node -> target = target;
+	if (RESC::MailboxPush(&reactor -> inbound, node)) {
+		eventfd_write(reactor -> wakeSock, 1);
+	}
+}
+
+void BroadcastPayload(RESC::Payload* payload) {
+	if (SERVER_MODE != THREAD_MODE) {
+		// One node per reactor; each one fans out to its own connections.
+		for (int i = 0; i < REACTORS.size(); i++) {
+			PostToReactor(REACTORS[i], 0, payload);
+		}
+		return;
+	}
+	// Add to all the queues, one shard at a time, spreading the shards
+	// over the pool when there are enough users to be worth it.
+	long startNs = NowNs();
+	FanoutJob job;
+	job.payload = payload;
+	job.sender = NULL;
+	job.members = NULL;
+	job.delivered.store(0, memory_order_relaxed);
+	if (OPEN_QUEUES.load(memory_order_relaxed) > FANOUT_THRESHOLD) {
+		RESC::WorkPoolRun(&FANOUT_POOL, RESC::REGISTRY_SHARDS, FANOUT_SHARD_CHUNK, BroadcastShards, &job);
+	} else {
+		BroadcastShards(&job, 0, RESC::REGISTRY_SHARDS);
+	}
+	RecordFanout(job.delivered.load(memory_order_relaxed), NowNs() - startNs);
+}
+
+void BroadcastShards(void* args_p, size_t begin, size_t end) {
+	FanoutJob* job = (FanoutJob*) args_p;
+	long delivered = 0;
+	for (size_t i = begin; i < end; i++) {
+		RESC::RegistryShard<MsgQueue*>* shard = &MSG_QUEUE.shards[i];
+		pthread_mutex_lock(&shard -> lock);
+		unordered_map<string, MsgQueue*>::iterator msgIter = shard -> entries.begin();
+		while (msgIter != shard -> entries.end()) {
+			if (IsBroadcastFor(job -> payload, (*msgIter).first, (*msgIter).second)) {
+				PostPayload((*msgIter).second, job -> payload);
+				delivered++;
+			}
+			msgIter++;
+		}
+		pthread_mutex_unlock(&shard -> lock);
+	}
+	job -> delivered.fetch_add(delivered, memory_order_relaxed);
+}
+
+void PostToMembers(void* args_p, size_t begin, size_t end) {
+	FanoutJob* job = (FanoutJob*) args_p;
+	vector<MsgQueue*> &members = *job -> members;
+	long delivered = 0;
+	for (size_t i = begin; i < end; i++) {
+		if (members[i] != job -> sender) {
+			PostPayload(members[i], job -> payload);
+			delivered++;
+		}
+	}
+	job -> delivered.fetch_add(delivered, memory_order_relaxed);
+}
+
+long NowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void RecordFanout(long recipients, long elapsedNs) {
+	int bucket = 0;
+	while (bucket < FANOUT_BUCKETS - 1 && (2L << bucket) <= recipients) {
+		bucket++;
+	}
+	FanoutBucket &stats = FANOUT_STATS[bucket];
+	stats.count.fetch_add(1, memory_order_relaxed);
+	stats.totalNs.fetch_add(elapsedNs, memory_order_relaxed);
+	long maxNs = stats.maxNs.load(memory_order_relaxed);
+	while (elapsedNs > maxNs && !stats.maxNs.compare_exchange_weak(maxNs, elapsedNs, memory_order_relaxed)) {
+	}
+}
+
+void ReportFanout() {
+	for (int i = 0; i < FANOUT_BUCKETS; i++) {
+		long count = FANOUT_STATS[i].count.load(memory_order_relaxed);
+		if (count == 0) {
+			continue;
+		}
+		long totalNs = FANOUT_STATS[i].totalNs.load(memory_order_relaxed);
+		long maxNs = FANOUT_STATS[i].maxNs.load(memory_order_relaxed);
+		// Bucket 0 also holds fan-outs that reached nobody.
+		cout << "Fanout: " << (i == 0 ? 0 : 1L << i) << "-" << (2L << i) - 1 << " recipients, " << count
+			<< " fan-outs, avg " << totalNs / count / 1000 << " us, max " << maxNs / 1000 << " us" << endl;
+	}
+	if (SERVER_MODE == THREAD_MODE) {
+		cout << "Fanout: " << FANOUT_POOL.workers.size() << " pool workers, "
+			<< FANOUT_POOL.steals.load(memory_order_relaxed) << " chunks stolen" << endl;
+	}
+}
+
+void* FanoutReportThread(void* args_p) {
+	long reported = 0;
+	while (true) {
+		sleep(FANOUT_REPORT_SECONDS);
+		long total = 0;
+		for (int i = 0; i < FANOUT_BUCKETS; i++) {
+			total += FANOUT_STATS[i].count.load(memory_order_relaxed);
+		}
+		if (total != reported) {
+			reported = total;
+			ReportFanout();
+		}
+	}
+	return NULL;
+}
+
+bool IsBroadcastFor(RESC::Payload* payload, const string &username, MsgQueue* queue) {
+	if (payload -> cmd == RESC::USER_LIST_MSG) {
+		return !queue -> wantsDelta;
+	}
+	if (payload -> cmd == RESC::PRESENCE_MSG) {
+		return queue -> wantsDelta;
+	}
+	if (payload -> historySeq != 0) {
+		uint64_t floor = (payload -> cmd == RESC::ROOM_MSG) ? RoomHistoryFloor(queue, payload -> to) : queue -> historyFloor;
+		if (payload -> historySeq <= floor) {
+			return false;
+		}
+	}
+	string_view from(payload -> body.data() + payload -> fromOffset, payload -> fromLength);
+	return from != username;
+}
+
+bool IsRoomMember(MsgQueue* queue, const string &room) {
+	return find(queue -> rooms.begin(), queue -> rooms.end(), room) != queue -> rooms.end();
+}
+
+uint64_t RoomHistoryFloor(MsgQueue* queue, const string &room) {
+	for (size_t i = 0; i < queue -> rooms.size(); i++) {
+		if (queue -> rooms[i] == room) {
+			return queue -> roomFloors[i];
+		}
+	}
+	return 0;
+}
+
+void ReplayHistory(RESC::HistoryRing* ring, uint64_t upTo, MsgQueue* queue) {
+	// A reactor user is on our thread, so the replay goes straight onto
+	// their output queue and out in the next flush with everything else.
+	vector<RESC::Payload*> replay;
+	RESC::HistoryReplay(ring, upTo, replay);
+	Connection* conn = NULL;
+	if (queue -> reactor != NULL) {
+		unordered_map<uint64_t, Connection*>::iterator connIter = queue -> reactor -> connections.find(queue -> connId);
+		if (connIter != queue -> reactor -> connections.end()) {
+			conn = (*connIter).second;
+		}
+	}
+	for (size_t i = 0; i < replay.size(); i++) {
+		if (conn != NULL) {
+			RESC::OutQueuePush(&conn -> out, replay[i]);
+			continue;
+		}
+		if (queue -> reactor == NULL) {
+			PostPayload(queue, replay[i]);
+		}
+		RESC::ReleasePayload(replay[i]);
+	}
+}
+
+bool JoinRoom(MsgQueue* queue, const string &room) {
+	if (find(queue -> rooms.begin(), queue -> rooms.end(), room) != queue -> rooms.end()) {
+		return false;
+	}
+	queue -> rooms.push_back(room);
+	queue -> roomFloors.push_back(0);
+	Reactor* reactor = queue -> reactor;
+	if (reactor != NULL) {
+		// Our own thread, so the local set needs no lock.
+		unordered_map<uint64_t, Connection*>::iterator connIter = reactor -> connections.find(queue -> connId);
+		if (connIter != reactor -> connections.end()) {
+			RESC::MemberSetAdd(&reactor -> rooms[room], (*connIter).second);
+		}
+	}
+	RESC::RegistryShard<Room>* shard = RESC::RegistryShardFor(&ROOMS, room);
+	pthread_mutex_lock(&shard -> lock);
+		Room &entry = shard -> entries[room];
+		if (entry.memberCount == 0) {
+			entry.reactorMembers.assign(REACTORS.size(), 0);
+		}
+		entry.memberCount++;
+		if (reactor != NULL) {
+			entry.reactorMembers[reactor -> index]++;
+		} else {
+			RESC::MemberSetAdd(&entry.members, queue);
+		}
+		if (entry.history != NULL) {
+			// Room messages are kept and posted under this lock.
+			queue -> roomFloors.back() = RESC::HistoryHead(entry.history);
+			ReplayHistory(entry.history, queue -> roomFloors.back(), queue);
+		}
+	pthread_mutex_unlock(&shard -> lock);
+	return true;
+}
+
+bool LeaveRoom(MsgQueue* queue, const string &room) {
+	vector<string>::iterator roomIter = find(queue -> rooms.begin(), queue -> rooms.end(), room);
+	if (roomIter == queue -> rooms.end()) {
+		return false;
+	}
+	// room may be the element we erase.
+	string name = room;
+	size_t index = roomIter - queue -> rooms.begin();
+	*roomIter = queue -> rooms.back();
+	queue -> rooms.pop_back();
+	queue -> roomFloors[index] = queue -> roomFloors.back();
+	queue -> roomFloors.pop_back();
+	Reactor* reactor = queue -> reactor;
+	if (reactor != NULL) {
+		unordered_map<string, RESC::MemberSet<Connection*>>::iterator localIter = reactor -> rooms.find(name);
+		unordered_map<uint64_t, Connection*>::iterator connIter = reactor -> connections.find(queue -> connId);
+		if (localIter != reactor -> rooms.end() && connIter != reactor -> connections.end()) {
+			RESC::MemberSetRemove(&(*localIter).second, (*connIter).second);
+			if ((*localIter).second.members.empty()) {
+				reactor -> rooms.erase(localIter);
+			}
+		}
+	}
+	RESC::RegistryShard<Room>* shard = RESC::RegistryShardFor(&ROOMS, name);
+	pthread_mutex_lock(&shard -> lock);
+		unordered_map<string, Room>::iterator entryIter = shard -> entries.find(name);
+		if (entryIter != shard -> entries.end()) {
+			Room &entry = (*entryIter).second;
+			entry.memberCount--;
+			if (reactor != NULL) {
+				entry.reactorMembers[reactor -> index]--;
+			} else {
+				RESC::MemberSetRemove(&entry.members, queue);
+			}
+			if (entry.memberCount == 0) {
+				if (entry.history != NULL) {
+					RESC::DeleteHistoryRing(entry.history);
+				}
+				shard -> entries.erase(entryIter);
+			}
+		}
+	pthread_mutex_unlock(&shard -> lock);
+	return true;
+}
+
+void PostToRoom(RESC::Payload* payload, MsgQueue* sender) {
+	// Only the room's members are touched, however many users are online.
+	RESC::RegistryShard<Room>* shard = RESC::RegistryShardFor(&ROOMS, payload -> to);
+	pthread_mutex_lock(&shard -> lock);
+		unordered_map<string, Room>::iterator entryIter = shard -> entries.find(payload -> to);
+		if (entryIter != shard -> entries.end()) {
+			Room &entry = (*entryIter).second;
+			if (HISTORY_SIZE > 0) {
+				if (entry.history == NULL) {
+					entry.history = RESC::CreateHistoryRing(HISTORY_SIZE);
+				}
+				RESC::HistoryRecord(entry.history, payload);
+			}
+			for (size_t i = 0; i < entry.reactorMembers.size(); i++) {
+				if (entry.reactorMembers[i] > 0) {
+					PostToReactor(REACTORS[i], 0, payload);
+				}
+			}
+			if (!entry.members.members.empty()) {
+				// Our shard lock keeps the member list still while the
+				// pool's chunks read it.
+				long startNs = NowNs();
+				FanoutJob job;
+				job.payload = payload;
+				job.sender = sender;
+				job.members = &entry.members.members;
+				job.delivered.store(0, memory_order_relaxed);
+				size_t memberCount = job.members -> size();
+				if (memberCount > (size_t) FANOUT_THRESHOLD) {
+					RESC::WorkPoolRun(&FANOUT_POOL, memberCount, FANOUT_CHUNK, PostToMembers, &job);
+				} else {
+					PostToMembers(&job, 0, memberCount);
+				}
+				RecordFanout(job.delivered.load(memory_order_relaxed), NowNs() - startNs);
+			}
+		}
+	pthread_mutex_unlock(&shard -> lock);
+}
+
+void DisconnectUser(RESC::User &user, MsgQueue* queue) {
+	CloseQueue(user.username, queue);
+	RESC::RegistryShard<RESC::User>* shard = RESC::RegistryShardFor(&USER_LIST, user.username);
+	pthread_mutex_lock(&shard -> lock);
+		unordered_map<string, RESC::User>::iterator usrIter = shard -> entries.find(user.username);
+		if (usrIter != shard -> entries.end()) {
+			// found user
+			user.isConnected = false;
+			(*usrIter).second.isConnected = false;
+		}
+	pthread_mutex_unlock(&shard -> lock);
+	SchedulePresenceUpdate();
+}
+
+string CreateSessionToken() {
+	unsigned char bytes[16];
+	if (getrandom(bytes, sizeof(bytes), 0) != sizeof(bytes)) {
+		cerr << "Unable to make a session token." << endl;
+		return "";
+	}
+	const char digits[] = "0123456789abcdef";
+	string token;
+	for (size_t i = 0; i < sizeof(bytes); i++) {
+		token += digits[bytes[i] >> 4];
+		token += digits[bytes[i] & 15];
+	}
+	return token;
+}
+
+Session* OpenSession(const SessionOptions &options, const string &username, MsgQueue* queue, int sock,
+	int wakeSock, Connection* conn) {
+	Session* session = new Session;
+	session -> token = options.token;
+	session -> username = username;
+	session -> state = SESSION_ATTACHED;
+	session -> isClaimed = false;
+	session -> queue = queue;
+	session -> sock = sock;
+	session -> parkedAt = 0;
+	session -> wakeSock = wakeSock;
+	RESC::OutQueueInit(&session -> out);
+	session -> reactor = (conn != NULL) ? conn -> reactor : NULL;
+	session -> connId = (conn != NULL) ? conn -> id : 0;
+	session -> resumeSock = -1;
+	session -> resumeSeq = 0;
+	session -> adopter = NULL;
+	RESC::RegistryShard<Session*>* shard = RESC::RegistryShardFor(&SESSIONS, options.token);
+	pthread_mutex_lock(&shard -> lock);
+	shard -> entries[options.token] = session;
+	pthread_mutex_unlock(&shard -> lock);
+	return session;
+}
+
+Session* ClaimSession(const string &token, const string &username) {
+	Session* session = NULL;
+	RESC::RegistryShard<Session*>* shard = RESC::RegistryShardFor(&SESSIONS, token);
+	pthread_mutex_lock(&shard -> lock);
+		unordered_map<string, Session*>::iterator sessionIter = shard -> entries.find(token);
+		if (sessionIter != shard -> entries.end() && (*sessionIter).second -> username == username &&
+			!(*sessionIter).second -> isClaimed) {
+			session = (*sessionIter).second;
+			session -> isClaimed = true;
+			if (session -> sock >= 0) {
+				// Owners park before closing, under this lock, so the socket
+				// is still theirs. They see it end and park for us.
+				shutdown(session -> sock, SHUT_RDWR);
+			}
+		}
+	pthread_mutex_unlock(&shard -> lock);
+	return session;
+}
+
+void ReleaseClaim(Session* session) {
+	RESC::RegistryShard<Session*>* shard = RESC::RegistryShardFor(&SESSIONS, session -> token);
+	pthread_mutex_lock(&shard -> lock);
+	session -> isClaimed = false;
+	pthread_mutex_unlock(&shard -> lock);
+}
+
+bool ParkSession(Session* session, bool canPark, RESC::OutQueue* out) {
+	RESC::RegistryShard<Session*>* shard = RESC::RegistryShardFor(&SESSIONS, session -> token);
+	pthread_mutex_lock(&shard -> lock);
+		// An expired session is already out of the registry.
+		bool isKept = session -> state != SESSION_EXPIRED && (canPark || session -> isClaimed);
+		if (!isKept && session -> state != SESSION_EXPIRED) {
+			shard -> entries.erase(session -> token);
+		}
+		if (isKept) {
+			if (out != NULL) {
+				session -> out = move(*out);
+				RESC::OutQueueInit(out);
+			}
+			session -> sock = -1;
+			if (session -> state == SESSION_ATTACHED) {
+				session -> state = SESSION_PARKED;
+				session -> parkedAt = NowNs();
+			}
+		}
+	pthread_mutex_unlock(&shard -> lock);
+	return isKept;
+}
+
+bool ResumeThreadSession(Session* session, int requestSock, RESC::OutQueue &out) {
+	// The claim cut the old socket off; its thread parks as soon as it
+	// notices.
+	RESC::RegistryShard<Session*>* shard = RESC::RegistryShardFor(&SESSIONS, session -> token);
+	for (int waited = 0; waited < RESUME_WAIT_MS; waited += 10) {
+		pthread_mutex_lock(&shard -> lock);
+		if (session -> state == SESSION_PARKED) {
+			out = move(session -> out);
+			RESC::OutQueueInit(&session -> out);
+			session -> state = SESSION_ATTACHED;
+			session -> isClaimed = false;
+			session -> sock = requestSock;
+			pthread_mutex_unlock(&shard -> lock);
+			return true;
+		}
+		pthread_mutex_unlock(&shard -> lock);
+		usleep(10000);
+	}
+	ReleaseClaim(session);
+	return false;
+}
+
+void ExpireSession(Session* session) {
+	RESC::User user;
+	user.username = session -> username;
+	user.isConnected = true;
+	DisconnectUser(user, session -> queue);
+	ConfirmStored(&session -> out);
+	StoreUnsent(&session -> out);
+	RESC::OutQueueClear(&session -> out);
+	close(session -> wakeSock);
+	delete session;
+}
+
+void StoreUnsent(RESC::OutQueue* out) {
+	for (int lane = 0; lane < RESC::LANE_COUNT; lane++) {
+		for (size_t i = 0; i < out -> lanes[lane].size(); i++) {
+			if (out -> lanes[lane][i].payload -> cmd == RESC::DIRECT_MSG) {
+				DeliverOrStore(out -> lanes[lane][i].payload);
+			}
+		}
+	}
+	for (size_t i = 0; i < out -> wire.size(); i++) {
+		if (out -> wire[i].isLast && out -> wire[i].payload -> cmd == RESC::DIRECT_MSG) {
+			DeliverOrStore(out -> wire[i].payload);
+		}
+	}
+}
+
+void* SessionThread(void* args_p) {
+	while (true) {
+		sleep(1);
+		long expiresNs = NowNs() - RESUME_GRACE_SECONDS * 1000000000L;
+		vector<Session*> expired;
+		for (size_t i = 0; i < RESC::REGISTRY_SHARDS; i++) {
+			RESC::RegistryShard<Session*>* shard = &SESSIONS.shards[i];
+			pthread_mutex_lock(&shard -> lock);
+			unordered_map<string, Session*>::iterator sessionIter = shard -> entries.begin();
+			while (sessionIter != shard -> entries.end()) {
+				Session* session = (*sessionIter).second;
+				if (session -> state != SESSION_PARKED || session -> isClaimed) {
+					sessionIter++;
+					continue;
+				}
+				// Nobody else drains a parked thread-mode mailbox.
+				bool hasOverflowed = false;
+				RESC::MailNode* node;
+				while (session -> reactor == NULL && !hasOverflowed &&
+					(node = RESC::MailboxPop(&session -> queue -> mailbox)) != NULL) {
+					hasOverflowed = !QueueForSend(&session -> out, node -> payload, session -> username);
+					delete node;
+				}
+				if (!hasOverflowed && session -> parkedAt > expiresNs) {
+					sessionIter++;
+					continue;
+				}
+				session -> state = SESSION_EXPIRED;
+				expired.push_back(session);
+				sessionIter = shard -> entries.erase(sessionIter);
+			}
+			pthread_mutex_unlock(&shard -> lock);
+		}
+		for (size_t i = 0; i < expired.size(); i++) {
+			cout << "Session: " << expired[i] -> username << " was not resumed in time" << endl;
+			if (expired[i] -> reactor != NULL) {
+				// The connection holding it logs the user out.
+				PostSessionEvent(expired[i] -> reactor, expired[i] -> connId);
+			} else {
+				ExpireSession(expired[i]);
+			}
+		}
+	}
+	return NULL;
+}
+
+void PostSessionEvent(Reactor* reactor, uint64_t connId) {
+	RESC::MailNode* node = new RESC::MailNode;
+	node -> payload = NULL;
+	node -> target = connId;
+	if (RESC::MailboxPush(&reactor -> inbound, node)) {
+		eventfd_write(reactor -> wakeSock, 1);
+	}
+}
+
+bool ReadClusterKey() {
+	ifstream keyFile(CLUSTER_KEY_FILE.c_str());
+	if (CLUSTER_KEY_FILE.empty() || !keyFile.is_open()) {
+		return false;
+	}
+	getline(keyFile, CLUSTER_KEY);
+	return !CLUSTER_KEY.empty();
+}
+
+bool IsClusterKey(string_view key) {
+	unsigned char difference = (key.length() == CLUSTER_KEY.length()) ? 0 : 1;
+	for (size_t i = 0; i < key.length(); i++) {
+		difference |= key[i] ^ CLUSTER_KEY[i % CLUSTER_KEY.length()];
+	}
+	return difference == 0;
+}
+
+void StartCluster() {
+	if (NODE_NAME.empty()) {
+		char hostname[256];
+		if (gethostname(hostname, sizeof(hostname)) != 0) {
+			strcpy(hostname, "localhost");
+		}
+		hostname[sizeof(hostname) - 1] = '\0';
+		NODE_NAME = string(hostname) + ":" + to_string(SERVER_PORT);
+	}
+	if (CLUSTER_PORT != 0) {
+		int clusterSock = OpenListener(CLUSTER_PORT, false);
+		pthread_t listenTid;
+		if (clusterSock < 0 || pthread_create(&listenTid, NULL, ClusterListenThread, (void*)(intptr_t) clusterSock) != 0) {
+			cerr << "Unable to listen for other nodes on port " << CLUSTER_PORT << "." << endl;
+			exit(-1);
+		}
+	}
+	for (size_t i = 0; i < PEER_ADDRESSES.size(); i++) {
+		pthread_t peerTid;
+		if (pthread_create(&peerTid, NULL, PeerThread, (void*) &PEER_ADDRESSES[i]) != 0) {
+			cerr << "Failed to create peer thread." << endl;
+			exit(-1);
+		}
+	}
+	cout << "RESCD: Cluster node " << NODE_NAME << ", links from other nodes on port " << CLUSTER_PORT
+		<< ", dialling " << PEER_ADDRESSES.size() << " of them." << endl;
+	for (size_t i = 0; i < PEER_ADDRESSES.size(); i++) {
+		if (PEER_ADDRESSES[i].isUpstream) {
+			cout << "RESCD: Relaying for " << PEER_ADDRESSES[i].host << ":" << PEER_ADDRESSES[i].port << "." << endl;
+		}
+	}
+}
+
+void* ClusterListenThread(void* args_p) {
+	int clusterSock = (int)(intptr_t) args_p;
+	while (true) {
+		struct sockaddr_in peerAddress;
+		socklen_t addrLen = sizeof(peerAddress);
+		int peerSock = accept(clusterSock, (struct sockaddr*) &peerAddress, &addrLen);
+		if (peerSock < 0) {
+			if (errno != EINTR) {
+				cerr << "Error accepting links from other nodes." << endl;
+			}
+			continue;
+		}
+		PeerAddress* address = new PeerAddress;
+		address -> port = 0;
+		address -> sock = peerSock;
+		address -> isUpstream = false;
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, PeerThread, (void*) address) != 0) {
+			cerr << "Failed to create peer thread." << endl;
+			close(peerSock);
+			delete address;
+		}
+	}
+	return NULL;
+}
+
+void* PeerThread(void* args_p) {
+	PeerAddress* address = (PeerAddress*) args_p;
+	pthread_detach(pthread_self());
+	if (address -> host.empty()) {
+		ServePeer(address -> sock, false, false);
+		close(address -> sock);
+		delete address;
+		pthread_exit(NULL);
+	}
+	// Ours to dial, for as long as we run. A link that was up is dialled
+	// again straight away; a node that isn't there, less and less often.
+	int waitSeconds = 1;
+	while (true) {
+		int peerSock = DialPeer(address);
+		if (peerSock >= 0) {
+			if (ServePeer(peerSock, true, address -> isUpstream)) {
+				waitSeconds = 1;
+			}
+			close(peerSock);
+		}
+		sleep(waitSeconds);
+		waitSeconds = min(waitSeconds * 2, PEER_RETRY_SECONDS);
+	}
+	return NULL;
+}
+
+int DialPeer(const PeerAddress* address) {
+	// Not OpenSocket: several peer threads dial at once, and gethostbyname
+	// shares one buffer between them.
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo* found;
+	if (getaddrinfo(address -> host.c_str(), to_string(address -> port).c_str(), &hints, &found) != 0) {
+		cerr << "Cluster: unable to resolve " << address -> host << endl;
+		return -1;
+	}
+	int peerSock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (peerSock >= 0 && connect(peerSock, found -> ai_addr, found -> ai_addrlen) < 0) {
+		close(peerSock);
+		peerSock = -1;
+	}
+	freeaddrinfo(found);
+	return peerSock;
+}
+
+bool ServePeer(int peerSock, bool isDialled, bool isUpstream) {
+	// Both ends send their name and the key in a v1 frame, then speak v2
+	// both ways. Whoever dialled goes first, so we never tell our key to
+	// someone who has yet to show they know it.
+	struct timeval timeout;
+	timeout.tv_sec = 5;
+	timeout.tv_usec = 0;
+	setsockopt(peerSock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	string ourHello = ((isUpstream) ? RELAY_HELLO : PEER_HELLO) + NODE_NAME + "\n" + CLUSTER_KEY;
+	if (isDialled) {
+		RESC::SendMessage(peerSock, ourHello);
+	}
+	string hello = RESC::ReadMessage(peerSock);
+	size_t keySplit = hello.find('\n');
+	if (keySplit == string::npos || !IsClusterKey(string_view(hello).substr(keySplit + 1))) {
+		cerr << "Cluster: refusing a link without our key." << endl;
+		return false;
+	}
+	hello.erase(keySplit);
+	if (!isDialled) {
+		RESC::SendMessage(peerSock, ourHello);
+	}
+	bool isRelay = hello.compare(0, RELAY_HELLO.length(), RELAY_HELLO) == 0;
+	size_t helloLength = (isRelay) ? RELAY_HELLO.length() : PEER_HELLO.length();
+	if ((!isRelay && hello.compare(0, PEER_HELLO.length(), PEER_HELLO) != 0) || hello.length() == helloLength ||
+		hello.substr(helloLength) == NODE_NAME) {
+		cerr << "Cluster: refusing a link without a handshake, or to ourselves." << endl;
+		return false;
+	}
+	Peer* peer = new Peer;
+	peer -> node = hello.substr(helloLength);
+	peer -> isTree = isUpstream || isRelay;
+	peer -> advertisedVersion = 0;
+	peer -> sock = peerSock;
+	peer -> wakeSock = eventfd(0, EFD_NONBLOCK);
+	if (peer -> wakeSock < 0) {
+		cerr << "Unable to create wakeup descriptor." << endl;
+		delete peer;
+		return false;
+	}
+	RESC::MailboxInit(&peer -> mailbox);
+	RESC::FrameReader reader;
+	RESC::FrameReaderInit(&reader);
+	reader.version = RESC::PROTOCOL_V2;
+	RESC::FrameHeader header;
+	RESC::MessageView view;
+	RESC::FrameStatus status;
+	RESC::OutQueue out;
+	RESC::OutQueueInit(&out);
+	out.version = RESC::PROTOCOL_V2;
+	out.canSlice = true;
+	SetNonBlocking(peerSock);
+	setsockopt(peerSock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &NOTSENT_LOWAT, sizeof(NOTSENT_LOWAT));
+	// Every hop's latency adds up and the out queue batches anyway, so
+	// Nagle would only hold a frame back for the other end's delayed ACK.
+	int noDelay = 1;
+	setsockopt(peerSock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+	RegisterPeer(peer, &out);
+	cout << "Cluster: linked to " << peer -> node << ((isUpstream) ? ", our upstream" : (isRelay) ? ", a relay" : "") << endl;
+
+	struct pollfd peerfd[2];
+	peerfd[0].fd = peerSock;
+	peerfd[1].fd = peer -> wakeSock;
+	peerfd[1].events = POLLIN;
+	string linkName = "node " + peer -> node;
+	bool isLinked = true;
+	while (isLinked) {
+		while ((status = RESC::FrameReaderNext(&reader, header, view)) == RESC::FRAME_READY) {
+			ProcessPeerFrame(peer, view);
+		}
+		if (status == RESC::FRAME_INVALID) {
+			break;
+		}
+		RESC::FrameReaderRelease(&reader);
+
+		RESC::MailboxArm(&peer -> mailbox);
+		RESC::MailNode* node;
+		while (isLinked && (node = RESC::MailboxPop(&peer -> mailbox)) != NULL) {
+			isLinked = QueueForSend(&out, node -> payload, linkName);
+			delete node;
+		}
+		if (!isLinked || RESC::FlushOutQueue(peerSock, &out) == RESC::FLUSH_ERROR) {
+			break;
+		}
+		ConfirmStored(&out);
+		peerfd[0].events = (RESC::OutQueueIsEmpty(&out)) ? POLLIN : (POLLIN | POLLOUT);
+		int pollSock = poll(peerfd, 2, -1);
+		if (pollSock > 0 && (peerfd[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+			int bytesRecv = RESC::FrameReaderFill(peerSock, &reader);
+			if (bytesRecv == 0 || (bytesRecv < 0 && errno != EAGAIN && errno != EINTR)) {
+				break;
+			}
+		}
+		if (pollSock > 0 && (peerfd[1].revents & POLLIN)) {
+			eventfd_t wakeCount;
+			eventfd_read(peer -> wakeSock, &wakeCount);
+		}
+	}
+	ConfirmStored(&out);
+	UnregisterPeer(peer, &out);
+	cout << "Cluster: lost the link to " << peer -> node << endl;
+	RESC::OutQueueClear(&out);
+	close(peer -> wakeSock);
+	delete peer;
+	return true;
+}
+
+void RegisterPeer(Peer* peer, RESC::OutQueue* out) {
+	// Under PublishLock, so the snapshot and the deltas after it neither
+	// overlap nor leave a hole.
+	vector<pair<string, string> > remote;
+	pthread_mutex_lock(&PublishLock);
+	CollectLocations(remote);
+	pthread_mutex_lock(&PeerLock);
+	peer -> advertised = AdvertisedTo(peer, remote);
+	RESC::Message snapshotMsg;
+	snapshotMsg.cmd = RESC::PRESENCE_MSG;
+	snapshotMsg.msg = to_string(peer -> advertisedVersion) + " full";
+	for (size_t i = 0; i < peer -> advertised.size(); i++) {
+		snapshotMsg.msg.append("\n").append(peer -> advertised[i]);
+	}
+	RESC::OutQueuePush(out, RESC::CreatePayload(snapshotMsg));
+	vector<Peer*>::iterator peerIter = PEERS.begin();
+	while (peerIter != PEERS.end() && (*peerIter) -> node != peer -> node) {
+		peerIter++;
+	}
+	if (peerIter != PEERS.end()) {
+		// The old link is most likely dead; it finds out on its own.
+		*peerIter = peer;
+	} else {
+		PEERS.push_back(peer);
+	}
+	pthread_mutex_unlock(&PeerLock);
+	pthread_mutex_unlock(&PublishLock);
+}
+
+void UnregisterPeer(Peer* peer, RESC::OutQueue* out) {
+	pthread_mutex_lock(&PeerLock);
+	vector<Peer*>::iterator peerIter = find(PEERS.begin(), PEERS.end(), peer);
+	bool isRoute = peerIter != PEERS.end();
+	if (isRoute) {
+		PEERS.erase(peerIter);
+	}
+	pthread_mutex_unlock(&PeerLock);
+
+	// Every producer posts under PeerLock, so nobody can reach the mailbox
+	// now. Direct messages we never sent are kept here until their user
+	// turns up again, while LOCATIONS still knows them.
+	StoreUnsent(out);
+	RESC::MailNode* node;
+	while ((node = RESC::MailboxPop(&peer -> mailbox)) != NULL) {
+		if (node -> payload -> cmd == RESC::DIRECT_MSG) {
+			DeliverOrStore(node -> payload);
+		}
+		RESC::ReleasePayload(node -> payload);
+		delete node;
+	}
+	if (isRoute) {
+		ForgetNode(peer -> node);
+		SchedulePresenceUpdate();
+	}
+}
+
+void ProcessPeerFrame(Peer* peer, RESC::MessageView msg) {
+	PEER_FRAMES.fetch_add(1, memory_order_relaxed);
+	if (msg.cmd == RESC::PRESENCE_MSG) {
+		ApplyGossip(peer -> node, msg.msg);
+		return;
+	}
+	if (msg.cmd != RESC::BROADCAST_MSG && msg.cmd != RESC::DIRECT_MSG &&
+		msg.cmd != RESC::FILE_STREAM_MSG && msg.cmd != RESC::ROOM_MSG) {
+		return;
+	}
+	// Every cluster node has a link to every other, so what came over one
+	// is only ours to deliver, and our relays'. A user who has just left
+	// here gets a direct message at their next login, wherever that is.
+	RESC::Payload* payload = RESC::CreatePayload(msg);
+	RESC::RegistryShard<MsgQueue*>* shard;
+	unordered_map<string, MsgQueue*>::iterator msgIter;
+	switch (msg.cmd) {
+		case RESC::BROADCAST_MSG:
+			if (ALL_HISTORY != NULL) {
+				RESC::HistoryRecord(ALL_HISTORY, payload);
+			}
+			BroadcastPayload(payload);
+			ForwardToPeers(payload, peer);
+			break;
+		case RESC::ROOM_MSG:
+			// Membership isn't gossiped: the sender's node checked it, so
+			// we only check the sender is one of that node's users.
+			if (IsReachedBy(string(msg.from), peer -> node)) {
+				PostToRoom(payload, NULL);
+				ForwardToPeers(payload, peer);
+			}
+			break;
+		case RESC::DIRECT_MSG:
+		case RESC::FILE_STREAM_MSG:
+			shard = RESC::RegistryShardFor(&MSG_QUEUE, payload -> to);
+			pthread_mutex_lock(&shard -> lock);
+				msgIter = shard -> entries.find(payload -> to);
+				if (msgIter != shard -> entries.end()) {
+					PostPayload((*msgIter).second, payload);
+				} else if (!ForwardToPeer(payload, peer) && msg.cmd == RESC::DIRECT_MSG) {
+					StoreOffline(payload);
+				}
+			pthread_mutex_unlock(&shard -> lock);
+			break;
+		default:
+			break;
+	}
+	RESC::ReleasePayload(payload);
+}
+
+void ApplyGossip(const string &node, string_view body) {
+	// Links keep frames in order, so versions need no checking here.
+	unsigned long version;
+	bool isSnapshot;
+	string_view entries;
+	if (!RESC::ParsePresence(body, version, isSnapshot, entries)) {
+		return;
+	}
+	if (isSnapshot) {
+		ForgetNode(node);
+	}
+	size_t start = 0;
+	while (start < entries.length()) {
+		size_t split = RESC::FindByte(entries, '\n', start);
+		if (split == string_view::npos) {
+			split = entries.length();
+		}
+		string_view entry = entries.substr(start, split - start);
+		if (isSnapshot) {
+			UpdateLocation(string(entry), node, true);
+		} else if (!entry.empty() && entry[0] == '+') {
+			UpdateLocation(string(entry.substr(1)), node, true);
+		} else if (!entry.empty() && entry[0] == '-') {
+			UpdateLocation(string(entry.substr(1)), node, false);
+		}
+		start = split + 1;
+	}
+	SchedulePresenceUpdate();
+}
+
+void UpdateLocation(const string &username, const string &node, bool isOnline) {
+	// Under the user's MSG_QUEUE shard lock: a direct message for them is
+	// either stored before this or finds them on node, never neither.
+	RESC::RegistryShard<MsgQueue*>* queueShard = RESC::RegistryShardFor(&MSG_QUEUE, username);
+	pthread_mutex_lock(&queueShard -> lock);
+	RESC::RegistryShard<string>* shard = RESC::RegistryShardFor(&LOCATIONS, username);
+	pthread_mutex_lock(&shard -> lock);
+	string &location = shard -> entries[username];
+	if (isOnline) {
+		location = node;
+	} else if (location == node) {
+		location.clear();
+	}
+	pthread_mutex_unlock(&shard -> lock);
+	if (isOnline && isOfflineLogOpen && queueShard -> entries.count(username) == 0 &&
+		RESC::LogHasWaiting(&OFFLINE_LOG, username)) {
+		vector<RESC::Payload*> stored;
+		RESC::LogDrain(&OFFLINE_LOG, username, stored);
+		// Confirmed once the link has sent them; until then they wait here.
+		for (size_t i = 0; i < stored.size(); i++) {
+			PostToPeer(node, stored[i], NULL);
+			RESC::ReleasePayload(stored[i]);
+		}
+		cout << "Offline: " << stored.size() << " messages forwarded to " << username << " on " << node << endl;
+	}
+	pthread_mutex_unlock(&queueShard -> lock);
+}
+
+void ForgetNode(const string &node) {
+	for (size_t i = 0; i < RESC::REGISTRY_SHARDS; i++) {
+		RESC::RegistryShard<string>* shard = &LOCATIONS.shards[i];
+		pthread_mutex_lock(&shard -> lock);
+		unordered_map<string, string>::iterator locationIter = shard -> entries.begin();
+		while (locationIter != shard -> entries.end()) {
+			if ((*locationIter).second == node) {
+				(*locationIter).second.clear();
+			}
+			locationIter++;
+		}
+		pthread_mutex_unlock(&shard -> lock);
+	}
+}
+
+bool IsReachedBy(const string &username, const string &node) {
+	RESC::RegistryShard<string>* shard = RESC::RegistryShardFor(&LOCATIONS, username);
+	pthread_mutex_lock(&shard -> lock);
+	unordered_map<string, string>::iterator locationIter = shard -> entries.find(username);
+	bool isReached = locationIter != shard -> entries.end() && (*locationIter).second == node;
+	pthread_mutex_unlock(&shard -> lock);
+	return isReached;
+}
+
+bool ForwardToPeer(RESC::Payload* payload, Peer* from) {
+	string node;
+	RESC::RegistryShard<string>* shard = RESC::RegistryShardFor(&LOCATIONS, payload -> to);
+	pthread_mutex_lock(&shard -> lock);
+	unordered_map<string, string>::iterator locationIter = shard -> entries.find(payload -> to);
+	if (locationIter != shard -> entries.end()) {
+		node = (*locationIter).second;
+	}
+	pthread_mutex_unlock(&shard -> lock);
+	return !node.empty() && PostToPeer(node, payload, from);
+}
+
+bool PostToPeer(const string &node, RESC::Payload* payload, Peer* from) {
+	bool isPosted = false;
+	pthread_mutex_lock(&PeerLock);
+	for (size_t i = 0; i < PEERS.size(); i++) {
+		if (PEERS[i] -> node == node) {
+			// A stale location must not bounce it back, or round the cluster.
+			if (IsForwarded(from, PEERS[i])) {
+				PostToLink(PEERS[i], payload);
+				isPosted = true;
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&PeerLock);
+	return isPosted;
+}
+
+void ForwardToPeers(RESC::Payload* payload, Peer* from) {
+	pthread_mutex_lock(&PeerLock);
+	for (size_t i = 0; i < PEERS.size(); i++) {
+		if (IsForwarded(from, PEERS[i])) {
+			PostToLink(PEERS[i], payload);
+		}
+	}
+	pthread_mutex_unlock(&PeerLock);
+}
+
+bool IsForwarded(Peer* from, Peer* to) {
+	// The tree has no cycles and the cluster is one hop across, so this is
+	// enough for every frame to reach every node once.
+	if (from == NULL) {
+		return true;
+	}
+	return to != from && to -> node != from -> node && (from -> isTree || to -> isTree);
+}
+
+void GossipToPeers(const vector<pair<string, string> > &remote) {
+	pthread_mutex_lock(&PeerLock);
+	for (size_t i = 0; i < PEERS.size(); i++) {
+		Peer* peer = PEERS[i];
+		vector<string> users = AdvertisedTo(peer, remote);
+		string changes = PresenceChanges(peer -> advertised, users);
+		if (changes.empty()) {
+			continue;
+		}
+		peer -> advertisedVersion++;
+		peer -> advertised.swap(users);
+		RESC::Message gossipMsg;
+		gossipMsg.cmd = RESC::PRESENCE_MSG;
+		gossipMsg.msg = to_string(peer -> advertisedVersion) + " delta" + changes;
+		RESC::Payload* gossipPayload = RESC::CreatePayload(gossipMsg);
+		PostToLink(peer, gossipPayload);
+		RESC::ReleasePayload(gossipPayload);
+	}
+	pthread_mutex_unlock(&PeerLock);
+}
+
+vector<string> AdvertisedTo(Peer* peer, const vector<pair<string, string> > &remote) {
+	vector<string> users(LOCAL_USERS);
+	if (peer -> isTree) {
+		for (size_t i = 0; i < remote.size(); i++) {
+			if (remote[i].second != peer -> node) {
+				users.push_back(remote[i].first);
+			}
+		}
+	} else {
+		// A cluster node hears about the rest of the cluster from itself.
+		unordered_set<string> treeNodes;
+		for (size_t i = 0; i < PEERS.size(); i++) {
+			if (PEERS[i] -> isTree) {
+				treeNodes.insert(PEERS[i] -> node);
+			}
+		}
+		for (size_t i = 0; i < remote.size() && !treeNodes.empty(); i++) {
+			if (treeNodes.count(remote[i].second) > 0) {
+				users.push_back(remote[i].first);
+			}
+		}
+	}
+	sort(users.begin(), users.end());
+	users.erase(unique(users.begin(), users.end()), users.end());
+	return users;
+}
+
+void CollectLocations(vector<pair<string, string> > &remote) {
+	for (size_t i = 0; i < RESC::REGISTRY_SHARDS; i++) {
+		RESC::RegistryShard<string>* shard = &LOCATIONS.shards[i];
+		pthread_mutex_lock(&shard -> lock);
+		unordered_map<string, string>::iterator locationIter = shard -> entries.begin();
+		while (locationIter != shard -> entries.end()) {
+			if (!(*locationIter).second.empty()) {
+				remote.push_back(*locationIter);
+			}
+			locationIter++;
+		}
+		pthread_mutex_unlock(&shard -> lock);
+	}
+}
+
+void PostToLink(Peer* peer, RESC::Payload* payload) {
+	RESC::MailNode* node = new RESC::MailNode;
+	RESC::RetainPayload(payload);
+	node -> payload = payload;
+	node -> target = 0;
+	if (RESC::MailboxPush(&peer -> mailbox, node)) {
+		eventfd_write(peer -> wakeSock, 1);
+	}
+	FORWARDED_FRAMES.fetch_add(1, memory_order_relaxed);
+}
+
+void* ReactorThread(void* args_p) {
+	Reactor* reactor = (Reactor*) args_p;
+	PinReactor(reactor);
+	if (SERVER_MODE == URING_MODE && StartUring(reactor)) {
+		RunUringLoop(reactor);
+	} else {
+		RunEpollLoop(reactor);
+	}
+	pthread_exit(NULL);
+}
+
+void RunEpollLoop(Reactor* reactor) {
+	struct epoll_event events[MAX_EVENTS];
+	while (true) {
+		int eventCount = epoll_wait(reactor -> epollSock, events, MAX_EVENTS, -1);
+		if (eventCount < 0 && errno != EINTR) {
+			cerr << "epoll_wait failed." << endl;
+			return;
+		}
+		for (int i = 0; i < eventCount; i++) {
+			Connection* conn = (Connection*) events[i].data.ptr;
+			if (conn == NULL) {
+				AcceptConnections(reactor);
+				continue;
+			}
+			if ((void*) conn == (void*) reactor) {
+				DrainInbound(reactor);
+				continue;
+			}
+			if (conn -> state == CONN_CLOSED || conn -> isParked) {
+				// Already closed earlier in this batch.
+				continue;
+			}
+			if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+				ReadConnection(conn);
+			}
+			if (conn -> state != CONN_CLOSED && (events[i].events & EPOLLOUT)) {
+				FlushConnection(conn);
+			}
+			if (conn -> state == CONN_CLOSED) {
+				CloseConnection(reactor, conn);
+			}
+		}
+		FreeClosedConnections(reactor);
+	}
+}
+
+bool StartUring(Reactor* reactor) {
+	RESC::Uring* ring = new RESC::Uring;
+	// Accept, recv, send and poll are all there from 5.6; the buffer ring
+	// needs 5.19 and multishot recv 6.0.
+	const unsigned char opcodes[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_POLL_ADD };
+	if (!RESC::UringInit(ring, 4096)) {
+		delete ring;
+		cerr << "RESCD: reactor " << reactor -> index << " falling back to epoll." << endl;
+		return false;
+	}
+	if (!RESC::UringSupports(ring, opcodes, sizeof(opcodes)) || !RESC::UringCanRecvMultishot(ring)) {
+		cerr << "RESCD: io_uring lacks multishot recv; reactor " << reactor -> index << " falling back to epoll." << endl;
+		RESC::UringClose(ring);
+		delete ring;
+		return false;
+	}
+	// Accepting and wakeups stay armed for the life of the ring.
+	reactor -> ring = ring;
+	reactor -> isAcceptArmed = false;
+	reactor -> isWakeArmed = false;
+	ArmReactor(reactor);
+	cout << "RESCD: reactor " << reactor -> index << " on io_uring." << endl;
+	return true;
+}
+
+void RunUringLoop(Reactor* reactor) {
+	RESC::Uring* ring = reactor -> ring;
+	while (true) {
+		// Everything queued by the last batch, sends included, goes to the
+		// kernel in this one call.
+		// Nor wait while accept or wakeup is unarmed: nothing may come to
+		// end the wait.
+		bool isArmed = reactor -> isAcceptArmed && reactor -> isWakeArmed;
+		int minComplete = (RESC::UringHasCompletions(ring) || !isArmed) ? 0 : 1;
+		if (RESC::UringSubmit(ring, minComplete) < 0 && errno != EAGAIN && errno != EBUSY) {
+			cerr << "io_uring_enter failed: " << strerror(errno) << endl;
+			return;
+		}
+		struct io_uring_cqe cqe;
+		while (RESC::UringNextCompletion(ring, cqe)) {
+			HandleCompletion(reactor, cqe);
+		}
+		// Re-armed once completions are reaped, when the ring has room.
+		ArmReactor(reactor);
+		FreeClosedConnections(reactor);
+	}
+}
+
+void ArmReactor(Reactor* reactor) {
+	struct io_uring_sqe* sqe;
+	if (!reactor -> isAcceptArmed && (sqe = RESC::UringGetSqe(reactor -> ring)) != NULL) {
+		RESC::UringPrepAcceptMultishot(sqe, reactor -> listenSock, (uint64_t) reactor | URING_ACCEPT);
+		reactor -> isAcceptArmed = true;
+	}
+	if (!reactor -> isWakeArmed && (sqe = RESC::UringGetSqe(reactor -> ring)) != NULL) {
+		RESC::UringPrepPollMultishot(sqe, reactor -> wakeSock, (uint64_t) reactor | URING_WAKE);
+		reactor -> isWakeArmed = true;
+	}
+}
+
+void HandleCompletion(Reactor* reactor, struct io_uring_cqe &cqe) {
+	UringOp op = (UringOp) (cqe.user_data & URING_OP_MASK);
+	bool isArmed = (cqe.flags & IORING_CQE_F_MORE) != 0;
+	switch (op) {
+		case URING_ACCEPT:
+			if (cqe.res >= 0) {
+				Connection* conn = CreateConnection(reactor, cqe.res);
+				if (!ArmRecv(reactor, conn)) {
+					CloseConnection(reactor, conn);
+				}
+			} else if (cqe.res != -EAGAIN && cqe.res != -EINTR) {
+				cerr << "Error accepting connections." << endl;
+			}
+			reactor -> isAcceptArmed = isArmed;
+			break;
+		case URING_WAKE:
+			reactor -> isWakeArmed = isArmed;
+			DrainInbound(reactor);
+			break;
+		case URING_RECV:
+			HandleRecvCompletion(reactor, (Connection*) (cqe.user_data & ~URING_OP_MASK), cqe);
+			break;
+		case URING_SEND:
+			HandleSendCompletion(reactor, (Connection*) (cqe.user_data & ~URING_OP_MASK), cqe);
+			break;
+		case URING_CANCEL: {
+			// A moving connection's recv is cancelled before the socket goes.
+			Connection* conn = (Connection*) (cqe.user_data & ~URING_OP_MASK);
+			conn -> pendingOps--;
+			if (conn -> state == CONN_MOVING && conn -> pendingOps == 0) {
+				MoveConnection(reactor, conn);
+			}
+			break;
+		}
+	}
+}
+
+void HandleRecvCompletion(Reactor* reactor, Connection* conn, struct io_uring_cqe &cqe) {
+	if (!(cqe.flags & IORING_CQE_F_MORE)) {
+		conn -> pendingOps--;
+	}
+	bool isReading = conn -> state != CONN_CLOSED && !conn -> isParked;
+	if (cqe.flags & IORING_CQE_F_BUFFER) {
+		unsigned short bufferId = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+		if (cqe.res > 0 && isReading) {
+			RESC::FrameReaderAppend(&conn -> reader, RESC::UringBuffer(reactor -> ring, bufferId), cqe.res);
+		}
+		RESC::UringReturnBuffer(reactor -> ring, bufferId);
+	}
+	if (!isReading) {
+		// Already closed or parked; this was the recv winding down.
+		return;
+	}
+	if (conn -> state == CONN_MOVING) {
+		// Anything that came in goes along with the socket.
+		if (conn -> pendingOps == 0) {
+			MoveConnection(reactor, conn);
+		}
+		return;
+	}
+	if (cqe.res > 0) {
+		HandleFrames(conn);
+		RESC::FrameReaderRelease(&conn -> reader);
+		if (conn -> state == CONN_MOVING) {
+			// The cancel completes the recv.
+			return;
+		}
+		if (conn -> state != CONN_CLOSED) {
+			FlushConnection(conn);
+		}
+	} else if (cqe.res != -ENOBUFS) {
+		// Orderly shutdown or hard error.
+		conn -> state = CONN_CLOSED;
+	}
+	// Running out of buffers or the kernel deciding so ends a multishot
+	// recv; start another.
+	if (conn -> state != CONN_CLOSED && !(cqe.flags & IORING_CQE_F_MORE)) {
+		ArmRecv(reactor, conn);
+	}
+	if (conn -> state == CONN_CLOSED) {
+		CloseConnection(reactor, conn);
+	}
+}
+
+void HandleSendCompletion(Reactor* reactor, Connection* conn, struct io_uring_cqe &cqe) {
+	conn -> pendingOps--;
+	reactor -> spareSends.push_back(conn -> send);
+	conn -> send = NULL;
+	if (conn -> state == CONN_CLOSED) {
+		return;
+	}
+	if (conn -> isParked) {
+		// The socket has gone; what this got out is only kept for the
+		// resume, which may have been waiting on it.
+		if (cqe.res > 0) {
+			RESC::OutQueueAdvance(&conn -> out, cqe.res);
+		}
+		Connection* adopter = conn -> session -> adopter;
+		if (adopter != NULL) {
+			AdoptSession(reactor, adopter, conn -> session);
+			ServeAdopted(reactor, adopter);
+		}
+		return;
+	}
+	if (cqe.res < 0) {
+		conn -> state = CONN_CLOSED;
+		CloseConnection(reactor, conn);
+		return;
+	}
+	RESC::OutQueueAdvance(&conn -> out, cqe.res);
+	FlushConnection(conn);
+	if (conn -> state == CONN_CLOSED) {
+		CloseConnection(reactor, conn);
+	}
+}
+
+bool ArmRecv(Reactor* reactor, Connection* conn) {
+	struct io_uring_sqe* sqe = RESC::UringGetSqe(reactor -> ring);
+	if (sqe == NULL) {
+		conn -> state = CONN_CLOSED;
+		return false;
+	}
+	RESC::UringPrepRecvMultishot(sqe, conn -> sock, (uint64_t) conn | URING_RECV);
+	conn -> pendingOps++;
+	return true;
+}
+
+void UringFlushConnection(Connection* conn) {
+	// One send in flight per connection keeps the stream in order; its
+	// completion picks up whatever was queued meanwhile.
+	if (conn -> send != NULL || RESC::OutQueueIsEmpty(&conn -> out)) {
+		return;
+	}
+	Reactor* reactor = conn -> reactor;
+	UringSend* send;
+	if (reactor -> spareSends.empty()) {
+		send = new UringSend;
+	} else {
+		send = reactor -> spareSends.back();
+		reactor -> spareSends.pop_back();
+	}
+	memset(&send -> msgHeader, 0, sizeof(send -> msgHeader));
+	send -> msgHeader.msg_iov = send -> iov;
+	send -> msgHeader.msg_iovlen = RESC::OutQueueGather(&conn -> out, send -> headers, send -> iov);
+	int fd;
+	off_t position;
+	size_t length;
+	if (send -> msgHeader.msg_iovlen == 0 && RESC::OutQueueFilePart(&conn -> out, fd, position, length)) {
+		// Read the file bytes in and send them like any others.
+		send -> fileBytes.resize(length);
+		ssize_t bytesRead = pread(fd, &send -> fileBytes[0], length, position);
+		if (bytesRead <= 0) {
+			reactor -> spareSends.push_back(send);
+			conn -> state = CONN_CLOSED;
+			return;
+		}
+		send -> iov[0].iov_base = &send -> fileBytes[0];
+		send -> iov[0].iov_len = bytesRead;
+		send -> msgHeader.msg_iovlen = 1;
+	}
+	struct io_uring_sqe* sqe = RESC::UringGetSqe(reactor -> ring);
+	if (sqe == NULL) {
+		reactor -> spareSends.push_back(send);
+		conn -> state = CONN_CLOSED;
+		return;
+	}
+	RESC::UringPrepSendmsg(sqe, conn -> sock, &send -> msgHeader, (uint64_t) conn | URING_SEND);
+	conn -> out.syscalls++;
+	conn -> send = send;
+	conn -> pendingOps++;
+}
+
+void AcceptConnections(Reactor* reactor) {
+	while (true) {
+		struct sockaddr_in clientAddress;
+		socklen_t addrLen = sizeof(clientAddress);
+		int requestSock = accept(reactor -> listenSock, (struct sockaddr*) &clientAddress, &addrLen);
+		if (requestSock < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				cerr << "Error accepting connections." << endl;
+			}
+			return;
+		}
+		if (!SetNonBlocking(requestSock)) {
+			close(requestSock);
+			continue;
+		}
+
+		Connection* conn = CreateConnection(reactor, requestSock);
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = conn;
+		if (epoll_ctl(reactor -> epollSock, EPOLL_CTL_ADD, requestSock, &ev) < 0) {
+			cerr << "Error registering connection." << endl;
+			reactor -> connections.erase(conn -> id);
+			close(requestSock);
+			delete conn;
+			continue;
+		}
+	}
+}
+
+Connection* CreateConnection(Reactor* reactor, int requestSock) {
+	Connection* conn = new Connection;
+	conn -> id = NEXT_CONNECTION_ID.fetch_add(1, memory_order_relaxed);
+	conn -> sock = requestSock;
+	conn -> state = CONN_AUTH;
+	conn -> user.isConnected = false;
+	RESC::FrameReaderInit(&conn -> reader);
+	RESC::OutQueueInit(&conn -> out);
+	conn -> reactor = reactor;
+	conn -> queue = NULL;
+	conn -> hasPendingFlush = false;
+	conn -> pendingOps = 0;
+	conn -> send = NULL;
+	conn -> session = NULL;
+	conn -> isParked = false;
+	conn -> canPark = true;
+	conn -> resuming = NULL;
+	setsockopt(requestSock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &NOTSENT_LOWAT, sizeof(NOTSENT_LOWAT));
+	reactor -> connections[conn -> id] = conn;
+	return conn;
+}
+
+void ReadConnection(Connection* conn) {
+	// Edge triggered, so keep reading until the socket is empty, handling
+	// the complete frames from each recv() before the next one. A resuming
+	// login stops here and leaves the rest for the session's reactor.
+	while (conn -> state == CONN_AUTH || conn -> state == CONN_CHAT) {
+		int bytesRecv = RESC::FrameReaderFill(conn -> sock, &conn -> reader);
+		if (bytesRecv < 0 && errno == EINTR) {
+			continue;
+		}
+		if (bytesRecv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		}
+		if (bytesRecv <= 0) {
+			// Orderly shutdown or hard error.
+			conn -> state = CONN_CLOSED;
+			break;
+		}
+		HandleFrames(conn);
+	}
+	RESC::FrameReaderRelease(&conn -> reader);
+	if (conn -> state == CONN_MOVING) {
+		MoveConnection(conn -> reactor, conn);
+		return;
+	}
+
+	// Send the auth reply and, for delta users, the login snapshot.
+	if (conn -> state != CONN_CLOSED) {
+		FlushConnection(conn);
+	}
+}
+
+void HandleFrames(Connection* conn) {
+	RESC::FrameHeader header;
+	RESC::MessageView view;
+	RESC::FrameStatus status = RESC::FRAME_PARTIAL;
+	while ((conn -> state == CONN_AUTH || conn -> state == CONN_CHAT) &&
+		(status = RESC::FrameReaderNext(&conn -> reader, header, view)) == RESC::FRAME_READY) {
+		HandleFrame(conn, view);
+	}
+	if (status == RESC::FRAME_INVALID) {
+		conn -> canPark = false;
+		conn -> state = CONN_CLOSED;
+	}
+}
+
+void HandleFrame(Connection* conn, RESC::MessageView &msg) {
+	switch (conn -> state) {
+		case CONN_AUTH: {
+			SessionOptions options;
+			string authResponse;
+			bool hasValidated = Authenticate(msg.msg, conn -> user, options, authResponse);
+			if (options.session != NULL) {
+				// The reply goes out once the session is ours.
+				options.session -> resumeSeq = options.resumeSeq;
+				options.session -> authResponse = authResponse;
+				TakeOverSession(conn, options.session);
+				break;
+			}
+			RESC::OutQueuePush(&conn -> out, RESC::CreateRawPayload(authResponse));
+			if (hasValidated) {
+				// Frames after the login, even ones already buffered, use
+				// the agreed framing.
+				conn -> reader.version = options.version;
+				conn -> out.version = options.version;
+				conn -> out.canSlice = options.canSlice;
+				conn -> state = CONN_CHAT;
+				conn -> queue = OpenQueue(conn -> user.username, -1, conn, options);
+				OfferTransfers(conn -> user.username, conn -> queue);
+				SchedulePresenceUpdate();
+				if (options.canResume) {
+					conn -> out.keepSent = RESUME_WINDOW;
+					conn -> session = OpenSession(options, conn -> user.username, conn -> queue, conn -> sock, -1, conn);
+				}
+			}
+			break;
+		}
+		case CONN_CHAT:
+			if (!ProcessFrame(msg, conn -> user.username, conn -> queue)) {
+				conn -> canPark = false;
+				conn -> state = CONN_CLOSED;
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+void DrainInbound(Reactor* reactor) {
+	eventfd_t wakeCount;
+	eventfd_read(reactor -> wakeSock, &wakeCount);
+
+	// Queue everything first so each connection gets one flush however
+	// many payloads it was sent.
+	vector<Connection*> pending;
+	RESC::MailboxArm(&reactor -> inbound);
+	RESC::MailNode* node;
+	while ((node = RESC::MailboxPop(&reactor -> inbound)) != NULL) {
+		RESC::Payload* payload = node -> payload;
+		if (payload == NULL) {
+			HandleSessionEvent(reactor, node -> target);
+			delete node;
+			continue;
+		}
+		if (node -> target == 0) {
+			// This reactor's share of a fan-out; the others do theirs
+			// at the same time.
+			long startNs = NowNs();
+			long delivered = 0;
+			if (payload -> cmd == RESC::ROOM_MSG) {
+				delivered = DeliverToRoom(reactor, payload, pending);
+			} else {
+				unordered_map<uint64_t, Connection*>::iterator connIter = reactor -> connections.begin();
+				while (connIter != reactor -> connections.end()) {
+					Connection* conn = (*connIter).second;
+					if (conn -> state == CONN_CHAT &&
+						IsBroadcastFor(payload, conn -> user.username, conn -> queue)) {
+						DeliverToConnection(conn, payload, pending);
+						delivered++;
+					}
+					connIter++;
+				}
+			}
+			RecordFanout(delivered, NowNs() - startNs);
+		} else {
+			// The connection may have gone since this was posted; ids are
+			// never reused, so a miss just means nobody to deliver to.
+			unordered_map<uint64_t, Connection*>::iterator connIter = reactor -> connections.find(node -> target);
+			if (connIter != reactor -> connections.end() && (*connIter).second -> state == CONN_CHAT) {
+				DeliverToConnection((*connIter).second, payload, pending);
+			} else if (payload -> cmd == RESC::DIRECT_MSG) {
+				DeliverOrStore(payload);
+			}
+		}
+		RESC::ReleasePayload(payload);
+		delete node;
+	}
+
+	for (int i = 0; i < pending.size(); i++) {
+		pending[i] -> hasPendingFlush = false;
+		if (pending[i] -> state == CONN_CHAT) {
+			FlushConnection(pending[i]);
+		}
+		if (pending[i] -> state == CONN_CLOSED) {
+			CloseConnection(reactor, pending[i]);
+		}
+	}
+}
+
+long DeliverToRoom(Reactor* reactor, RESC::Payload* payload, vector<Connection*> &pending) {
+	unordered_map<string, RESC::MemberSet<Connection*>>::iterator localIter = reactor -> rooms.find(payload -> to);
+	if (localIter == reactor -> rooms.end()) {
+		// Everyone here left since it was posted.
+		return 0;
+	}
+	long delivered = 0;
+	vector<Connection*> &members = (*localIter).second.members;
+	for (size_t i = 0; i < members.size(); i++) {
+		Connection* conn = members[i];
+		if (conn -> state == CONN_CHAT && IsBroadcastFor(payload, conn -> user.username, conn -> queue)) {
+			DeliverToConnection(conn, payload, pending);
+			delivered++;
+		}
+	}
+	return delivered;
+}
+
+void DeliverToConnection(Connection* conn, RESC::Payload* payload, vector<Connection*> &pending) {
+	RESC::RetainPayload(payload);
+	if (!QueueForSend(&conn -> out, payload, conn -> user.username)) {
+		// Closed once the inbound pass is done with it.
+		conn -> canPark = false;
+		conn -> state = CONN_CLOSED;
+	}
+	if (!conn -> hasPendingFlush) {
+		conn -> hasPendingFlush = true;
+		pending.push_back(conn);
+	}
+}
+
+void PinReactor(Reactor* reactor) {
+	// Reactor i gets the i-th CPU we are allowed on, wrapping around when
+	// there are more reactors than CPUs.
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+		return;
+	}
+	int skip = reactor -> index % CPU_COUNT(&allowed);
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &allowed) || skip-- > 0) {
+			continue;
+		}
+		cpu_set_t pinned;
+		CPU_ZERO(&pinned);
+		CPU_SET(cpu, &pinned);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(pinned), &pinned) == 0) {
+			cout << "RESCD: reactor " << reactor -> index << " pinned to CPU " << cpu << "." << endl;
+		}
+		return;
+	}
+}
+
+void FlushConnection(Connection* conn) {
+	if (conn -> isParked) {
+		// Kept for whoever resumes the session.
+		return;
+	}
+	if (conn -> reactor -> ring != NULL) {
+		// The send completion has already advanced past what went out.
+		ConfirmStored(&conn -> out);
+		UringFlushConnection(conn);
+		return;
+	}
+	// FLUSH_BLOCKED leaves the rest queued; EPOLLOUT calls us back once the
+	// socket drains.
+	if (RESC::FlushOutQueue(conn -> sock, &conn -> out) == RESC::FLUSH_ERROR) {
+		conn -> state = CONN_CLOSED;
+	}
+	ConfirmStored(&conn -> out);
+}
 
-int main (int argc, char * argv[])
-{
-	// Process Arguments
-	unsigned short serverPort; 
-	if (argc != 2){
-		// Incorrect number of arguments
-		cerr << "Incorrect number of arguments. Please try again." << endl;
-		return -1;
+void CloseConnection(Reactor* reactor, Connection* conn) {
+	if (conn -> sock < 0 && !conn -> isParked) {
+		// Already closed this batch.
+		return;
 	}
-	serverPort = atoi(argv[1]); 
-	
-	// Create socket connection
-	conn_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (conn_socket < 0){
-		cerr << "Error with socket." << endl;
-		exit(-1);
+	if (conn -> resuming != NULL) {
+		// Went before it could take the session over.
+		if (conn -> resuming -> adopter == conn) {
+			conn -> resuming -> adopter = NULL;
+		}
+		ReleaseClaim(conn -> resuming);
+		conn -> resuming = NULL;
 	}
-	
-	// Set the socket Fields
-	struct sockaddr_in serverAddress;
-	serverAddress.sin_family = AF_INET;    // Always AF_INET
-	serverAddress.sin_addr.s_addr = htonl(INADDR_ANY);
-	serverAddress.sin_port = htons(serverPort);
-	
-	// Assign Port to socket
-	int sock_status = bind(conn_socket, (struct sockaddr *) &serverAddress, sizeof(serverAddress));
-	if (sock_status < 0) {
-		cerr << "Error with bind." << endl;
-		exit(-1);
+	// Parked before the socket closes, so a claim never cuts off a
+	// descriptor that has been reused.
+	bool isKept = conn -> session != NULL && ParkSession(conn -> session, conn -> canPark && conn -> sock >= 0, NULL);
+	if (!isKept && conn -> user.isConnected) {
+		DisconnectUser(conn -> user, conn -> queue);
+		if (conn -> isParked) {
+			ConfirmStored(&conn -> out);
+			StoreUnsent(&conn -> out);
+		}
 	}
-	
-	// Set socket to listen.
-	int listen_status = listen(conn_socket, MAXPENDING);
-	if (listen_status < 0) {
-		cerr << "Error with listening." << endl;
-		exit(-1);
+	if (conn -> sock >= 0) {
+		// Anything still posted to us names the connection by id, which
+		// stops resolving here, unless we are parking.
+		if (reactor -> ring != NULL) {
+			// Requests in flight hold the socket open past close(); shutting
+			// it down is what ends them.
+			shutdown(conn -> sock, SHUT_RDWR);
+		} else {
+			epoll_ctl(reactor -> epollSock, EPOLL_CTL_DEL, conn -> sock, NULL);
+		}
+		close(conn -> sock);
+		conn -> sock = -1;
 	}
-	
-	// We are good to go! Alert admin running that we can now accept requests
-	cout << endl << "RESCD: Ready to accept connections. " << endl;
-	
-	
-	// Process Interrupts so we can gracefully exit()
-	struct sigaction sigIntHandler;
-	sigIntHandler.sa_handler = ProcessSignal;
-	sigemptyset(&sigIntHandler.sa_mask);
-	sigIntHandler.sa_flags = 0;
-	sigaction(SIGINT, &sigIntHandler, NULL);
-	
-	// Accept connections
-	while (true) {
-		// Accept connections
-		struct sockaddr_in clientAddress;
-		socklen_t addrLen = sizeof(clientAddress);
-		int requestSock = accept(conn_socket, (struct sockaddr*) &clientAddress, &addrLen);
-		if (requestSock < 0) {
-			cerr << "Error accepting connections." << endl;
-			exit(-1);
+	if (isKept) {
+		if (!conn -> isParked) {
+			cout << "Session: parking " << conn -> user.username << " for " << RESUME_GRACE_SECONDS << " seconds" << endl;
 		}
+		conn -> isParked = true;
+		conn -> state = CONN_CHAT;
+		return;
+	}
+	delete conn -> session;
+	conn -> session = NULL;
+	conn -> isParked = false;
+	reactor -> connections.erase(conn -> id);
+	conn -> state = CONN_CLOSED;
+	reactor -> closed.push_back(conn);
+	cout << "Closing socket" << endl;
+}
 
-		// Create child thread to handle process
-		struct threadArgs* args_p = new threadArgs;
-		args_p -> requestSocket = requestSock;
-		pthread_t tid;
-		int threadStatus = pthread_create(&tid, NULL, requestThread, (void*)args_p);
-		if (threadStatus != 0){
-			// Failed to create child thread
-			cerr << "Failed to create child process." << endl;
-			close(requestSock);
-			pthread_exit(NULL);
+void FreeClosedConnections(Reactor* reactor) {
+	// The output queue goes last: an in-flight send still points into it.
+	size_t kept = 0;
+	for (size_t i = 0; i < reactor -> closed.size(); i++) {
+		Connection* conn = reactor -> closed[i];
+		if (conn -> pendingOps > 0) {
+			reactor -> closed[kept++] = conn;
+			continue;
 		}
+		RESC::OutQueueClear(&conn -> out);
+		delete conn;
 	}
-
-	return 0;
+	reactor -> closed.resize(kept);
 }
 
+void TakeOverSession(Connection* conn, Session* session) {
+	Reactor* reactor = conn -> reactor;
+	conn -> resuming = session;
+	if (session -> reactor == reactor) {
+		AdoptSession(reactor, conn, session);
+		return;
+	}
+	conn -> state = CONN_MOVING;
+	if (reactor -> ring == NULL) {
+		// ReadConnection moves it once this read is done.
+		return;
+	}
+	struct io_uring_sqe* sqe = RESC::UringGetSqe(reactor -> ring);
+	if (sqe == NULL) {
+		conn -> state = CONN_CLOSED;
+		return;
+	}
+	RESC::UringPrepCancel(sqe, (uint64_t) conn | URING_RECV, (uint64_t) conn | URING_CANCEL);
+	conn -> pendingOps++;
+}
 
-void* requestThread(void* args_p) {
-  
-	// Local Variables
-	threadArgs* tmp = (threadArgs*) args_p;
-	int requestSocket = tmp -> requestSocket;
-	delete tmp;
-
-	// Detach Thread to ensure that resources are deallocated on return.
-	pthread_detach(pthread_self());
+void AdoptSession(Reactor* reactor, Connection* conn, Session* session) {
+	unordered_map<uint64_t, Connection*>::iterator connIter = reactor -> connections.find(session -> connId);
+	if (connIter == reactor -> connections.end()) {
+		// A claimed session's connection stays until it is adopted.
+		cerr << "Session for " << session -> username << " has no connection." << endl;
+		conn -> state = CONN_CLOSED;
+		return;
+	}
+	Connection* old = (*connIter).second;
+	if (!old -> isParked) {
+		// The claim cut its socket off; it may just not have noticed yet.
+		old -> state = CONN_CLOSED;
+		CloseConnection(reactor, old);
+	}
+	if (old -> send != NULL) {
+		// The send in flight still points into its output queue.
+		conn -> state = CONN_RESUMING;
+		session -> adopter = conn;
+		return;
+	}
+	session -> adopter = NULL;
+	conn -> user = old -> user;
+	conn -> queue = old -> queue;
+	conn -> session = session;
+	conn -> resuming = NULL;
+	conn -> out = move(old -> out);
+	RESC::OutQueueInit(&old -> out);
+	for (size_t i = 0; i < conn -> queue -> rooms.size(); i++) {
+		RESC::MemberSet<Connection*> &members = reactor -> rooms[conn -> queue -> rooms[i]];
+		RESC::MemberSetRemove(&members, old);
+		RESC::MemberSetAdd(&members, conn);
+	}
+	// Everything posted to the session names its connection id.
+	reactor -> connections.erase(conn -> id);
+	conn -> id = old -> id;
+	reactor -> connections[conn -> id] = conn;
+	old -> isParked = false;
+	old -> session = NULL;
+	old -> user.isConnected = false;
+	old -> queue = NULL;
+	old -> state = CONN_CLOSED;
+	reactor -> closed.push_back(old);
 
-	// Handle Request
-	ProcessRequest(requestSocket);
+	RESC::RegistryShard<Session*>* shard = RESC::RegistryShardFor(&SESSIONS, session -> token);
+	pthread_mutex_lock(&shard -> lock);
+	session -> state = SESSION_ATTACHED;
+	session -> isClaimed = false;
+	session -> sock = conn -> sock;
+	pthread_mutex_unlock(&shard -> lock);
 
-	// Close Client socket
-	close(requestSocket);
+	uint64_t from = RESC::OutQueueResume(&conn -> out, session -> resumeSeq);
+	RESC::OutQueuePushFirst(&conn -> out, RESC::CreateRawPayload(session -> authResponse + " resumed=" + to_string(from)));
+	conn -> reader.version = RESC::PROTOCOL_V2;
+	conn -> state = CONN_CHAT;
+	RESUMED_SESSIONS.fetch_add(1, memory_order_relaxed);
+	cout << "Session: " << conn -> user.username << " resumed from seq " << from << endl;
+}
 
-	// Quit thread
-	pthread_exit(NULL);
+void ServeAdopted(Reactor* reactor, Connection* conn) {
+	if (conn -> state == CONN_CHAT) {
+		HandleFrames(conn);
+		RESC::FrameReaderRelease(&conn -> reader);
+	}
+	if (conn -> state == CONN_CHAT) {
+		FlushConnection(conn);
+	}
+	if (conn -> state == CONN_CLOSED) {
+		CloseConnection(reactor, conn);
+	}
 }
 
-void ProcessRequest(int requestSock) {
+void MoveConnection(Reactor* reactor, Connection* conn) {
+	Session* session = conn -> resuming;
+	if (reactor -> ring == NULL) {
+		epoll_ctl(reactor -> epollSock, EPOLL_CTL_DEL, conn -> sock, NULL);
+	}
+	RESC::FrameReader* reader = &conn -> reader;
+	session -> resumeBytes.assign(reader -> buffer.data() + reader -> start, reader -> end - reader -> start);
+	session -> resumeSock = conn -> sock;
+	conn -> sock = -1;
+	conn -> resuming = NULL;
+	reactor -> connections.erase(conn -> id);
+	conn -> state = CONN_CLOSED;
+	reactor -> closed.push_back(conn);
+	PostSessionEvent(session -> reactor, session -> connId);
+}
 
-	// Polling structures
-	RESC::User user;
-	fd_set requestfd;
-	struct timeval tv;
-	int sockIndex = 0;
-	
-	// Authenticate User
-	bool hasValidated = true;
-	do {
-		cout << "Reading message incoming" << endl;
-		string authRequest = RESC::ReadMessage(requestSock);
-		hasValidated = ValidateUser(authRequest, user);
-		string authResponse = (hasValidated) ? "SUCCESSFUL" : "UNSUCCESSFUL";
-		cout << "User auth'd " << authResponse << endl;
-		RESC::SendMessage(requestSock, authResponse);
-	} while (!hasValidated);
-	UpdateUserLists();
-	
-	// Announce User, Update UserLists
-	
-	// Clear FD_Set and set timeout.
-	FD_ZERO(&requestfd);
-	tv.tv_sec = 1;
-	tv.tv_usec = 20000;
-
-	// Initialize Data
-	FD_SET(requestSock, &requestfd);
-	sockIndex = requestSock + 1;
-	
-	while (true) {
-		// Read Data
-		int pollSock = select(sockIndex, &requestfd, NULL, NULL, &tv);
-		tv.tv_sec = 1;
-		tv.tv_usec = 20000;
-		FD_SET(requestSock, &requestfd);
-		if (pollSock != 0 && pollSock != -1) {
-			// READ DATA
-			string msg = RESC::ReadMessage(requestSock);
-			if (RESC::HasQuit(msg)){
-				break;
-			}
-			ProcessMessage(msg, user.username);
-		}
-		
-		// Send Data
-		pthread_mutex_lock(&MsgQueueLock);
-		unordered_map<string, deque<RESC::Message> >::iterator msgIter = MSG_QUEUE.find(user.username);
-		if (msgIter != MSG_QUEUE.end()) {
-			while (!(*msgIter).second.empty()) {
-				RESC::Message tmpMsg =  (*msgIter).second.front();
-				// 
-				string outMsg = RESC::EncodeMessage(tmpMsg);
-				RESC::SendMessage(requestSock, outMsg);
-				(*msgIter).second.pop_front();
-			}
-		}
-		pthread_mutex_unlock(&MsgQueueLock);
-	}	
-	pthread_mutex_lock(&MsgQueueLock);
-	MSG_QUEUE.erase(user.username);
-	pthread_mutex_unlock(&MsgQueueLock);
-	pthread_mutex_lock(&UserListLock);
-		unordered_map<string, RESC::User>::iterator usrIter = USER_LIST.find(user.username);
-		if (usrIter != USER_LIST.end()) {
-			// found user
-			user.isConnected = false;
-			(*usrIter).second.isConnected = false;
+void HandleSessionEvent(Reactor* reactor, uint64_t connId) {
+	unordered_map<uint64_t, Connection*>::iterator connIter = reactor -> connections.find(connId);
+	if (connIter == reactor -> connections.end() || (*connIter).second -> session == NULL) {
+		return;
+	}
+	Connection* old = (*connIter).second;
+	Session* session = old -> session;
+	RESC::RegistryShard<Session*>* shard = RESC::RegistryShardFor(&SESSIONS, session -> token);
+	pthread_mutex_lock(&shard -> lock);
+	bool isExpired = session -> state == SESSION_EXPIRED;
+	pthread_mutex_unlock(&shard -> lock);
+	if (isExpired) {
+		old -> canPark = false;
+		old -> state = CONN_CLOSED;
+		CloseConnection(reactor, old);
+		return;
+	}
+	if (session -> resumeSock < 0) {
+		return;
+	}
+	Connection* conn = CreateConnection(reactor, session -> resumeSock);
+	session -> resumeSock = -1;
+	if (reactor -> ring != NULL) {
+		ArmRecv(reactor, conn);
+	} else {
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = conn;
+		if (epoll_ctl(reactor -> epollSock, EPOLL_CTL_ADD, conn -> sock, &ev) < 0) {
+			cerr << "Error registering connection." << endl;
+			conn -> state = CONN_CLOSED;
 		}
-	pthread_mutex_unlock(&UserListLock);
-	UpdateUserLists();
-	cout << "Closing socket" << endl;
+	}
+	RESC::FrameReaderAppend(&conn -> reader, session -> resumeBytes.data(), session -> resumeBytes.length());
+	session -> resumeBytes.clear();
+	conn -> resuming = session;
+	if (conn -> state != CONN_CLOSED) {
+		AdoptSession(reactor, conn, session);
+	}
+	ServeAdopted(reactor, conn);
+}
+
+bool SetNonBlocking(int sock) {
+	int flags = fcntl(sock, F_GETFL, 0);
+	if (flags < 0) return false;
+	return (fcntl(sock, F_SETFL, flags | O_NONBLOCK) == 0);
 }
 
 void UpdateUserLists() {
 	stringstream ss;
-	pthread_mutex_lock(&UserListLock);
-		int count = 0;
-		unordered_map<string, RESC::User>::iterator usrIter = USER_LIST.begin();
-		while (usrIter != USER_LIST.end()) {
+	vector<string> online;
+	pthread_mutex_lock(&PublishLock);
+	// One shard at a time, so logins elsewhere keep going while we read.
+	for (size_t i = 0; i < RESC::REGISTRY_SHARDS; i++) {
+		RESC::RegistryShard<RESC::User>* shard = &USER_LIST.shards[i];
+		pthread_mutex_lock(&shard -> lock);
+		unordered_map<string, RESC::User>::iterator usrIter = shard -> entries.begin();
+		while (usrIter != shard -> entries.end()) {
 			if ((*usrIter).second.isConnected) {	
-				if (count < 20) {		
-					ss << "| " << (*usrIter).first << endl;
-				}
-				count++;
+				online.push_back((*usrIter).first);
 			}
 			usrIter++;
 		}
-		ss << "| " << "-----" << endl;
-		ss << "| " << count << " Users" << endl;
-	pthread_mutex_unlock(&UserListLock);
+		pthread_mutex_unlock(&shard -> lock);
+	}
+	sort(online.begin(), online.end());
+
+	// Other nodes hear about our users, each link as a delta of its own.
+	LOCAL_USERS = online;
+	vector<pair<string, string> > remote;
+	CollectLocations(remote);
+	GossipToPeers(remote);
+	// Our users see theirs too; someone on two nodes is listed once.
+	for (size_t i = 0; i < remote.size(); i++) {
+		online.push_back(remote[i].first);
+	}
+	sort(online.begin(), online.end());
+	online.erase(unique(online.begin(), online.end()), online.end());
+
+	for (size_t i = 0; i < online.size() && i < 20; i++) {
+		ss << "| " << online[i] << endl;
+	}
+	ss << "| " << "-----" << endl;
+	ss << "| " << online.size() << " Users" << endl;
 	
 	RESC::Message usrListMsg;
 	usrListMsg.from = "SERVER";
@@ -275,84 +3499,496 @@ void UpdateUserLists() {
 	usrListMsg.msg = ss.str();
 	ss.str("");
 	ss.clear();
-	unordered_map<string, deque<RESC::Message> >::iterator msgIter;
-	pthread_mutex_lock(&MsgQueueLock);
-	// Add to all the queues
-	msgIter = MSG_QUEUE.begin();
-	while (msgIter != MSG_QUEUE.end()) {
-		(*msgIter).second.push_back(usrListMsg);
-		msgIter++;
+	RESC::Payload* payload = RESC::CreatePayload(usrListMsg);
+
+	string changes = PresenceChanges(PUBLISHED_USERS, online);
+	RESC::Payload* deltaPayload = NULL;
+	if (!changes.empty()) {
+		// A login and logout inside one window cancel out and cost
+		// delta users nothing.
+		PRESENCE_VERSION++;
+		PUBLISHED_USERS.swap(online);
+		RESC::Message deltaMsg;
+		deltaMsg.cmd = RESC::PRESENCE_MSG;
+		deltaMsg.msg = to_string(PRESENCE_VERSION) + " delta" + changes;
+		deltaPayload = RESC::CreatePayload(deltaMsg);
+	}
+
+	// Legacy users get the userlist, delta users the delta.
+	BroadcastPayload(payload);
+	if (deltaPayload != NULL) {
+		BroadcastPayload(deltaPayload);
+	}
+	pthread_mutex_unlock(&PublishLock);
+	RESC::ReleasePayload(payload);
+	if (deltaPayload != NULL) {
+		RESC::ReleasePayload(deltaPayload);
+	}
+}
+
+string PresenceChanges(const vector<string> &before, const vector<string> &after) {
+	// Walk the sorted old and new lists together for joins and leaves.
+	string changes;
+	size_t oldIndex = 0;
+	size_t newIndex = 0;
+	while (oldIndex < before.size() || newIndex < after.size()) {
+		if (oldIndex == before.size() ||
+			(newIndex < after.size() && after[newIndex] < before[oldIndex])) {
+			changes.append("\n+").append(after[newIndex++]);
+		} else if (newIndex == after.size() || before[oldIndex] < after[newIndex]) {
+			changes.append("\n-").append(before[oldIndex++]);
+		} else {
+			oldIndex++;
+			newIndex++;
+		}
+	}
+	return changes;
+}
+
+RESC::Payload* CreatePresenceSnapshot() {
+	RESC::Message snapshotMsg;
+	snapshotMsg.cmd = RESC::PRESENCE_MSG;
+	snapshotMsg.msg = to_string(PRESENCE_VERSION) + " full";
+	for (size_t i = 0; i < PUBLISHED_USERS.size(); i++) {
+		snapshotMsg.msg.append("\n").append(PUBLISHED_USERS[i]);
+	}
+	return RESC::CreatePayload(snapshotMsg);
+}
+
+void SendPresenceSnapshot(const string &username) {
+	pthread_mutex_lock(&PublishLock);
+	RESC::Payload* snapshot = CreatePresenceSnapshot();
+	RESC::RegistryShard<MsgQueue*>* shard = RESC::RegistryShardFor(&MSG_QUEUE, username);
+	pthread_mutex_lock(&shard -> lock);
+	unordered_map<string, MsgQueue*>::iterator msgIter = shard -> entries.find(username);
+	if (msgIter != shard -> entries.end()) {
+		PostPayload((*msgIter).second, snapshot);
+	}
+	pthread_mutex_unlock(&shard -> lock);
+	pthread_mutex_unlock(&PublishLock);
+	RESC::ReleasePayload(snapshot);
+}
+
+void SchedulePresenceUpdate() {
+	pthread_mutex_lock(&PresenceLock);
+	PRESENCE_CHANGES++;
+	if (!isPresenceDirty) {
+		isPresenceDirty = true;
+		pthread_cond_signal(&PresenceCond);
+	}
+	pthread_mutex_unlock(&PresenceLock);
+}
+
+void* PresenceThread(void* args_p) {
+	long changesSent = 0;
+	while (true) {
+		pthread_mutex_lock(&PresenceLock);
+		while (!isPresenceDirty) {
+			pthread_cond_wait(&PresenceCond, &PresenceLock);
+		}
+		pthread_mutex_unlock(&PresenceLock);
+
+		// Let the rest of a login/logout burst land before building.
+		if (PRESENCE_WINDOW_MS > 0) {
+			usleep(PRESENCE_WINDOW_MS * 1000);
+		}
+
+		// Anything that arrives from here on marks presence dirty again
+		// and gets the next window.
+		pthread_mutex_lock(&PresenceLock);
+		isPresenceDirty = false;
+		long changes = PRESENCE_CHANGES;
+		pthread_mutex_unlock(&PresenceLock);
+		UpdateUserLists();
+		PRESENCE_SNAPSHOTS++;
+
+		long windowChanges = changes - changesSent;
+		changesSent = changes;
+		cout << "Presence: 1 userlist for " << windowChanges << " changes, "
+			<< changes - PRESENCE_SNAPSHOTS << " of " << changes << " coalesced so far, delta version "
+			<< PRESENCE_VERSION << endl;
+	}
+	return NULL;
+}
+
+bool ProcessFrame(RESC::MessageView msg, const string &userFrom, MsgQueue* queue) {
+	if (msg.cmd == RESC::INVALID_MSG) {
+		// Text command, from a v1 client or an untyped v2 frame.
+		if (RESC::HasQuit(msg.msg)) {
+			return false;
+		}
+		if (msg.msg.empty()) {
+			return true;
+		}
+		msg = RESC::ParseMessage(msg.msg, userFrom);
+	} else {
+		// v2 header already says where it goes; only the sender is ours
+		// to fill in.
+		msg.from = userFrom;
+	}
+	if (msg.cmd == RESC::PRESENCE_MSG) {
+		// Client missed a delta and wants to start over.
+		SendPresenceSnapshot(userFrom);
+		return true;
+	}
+	if (msg.cmd == RESC::JOIN_MSG && !msg.to.empty()) {
+		JoinRoom(queue, string(msg.to));
+		return true;
+	}
+	if (msg.cmd == RESC::LEAVE_MSG) {
+		LeaveRoom(queue, string(msg.to));
+		return true;
+	}
+	if (msg.cmd == RESC::FILE_PUT_MSG || msg.cmd == RESC::FILE_GET_MSG ||
+		msg.cmd == RESC::FILE_DONE_MSG || msg.cmd == RESC::FILE_CHUNK_MSG) {
+		ProcessTransfer(msg, userFrom, queue);
+		return true;
 	}
-	pthread_mutex_unlock(&MsgQueueLock);
+	ProcessMessage(msg, userFrom, queue);
+	return true;
 }
 
-void ProcessMessage(string rawMsg, string userFrom) {
-	RESC::Message msg = RESC::CreateMessage(rawMsg, userFrom);
-	if (msg.cmd == RESC::INVALID_MSG) return;
+void ProcessMessage(RESC::MessageView msg, const string &userFrom, MsgQueue* queue) {
+	// The views point into the connection's frame buffer; the only copy
+	// made is the encoded payload.
+	if (msg.cmd != RESC::BROADCAST_MSG && msg.cmd != RESC::DIRECT_MSG &&
+		msg.cmd != RESC::FILE_STREAM_MSG && msg.cmd != RESC::ROOM_MSG) {
+		return;
+	}
+	if (msg.cmd == RESC::ROOM_MSG && !IsRoomMember(queue, string(msg.to))) {
+		// Nor kept for the room's history, nor sent to other nodes.
+		RESC::Message reply;
+		reply.cmd = RESC::DIRECT_MSG;
+		reply.to = userFrom;
+		reply.from = "SERVER";
+		reply.msg = "You are not in " + string(msg.to) + "; /join it first.";
+		RESC::Payload* replyPayload = RESC::CreatePayload(reply);
+		PostPayload(queue, replyPayload);
+		RESC::ReleasePayload(replyPayload);
+		return;
+	}
 	
-	unordered_map<string, deque<RESC::Message> >::iterator msgIter;
+	// Encoded once here and shared by every recipient.
+	RESC::Payload* payload = RESC::CreatePayload(msg);
+	string to(msg.to);
+	unordered_map<string, MsgQueue*>::iterator msgIter;
+	RESC::RegistryShard<MsgQueue*>* shard;
 	switch(msg.cmd) {
 		case RESC::BROADCAST_MSG:
-			pthread_mutex_lock(&MsgQueueLock);
-				// Add to all the queues
-				msgIter = MSG_QUEUE.begin();
-				while (msgIter != MSG_QUEUE.end()) {
-					if ((*msgIter).first.compare(userFrom)) {
-						(*msgIter).second.push_back(msg);
-					}
-					msgIter++;
-				}
-			pthread_mutex_unlock(&MsgQueueLock);
+			if (ALL_HISTORY != NULL) {
+				RESC::HistoryRecord(ALL_HISTORY, payload);
+			}
+			BroadcastPayload(payload);
+			ForwardToPeers(payload, NULL);
+			break;
+		case RESC::ROOM_MSG:
+			PostToRoom(payload, queue);
+			ForwardToPeers(payload, NULL);
 			break;
 		case RESC::DIRECT_MSG:
-			pthread_mutex_lock(&MsgQueueLock);
-				msgIter = MSG_QUEUE.find(msg.to);
-				if (msgIter != MSG_QUEUE.end()) {
+			shard = RESC::RegistryShardFor(&MSG_QUEUE, to);
+			pthread_mutex_lock(&shard -> lock);
+				msgIter = shard -> entries.find(to);
+				if (msgIter != shard -> entries.end()) {
 					if ((*msgIter).first.compare(userFrom)) {
-						(*msgIter).second.push_back(msg);
+						PostPayload((*msgIter).second, payload);
 					}
+				} else if (to.compare(userFrom) && !ForwardToPeer(payload, NULL)) {
+					StoreOffline(payload);
 				}
-			pthread_mutex_unlock(&MsgQueueLock);
+			pthread_mutex_unlock(&shard -> lock);
 			break;
 		case RESC::FILE_STREAM_MSG:
-			pthread_mutex_lock(&MsgQueueLock);
-				msgIter = MSG_QUEUE.find(msg.to);
-				if (msgIter != MSG_QUEUE.end()) {
+			shard = RESC::RegistryShardFor(&MSG_QUEUE, to);
+			pthread_mutex_lock(&shard -> lock);
+				msgIter = shard -> entries.find(to);
+				if (msgIter != shard -> entries.end()) {
 					if ((*msgIter).first.compare(userFrom)) {
-						(*msgIter).second.push_back(msg);
+						PostPayload((*msgIter).second, payload);
 					}
+				} else if (to.compare(userFrom)) {
+					ForwardToPeer(payload, NULL);
 				}
-			pthread_mutex_unlock(&MsgQueueLock);
+			pthread_mutex_unlock(&shard -> lock);
+			break;
+		default:
+			break;
+	}
+	RESC::ReleasePayload(payload);
+}
+
+void ProcessTransfer(RESC::MessageView msg, const string &userFrom, MsgQueue* queue) {
+	if (!queue -> canTransfer) {
+		return;
+	}
+	switch (msg.cmd) {
+		case RESC::FILE_PUT_MSG:
+			StartTransfer(msg, userFrom, queue);
+			break;
+		case RESC::FILE_CHUNK_MSG:
+			SpoolChunk(msg, userFrom, queue);
+			break;
+		case RESC::FILE_GET_MSG:
+			SendTransferWindow(msg, userFrom, queue);
+			break;
+		case RESC::FILE_DONE_MSG:
+			FinishTransfer(msg, userFrom);
 			break;
 		default:
 			break;
 	}
 }
 
-bool ValidateUser(string request, RESC::User &user)
+void StartTransfer(RESC::MessageView msg, const string &userFrom, MsgQueue* queue) {
+	// "/fileput <to> <id> <size> <name>"
+	string_view fields = msg.msg;
+	string_view id;
+	string_view sizeField;
+	uint64_t size;
+	if (msg.to.empty() || !RESC::SplitTransferField(fields, id) || !RESC::IsTransferId(id) ||
+		!RESC::SplitTransferField(fields, sizeField) || !RESC::ParseTransferNumber(sizeField, size) || fields.empty()) {
+		return;
+	}
+	string key = string(id) + "/" + userFrom;
+	RESC::RegistryShard<Transfer*>* shard = RESC::RegistryShardFor(&TRANSFERS, key);
+	pthread_mutex_lock(&shard -> lock);
+	unordered_map<string, Transfer*>::iterator transferIter = shard -> entries.find(key);
+	Transfer* transfer = (transferIter != shard -> entries.end()) ? (*transferIter).second : NULL;
+	if (transfer != NULL && (transfer -> receiver != msg.to || transfer -> size != size || transfer -> name != fields)) {
+		// Same id, different file: start over. Chunks already queued
+		// from the old spool keep it open until they are sent.
+		shard -> entries.erase(transferIter);
+		RESC::ReleaseFile(transfer -> spool);
+		delete transfer;
+		transfer = NULL;
+		OPEN_TRANSFERS.fetch_sub(1, memory_order_relaxed);
+	}
+	if (transfer == NULL) {
+		RESC::FileSource* spool = CreateSpool();
+		if (spool == NULL) {
+			pthread_mutex_unlock(&shard -> lock);
+			return;
+		}
+		transfer = new Transfer;
+		transfer -> sender = userFrom;
+		transfer -> receiver = string(msg.to);
+		transfer -> id = string(id);
+		transfer -> name = string(fields);
+		transfer -> size = size;
+		transfer -> received = 0;
+		transfer -> spool = spool;
+		shard -> entries[key] = transfer;
+		long open = OPEN_TRANSFERS.fetch_add(1, memory_order_relaxed) + 1;
+		cout << "Transfer: " << userFrom << " sending " << transfer -> receiver << " " << transfer -> name
+			<< ", " << size << " bytes; " << open << " transfers open" << endl;
+	}
+	string receiver = transfer -> receiver;
+	uint64_t received = transfer -> received;
+	pthread_mutex_unlock(&shard -> lock);
+	RESC::Payload* ack = CreateTransferPayload(RESC::FILE_ACK_MSG, receiver, string(id) + " " + to_string(received));
+	PostPayload(queue, ack);
+	RESC::ReleasePayload(ack);
+	if (size == 0) {
+		// Nothing to wait for.
+		OfferTransfers(receiver, NULL);
+	}
+}
+
+void SpoolChunk(RESC::MessageView msg, const string &userFrom, MsgQueue* queue) {
+	// Chunks arrive in order on one connection; one that doesn't start
+	// where the spool ends is left over from before a resume.
+	uint64_t offset;
+	string_view data;
+	if (!RESC::IsTransferId(msg.to) || !RESC::SplitFileChunk(msg.msg, offset, data)) {
+		return;
+	}
+	string key = string(msg.to) + "/" + userFrom;
+	RESC::RegistryShard<Transfer*>* shard = RESC::RegistryShardFor(&TRANSFERS, key);
+	pthread_mutex_lock(&shard -> lock);
+	unordered_map<string, Transfer*>::iterator transferIter = shard -> entries.find(key);
+	if (transferIter == shard -> entries.end()) {
+		pthread_mutex_unlock(&shard -> lock);
+		return;
+	}
+	Transfer* transfer = (*transferIter).second;
+	if (offset != transfer -> received || data.empty() || data.length() > transfer -> size - transfer -> received) {
+		pthread_mutex_unlock(&shard -> lock);
+		return;
+	}
+	size_t written = 0;
+	while (written < data.length()) {
+		ssize_t bytesWritten = pwrite(transfer -> spool -> fd, data.data() + written, data.length() - written, offset + written);
+		if (bytesWritten < 0 && errno == EINTR) {
+			continue;
+		}
+		if (bytesWritten <= 0) {
+			// Out of disk, most likely. The sender waits for an ack
+			// that never comes and resumes from here next time.
+			cerr << "Unable to write spool for " << transfer -> name << " from " << userFrom << "." << endl;
+			pthread_mutex_unlock(&shard -> lock);
+			return;
+		}
+		written += bytesWritten;
+	}
+	transfer -> received += written;
+	string receiver = transfer -> receiver;
+	uint64_t received = transfer -> received;
+	bool isComplete = (received == transfer -> size);
+	if (isComplete) {
+		cout << "Transfer: " << transfer -> name << " from " << userFrom << " spooled, "
+			<< received << " bytes" << endl;
+	}
+	pthread_mutex_unlock(&shard -> lock);
+	RESC::Payload* ack = CreateTransferPayload(RESC::FILE_ACK_MSG, receiver, string(msg.to) + " " + to_string(received));
+	PostPayload(queue, ack);
+	RESC::ReleasePayload(ack);
+	if (isComplete) {
+		OfferTransfers(receiver, NULL);
+	}
+}
+
+void SendTransferWindow(RESC::MessageView msg, const string &userFrom, MsgQueue* queue) {
+	// "/fileget <from> <id> <offset>"
+	string_view fields = msg.msg;
+	string_view id;
+	string_view offsetField;
+	uint64_t offset;
+	if (!RESC::SplitTransferField(fields, id) || !RESC::IsTransferId(id) ||
+		!RESC::SplitTransferField(fields, offsetField) || !RESC::ParseTransferNumber(offsetField, offset)) {
+		return;
+	}
+	string key = string(id) + "/" + string(msg.to);
+	RESC::RegistryShard<Transfer*>* shard = RESC::RegistryShardFor(&TRANSFERS, key);
+	pthread_mutex_lock(&shard -> lock);
+	unordered_map<string, Transfer*>::iterator transferIter = shard -> entries.find(key);
+	if (transferIter != shard -> entries.end() && (*transferIter).second -> receiver == userFrom &&
+		(*transferIter).second -> received == (*transferIter).second -> size) {
+		// The chunks only point at the spool; the bytes go from the page
+		// cache to the socket when they are flushed.
+		Transfer* transfer = (*transferIter).second;
+		uint64_t end = min(transfer -> size, offset + RESC::FILE_WINDOW_BYTES);
+		RESC::MessageView chunk;
+		chunk.cmd = RESC::FILE_CHUNK_MSG;
+		chunk.to = transfer -> id;
+		chunk.from = transfer -> sender;
+		for (uint64_t position = offset; position < end; position += RESC::FILE_CHUNK_BYTES) {
+			string head;
+			RESC::AppendFileOffset(head, position);
+			chunk.msg = head;
+			size_t length = min((uint64_t) RESC::FILE_CHUNK_BYTES, end - position);
+			RESC::Payload* payload = RESC::CreateFilePayload(chunk, transfer -> spool, position, length);
+			PostPayload(queue, payload);
+			RESC::ReleasePayload(payload);
+		}
+	}
+	pthread_mutex_unlock(&shard -> lock);
+}
+
+void FinishTransfer(RESC::MessageView msg, const string &userFrom) {
+	// "/filedone <from> <id>"
+	string key = string(msg.msg) + "/" + string(msg.to);
+	RESC::RegistryShard<Transfer*>* shard = RESC::RegistryShardFor(&TRANSFERS, key);
+	pthread_mutex_lock(&shard -> lock);
+	unordered_map<string, Transfer*>::iterator transferIter = shard -> entries.find(key);
+	if (transferIter == shard -> entries.end() || (*transferIter).second -> receiver != userFrom) {
+		pthread_mutex_unlock(&shard -> lock);
+		return;
+	}
+	Transfer* transfer = (*transferIter).second;
+	shard -> entries.erase(transferIter);
+	pthread_mutex_unlock(&shard -> lock);
+	long open = OPEN_TRANSFERS.fetch_sub(1, memory_order_relaxed) - 1;
+	cout << "Transfer: " << transfer -> name << " from " << transfer -> sender << " delivered to "
+		<< userFrom << "; " << open << " transfers open" << endl;
+	RESC::ReleaseFile(transfer -> spool);
+	delete transfer;
+}
+
+void OfferTransfers(const string &username, MsgQueue* queue) {
+	// With no queue, offers go to wherever username is logged in, if they
+	// are; with one, straight to it. An offer may arrive twice if a login
+	// and the last chunk cross; clients ignore the second.
+	if (OPEN_TRANSFERS.load(memory_order_relaxed) == 0 || (queue != NULL && !queue -> canTransfer)) {
+		return;
+	}
+	vector<RESC::Payload*> offers;
+	for (size_t i = 0; i < RESC::REGISTRY_SHARDS; i++) {
+		RESC::RegistryShard<Transfer*>* shard = &TRANSFERS.shards[i];
+		pthread_mutex_lock(&shard -> lock);
+		unordered_map<string, Transfer*>::iterator transferIter = shard -> entries.begin();
+		while (transferIter != shard -> entries.end()) {
+			Transfer* transfer = (*transferIter).second;
+			if (transfer -> receiver == username && transfer -> received == transfer -> size) {
+				offers.push_back(CreateTransferPayload(RESC::FILE_OFFER_MSG, transfer -> sender,
+					transfer -> id + " " + to_string(transfer -> size) + " " + transfer -> name));
+			}
+			transferIter++;
+		}
+		pthread_mutex_unlock(&shard -> lock);
+	}
+	if (queue != NULL) {
+		for (size_t i = 0; i < offers.size(); i++) {
+			PostPayload(queue, offers[i]);
+		}
+	} else if (!offers.empty()) {
+		RESC::RegistryShard<MsgQueue*>* shard = RESC::RegistryShardFor(&MSG_QUEUE, username);
+		pthread_mutex_lock(&shard -> lock);
+		unordered_map<string, MsgQueue*>::iterator msgIter = shard -> entries.find(username);
+		if (msgIter != shard -> entries.end() && (*msgIter).second -> canTransfer) {
+			for (size_t i = 0; i < offers.size(); i++) {
+				PostPayload((*msgIter).second, offers[i]);
+			}
+		}
+		pthread_mutex_unlock(&shard -> lock);
+	}
+	for (size_t i = 0; i < offers.size(); i++) {
+		RESC::ReleasePayload(offers[i]);
+	}
+}
+
+RESC::FileSource* CreateSpool() {
+	string path = SPOOL_DIR + "/rescSpool.XXXXXX";
+	vector<char> name(path.begin(), path.end());
+	name.push_back('\0');
+	int fd = mkstemp(&name[0]);
+	if (fd < 0) {
+		cerr << "Unable to create spool file in " << SPOOL_DIR << "." << endl;
+		return NULL;
+	}
+	// Nothing needs the name, and an unlinked file goes away with us.
+	unlink(&name[0]);
+	return RESC::CreateFileSource(fd);
+}
+
+RESC::Payload* CreateTransferPayload(RESC::MsgType cmd, const string &name, const string &text) {
+	RESC::Message reply;
+	reply.cmd = cmd;
+	reply.from = name;
+	reply.msg = text;
+	return RESC::CreatePayload(reply);
+}
+
+bool ValidateUser(string_view request, RESC::User &user)
 {
 	bool isValidated = false;
-	stringstream ss;
 	string username;
 	string password;
 
 	cout << "Validating user request: " << request << endl;
-	const char * cMsg = request.c_str();
-	for (int i = 0; i < request.length(); i++) {
-		if (cMsg[i] == '|') {
-			username = ss.str();
-			ss.str("");
-			ss.clear();
-		}
-		ss << cMsg[i];
+	// Username is everything before the last '|'; the password keeps the
+	// separator, as it always has.
+	size_t split = RESC::FindLastByte(request, '|');
+	if (split == string_view::npos) {
+		password = string(request);
+	} else {
+		username = string(request.substr(0, split));
+		password = string(request.substr(split));
 	}
-	password = ss.str();
-	ss.str("");
-	ss.clear();
 	cout << "Recv'd message to Auth" << endl;
-	pthread_mutex_lock(&UserListLock);
-	unordered_map<string, RESC::User>::iterator usrIter = USER_LIST.find(username);
-	if (usrIter != USER_LIST.end()) {
+	RESC::RegistryShard<RESC::User>* shard = RESC::RegistryShardFor(&USER_LIST, username);
+	pthread_mutex_lock(&shard -> lock);
+	unordered_map<string, RESC::User>::iterator usrIter = shard -> entries.find(username);
+	if (usrIter != shard -> entries.end()) {
 		// found user
 		if (!(*usrIter).second.password.compare(password)) {
 			isValidated = true;
@@ -368,22 +4004,88 @@ bool ValidateUser(string request, RESC::User &user)
 		newUser.isConnected = true;
 		user.username = username;
 		user.isConnected = true;
-		USER_LIST.insert(make_pair(username, newUser));
+		shard -> entries.insert(make_pair(username, newUser));
 		isValidated = true;
 	}
-	pthread_mutex_unlock(&UserListLock);
-	
-	if (isValidated) {
-		pthread_mutex_lock(&MsgQueueLock);
-		MSG_QUEUE.insert(make_pair(username, deque<RESC::Message>()));
-		pthread_mutex_unlock(&MsgQueueLock);
-	}
+	pthread_mutex_unlock(&shard -> lock);
 	
 	return isValidated;
 }
 
+bool Authenticate(string_view request, RESC::User &user, SessionOptions &options, string &authResponse) {
+	string_view capabilities = RESC::SplitCapabilities(request);
+	options.version = RESC::PROTOCOL_V1;
+	options.wantsDelta = false;
+	options.canSlice = false;
+	options.canTransfer = false;
+	options.canResume = false;
+	options.token.clear();
+	options.session = NULL;
+	options.resumeSeq = 0;
+	bool canResume = RESUME_GRACE_SECONDS > 0 && RESC::HasCapability(capabilities, RESC::CAPABILITY_V2) &&
+		RESC::HasCapability(capabilities, RESC::CAPABILITY_RESUME);
+	string_view token = RESC::CapabilityValue(capabilities, "token");
+	if (canResume && !token.empty()) {
+		// Holding the token is as good as the password. Without the
+		// session it falls through to an ordinary login.
+		size_t split = RESC::FindLastByte(request, '|');
+		string username(request.substr(0, (split == string_view::npos) ? 0 : split));
+		options.session = ClaimSession(string(token), username);
+		if (options.session != NULL) {
+			user.username = username;
+			user.isConnected = true;
+			options.resumeSeq = strtoull(string(RESC::CapabilityValue(capabilities, "seq")).c_str(), NULL, 10);
+		}
+	}
+	bool hasValidated = options.session != NULL || ValidateUser(request, user);
+	authResponse = (hasValidated) ? "SUCCESSFUL" : "UNSUCCESSFUL";
+	cout << "User auth'd " << authResponse << endl;
+	if (!hasValidated) {
+		return false;
+	}
+	// Reply with the capabilities we agreed to.
+	string accepted;
+	if (RESC::HasCapability(capabilities, RESC::CAPABILITY_V2)) {
+		options.version = RESC::PROTOCOL_V2;
+		accepted = RESC::CAPABILITY_V2;
+	}
+	if (RESC::HasCapability(capabilities, RESC::CAPABILITY_DELTA)) {
+		options.wantsDelta = true;
+		accepted += (accepted.empty()) ? RESC::CAPABILITY_DELTA : " " + RESC::CAPABILITY_DELTA;
+	}
+	if (options.version == RESC::PROTOCOL_V2 && RESC::HasCapability(capabilities, RESC::CAPABILITY_SLICES)) {
+		// Slices are v2 frames.
+		options.canSlice = true;
+		accepted += " " + RESC::CAPABILITY_SLICES;
+	}
+	if (options.version == RESC::PROTOCOL_V2 && RESC::HasCapability(capabilities, RESC::CAPABILITY_FILES)) {
+		// Chunks carry binary data, which v1 frames can't.
+		options.canTransfer = true;
+		accepted += " " + RESC::CAPABILITY_FILES;
+	}
+	if (canResume) {
+		options.token = (options.session != NULL) ? options.session -> token : CreateSessionToken();
+		options.canResume = !options.token.empty();
+	}
+	if (options.canResume) {
+		accepted += " " + RESC::CAPABILITY_RESUME + " token=" + options.token;
+	}
+	if (!accepted.empty()) {
+		authResponse += "\n" + accepted;
+	}
+	return true;
+}
+
 void ProcessSignal(int sig) {
 	close(conn_socket);
+	ReportFanout();
+	cout << "Mailbox: " << DROPPED_FRAMES.load() << " messages, " << DROPPED_BYTES.load() << " bytes dropped, "
+		<< SLOW_KICKS.load() << " slow users disconnected" << endl;
+	cout << "Session: " << RESUMED_SESSIONS.load() << " sessions resumed" << endl;
+	if (CLUSTER_PORT != 0 || !PEER_ADDRESSES.empty()) {
+		cout << "Cluster: " << FORWARDED_FRAMES.load() << " frames forwarded, " << PEER_FRAMES.load()
+			<< " received from other nodes" << endl;
+	}
 	cout << endl << endl << "Shutting down server." << endl;
 	exit(1);
 }
\ No newline at end of file
@@ -0,0 +1,376 @@
+// AUTHOR: Ray Powers
+// DATE: October 18, 2026
+// FILE: rescUring.h
+
+// DESCRIPTION: Minimal io_uring wrapper for the RESC server, talking to the
+//				kernel through the raw system calls so nothing beyond the
+//				kernel headers is needed. Covers the submission and completion
+//				rings and one ring of provided receive buffers.
+
+#ifndef _RESCURING_H_
+#define _RESCURING_H_
+
+// Standard Library
+#include<iostream>
+#include<cstring>
+#include<cstdlib>
+#include<cerrno>
+#include<algorithm>
+
+// Kernel Interface
+#include<linux/io_uring.h>
+#include<sys/syscall.h>
+#include<sys/mman.h>
+#include<sys/socket.h>
+#include<poll.h>
+#include<unistd.h>
+
+using namespace std;
+
+namespace RESC {
+
+// Provided receive buffers, shared by every connection on a ring. A
+// multishot recv picks one per completion and we hand it back as soon as
+// its bytes are copied out.
+const unsigned URING_BUFFER_COUNT = 1024;	// Power of two.
+const unsigned URING_BUFFER_SIZE = 8192;
+const unsigned short URING_BUFFER_GROUP = 0;
+
+struct Uring {
+	int fd;
+	// Submission ring. sqLocalTail runs ahead of the kernel's tail until
+	// UringSubmit publishes it.
+	unsigned* sqHead;
+	unsigned* sqTail;
+	unsigned sqMask;
+	unsigned sqEntries;
+	unsigned sqLocalTail;
+	struct io_uring_sqe* sqes;
+	// Completion ring.
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned cqMask;
+	struct io_uring_cqe* cqes;
+	// Provided buffers.
+	struct io_uring_buf_ring* bufRing;
+	char* bufBase;
+	unsigned short bufTail;
+	// Mappings, for UringClose.
+	void* sqRingMem;
+	size_t sqRingSize;
+	void* cqRingMem;
+	size_t cqRingSize;
+	size_t sqesSize;
+	size_t bufRingSize;
+};
+
+int UringSetup(unsigned entries, struct io_uring_params* params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int UringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+int UringRegister(int fd, unsigned opcode, void* arg, unsigned argCount)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, argCount);
+}
+
+void UringClose(Uring* ring)
+{
+	if (ring -> bufRing != NULL) {
+		munmap(ring -> bufRing, ring -> bufRingSize);
+	}
+	if (ring -> bufBase != NULL) {
+		munmap(ring -> bufBase, (size_t) URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+	}
+	if (ring -> sqes != NULL) {
+		munmap(ring -> sqes, ring -> sqesSize);
+	}
+	if (ring -> cqRingMem != NULL && ring -> cqRingMem != ring -> sqRingMem) {
+		munmap(ring -> cqRingMem, ring -> cqRingSize);
+	}
+	if (ring -> sqRingMem != NULL) {
+		munmap(ring -> sqRingMem, ring -> sqRingSize);
+	}
+	if (ring -> fd >= 0) {
+		close(ring -> fd);
+	}
+	memset(ring, 0, sizeof(Uring));
+	ring -> fd = -1;
+}
+
+bool UringSupports(Uring* ring, const unsigned char* opcodes, int opcodeCount)
+{
+	// Asks the kernel which opcodes it knows; older kernels reject the probe
+	// itself, which counts as no.
+	size_t probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe* probe = (struct io_uring_probe*) calloc(1, probeSize);
+	bool isSupported = UringRegister(ring -> fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+	for (int i = 0; isSupported && i < opcodeCount; i++) {
+		isSupported = opcodes[i] <= probe -> last_op &&
+			(probe -> ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED) != 0;
+	}
+	free(probe);
+	return isSupported;
+}
+
+void UringReturnBuffer(Uring* ring, unsigned short bufferId)
+{
+	// Makes a provided buffer available to the kernel again.
+	// Indexed by hand: in C++ the kernel header's flexible array member
+	// comes out 8 bytes past where the kernel looks for it.
+	struct io_uring_buf* bufs = (struct io_uring_buf*) ring -> bufRing;
+	struct io_uring_buf* buf = &bufs[ring -> bufTail & (URING_BUFFER_COUNT - 1)];
+	buf -> addr = (unsigned long) (ring -> bufBase + (size_t) bufferId * URING_BUFFER_SIZE);
+	buf -> len = URING_BUFFER_SIZE;
+	buf -> bid = bufferId;
+	ring -> bufTail++;
+	__atomic_store_n(&ring -> bufRing -> tail, ring -> bufTail, __ATOMIC_RELEASE);
+}
+
+const char* UringBuffer(Uring* ring, unsigned short bufferId)
+{
+	return ring -> bufBase + (size_t) bufferId * URING_BUFFER_SIZE;
+}
+
+bool UringInitBuffers(Uring* ring)
+{
+	ring -> bufRingSize = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+	void* ringMem = mmap(NULL, ring -> bufRingSize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	void* bufMem = mmap(NULL, (size_t) URING_BUFFER_COUNT * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	ring -> bufRing = (ringMem == MAP_FAILED) ? NULL : (struct io_uring_buf_ring*) ringMem;
+	ring -> bufBase = (bufMem == MAP_FAILED) ? NULL : (char*) bufMem;
+	if (ring -> bufRing == NULL || ring -> bufBase == NULL) {
+		return false;
+	}
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long) ring -> bufRing;
+	reg.ring_entries = URING_BUFFER_COUNT;
+	reg.bgid = URING_BUFFER_GROUP;
+	ring -> bufTail = 0;
+	for (unsigned i = 0; i < URING_BUFFER_COUNT; i++) {
+		UringReturnBuffer(ring, i);
+	}
+	return UringRegister(ring -> fd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0;
+}
+
+bool UringInit(Uring* ring, unsigned entries)
+{
+	// Returns false, with a reason on cerr, when this kernel can't give us
+	// a ring; the caller is expected to carry on with epoll.
+	memset(ring, 0, sizeof(Uring));
+	ring -> fd = -1;
+
+	// Only one thread ever submits, and completions are fine waiting until
+	// we next enter the kernel. The completion ring is sized for a
+	// multishot recv and a send per connection; NODROP covers bursts.
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+	params.cq_entries = entries * 4;
+	ring -> fd = UringSetup(entries, &params);
+	if (ring -> fd < 0 && errno == EINVAL) {
+		// Kernels before 6.0 don't know the last two flags.
+		memset(&params, 0, sizeof(params));
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = entries * 4;
+		ring -> fd = UringSetup(entries, &params);
+	}
+	if (ring -> fd < 0) {
+		cerr << "io_uring_setup failed: " << strerror(errno) << endl;
+		return false;
+	}
+	if (!(params.features & IORING_FEAT_NODROP)) {
+		cerr << "io_uring lacks IORING_FEAT_NODROP." << endl;
+		UringClose(ring);
+		return false;
+	}
+
+	ring -> sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring -> cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring -> sqRingSize = max(ring -> sqRingSize, ring -> cqRingSize);
+		ring -> cqRingSize = ring -> sqRingSize;
+	}
+	void* sqMem = mmap(NULL, ring -> sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring -> fd, IORING_OFF_SQ_RING);
+	ring -> sqRingMem = (sqMem == MAP_FAILED) ? NULL : sqMem;
+	if (ring -> sqRingMem != NULL && (params.features & IORING_FEAT_SINGLE_MMAP)) {
+		ring -> cqRingMem = ring -> sqRingMem;
+	} else if (ring -> sqRingMem != NULL) {
+		void* cqMem = mmap(NULL, ring -> cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring -> fd, IORING_OFF_CQ_RING);
+		ring -> cqRingMem = (cqMem == MAP_FAILED) ? NULL : cqMem;
+	}
+	ring -> sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	void* sqesMem = mmap(NULL, ring -> sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring -> fd, IORING_OFF_SQES);
+	ring -> sqes = (sqesMem == MAP_FAILED) ? NULL : (struct io_uring_sqe*) sqesMem;
+	if (ring -> sqRingMem == NULL || ring -> cqRingMem == NULL || ring -> sqes == NULL) {
+		cerr << "Error mapping io_uring rings." << endl;
+		UringClose(ring);
+		return false;
+	}
+
+	char* sqBase = (char*) ring -> sqRingMem;
+	ring -> sqHead = (unsigned*) (sqBase + params.sq_off.head);
+	ring -> sqTail = (unsigned*) (sqBase + params.sq_off.tail);
+	ring -> sqMask = *(unsigned*) (sqBase + params.sq_off.ring_mask);
+	ring -> sqEntries = params.sq_entries;
+	ring -> sqLocalTail = *ring -> sqTail;
+	// SQE i always sits in slot i, so the index array is filled once.
+	unsigned* sqArray = (unsigned*) (sqBase + params.sq_off.array);
+	for (unsigned i = 0; i < params.sq_entries; i++) {
+		sqArray[i] = i;
+	}
+	char* cqBase = (char*) ring -> cqRingMem;
+	ring -> cqHead = (unsigned*) (cqBase + params.cq_off.head);
+	ring -> cqTail = (unsigned*) (cqBase + params.cq_off.tail);
+	ring -> cqMask = *(unsigned*) (cqBase + params.cq_off.ring_mask);
+	ring -> cqes = (struct io_uring_cqe*) (cqBase + params.cq_off.cqes);
+
+	if (!UringInitBuffers(ring)) {
+		cerr << "Error registering io_uring receive buffers: " << strerror(errno) << endl;
+		UringClose(ring);
+		return false;
+	}
+	return true;
+}
+
+int UringSubmit(Uring* ring, unsigned minComplete)
+{
+	// Hands every prepared SQE to the kernel in one call and, if asked,
+	// waits for completions. Returns the io_uring_enter result.
+	__atomic_store_n(ring -> sqTail, ring -> sqLocalTail, __ATOMIC_RELEASE);
+	unsigned toSubmit = ring -> sqLocalTail - __atomic_load_n(ring -> sqHead, __ATOMIC_ACQUIRE);
+	int status;
+	do {
+		status = UringEnter(ring -> fd, toSubmit, minComplete, IORING_ENTER_GETEVENTS);
+	} while (status < 0 && errno == EINTR);
+	return status;
+}
+
+struct io_uring_sqe* UringGetSqe(Uring* ring)
+{
+	// Submits what is queued when the ring is full. The SQE comes back
+	// zeroed, or NULL if the kernel takes none: with the completion queue
+	// overflowed (EBUSY) it won't until the caller reaps, so retrying here
+	// would spin.
+	if (ring -> sqLocalTail - __atomic_load_n(ring -> sqHead, __ATOMIC_ACQUIRE) >= ring -> sqEntries) {
+		UringSubmit(ring, 0);
+		if (ring -> sqLocalTail - __atomic_load_n(ring -> sqHead, __ATOMIC_ACQUIRE) >= ring -> sqEntries) {
+			return NULL;
+		}
+	}
+	struct io_uring_sqe* sqe = &ring -> sqes[ring -> sqLocalTail & ring -> sqMask];
+	ring -> sqLocalTail++;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+bool UringHasCompletions(Uring* ring)
+{
+	return *ring -> cqHead != __atomic_load_n(ring -> cqTail, __ATOMIC_ACQUIRE);
+}
+
+bool UringNextCompletion(Uring* ring, struct io_uring_cqe &cqe)
+{
+	// Copies out and consumes the oldest completion, if there is one.
+	unsigned head = *ring -> cqHead;
+	if (head == __atomic_load_n(ring -> cqTail, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+	cqe = ring -> cqes[head & ring -> cqMask];
+	__atomic_store_n(ring -> cqHead, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+void UringPrepAcceptMultishot(struct io_uring_sqe* sqe, int listenSock, uint64_t userData)
+{
+	// One SQE keeps accepting until it fails or is cancelled.
+	sqe -> opcode = IORING_OP_ACCEPT;
+	sqe -> fd = listenSock;
+	sqe -> ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe -> accept_flags = SOCK_NONBLOCK;
+	sqe -> user_data = userData;
+}
+
+void UringPrepRecvMultishot(struct io_uring_sqe* sqe, int sock, uint64_t userData)
+{
+	// Each completion carries one provided buffer's worth of bytes.
+	sqe -> opcode = IORING_OP_RECV;
+	sqe -> fd = sock;
+	sqe -> ioprio = IORING_RECV_MULTISHOT;
+	sqe -> flags = IOSQE_BUFFER_SELECT;
+	sqe -> buf_group = URING_BUFFER_GROUP;
+	sqe -> user_data = userData;
+}
+
+void UringPrepPollMultishot(struct io_uring_sqe* sqe, int fd, uint64_t userData)
+{
+	sqe -> opcode = IORING_OP_POLL_ADD;
+	sqe -> fd = fd;
+	sqe -> poll32_events = POLLIN;
+	sqe -> len = IORING_POLL_ADD_MULTI;
+	sqe -> user_data = userData;
+}
+
+void UringPrepSendmsg(struct io_uring_sqe* sqe, int sock, struct msghdr* msgHeader, uint64_t userData)
+{
+	// msgHeader and everything it points at must outlive the completion.
+	sqe -> opcode = IORING_OP_SENDMSG;
+	sqe -> fd = sock;
+	sqe -> addr = (unsigned long) msgHeader;
+	sqe -> len = 1;
+	sqe -> msg_flags = MSG_NOSIGNAL;
+	sqe -> user_data = userData;
+}
+
+void UringPrepCancel(struct io_uring_sqe* sqe, uint64_t target, uint64_t userData)
+{
+	// Ends the request submitted with user_data target; it completes with
+	// -ECANCELED, unless it was done anyway, and this one completes too.
+	sqe -> opcode = IORING_OP_ASYNC_CANCEL;
+	sqe -> fd = -1;
+	sqe -> addr = target;
+	sqe -> user_data = userData;
+}
+
+bool UringCanRecvMultishot(Uring* ring)
+{
+	// Multishot recv (6.0) has no probe bit of its own: try it on a socket
+	// pair and see whether the kernel keeps it armed.
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+		return false;
+	}
+	struct io_uring_sqe* sqe = UringGetSqe(ring);
+	UringPrepRecvMultishot(sqe, pair[0], 1);
+	send(pair[1], "x", 1, MSG_NOSIGNAL);
+	bool isSupported = false;
+	struct io_uring_cqe cqe;
+	if (UringSubmit(ring, 1) >= 0 && UringNextCompletion(ring, cqe)) {
+		isSupported = cqe.res == 1 && (cqe.flags & IORING_CQE_F_MORE);
+		if (cqe.flags & IORING_CQE_F_BUFFER) {
+			UringReturnBuffer(ring, cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+		}
+	}
+	// Closing both ends ends the recv; soak up its last completion.
+	shutdown(pair[0], SHUT_RDWR);
+	close(pair[0]);
+	close(pair[1]);
+	while (isSupported && UringSubmit(ring, 1) >= 0 && UringNextCompletion(ring, cqe)) {
+		if (cqe.flags & IORING_CQE_F_BUFFER) {
+			UringReturnBuffer(ring, cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+		}
+		if (!(cqe.flags & IORING_CQE_F_MORE)) {
+			break;
+		}
+	}
+	return isSupported;
+}
+
+}
+#endif // _RESCURING_H_